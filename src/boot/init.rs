@@ -18,12 +18,13 @@ pub static mut SECONDARY_STACKS: [[u8; SECONDARY_STACK_SIZE]; TINYENV_SMP - 1] =
 pub static mut BOOT_PT_L0: Aligned4K<[A64PTE; 512]> = Aligned4K::new([A64PTE::empty(); 512]);
 
 #[unsafe(link_section = ".data")]
-static mut BOOT_PT_L1: Aligned4K<[A64PTE; 512]> = Aligned4K::new([A64PTE::empty(); 512]);
+pub static mut BOOT_PT_L1: Aligned4K<[A64PTE; 512]> = Aligned4K::new([A64PTE::empty(); 512]);
 
 /// Initialize boot page table.
 ///
 /// This creates a simple identity mapping for the kernel and device memory.
-/// The page table will be replaced by a more sophisticated one later.
+/// It is replaced by the kernel page table in `mm::page_table::init`, and
+/// only used by secondary CPUs until they get there.
 ///
 /// # Safety
 ///
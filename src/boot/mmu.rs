@@ -32,7 +32,13 @@ pub unsafe fn init_mmu(root_paddr: PhysAddr) {
         + TCR_EL1::ORGN1::WriteBack_ReadAlloc_WriteAlloc_Cacheable
         + TCR_EL1::IRGN1::WriteBack_ReadAlloc_WriteAlloc_Cacheable
         + TCR_EL1::T1SZ.val(16);
-    TCR_EL1.write(TCR_EL1::IPS::Bits_48 + tcr_flags0 + tcr_flags1);
+    // TTBR0 entries are tagged with 16-bit ASIDs where the CPU has them.
+    let asid_size = if ID_AA64MMFR0_EL1.matches_all(ID_AA64MMFR0_EL1::ASIDBits::Bits_16) {
+        TCR_EL1::AS::ASID16Bits
+    } else {
+        TCR_EL1::AS::ASID8Bits
+    };
+    TCR_EL1.write(TCR_EL1::IPS::Bits_48 + TCR_EL1::A1::TTBR0 + asid_size + tcr_flags0 + tcr_flags1);
     barrier::isb(barrier::SY);
 
     // Set both TTBR0 and TTBR1
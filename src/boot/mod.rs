@@ -9,6 +9,7 @@
 pub mod entry;
 pub mod init;
 pub mod mmu;
+pub mod phases;
 
 use core::sync::atomic::{AtomicUsize, Ordering};
 
@@ -97,6 +98,7 @@ pub fn rust_main(_cpu_id: usize, arg: usize) -> ! {
     );
 
     percpu::init(0); // Initialize percpu for CPU 0
+    phases::mark("early init");
 
     // Print build time
     println!(
@@ -109,6 +111,7 @@ pub fn rust_main(_cpu_id: usize, arg: usize) -> ! {
     crate::console::init_logger().expect("Failed to initialize logger");
 
     backtrace_init();
+    crate::mm::allocator::register_lock();
 
     with_provider::<IrqProvider>()
         .init(
@@ -116,31 +119,48 @@ pub fn rust_main(_cpu_id: usize, arg: usize) -> ! {
             phys_to_virt(pa!(crate::config::GICR_BASE)),
         )
         .expect("Failed to initialize IRQ");
+    with_provider::<UartProvider>().init_irq();
 
     with_provider::<BootProvider>().driver_init_early();
     with_provider::<PowerProvider>()
         .init("hvc")
         .expect("Failed to initialize PSCI");
+    phases::mark("early drivers");
 
     // Initialize task scheduler
     crate::task::init_taskmanager();
 
     println!("\nHello RustTinyOS!\n");
 
-    // Safe because the pointer is a valid pointer to unaliased memory.
-    with_provider::<BootProvider>().fdt_init(arg);
+    // Safe because the pointer is a valid pointer to unaliased memory. Go
+    // through the linear map, the identity map is gone after paging init.
+    with_provider::<BootProvider>().fdt_init(phys_to_virt(pa!(arg)).as_usize());
+    crate::mm::frame::init(arg);
+    crate::mm::page_table::init();
+    phases::mark("memory");
 
-    with_provider::<BootProvider>().driver_init();
-
-    // Boot secondary CPUs
+    // Boot secondary CPUs, they help with the probes queued next
     boot_secondary_cpus();
+    phases::mark("secondary cpus");
+
+    // Returns once every device is probed; the filesystem needs the block
+    // device
+    with_provider::<BootProvider>().driver_init();
+    phases::mark("drivers");
 
     // Initialize/Mount Filesystem
     crate::fs::init();
+    phases::mark("filesystem");
+
+    // From here on, log records are queued per CPU and printed by a task
+    crate::console::log_ring::start_drain();
 
     // Create main user task as child of ROOT
     crate::task::thread::spawn("Main Task", crate::main);
 
+    phases::mark("scheduler");
+    phases::log_phases();
+
     // Signal all CPUs to start scheduling
     START_SCHEDULING.store(1, Ordering::SeqCst);
 
@@ -153,6 +173,8 @@ pub fn rust_main(_cpu_id: usize, arg: usize) -> ! {
 /// This function is called by each secondary CPU after basic hardware
 /// initialization (EL switch, FP enable, MMU setup).
 pub fn rust_main_secondary(cpu_id: usize) -> ! {
+    crate::mm::page_table::init_secondary();
+
     // Initialize percpu for this CPU
     percpu::init(cpu_id);
     crate::hal::init_exception();
@@ -171,9 +193,11 @@ pub fn rust_main_secondary(cpu_id: usize) -> ! {
     // // Signal that this CPU is ready
     CPUS_READY.fetch_add(1, Ordering::SeqCst);
 
-    // // Wait for primary CPU to signal start
+    // // Wait for primary CPU to signal start, probing devices meanwhile
     while START_SCHEDULING.load(Ordering::SeqCst) == 0 {
-        core::hint::spin_loop();
+        if !crate::device::core::driver_manager().run_queued_probes() {
+            core::hint::spin_loop();
+        }
     }
 
     // // Join the scheduler - secondary CPUs participate in task scheduling
@@ -184,10 +208,13 @@ pub fn rust_main_secondary(cpu_id: usize) -> ! {
 #[cfg(all(target_os = "none", not(test)))]
 #[panic_handler]
 fn panic(info: &core::panic::PanicInfo) -> ! {
+    // Nothing will drain the rings any more.
+    crate::console::log_ring::set_direct();
     error!("{}", info);
 
     // Capture and display backtrace
     error!("\n{}", axbacktrace::Backtrace::capture());
 
+    crate::console::flush();
     with_provider::<PowerProvider>().system_off();
 }
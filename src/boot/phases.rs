@@ -0,0 +1,54 @@
+//! Boot phase timestamps.
+//!
+//! Boot code marks the end of each phase with [`mark`]. Times come straight
+//! from the system counter, which runs from reset, so they work before the
+//! timer driver is probed and the first phase includes the time spent in
+//! firmware and the bootloader.
+
+use aarch64_cpu::registers::{CNTFRQ_EL0, CNTPCT_EL0, Readable};
+
+use crate::hal::Mutex;
+
+/// Phases recorded at most; later marks are dropped.
+const MAX_PHASES: usize = 16;
+
+/// Names and end times of the phases so far, and their count.
+static PHASES: Mutex<([(&str, u64); MAX_PHASES], usize)> = Mutex::new(([("", 0); MAX_PHASES], 0));
+
+/// Returns the time since reset in nanoseconds.
+#[inline]
+pub fn now_ns() -> u64 {
+    let freq = CNTFRQ_EL0.get().max(1) as u128;
+    (CNTPCT_EL0.get() as u128 * 1_000_000_000 / freq) as u64
+}
+
+/// Records that the boot phase `name` ends now.
+pub fn mark(name: &'static str) {
+    let now = now_ns();
+    let mut phases = PHASES.lock();
+    let (entries, len) = &mut *phases;
+    if *len < MAX_PHASES {
+        entries[*len] = (name, now);
+        *len += 1;
+    }
+}
+
+/// Returns each phase recorded so far with its end time since reset.
+pub fn phases() -> alloc::vec::Vec<(&'static str, u64)> {
+    let phases = PHASES.lock();
+    phases.0[..phases.1].to_vec()
+}
+
+/// Logs how long each phase took.
+pub fn log_phases() {
+    let mut prev = 0;
+    for (name, end_ns) in phases() {
+        info!(
+            "boot: {:<16} {:>8} us (at {} us)",
+            name,
+            (end_ns - prev) / 1000,
+            end_ns / 1000
+        );
+        prev = end_ns;
+    }
+}
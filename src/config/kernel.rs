@@ -4,18 +4,48 @@ use const_env::env_item;
 
 pub const BOOT_STACK_SIZE: usize = 0x40000;
 pub const PHYS_VIRT_OFFSET: usize = 0xffff_0000_0000_0000;
-pub const HEAP_ALLOCATOR_SIZE: usize = 0x10000000; // 256MB heap size
-pub const TICKS_PER_SEC: usize = 100; // 100 ticks per second (1ms per tick)
+pub const HEAP_ALLOCATOR_SIZE: usize = 0x1000000; // 16MB boot heap, grown from page frames later
+pub const HEAP_GROW_SIZE: usize = 0x200000; // Minimum heap growth step (2MB)
+pub const TICKS_PER_SEC: usize = 100; // Scheduler tick rate (10ms per tick), the unit of time slices
 
 // Multi-core configuration
 pub const SECONDARY_STACK_SIZE: usize = 0x10000; // 64KB per secondary CPU
 
 // Task scheduling configuration
 pub const TASK_STACK_SIZE: usize = 0x10000; // 64KB per task
+pub const TASK_STACK_POOL_SIZE: usize = 32; // Stacks of exited tasks kept for reuse
+pub const SCHED_SLICE_TICKS: usize = 2; // Time slice before a running task is preempted
+
+// Block device configuration
+pub const BLOCK_CACHE_SECTORS: usize = 2048; // 1MB of cached 512-byte sectors
+pub const BLOCK_IO_MAX_SECTORS: usize = 256; // Largest coalesced request (128KB)
+pub const BLOCK_READAHEAD_MIN_SECTORS: usize = 8; // First read-ahead window (4KB)
+pub const BLOCK_READAHEAD_MAX_SECTORS: usize = 256; // Read-ahead window ceiling (128KB)
+pub const DENTRY_CACHE_ENTRIES: usize = 1024; // Cached FAT32 path lookups
+
+// Logging configuration
+pub const LOG_RING_SIZE: usize = 0x4000; // 16KB of queued log records per CPU
+
+// Profiling configuration
+pub const PROFILE_SAMPLES: usize = 4096; // PC samples kept per CPU per session
+pub const PROFILE_DEFAULT_PERIOD: u32 = 1_000_000; // Events between two PC samples
+pub const TRACE_ENTRIES: usize = 1024; // Tracepoint records kept per CPU (oldest overwritten)
 
 // Timer interrupt configuration
 pub const TIMER_IRQ: IntId = IntId::ppi(14);
 
+// PMU overflow interrupt, the same PPI on every supported board
+pub const PMU_IRQ: IntId = IntId::ppi(7);
+
+// SGI used to kick an idle CPU out of `wfi` when work is queued for it
+pub const RESCHED_IPI: IntId = IntId::sgi(1);
+
+// SGI asking every CPU to start or stop its part of a profiling session
+pub const PROFILE_IPI: IntId = IntId::sgi(2);
+
+// SGI a CPU raises on itself to wake the log drain task
+pub const LOG_KICK_IPI: IntId = IntId::sgi(4);
+
 #[env_item]
 pub const TINYENV_SMP: usize = 1;
 
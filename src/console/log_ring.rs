@@ -0,0 +1,259 @@
+//! Per-CPU log rings, drained to the console in the background.
+//!
+//! Each CPU formats its log records into its own single-producer ring, so
+//! logging takes no lock and never waits for the UART. A drain task copies
+//! the records out and prints them. When a ring is full, new records are
+//! dropped and counted; the drain reports the count.
+//!
+//! The drain task sleeps while every ring is empty. A record that makes a
+//! ring non-empty kicks it awake, but not directly: [`write`] may run under
+//! the scheduler's locks, so it raises [`LOG_KICK_IPI`] on its own CPU, and
+//! the IPI handler wakes the task once IRQs are unmasked again.
+//!
+//! Until [`start_drain`] runs, and again after [`set_direct`] (e.g. on
+//! panic), records are printed synchronously instead.
+
+use core::cell::UnsafeCell;
+use core::fmt::{self, Write};
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering, fence};
+
+use provider_core::with_provider;
+
+use crate::config::kernel::{LOG_KICK_IPI, LOG_RING_SIZE, TINYENV_SMP};
+use crate::device::provider::IrqProvider;
+use crate::hal::{Mutex, cpu, percpu};
+use crate::print;
+use crate::task::wait_queue::WaitQueue;
+
+/// Longest record, newline included; longer ones are cut off.
+pub const LOG_RECORD_MAX: usize = 512;
+
+/// Bytes before each record holding its length.
+const HEADER: usize = 2;
+
+/// A record being formatted on the stack.
+pub struct LogRecord {
+    buf: [u8; LOG_RECORD_MAX],
+    len: usize,
+}
+
+impl LogRecord {
+    pub const fn new() -> Self {
+        Self {
+            buf: [0; LOG_RECORD_MAX],
+            len: 0,
+        }
+    }
+
+    /// Ends the record with a newline, also when it was cut off.
+    pub fn terminate(&mut self) {
+        if self.buf[..self.len].last() != Some(&b'\n') {
+            self.buf[self.len] = b'\n';
+            self.len += 1;
+        }
+    }
+
+    fn as_str(&self) -> &str {
+        // Only whole characters are ever copied in.
+        core::str::from_utf8(&self.buf[..self.len]).unwrap_or("<bad log record>\n")
+    }
+}
+
+impl Write for LogRecord {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        // Keep a byte for the newline `terminate` may add.
+        let mut n = s.len().min(LOG_RECORD_MAX - 1 - self.len);
+        while !s.is_char_boundary(n) {
+            n -= 1;
+        }
+        self.buf[self.len..self.len + n].copy_from_slice(&s.as_bytes()[..n]);
+        self.len += n;
+        Ok(())
+    }
+}
+
+/// The fields the owning CPU writes, on a cache line of their own.
+#[repr(align(64))]
+struct Producer {
+    /// Bytes produced by the owning CPU, ever.
+    tail: AtomicUsize,
+    dropped: AtomicU64,
+}
+
+/// The fields the drain writes, on a cache line of their own.
+#[repr(align(64))]
+struct Consumer {
+    /// Bytes consumed by the drain, ever.
+    head: AtomicUsize,
+    /// Value of `dropped` last reported by the drain.
+    reported: AtomicU64,
+}
+
+/// Single-producer, single-consumer byte ring of length-prefixed records.
+///
+/// Aligned so that neighbouring CPUs' rings share no cache line either.
+#[repr(align(64))]
+struct LogRing {
+    buf: UnsafeCell<[u8; LOG_RING_SIZE]>,
+    producer: Producer,
+    consumer: Consumer,
+}
+
+// Safety: only the owning CPU writes past `tail`, and only the drain, under
+// `DRAIN_LOCK`, reads between `head` and `tail`.
+unsafe impl Sync for LogRing {}
+
+impl LogRing {
+    const fn new() -> Self {
+        Self {
+            buf: UnsafeCell::new([0; LOG_RING_SIZE]),
+            producer: Producer {
+                tail: AtomicUsize::new(0),
+                dropped: AtomicU64::new(0),
+            },
+            consumer: Consumer {
+                head: AtomicUsize::new(0),
+                reported: AtomicU64::new(0),
+            },
+        }
+    }
+
+    /// Appends a record. Must run on the owning CPU with IRQs masked, so
+    /// an IRQ handler logging on the same CPU cannot interleave.
+    ///
+    /// Returns `true` if the drain had emptied the ring before the record
+    /// went in, and may have gone to sleep without seeing it.
+    fn push(&self, record: &[u8]) -> bool {
+        let need = HEADER + record.len();
+        let tail = self.producer.tail.load(Ordering::Relaxed);
+        let head = self.consumer.head.load(Ordering::Acquire);
+        if LOG_RING_SIZE - (tail - head) < need {
+            self.producer.dropped.fetch_add(1, Ordering::Relaxed);
+            return false;
+        }
+
+        let buf = self.buf.get() as *mut u8;
+        let len = (record.len() as u16).to_le_bytes();
+        for (i, &byte) in len.iter().chain(record).enumerate() {
+            unsafe { buf.add((tail + i) % LOG_RING_SIZE).write(byte) };
+        }
+        self.producer.tail.store(tail + need, Ordering::Release);
+
+        // Pairs with the fence in `pop`: either the drain sees the new
+        // tail, or we see that it consumed everything before it.
+        fence(Ordering::SeqCst);
+        self.consumer.head.load(Ordering::Relaxed) == tail
+    }
+
+    /// Removes the oldest record into `record`, or returns `false` if the
+    /// ring is empty.
+    fn pop(&self, record: &mut LogRecord) -> bool {
+        let head = self.consumer.head.load(Ordering::Relaxed);
+        fence(Ordering::SeqCst);
+        let tail = self.producer.tail.load(Ordering::Acquire);
+        if head == tail {
+            return false;
+        }
+
+        let buf = self.buf.get() as *const u8;
+        let byte = |i: usize| unsafe { buf.add((head + i) % LOG_RING_SIZE).read() };
+        let len = u16::from_le_bytes([byte(0), byte(1)]) as usize;
+        for i in 0..len {
+            record.buf[i] = byte(HEADER + i);
+        }
+        record.len = len;
+        self.consumer
+            .head
+            .store(head + HEADER + len, Ordering::Release);
+        true
+    }
+}
+
+static RINGS: [LogRing; TINYENV_SMP] = [const { LogRing::new() }; TINYENV_SMP];
+
+/// Set while records are printed synchronously.
+static DIRECT: AtomicBool = AtomicBool::new(true);
+
+/// Serializes consumers of the rings.
+static DRAIN_LOCK: Mutex<()> = Mutex::new(());
+
+/// Set when a ring became non-empty, until the drain task picks it up.
+static KICKED: AtomicBool = AtomicBool::new(false);
+
+/// Where the drain task sleeps while every ring is empty.
+static DRAIN_WAIT: WaitQueue = WaitQueue::new();
+
+/// Queues a formatted record for the console.
+pub fn write(record: &LogRecord) {
+    // Read the CPU id with IRQs off, so the task cannot migrate and share
+    // another CPU's single-producer ring.
+    let irq_enabled = cpu::local_irq_save();
+    let queued = match percpu::try_cpu_id() {
+        Some(cpu_id) if !DIRECT.load(Ordering::Acquire) => {
+            if RINGS[cpu_id].push(&record.buf[..record.len]) && !KICKED.swap(true, Ordering::AcqRel)
+            {
+                // Taken once IRQs are unmasked, outside whatever locks the
+                // caller holds.
+                with_provider::<IrqProvider>().send_sgi(LOG_KICK_IPI, cpu_id);
+            }
+            true
+        }
+        _ => false,
+    };
+    cpu::local_irq_restore(irq_enabled);
+    if !queued {
+        print!("{}", record.as_str());
+    }
+}
+
+/// Prints every queued record.
+pub fn drain() {
+    let _guard = DRAIN_LOCK.lock();
+    let mut record = LogRecord::new();
+    for (cpu_id, ring) in RINGS.iter().enumerate() {
+        while ring.pop(&mut record) {
+            print!("{}", record.as_str());
+        }
+        let dropped = ring.producer.dropped.load(Ordering::Relaxed);
+        let reported = ring.consumer.reported.swap(dropped, Ordering::Relaxed);
+        if dropped != reported {
+            print!(
+                "[log: {} records dropped on CPU {}]\n",
+                dropped - reported,
+                cpu_id
+            );
+        }
+    }
+}
+
+/// Returns the number of records dropped on each CPU since boot.
+#[allow(unused)]
+pub fn dropped() -> [u64; TINYENV_SMP] {
+    core::array::from_fn(|cpu_id| RINGS[cpu_id].producer.dropped.load(Ordering::Relaxed))
+}
+
+/// Switches to ring buffering, and starts the task that drains the rings.
+pub fn start_drain() {
+    with_provider::<IrqProvider>().register(LOG_KICK_IPI, |_| {
+        DRAIN_WAIT.notify_one();
+    });
+    crate::task::thread::spawn("Log Drain", || {
+        loop {
+            DRAIN_WAIT.wait_until(|| KICKED.swap(false, Ordering::AcqRel));
+            drain();
+        }
+    });
+    DIRECT.store(false, Ordering::Release);
+}
+
+/// Enables [`LOG_KICK_IPI`] on this CPU; SGIs are banked, so every CPU
+/// enables its own.
+pub fn init_cpu() {
+    with_provider::<IrqProvider>().enable(LOG_KICK_IPI, 0x80);
+}
+
+/// Prints whatever is queued and goes back to printing synchronously.
+pub fn set_direct() {
+    DIRECT.store(true, Ordering::Release);
+    drain();
+}
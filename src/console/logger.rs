@@ -1,8 +1,9 @@
 //! Logger implementation for the log crate.
 
-use core::fmt::{self, Display};
+use core::fmt::{self, Display, Write};
 use log::{Level, LevelFilter, Log, Metadata, Record};
 
+use super::log_ring::{self, LogRecord};
 use crate::TinyResult;
 use crate::config::kernel::TINYENV_LOG;
 use crate::device::provider::TimerProvider;
@@ -56,15 +57,25 @@ impl Log for SimpleLogger {
             Level::Trace => (ColorCode::BrightBlack, ColorCode::BrightBlack),
         };
 
+        // Integer maths only: this runs on every log call.
         let current_nanos = with_provider::<TimerProvider>().boot_nanoseconds();
-        let secs =
-            (current_nanos as f64) / (with_provider::<TimerProvider>().nanos_per_sec() as f64);
+        let nanos_per_sec = with_provider::<TimerProvider>().nanos_per_sec();
+        let secs = current_nanos / nanos_per_sec;
+        let frac = (current_nanos % nanos_per_sec) * 100_000 / nanos_per_sec;
 
         // 彩色输出格式：[时间 文件:行号] 消息
-        println!("[{secs:.5} {file}:{line}] {args_color}{args}{color_reset}");
+        let mut out = LogRecord::new();
+        let _ = writeln!(
+            out,
+            "[{secs}.{frac:05} {file}:{line}] {args_color}{args}{color_reset}"
+        );
+        out.terminate();
+        log_ring::write(&out);
     }
 
-    fn flush(&self) {}
+    fn flush(&self) {
+        log_ring::drain();
+    }
 }
 
 /// Initialize the logger.
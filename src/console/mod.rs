@@ -2,6 +2,11 @@
 //!
 //! This module provides console output and logging support.
 
+use provider_core::with_provider;
+
+use crate::device::provider::UartProvider;
+
+pub mod log_ring;
 pub mod logger;
 
 #[macro_use]
@@ -10,3 +15,10 @@ pub mod print;
 pub use logger::init as init_logger;
 pub mod tty;
 pub use tty::start_tty;
+
+/// Writes out everything logged or printed so far, for use before the
+/// system stops.
+pub fn flush() {
+    log_ring::drain();
+    with_provider::<UartProvider>().flush();
+}
@@ -4,11 +4,11 @@
 //! multiple CPUs from being interleaved.
 
 use crate::device::provider::UartProvider;
-use crate::hal::Mutex;
+use crate::hal::{Mutex, TicketNoIrq};
 use core::fmt::{self, Write};
 use provider_core::with_provider;
 
-static PRINT_LOCK: Mutex<()> = Mutex::new(());
+static PRINT_LOCK: Mutex<()> = Mutex::const_new(unsafe { TicketNoIrq::named("PRINT_LOCK") }, ());
 
 /// Buffer size for formatting output before sending to UART.
 /// This should be large enough for most log lines.
@@ -36,6 +36,7 @@ pub fn start_tty() {
 }
 
 fn tty_main() {
+    crate::boot::phases::mark("shell");
     with_provider::<UartProvider>().puts("\r\n[tty] started. Type 'help' for commands.\r\n");
     with_provider::<UartProvider>().puts("> ");
 
@@ -43,88 +44,85 @@ fn tty_main() {
     let mut esc_state = EscapeState::Normal;
 
     loop {
-        if let Some(c) = with_provider::<UartProvider>().getchar() {
-            match esc_state {
-                EscapeState::Normal => {
-                    match c {
-                        0x1B => {
-                            // ESC character - start escape sequence
-                            esc_state = EscapeState::Escape;
-                        }
-                        b'\r' | b'\n' => {
-                            // Echo newline
-                            with_provider::<UartProvider>().puts("\r\n");
+        // Sleeps until the UART IRQ delivers input.
+        let c = with_provider::<UartProvider>().read_byte();
+        match esc_state {
+            EscapeState::Normal => {
+                match c {
+                    0x1B => {
+                        // ESC character - start escape sequence
+                        esc_state = EscapeState::Escape;
+                    }
+                    b'\r' | b'\n' => {
+                        // Echo newline
+                        with_provider::<UartProvider>().puts("\r\n");
 
-                            // Add to history before executing
-                            if !line.trim().is_empty() {
-                                HISTORY.lock().push(line.trim());
-                            }
+                        // Add to history before executing
+                        if !line.trim().is_empty() {
+                            HISTORY.lock().push(line.trim());
+                        }
 
-                            // Reset history navigation
-                            HISTORY.lock().reset_navigation();
+                        // Reset history navigation
+                        HISTORY.lock().reset_navigation();
 
-                            // Handle the command
-                            handle_line(&line);
+                        // Handle the command
+                        handle_line(&line);
 
-                            // Clear line buffer
-                            line.clear();
+                        // Clear line buffer
+                        line.clear();
 
-                            // Print prompt
-                            with_provider::<UartProvider>().puts("> ");
-                        }
-                        8 | 127 => {
-                            // Backspace
-                            if !line.is_empty() {
-                                line.pop();
-                                // Move cursor back, overwrite with space, move back again
-                                with_provider::<UartProvider>().puts("\x08 \x08");
-                            }
-                        }
-                        c if c.is_ascii_graphic() || c == b' ' => {
-                            // Printable character - reset history navigation
-                            HISTORY.lock().reset_navigation();
-                            line.push(c as char);
-                            with_provider::<UartProvider>().putchar(c);
-                        }
-                        _ => {
-                            // Ignore other control characters
+                        // Print prompt
+                        with_provider::<UartProvider>().puts("> ");
+                    }
+                    8 | 127 => {
+                        // Backspace
+                        if !line.is_empty() {
+                            line.pop();
+                            // Move cursor back, overwrite with space, move back again
+                            with_provider::<UartProvider>().puts("\x08 \x08");
                         }
                     }
-                }
-                EscapeState::Escape => {
-                    if c == b'[' {
-                        esc_state = EscapeState::Bracket;
-                    } else {
-                        // Invalid escape sequence, reset
-                        esc_state = EscapeState::Normal;
+                    c if c.is_ascii_graphic() || c == b' ' => {
+                        // Printable character - reset history navigation
+                        HISTORY.lock().reset_navigation();
+                        line.push(c as char);
+                        with_provider::<UartProvider>().putchar(c);
+                    }
+                    _ => {
+                        // Ignore other control characters
                     }
                 }
-                EscapeState::Bracket => {
+            }
+            EscapeState::Escape => {
+                if c == b'[' {
+                    esc_state = EscapeState::Bracket;
+                } else {
+                    // Invalid escape sequence, reset
                     esc_state = EscapeState::Normal;
-                    match c {
-                        b'A' => {
-                            // Up arrow - previous history
-                            handle_history_prev(&mut line);
-                        }
-                        b'B' => {
-                            // Down arrow - next history
-                            handle_history_next(&mut line);
-                        }
-                        b'C' => {
-                            // Right arrow - ignore for now
-                        }
-                        b'D' => {
-                            // Left arrow - ignore for now
-                        }
-                        _ => {
-                            // Unknown escape sequence, ignore
-                        }
+                }
+            }
+            EscapeState::Bracket => {
+                esc_state = EscapeState::Normal;
+                match c {
+                    b'A' => {
+                        // Up arrow - previous history
+                        handle_history_prev(&mut line);
+                    }
+                    b'B' => {
+                        // Down arrow - next history
+                        handle_history_next(&mut line);
+                    }
+                    b'C' => {
+                        // Right arrow - ignore for now
+                    }
+                    b'D' => {
+                        // Left arrow - ignore for now
+                    }
+                    _ => {
+                        // Unknown escape sequence, ignore
                     }
                 }
             }
-        } else {
-            // No input available, yield to other tasks
-            crate::task::thread::yield_now();
         }
     }
 }
@@ -6,14 +6,14 @@ use provider_core::with_provider;
 use super::model::{DeviceInfo, MAX_COMPAT_ENTRIES};
 
 pub trait Bus {
-    fn for_each_device(&self, f: impl FnMut(DeviceInfo<'_>));
+    fn for_each_device(&self, f: impl FnMut(DeviceInfo<'static>));
 }
 
 pub struct FdtBus;
 pub struct EarlyBus;
 
 impl Bus for EarlyBus {
-    fn for_each_device(&self, mut f: impl FnMut(DeviceInfo<'_>)) {
+    fn for_each_device(&self, mut f: impl FnMut(DeviceInfo<'static>)) {
         // Synthetic early-boot devices that do not rely on FDT parsing.
         f(DeviceInfo {
             node_name: "generic-timer",
@@ -35,7 +35,7 @@ impl Bus for EarlyBus {
 }
 
 impl Bus for FdtBus {
-    fn for_each_device(&self, mut f: impl FnMut(DeviceInfo<'_>)) {
+    fn for_each_device(&self, mut f: impl FnMut(DeviceInfo<'static>)) {
         let fdt = with_provider::<BootProvider>().get_fdt().lock();
 
         for node in fdt.all_nodes() {
@@ -52,9 +52,26 @@ impl Bus for FdtBus {
                 compatible,
                 reg_base: reg.map(|r| r.starting_address as usize),
                 reg_size: reg.and_then(|r| r.size),
-                irq: None,
+                irq: node
+                    .property("interrupts")
+                    .and_then(|prop| gic_intid(prop.value)),
             };
             f(dev);
         }
     }
 }
+
+/// Decodes the first specifier of a GIC `interrupts` property
+/// (`<type number flags>`) into an interrupt ID.
+fn gic_intid(cells: &[u8]) -> Option<u32> {
+    let cell = |i: usize| {
+        cells
+            .get(i * 4..i * 4 + 4)
+            .map(|b| u32::from_be_bytes([b[0], b[1], b[2], b[3]]))
+    };
+    match (cell(0)?, cell(1)?) {
+        (0, spi) => Some(spi + 32),
+        (1, ppi) => Some(ppi + 16),
+        _ => None,
+    }
+}
@@ -1,92 +1,142 @@
 //! Driver manager with explicit registration and level-based binding.
+//!
+//! Drivers are found through an index from compatible string to the drivers
+//! claiming it, built once from `PROVIDERS`. Early and core devices are
+//! probed right away on the boot CPU. Normal and late probes are queued and
+//! run by whichever CPU gets to them first: the secondary CPUs drain the
+//! queue while they wait for the scheduler to start, and the boot CPU joins
+//! in, in [`DriverManager::wait_for_probes`]. The queue holds one level at a
+//! time: a level is only queued once the one before it has been waited for.
 
-use provider_core::PROVIDERS;
+use alloc::collections::{BTreeMap, BTreeSet, VecDeque};
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicUsize, Ordering};
 
-use crate::hal::Mutex;
+use lazy_static::lazy_static;
+use provider_core::{PROVIDERS, ProviderDriver};
+
+use crate::boot::phases;
+use crate::hal::{Mutex, percpu};
 
 use super::model::{DeviceInfo, InitLevel};
 
-const MAX_BINDINGS: usize = 256;
+lazy_static! {
+    /// Drivers by compatible string, in `PROVIDERS` order.
+    static ref COMPATIBLE_INDEX: BTreeMap<&'static str, Vec<&'static ProviderDriver>> = {
+        let mut index: BTreeMap<_, Vec<_>> = BTreeMap::new();
+        for driver in PROVIDERS.iter().filter_map(|provider| provider.driver.as_ref()) {
+            for compatible in driver.compatibles {
+                index.entry(*compatible).or_default().push(driver);
+            }
+        }
+        index
+    };
+}
 
-#[derive(Clone, Copy)]
-struct BindingRecord {
-    driver_name: &'static str,
-    node_hash: u64,
+/// A probe waiting for a CPU to run it.
+struct ProbeJob {
+    driver: &'static ProviderDriver,
+    dev: DeviceInfo<'static>,
 }
 
 pub struct DriverManager {
-    bindings: Mutex<[Option<BindingRecord>; MAX_BINDINGS]>,
+    /// Driver and node names of the bindings made or being probed.
+    bindings: Mutex<BTreeSet<(&'static str, &'static str)>>,
+    queue: Mutex<VecDeque<ProbeJob>>,
+    /// Queued probes that have not finished yet.
+    pending: AtomicUsize,
 }
 
 impl DriverManager {
     pub const fn new() -> Self {
         Self {
-            bindings: Mutex::new([None; MAX_BINDINGS]),
+            bindings: Mutex::new(BTreeSet::new()),
+            queue: Mutex::new(VecDeque::new()),
+            pending: AtomicUsize::new(0),
         }
     }
 
-    pub fn bind_device_for_level(&self, dev: &DeviceInfo, level: InitLevel) {
-        for provider in PROVIDERS.iter() {
-            let Some(driver) = provider.driver else {
-                continue;
-            };
-
-            if driver.level != level
-                || !driver
-                    .compatibles
-                    .iter()
-                    .any(|compatible| dev.has_compatible(compatible))
-            {
-                continue;
+    /// Probes every driver of `level` that matches `dev`, on this CPU.
+    pub fn bind_device_for_level(&self, dev: &DeviceInfo<'static>, level: InitLevel) {
+        for driver in matching_drivers(dev, level) {
+            if self.claim(driver, dev) {
+                self.probe(driver, dev);
             }
+        }
+    }
 
-            let node_hash = hash_node(dev.node_name);
-            if self.is_bound(driver.name, node_hash) {
-                continue;
+    /// Queues a probe of every driver of `level` that matches `dev`, for
+    /// [`run_queued_probes`](Self::run_queued_probes) to pick up.
+    pub fn queue_device_for_level(&self, dev: &DeviceInfo<'static>, level: InitLevel) {
+        for driver in matching_drivers(dev, level) {
+            if self.claim(driver, dev) {
+                self.pending.fetch_add(1, Ordering::Relaxed);
+                self.queue.lock().push_back(ProbeJob { driver, dev: *dev });
             }
+        }
+    }
 
-            if let Err(err) = (driver.probe)(dev) {
-                warn!(
-                    "driver probe failed: driver={} node={} err={:?}",
-                    driver.name, dev.node_name, err
-                );
-                continue;
-            }
+    /// Runs queued probes until the queue is empty. Returns `false` if
+    /// there was nothing to run.
+    pub fn run_queued_probes(&self) -> bool {
+        let mut ran = false;
+        loop {
+            // The guard is dropped before probing, other CPUs keep popping.
+            let Some(job) = self.queue.lock().pop_front() else {
+                return ran;
+            };
+            self.probe(job.driver, &job.dev);
+            self.pending.fetch_sub(1, Ordering::Release);
+            ran = true;
+        }
+    }
 
-            self.record_binding(driver.name, node_hash);
+    /// Helps with the queued probes and returns once all of them finished.
+    pub fn wait_for_probes(&self) {
+        self.run_queued_probes();
+        while self.pending.load(Ordering::Acquire) > 0 {
+            core::hint::spin_loop();
         }
     }
 
-    fn is_bound(&self, driver_name: &'static str, node_hash: u64) -> bool {
-        let guard = self.bindings.lock();
-        guard
-            .iter()
-            .flatten()
-            .any(|r| r.driver_name == driver_name && r.node_hash == node_hash)
+    /// Records that `driver` binds `dev`. Returns `false` if it already
+    /// does, or is being probed for it.
+    fn claim(&self, driver: &'static ProviderDriver, dev: &DeviceInfo<'static>) -> bool {
+        self.bindings.lock().insert((driver.name, dev.node_name))
     }
 
-    fn record_binding(&self, driver_name: &'static str, node_hash: u64) {
-        let mut guard = self.bindings.lock();
-        for slot in guard.iter_mut() {
-            if slot.is_none() {
-                *slot = Some(BindingRecord {
-                    driver_name,
-                    node_hash,
-                });
-                return;
-            }
+    fn probe(&self, driver: &'static ProviderDriver, dev: &DeviceInfo<'static>) {
+        let start = phases::now_ns();
+        if let Err(err) = (driver.probe)(dev) {
+            warn!(
+                "driver probe failed: driver={} node={} err={:?}",
+                driver.name, dev.node_name, err
+            );
+            self.bindings.lock().remove(&(driver.name, dev.node_name));
+            return;
         }
-        warn!("binding table full, skipping record for {}", driver_name);
+        debug!(
+            "probed {} on {} in {} us on CPU {}",
+            driver.name,
+            dev.node_name,
+            (phases::now_ns() - start) / 1000,
+            percpu::cpu_id()
+        );
     }
 }
 
-fn hash_node(name: &str) -> u64 {
-    let mut hash: u64 = 0xcbf29ce484222325;
-    for b in name.as_bytes() {
-        hash ^= *b as u64;
-        hash = hash.wrapping_mul(0x100000001b3);
+/// Returns the drivers of `level` that claim one of the compatible strings
+/// of `dev`, most specific string first.
+fn matching_drivers(dev: &DeviceInfo<'static>, level: InitLevel) -> Vec<&'static ProviderDriver> {
+    let mut drivers: Vec<&'static ProviderDriver> = Vec::new();
+    for compatible in dev.compatible.iter().flatten() {
+        for &driver in COMPATIBLE_INDEX.get(*compatible).into_iter().flatten() {
+            if driver.level == level && !drivers.iter().any(|d| core::ptr::eq(*d, driver)) {
+                drivers.push(driver);
+            }
+        }
     }
-    hash
+    drivers
 }
 
 static DRIVER_MANAGER: DriverManager = DriverManager::new();
@@ -15,6 +15,9 @@ pub struct UartProvider {
     pub puts: fn(message: &str),
     pub putchar: fn(byte: u8),
     pub getchar: fn() -> Option<u8>,
+    pub read_byte: fn() -> u8,
+    pub init_irq: fn(),
+    pub flush: fn(),
 }
 
 #[derive(Clone, Copy)]
@@ -23,8 +26,24 @@ pub struct IrqProvider {
     pub init: fn(gicd_base: VirtAddr, gicr_base: VirtAddr) -> TinyResult<()>,
     pub init_secondary: fn(cpu_id: usize),
     pub register: fn(intid: IntId, handler: fn(usize)),
+    pub unregister: fn(intid: IntId),
     pub enable: fn(intid: IntId, priority: u8),
+    pub disable: fn(intid: IntId),
     pub handle: fn(),
+    pub send_sgi: fn(intid: IntId, cpu_id: usize),
+    /// Number of interrupt IDs the controller dispatches.
+    pub max_irqs: fn() -> usize,
+    pub stats: fn(cpu_id: usize, intid: usize) -> IrqStats,
+}
+
+/// How often an interrupt was handled on one CPU, and for how long.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct IrqStats {
+    pub count: u64,
+    /// Time spent in the handler, in total.
+    pub total_ns: u64,
+    /// Longest single run of the handler.
+    pub max_ns: u64,
 }
 
 #[derive(Clone, Copy)]
@@ -34,6 +53,7 @@ pub struct TimerProvider {
     pub nanos_per_sec: fn() -> u64,
     pub current_nanoseconds: fn() -> u64,
     pub busy_wait: fn(duration: Duration),
+    pub set_oneshot_timer: fn(deadline_ns: u64),
     pub init_secondary: fn(),
 }
 
@@ -59,5 +79,9 @@ pub struct BootProvider {
 pub struct BlockProvider {
     pub read_blocks: fn(block_id: usize, dst: &mut [u8]) -> TinyResult<()>,
     pub write_blocks: fn(block_id: usize, src: &[u8]) -> TinyResult<()>,
+    /// Reads several `(block_id, dst)` ranges, submitted to the device together.
+    pub read_blocks_sg: fn(segments: &mut [(usize, &mut [u8])]) -> TinyResult<()>,
+    /// Writes several `(block_id, src)` ranges, submitted to the device together.
+    pub write_blocks_sg: fn(segments: &[(usize, &[u8])]) -> TinyResult<()>,
     pub capacity_blocks: fn() -> TinyResult<u64>,
 }
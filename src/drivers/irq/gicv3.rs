@@ -1,17 +1,22 @@
 //! GICv3 (Generic Interrupt Controller version 3) driver.
 
+use aarch64_cpu::registers::{CNTFRQ_EL0, CNTPCT_EL0, Readable};
 use arm_gic::{
     IntId, UniqueMmioPointer,
     gicv3::{
-        GicCpuInterface, GicV3, InterruptGroup,
+        GicCpuInterface, GicV3, InterruptGroup, SgiTarget, SgiTargetGroup,
         registers::{Gicd, GicrSgi},
     },
 };
 use core::ptr::NonNull;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
 use lazyinit::LazyInit;
 use memory_addr::VirtAddr;
 
+use crate::config::kernel::TINYENV_SMP;
+use crate::device::provider::IrqStats;
 use crate::hal::percpu;
+use crate::profile::{TraceKind, trace};
 use crate::{TinyResult, hal::Mutex};
 
 /// The type of an interrupt handler.
@@ -20,9 +25,48 @@ pub type IrqHandler = fn(usize);
 /// Maximum number of interrupts supported (SGIs + PPIs + SPIs).
 const MAX_IRQ_COUNT: usize = 1024;
 
-/// Global interrupt handler table.
-static IRQ_HANDLER_TABLE: Mutex<[Option<IrqHandler>; MAX_IRQ_COUNT]> =
-    Mutex::new([None; MAX_IRQ_COUNT]);
+/// Global interrupt handler table, holding each handler's address, or `0`
+/// if there is none.
+///
+/// Handlers are registered rarely and looked up on every interrupt, so an
+/// update is a single atomic store and dispatch takes no lock.
+static IRQ_HANDLER_TABLE: [AtomicUsize; MAX_IRQ_COUNT] =
+    [const { AtomicUsize::new(0) }; MAX_IRQ_COUNT];
+
+/// Per-CPU accounting for one interrupt, in counter ticks.
+///
+/// Only the owning CPU updates it, from its IRQ handler, so plain loads
+/// and stores are enough; readers on other CPUs may see a slightly stale
+/// snapshot.
+struct IrqCounter {
+    count: AtomicU64,
+    ticks: AtomicU64,
+    max_ticks: AtomicU64,
+}
+
+impl IrqCounter {
+    const fn new() -> Self {
+        Self {
+            count: AtomicU64::new(0),
+            ticks: AtomicU64::new(0),
+            max_ticks: AtomicU64::new(0),
+        }
+    }
+
+    fn record(&self, ticks: u64) {
+        let add = |counter: &AtomicU64, n: u64| {
+            counter.store(counter.load(Ordering::Relaxed) + n, Ordering::Relaxed)
+        };
+        add(&self.count, 1);
+        add(&self.ticks, ticks);
+        if ticks > self.max_ticks.load(Ordering::Relaxed) {
+            self.max_ticks.store(ticks, Ordering::Relaxed);
+        }
+    }
+}
+
+static IRQ_COUNTERS: [[IrqCounter; MAX_IRQ_COUNT]; TINYENV_SMP] =
+    [const { [const { IrqCounter::new() }; MAX_IRQ_COUNT] }; TINYENV_SMP];
 
 /// Global GIC instance.
 static GIC: LazyInit<Mutex<GicV3>> = LazyInit::new();
@@ -39,10 +83,16 @@ pub fn irq_handler() {
 
     // Call the registered handler if exists
     let intid_val = u32::from(intid) as usize;
-    let handler_table = IRQ_HANDLER_TABLE.lock();
-    if let Some(handler) = handler_table[intid_val] {
-        drop(handler_table); // Release lock before calling handler
+    let handler = IRQ_HANDLER_TABLE[intid_val].load(Ordering::Acquire);
+    if handler != 0 {
+        // Safety: only `IrqHandler`s are ever stored in the table.
+        let handler: IrqHandler = unsafe { core::mem::transmute(handler) };
+        trace(TraceKind::IrqEntry, intid_val as u64, 0);
+        let start = CNTPCT_EL0.get();
         handler(intid_val);
+        let ticks = CNTPCT_EL0.get() - start;
+        IRQ_COUNTERS[percpu::cpu_id()][intid_val].record(ticks);
+        trace(TraceKind::IrqExit, intid_val as u64, ticks);
     } else {
         warn!("No handler registered for IRQ: {:?}", intid);
     }
@@ -50,20 +100,34 @@ pub fn irq_handler() {
     GicCpuInterface::end_interrupt(intid, InterruptGroup::Group1);
 }
 
+/// Returns the number of interrupt IDs with a handler slot.
+pub fn max_irqs() -> usize {
+    MAX_IRQ_COUNT
+}
+
+/// Returns how often `intid` was handled on `cpu_id`, and for how long.
+pub fn irqset_stats(cpu_id: usize, intid: usize) -> IrqStats {
+    let counter = &IRQ_COUNTERS[cpu_id][intid];
+    let freq = CNTFRQ_EL0.get().max(1) as u128;
+    let nanos = |ticks: u64| (ticks as u128 * 1_000_000_000 / freq) as u64;
+    IrqStats {
+        count: counter.count.load(Ordering::Relaxed),
+        total_ns: nanos(counter.ticks.load(Ordering::Relaxed)),
+        max_ns: nanos(counter.max_ticks.load(Ordering::Relaxed)),
+    }
+}
+
 /// Register an interrupt handler for the given interrupt ID.
 pub fn irqset_register(intid: IntId, handler: IrqHandler) {
-    let mut handler_table = IRQ_HANDLER_TABLE.lock();
     let intid_val = u32::from(intid) as usize;
-    handler_table[intid_val] = Some(handler);
+    IRQ_HANDLER_TABLE[intid_val].store(handler as usize, Ordering::Release);
     debug!("IRQ registered: {:?} on CPU {}", intid, percpu::cpu_id());
 }
 
 /// Unregister the interrupt handler for the given interrupt ID.
-#[allow(dead_code)]
 pub fn irqset_unregister(intid: IntId) {
-    let mut handler_table = IRQ_HANDLER_TABLE.lock();
     let intid_val = u32::from(intid) as usize;
-    handler_table[intid_val] = None;
+    IRQ_HANDLER_TABLE[intid_val].store(0, Ordering::Release);
     debug!("IRQ unregistered: {:?}", intid);
 }
 
@@ -87,7 +151,6 @@ pub fn irqset_enable(intid: IntId, priority: u8) {
 }
 
 /// Disable the given interrupt.
-#[allow(dead_code)]
 pub fn irqset_disable(intid: IntId) {
     let mut gic = GIC.lock();
     let intid_val = u32::from(intid);
@@ -103,6 +166,19 @@ pub fn irqset_disable(intid: IntId) {
     debug!("IRQ disabled: {:?}", intid);
 }
 
+/// Send a software-generated interrupt to the given CPU.
+pub fn irqset_send_sgi(intid: IntId, cpu_id: usize) {
+    let target = SgiTarget::List {
+        affinity3: 0,
+        affinity2: 0,
+        affinity1: 0,
+        target_list: 1 << cpu_id,
+    };
+    if let Err(e) = GicCpuInterface::send_sgi(intid, target, SgiTargetGroup::CurrentGroup1) {
+        error!("Failed to send SGI {:?} to CPU {}: {:?}", intid, cpu_id, e);
+    }
+}
+
 /// Initialize the GICv3 interrupt controller.
 pub fn init(gicd_virt: VirtAddr, gicr_virt: VirtAddr) -> TinyResult<()> {
     use anyhow::Context;
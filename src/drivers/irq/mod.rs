@@ -2,10 +2,13 @@
 
 pub mod gicv3;
 
-pub use gicv3::{init, init_secondary, irqset_enable, irqset_register};
+pub use gicv3::{
+    init, init_secondary, irqset_disable, irqset_enable, irqset_register, irqset_send_sgi,
+    irqset_stats, irqset_unregister, max_irqs,
+};
 
 #[allow(unused_imports)]
-pub use gicv3::{irq_handler, irqset_disable};
+pub use gicv3::irq_handler;
 
 provider_core::define_provider!(
     provider: IRQ_PROVIDER,
@@ -16,7 +19,12 @@ provider_core::define_provider!(
         init,
         init_secondary,
         register: irqset_register,
+        unregister: irqset_unregister,
         enable: irqset_enable,
+        disable: irqset_disable,
         handle: irq_handler,
+        send_sgi: irqset_send_sgi,
+        max_irqs,
+        stats: irqset_stats,
     }
 );
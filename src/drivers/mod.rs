@@ -23,14 +23,17 @@ pub fn driver_init_early() {
     }
 }
 
+/// Probes the normal and then the late devices, each level in parallel on
+/// every CPU. A late probe only starts once every normal one finished, so
+/// this returns with all devices ready.
 pub fn driver_init() {
     let bus = crate::device::core::FdtBus;
+    let manager = crate::device::core::driver_manager();
     for level in [
         crate::device::core::InitLevel::Normal,
         crate::device::core::InitLevel::Late,
     ] {
-        bus.for_each_device(|dev| {
-            crate::device::core::driver_manager().bind_device_for_level(&dev, level);
-        });
+        bus.for_each_device(|dev| manager.queue_device_for_level(&dev, level));
+        manager.wait_for_probes();
     }
 }
@@ -3,7 +3,7 @@
 #![allow(unused)]
 use core::sync::atomic::{AtomicU64, Ordering};
 
-use aarch64_cpu::registers::{CNTFRQ_EL0, CNTP_CTL_EL0, CNTP_TVAL_EL0, CNTPCT_EL0};
+use aarch64_cpu::registers::{CNTFRQ_EL0, CNTP_CTL_EL0, CNTP_CVAL_EL0, CNTP_TVAL_EL0, CNTPCT_EL0};
 use aarch64_cpu::registers::{Readable, Writeable};
 use arm_gic::IntId;
 use int_ratio::Ratio;
@@ -54,16 +54,15 @@ pub fn nanos_to_ticks(nanos: u64) -> u64 {
 /// Set a one-shot timer.
 ///
 /// A timer interrupt will be triggered at the specified monotonic time deadline (in nanoseconds).
+/// The absolute compare value is used, so deadlines of any distance work;
+/// `u64::MAX` means no interrupt at all.
 pub fn set_oneshot_timer(deadline_ns: u64) {
-    let cnptct = CNTPCT_EL0.get();
-    let cnptct_deadline = nanos_to_ticks(deadline_ns);
-    if cnptct < cnptct_deadline {
-        let interval = cnptct_deadline - cnptct;
-        debug_assert!(interval <= u32::MAX as u64);
-        CNTP_TVAL_EL0.set(interval);
+    let cnptct_deadline = if deadline_ns == u64::MAX {
+        u64::MAX
     } else {
-        CNTP_TVAL_EL0.set(0);
-    }
+        nanos_to_ticks(deadline_ns)
+    };
+    CNTP_CVAL_EL0.set(cnptct_deadline);
 }
 
 /// Early stage initialization: stores the timer frequency.
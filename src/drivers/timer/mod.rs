@@ -2,8 +2,6 @@
 
 pub mod generic_timer;
 
-use core::sync::atomic::{AtomicU64, Ordering};
-
 use arm_gic::IntId;
 pub use generic_timer::*;
 use provider_core::with_provider;
@@ -14,36 +12,20 @@ use crate::{
     device::provider::IrqProvider,
 };
 
-// Setup timer interrupt handler
-const PERIODIC_INTERVAL_NANOS: u64 = NANOS_PER_SEC / config::kernel::TICKS_PER_SEC as u64;
-static NEXT_PERIODIC_DEADLINE: AtomicU64 = AtomicU64::new(0);
-
-static NEXT_DEADLINE: AtomicU64 = AtomicU64::new(0);
-
-fn update_deadline(deadline_ns: u64) {
-    NEXT_DEADLINE.store(deadline_ns, Ordering::Release);
-    set_oneshot_timer(deadline_ns);
-}
-
+/// Timer IRQ handler.
+///
+/// There is no periodic tick: the one-shot deadline is the earlier of the
+/// next sleep timer and the end of the running task's time slice, so this
+/// accounts the slice, wakes expired sleepers and programs the next
+/// deadline. Other IRQs leave the timers alone.
 fn handle_timer_irq(_irq: usize) {
-    let current_ns = current_nanoseconds();
-    let mut next_deadline = NEXT_PERIODIC_DEADLINE.load(Ordering::Acquire);
-
-    if current_ns >= next_deadline {
-        NEXT_PERIODIC_DEADLINE.fetch_add(PERIODIC_INTERVAL_NANOS, Ordering::Release);
-        next_deadline = NEXT_PERIODIC_DEADLINE.load(Ordering::Acquire);
-    }
-
-    update_deadline(next_deadline);
+    crate::task::task_ops::task_scheduler_tick(current_nanoseconds());
+    crate::task::task_ops::task_timer_tick();
 }
 
 fn probe(_dev: &DeviceInfo) -> TinyResult<()> {
     // Initialize the generic timer early in the boot process
     generic_timer::init_early();
-    // set Deadline
-    let deadline = current_nanoseconds() + PERIODIC_INTERVAL_NANOS;
-    NEXT_PERIODIC_DEADLINE.store(deadline, Ordering::Release);
-    update_deadline(deadline);
     // Enable Timer interrupt
     with_provider::<IrqProvider>().register(config::kernel::TIMER_IRQ, handle_timer_irq);
     // Timer interrupt ID on ARM GIC
@@ -71,6 +53,7 @@ provider_core::define_provider!(
         nanos_per_sec: || NANOS_PER_SEC,
         current_nanoseconds: generic_timer::current_nanoseconds,
         busy_wait,
+        set_oneshot_timer,
         init_secondary,
     },
     driver: {
@@ -1,54 +1,230 @@
 //! DesignWare APB UART driver.
 
-use crate::TinyResult;
-use crate::hal::Mutex;
+use arm_gic::IntId;
 use dw_apb_uart::DW8250;
 use lazyinit::LazyInit;
 use memory_addr::VirtAddr;
+use provider_core::with_provider;
+
+use crate::device::provider::IrqProvider;
+use crate::hal::Mutex;
+use crate::task::wait_queue::WaitQueue;
+
+use super::ring::ByteRing;
+
+/// Size of the receive ring buffer. Must be a power of two.
+const RX_BUFFER_SIZE: usize = 256;
+
+/// Size of the transmit ring buffer. Must be a power of two.
+const TX_BUFFER_SIZE: usize = 4096;
+
+/// Depth of the hardware transmit FIFO on the RK3588.
+const TX_FIFO_DEPTH: usize = 64;
+
+/// Transmit holding register.
+const THR: usize = 0x00;
+/// Interrupt enable register, and its receive and transmit bits.
+const IER: usize = 0x04;
+const IER_ERBFI: u32 = 1 << 0;
+const IER_ETBEI: u32 = 1 << 1;
+/// Interrupt identification register, and the bits set when FIFOs are on.
+const IIR: usize = 0x08;
+const IIR_FIFOS: u32 = 0b11 << 6;
+/// Line status register, and its transmitter empty bit.
+const LSR: usize = 0x14;
+const LSR_THRE: u32 = 1 << 5;
+
+/// The UART along with the output it has yet to send.
+struct Port {
+    uart: DW8250,
+    base: VirtAddr,
+    /// Bytes queued behind the hardware FIFO. Only used once the transmit
+    /// interrupt is hooked up; before that, output is written synchronously.
+    tx: ByteRing<TX_BUFFER_SIZE>,
+    tx_irq: bool,
+}
 
-static UART: LazyInit<Mutex<DW8250>> = LazyInit::new();
+impl Port {
+    fn reg(&self, offset: usize) -> *mut u32 {
+        (self.base.as_usize() + offset) as *mut u32
+    }
+
+    fn set_interrupts(&mut self, tx: bool) {
+        let ier = if tx { IER_ERBFI | IER_ETBEI } else { IER_ERBFI };
+        unsafe { self.reg(IER).write_volatile(ier) };
+    }
+
+    /// Queues a byte, making room by waiting on the FIFO if the ring is
+    /// full.
+    fn send(&mut self, c: u8) {
+        if !self.tx_irq {
+            self.uart.putchar(c);
+            return;
+        }
+        if self.tx.is_full() {
+            let oldest = self.tx.pop().unwrap();
+            self.uart.putchar(oldest);
+        }
+        self.tx.push(c);
+    }
 
-fn do_putchar(uart: &mut DW8250, c: u8) {
-    match c {
-        b'\r' | b'\n' => {
-            uart.putchar(b'\r');
-            uart.putchar(b'\n');
+    fn send_char(&mut self, c: u8) {
+        if c == b'\r' || c == b'\n' {
+            self.send(b'\r');
+            self.send(b'\n');
+        } else {
+            self.send(c);
+        }
+    }
+
+    /// Moves queued bytes into the FIFO once it has drained, and leaves the
+    /// transmit interrupt on while anything is left over.
+    fn fill_fifo(&mut self) {
+        if !self.tx_irq {
+            return;
+        }
+        let lsr = unsafe { self.reg(LSR).read_volatile() };
+        if lsr & LSR_THRE != 0 {
+            // THRE means the whole FIFO (or the holding register) is empty.
+            let iir = unsafe { self.reg(IIR).read_volatile() };
+            let room = if iir & IIR_FIFOS == IIR_FIFOS {
+                TX_FIFO_DEPTH
+            } else {
+                1
+            };
+            // Straight to THR: `DW8250::putchar` waits for THRE again
+            // before every byte, i.e. for the FIFO to drain completely.
+            for _ in 0..room {
+                match self.tx.pop() {
+                    Some(c) => unsafe { self.reg(THR).write_volatile(c as u32) },
+                    None => break,
+                }
+            }
+        }
+        let pending = !self.tx.is_empty();
+        self.set_interrupts(pending);
+    }
+
+    /// Writes out every queued byte, waiting on the FIFO.
+    fn flush(&mut self) {
+        while let Some(c) = self.tx.pop() {
+            self.uart.putchar(c);
+        }
+        if self.tx_irq {
+            self.set_interrupts(false);
         }
-        c => uart.putchar(c),
     }
 }
 
+static UART: LazyInit<Mutex<Port>> = LazyInit::new();
+static UART_IRQ: LazyInit<IntId> = LazyInit::new();
+
+/// Bytes received by the IRQ handler and not yet read. When the ring is
+/// full, new bytes are dropped.
+static RX_RING: Mutex<ByteRing<RX_BUFFER_SIZE>> = Mutex::new(ByteRing::new());
+
+/// Tasks waiting in [`read_byte`] for input.
+static RX_WAIT: WaitQueue = WaitQueue::new();
+
 /// Writes a byte to the console.
 pub fn putchar(c: u8) {
-    do_putchar(&mut UART.lock(), c);
+    let mut port = UART.lock();
+    port.send_char(c);
+    port.fill_fifo();
 }
 
 /// Writes a string to the console atomically (holding the lock for the entire string).
 ///
-/// This prevents output from multiple CPUs from being interleaved.
+/// This prevents output from multiple CPUs from being interleaved. Once the
+/// transmit interrupt is hooked up, the string is only queued, and the
+/// caller waits just when the ring is full.
 pub fn puts(s: &str) {
-    let mut uart = UART.lock();
+    let mut port = UART.lock();
     for c in s.bytes() {
-        do_putchar(&mut uart, c);
+        port.send_char(c);
     }
+    port.fill_fifo();
+}
+
+/// Waits until all queued output has been written to the FIFO.
+pub fn flush() {
+    UART.lock().flush();
 }
 
 /// Reads a byte from the console, or returns [`None`] if no input is available.
-#[allow(unused)]
+///
+/// Bytes already taken off the hardware by the IRQ handler come first.
 pub fn getchar() -> Option<u8> {
-    UART.lock().getchar()
+    // The ring guard must be gone before the UART is locked: the IRQ
+    // handler takes the two the other way round.
+    let buffered = RX_RING.lock().pop();
+    buffered.or_else(|| UART.lock().uart.getchar())
+}
+
+/// Reads a byte from the console, blocking the current task until one
+/// arrives.
+pub fn read_byte() -> u8 {
+    let mut byte = None;
+    RX_WAIT.wait_until(|| {
+        byte = getchar();
+        byte.is_some()
+    });
+    byte.unwrap()
+}
+
+/// UART IRQ handler: moves the receive FIFO into the receive ring and
+/// wakes the readers, and refills the transmit FIFO from the transmit ring.
+fn handle_uart_irq(_irq: usize) {
+    let received = {
+        let mut port = UART.lock();
+        let mut ring = RX_RING.lock();
+        let mut received = false;
+        while let Some(c) = port.uart.getchar() {
+            ring.push(c);
+            received = true;
+        }
+        port.fill_fifo();
+        received
+    };
+    if received {
+        RX_WAIT.notify_all();
+    }
 }
 
 /// UART early initialization.
-#[allow(unused)]
-pub fn init_early(uart_base: VirtAddr) {
-    UART.init_once(Mutex::new(DW8250::new(uart_base.as_usize())));
-    UART.lock().init();
+pub fn init_early(uart_base: VirtAddr, irq_num: IntId) {
+    UART.init_once(Mutex::new(Port {
+        uart: DW8250::new(uart_base.as_usize()),
+        base: uart_base,
+        tx: ByteRing::new(),
+        tx_irq: false,
+    }));
+    UART_IRQ.init_once(irq_num);
+    UART.lock().uart.init();
 }
 
-/// UART IRQ Handler.
-#[allow(unused)]
-pub fn irq_handler(irq: usize) -> TinyResult<()> {
-    error!("UART IRQ Handler invoked unexpectedly: {irq}");
-    anyhow::bail!("UART IRQ handler invoked unexpectedly: {}", irq)
+/// Hooks up the receive and transmit interrupts once the interrupt
+/// controller is ready.
+pub fn init_irq() {
+    with_provider::<IrqProvider>().register(*UART_IRQ, handle_uart_irq);
+    with_provider::<IrqProvider>().enable(*UART_IRQ, 0xa0);
+    let mut port = UART.lock();
+    port.tx_irq = true;
+    port.set_interrupts(false);
 }
+
+provider_core::define_provider!(
+    provider: UART_PROVIDER,
+    vendor_id: 0,
+    device_id: 0,
+    priority: 100,
+    ops: crate::device::provider::UartProvider {
+        init_early,
+        puts,
+        putchar,
+        getchar,
+        read_byte,
+        init_irq,
+        flush,
+    }
+);
@@ -4,14 +4,14 @@
 pub mod dw_apb;
 #[cfg(feature = "qemu")]
 pub mod pl011;
+mod ring;
 
 // Export the appropriate UART driver based on the platform
 // Currently using dw_apb for OrangePi 5 Plus
 #[allow(unused)]
 #[cfg(feature = "opi5p")]
-pub use dw_apb::{getchar, init_early, irq_handler, putchar, puts};
+pub use dw_apb::{flush, getchar, init_early, init_irq, putchar, puts, read_byte};
 
 #[allow(unused)]
 #[cfg(feature = "qemu")]
-pub use pl011::{getchar, init_early, putchar, puts};
-
+pub use pl011::{flush, getchar, init_early, init_irq, putchar, puts, read_byte};
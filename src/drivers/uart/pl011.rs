@@ -4,45 +4,200 @@ use arm_gic::IntId;
 use arm_pl011::Pl011Uart;
 use lazyinit::LazyInit;
 use memory_addr::VirtAddr;
+use provider_core::with_provider;
 
+use crate::device::provider::IrqProvider;
 use crate::hal::Mutex;
+use crate::task::wait_queue::WaitQueue;
 
-static UART: LazyInit<Mutex<Pl011Uart>> = LazyInit::new();
+use super::ring::ByteRing;
 
-fn do_putchar(uart: &mut Pl011Uart, c: u8) {
-    match c {
-        b'\n' => {
-            uart.putchar(b'\r');
-            uart.putchar(b'\n');
+/// Size of the receive ring buffer. Must be a power of two.
+const RX_BUFFER_SIZE: usize = 256;
+
+/// Size of the transmit ring buffer. Must be a power of two.
+const TX_BUFFER_SIZE: usize = 4096;
+
+/// Flag register, and its transmit FIFO full bit.
+const UARTFR: usize = 0x18;
+const FR_TXFF: u32 = 1 << 5;
+/// Interrupt mask set/clear register, and its transmit interrupt bit.
+const UARTIMSC: usize = 0x38;
+const INT_TX: u32 = 1 << 5;
+
+/// The UART along with the output it has yet to send.
+struct Port {
+    uart: Pl011Uart,
+    base: VirtAddr,
+    /// Bytes queued behind the hardware FIFO. Only used once the transmit
+    /// interrupt is hooked up; before that, output is written synchronously.
+    tx: ByteRing<TX_BUFFER_SIZE>,
+    tx_irq: bool,
+}
+
+impl Port {
+    fn reg(&self, offset: usize) -> *mut u32 {
+        (self.base.as_usize() + offset) as *mut u32
+    }
+
+    fn tx_fifo_full(&self) -> bool {
+        unsafe { self.reg(UARTFR).read_volatile() & FR_TXFF != 0 }
+    }
+
+    fn set_tx_interrupt(&mut self, enabled: bool) {
+        let imsc = self.reg(UARTIMSC);
+        unsafe {
+            let mask = imsc.read_volatile();
+            imsc.write_volatile(if enabled {
+                mask | INT_TX
+            } else {
+                mask & !INT_TX
+            });
+        }
+    }
+
+    /// Queues a byte, making room by waiting on the FIFO if the ring is
+    /// full.
+    fn send(&mut self, c: u8) {
+        if !self.tx_irq {
+            self.uart.putchar(c);
+            return;
+        }
+        if self.tx.is_full() {
+            let oldest = self.tx.pop().unwrap();
+            self.uart.putchar(oldest);
+        }
+        self.tx.push(c);
+    }
+
+    fn send_char(&mut self, c: u8) {
+        if c == b'\n' {
+            self.send(b'\r');
+        }
+        self.send(c);
+    }
+
+    /// Moves queued bytes into the FIFO while it has room, and leaves the
+    /// transmit interrupt on while anything is left over.
+    fn fill_fifo(&mut self) {
+        if !self.tx_irq {
+            return;
+        }
+        while !self.tx_fifo_full() {
+            match self.tx.pop() {
+                Some(c) => self.uart.putchar(c),
+                None => break,
+            }
+        }
+        let pending = !self.tx.is_empty();
+        self.set_tx_interrupt(pending);
+    }
+
+    /// Writes out every queued byte, waiting on the FIFO.
+    fn flush(&mut self) {
+        while let Some(c) = self.tx.pop() {
+            self.uart.putchar(c);
+        }
+        if self.tx_irq {
+            self.set_tx_interrupt(false);
         }
-        c => uart.putchar(c),
     }
 }
 
+static UART: LazyInit<Mutex<Port>> = LazyInit::new();
+static UART_IRQ: LazyInit<IntId> = LazyInit::new();
+
+/// Bytes received by the IRQ handler and not yet read. When the ring is
+/// full, new bytes are dropped.
+static RX_RING: Mutex<ByteRing<RX_BUFFER_SIZE>> = Mutex::new(ByteRing::new());
+
+/// Tasks waiting in [`read_byte`] for input.
+static RX_WAIT: WaitQueue = WaitQueue::new();
+
 /// Writes a byte to the console.
 pub fn putchar(c: u8) {
-    do_putchar(&mut UART.lock(), c);
+    let mut port = UART.lock();
+    port.send_char(c);
+    port.fill_fifo();
 }
 
 /// Writes a string to the console atomically (holding the lock for the entire string).
 ///
-/// This prevents output from multiple CPUs from being interleaved.
+/// This prevents output from multiple CPUs from being interleaved. Once the
+/// transmit interrupt is hooked up, the string is only queued, and the
+/// caller waits just when the ring is full.
 pub fn puts(s: &str) {
-    let mut uart = UART.lock();
+    let mut port = UART.lock();
     for c in s.bytes() {
-        do_putchar(&mut uart, c);
+        port.send_char(c);
     }
+    port.fill_fifo();
+}
+
+/// Waits until all queued output has been written to the FIFO.
+pub fn flush() {
+    UART.lock().flush();
 }
 
 /// Reads a byte from the console, or returns [`None`] if no input is available.
+///
+/// Bytes already taken off the hardware by the IRQ handler come first.
 pub fn getchar() -> Option<u8> {
-    UART.lock().getchar()
+    // The ring guard must be gone before the UART is locked: the IRQ
+    // handler takes the two the other way round.
+    let buffered = RX_RING.lock().pop();
+    buffered.or_else(|| UART.lock().uart.getchar())
+}
+
+/// Reads a byte from the console, blocking the current task until one
+/// arrives.
+pub fn read_byte() -> u8 {
+    let mut byte = None;
+    RX_WAIT.wait_until(|| {
+        byte = getchar();
+        byte.is_some()
+    });
+    byte.unwrap()
+}
+
+/// UART IRQ handler: moves the receive FIFO into the receive ring and
+/// wakes the readers, and refills the transmit FIFO from the transmit ring.
+fn handle_uart_irq(_irq: usize) {
+    let received = {
+        let mut port = UART.lock();
+        let mut ring = RX_RING.lock();
+        let mut received = false;
+        while let Some(c) = port.uart.getchar() {
+            ring.push(c);
+            received = true;
+        }
+        port.fill_fifo();
+        port.uart.ack_interrupts();
+        received
+    };
+    if received {
+        RX_WAIT.notify_all();
+    }
 }
 
 /// Early stage initialization of the PL011 UART driver.
-pub fn init_early(uart_base: VirtAddr, _irq_num: IntId) {
-    UART.init_once(Mutex::new(Pl011Uart::new(uart_base.as_mut_ptr())));
-    UART.lock().init();
+pub fn init_early(uart_base: VirtAddr, irq_num: IntId) {
+    UART.init_once(Mutex::new(Port {
+        uart: Pl011Uart::new(uart_base.as_mut_ptr()),
+        base: uart_base,
+        tx: ByteRing::new(),
+        tx_irq: false,
+    }));
+    UART_IRQ.init_once(irq_num);
+    UART.lock().uart.init();
+}
+
+/// Hooks up the receive and transmit interrupts once the interrupt
+/// controller is ready.
+pub fn init_irq() {
+    with_provider::<IrqProvider>().register(*UART_IRQ, handle_uart_irq);
+    with_provider::<IrqProvider>().enable(*UART_IRQ, 0xa0);
+    UART.lock().tx_irq = true;
 }
 
 provider_core::define_provider!(
@@ -55,6 +210,8 @@ provider_core::define_provider!(
         puts,
         putchar,
         getchar,
+        read_byte,
+        init_irq,
+        flush,
     }
 );
-
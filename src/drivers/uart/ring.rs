@@ -0,0 +1,46 @@
+//! Byte rings between the UART drivers and their interrupt handlers.
+
+/// A fixed-size FIFO of bytes. `N` must be a power of two.
+pub struct ByteRing<const N: usize> {
+    buf: [u8; N],
+    head: usize,
+    tail: usize,
+}
+
+impl<const N: usize> ByteRing<N> {
+    pub const fn new() -> Self {
+        Self {
+            buf: [0; N],
+            head: 0,
+            tail: 0,
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.head == self.tail
+    }
+
+    pub fn is_full(&self) -> bool {
+        self.tail.wrapping_sub(self.head) == N
+    }
+
+    /// Appends a byte, or returns `false` if the ring is full.
+    pub fn push(&mut self, c: u8) -> bool {
+        if self.is_full() {
+            return false;
+        }
+        self.buf[self.tail % N] = c;
+        self.tail = self.tail.wrapping_add(1);
+        true
+    }
+
+    /// Removes the oldest byte.
+    pub fn pop(&mut self) -> Option<u8> {
+        if self.is_empty() {
+            return None;
+        }
+        let c = self.buf[self.head % N];
+        self.head = self.head.wrapping_add(1);
+        Some(c)
+    }
+}
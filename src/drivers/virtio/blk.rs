@@ -1,17 +1,28 @@
 use crate::TinyResult;
 use crate::device::core::{DeviceInfo, InitLevel};
+use crate::device::provider::IrqProvider;
 use crate::drivers::virtio::hal::VirtioHalImpl;
-use crate::hal::Mutex;
+use crate::hal::{Mutex, TicketNoIrq};
+use crate::profile::{TraceKind, trace};
+use crate::task::wait_queue::{WaitQueue, can_block};
+use alloc::vec::Vec;
+use anyhow::bail;
+use arm_gic::IntId;
 use core::ptr::NonNull;
 use lazy_static::lazy_static;
+use lazyinit::LazyInit;
 use log::info;
+use provider_core::with_provider;
+use virtio_drivers::Error as VirtioError;
+use virtio_drivers::device::blk::{BlkReq, BlkResp, SECTOR_SIZE};
 use virtio_drivers::transport::{DeviceType, Transport, mmio::VirtIOHeader};
 use virtio_drivers::{device::blk::VirtIOBlk, transport::mmio::MmioTransport};
 
 type VirtioBlkDevice = VirtIOBlk<VirtioHalImpl, MmioTransport<'static>>;
 
 lazy_static! {
-    pub static ref BLOCK_DEVICE: Mutex<Option<VirtioBlkDevice>> = Mutex::new(None);
+    pub static ref BLOCK_DEVICE: Mutex<Option<VirtioBlkDevice>> =
+        Mutex::const_new(unsafe { TicketNoIrq::named("BLOCK_DEVICE") }, None);
 }
 
 pub fn with_block_device<R>(
@@ -24,18 +35,231 @@ pub fn with_block_device<R>(
     f(dev)
 }
 
+/// Tasks waiting for one of their requests to complete or for a free
+/// descriptor to submit one.
+static BLK_WAIT: WaitQueue = WaitQueue::new();
+
+/// Interrupt line of the device, set once completions are IRQ-driven.
+static BLK_IRQ: LazyInit<IntId> = LazyInit::new();
+
+enum Buffer<'a> {
+    Read(&'a mut [u8]),
+    Write(&'a [u8]),
+}
+
+/// One request and the memory the device owns while it is in flight.
+struct Request<'a> {
+    block_id: usize,
+    buf: Buffer<'a>,
+    req: BlkReq,
+    resp: BlkResp,
+    token: Option<u16>,
+}
+
+impl<'a> Request<'a> {
+    fn new(block_id: usize, buf: Buffer<'a>) -> Self {
+        Self {
+            block_id,
+            buf,
+            req: BlkReq::default(),
+            resp: BlkResp::default(),
+            token: None,
+        }
+    }
+
+    /// Adds the request to the virtqueue. Returns `false` if the queue is
+    /// full.
+    fn submit(&mut self, dev: &mut VirtioBlkDevice) -> TinyResult<bool> {
+        // Safety: the buffers stay borrowed by `self`, and `run` does not
+        // return until every submitted request has completed.
+        let token = unsafe {
+            match &mut self.buf {
+                Buffer::Read(buf) => {
+                    dev.read_blocks_nb(self.block_id, &mut self.req, buf, &mut self.resp)
+                }
+                Buffer::Write(buf) => {
+                    dev.write_blocks_nb(self.block_id, &mut self.req, buf, &mut self.resp)
+                }
+            }
+        };
+        match token {
+            Ok(token) => {
+                trace(TraceKind::BlockSubmit, self.block_id as u64, self.blocks());
+                self.token = Some(token);
+                Ok(true)
+            }
+            Err(VirtioError::QueueFull) => Ok(false),
+            Err(e) => bail!("virtio-blk request failed: {:?}", e),
+        }
+    }
+
+    /// Takes the request back from the device once it is in the used ring.
+    fn complete(&mut self, dev: &mut VirtioBlkDevice) -> TinyResult<()> {
+        let token = self.token.take().expect("completing an idle request");
+        // Safety: same buffers as passed to `submit`.
+        let done = unsafe {
+            match &mut self.buf {
+                Buffer::Read(buf) => {
+                    dev.complete_read_blocks(token, &self.req, buf, &mut self.resp)
+                }
+                Buffer::Write(buf) => {
+                    dev.complete_write_blocks(token, &self.req, buf, &mut self.resp)
+                }
+            }
+        };
+        trace(
+            TraceKind::BlockComplete,
+            self.block_id as u64,
+            self.blocks(),
+        );
+        done.map_err(|e| anyhow::anyhow!("virtio-blk request failed: {:?}", e))
+    }
+
+    fn blocks(&self) -> u64 {
+        let len = match &self.buf {
+            Buffer::Read(buf) => buf.len(),
+            Buffer::Write(buf) => buf.len(),
+        };
+        (len / SECTOR_SIZE) as u64
+    }
+}
+
+/// Progress of a batch of requests in [`run`].
+struct Batch<'a, 'b> {
+    reqs: &'b mut [Request<'a>],
+    /// Requests before this index have been submitted.
+    submitted: usize,
+    in_flight: usize,
+    result: TinyResult<()>,
+}
+
+impl Batch<'_, '_> {
+    fn done(&self) -> bool {
+        self.in_flight == 0 && (self.submitted == self.reqs.len() || self.result.is_err())
+    }
+
+    /// Submits what fits in the queue and completes our requests at the
+    /// head of the used ring. Returns whether anything changed.
+    ///
+    /// The device lock is only held for the duration of the step, so other
+    /// tasks and CPUs can queue their own requests in between.
+    fn step(&mut self) -> bool {
+        let mut guard = BLOCK_DEVICE.lock();
+        let Some(dev) = guard.as_mut() else {
+            if self.result.is_ok() {
+                self.result = Err(anyhow::anyhow!("block device not initialized"));
+            }
+            return true;
+        };
+
+        let mut progress = false;
+        while self.result.is_ok() && self.submitted < self.reqs.len() {
+            match self.reqs[self.submitted].submit(dev) {
+                Ok(true) => {
+                    self.submitted += 1;
+                    self.in_flight += 1;
+                    progress = true;
+                }
+                Ok(false) => break,
+                Err(e) => {
+                    self.result = Err(e);
+                    progress = true;
+                }
+            }
+        }
+
+        // The used ring can only be consumed in order, so stop at the first
+        // entry owned by another task; it is woken to take it.
+        while let Some(token) = dev.peek_used() {
+            let Some(req) = self.reqs[..self.submitted]
+                .iter_mut()
+                .find(|req| req.token == Some(token))
+            else {
+                break;
+            };
+            let done = req.complete(dev);
+            if let Err(e) = done
+                && self.result.is_ok()
+            {
+                self.result = Err(e);
+            }
+            self.in_flight -= 1;
+            progress = true;
+        }
+        progress
+    }
+}
+
+/// Runs `reqs` to completion, keeping as many of them in flight as the
+/// queue allows. Returns the first error.
+///
+/// With the device IRQ hooked up the caller sleeps between steps. Callers
+/// that cannot sleep (interrupts masked, e.g. under a spinlock, or the
+/// idle task) poll instead, still without holding the device lock.
+fn run(reqs: &mut [Request]) -> TinyResult<()> {
+    let mut batch = Batch {
+        reqs,
+        submitted: 0,
+        in_flight: 0,
+        result: Ok(()),
+    };
+    let can_sleep = BLK_IRQ.is_inited() && can_block();
+
+    while !batch.done() {
+        let progress = if can_sleep {
+            let mut progress = false;
+            BLK_WAIT.wait_until(|| {
+                progress = batch.step();
+                progress || batch.done()
+            });
+            progress
+        } else {
+            let progress = batch.step();
+            if !progress {
+                core::hint::spin_loop();
+            }
+            progress
+        };
+        // Completing frees descriptors and may expose another task's entry
+        // at the head of the used ring.
+        if progress && BLK_IRQ.is_inited() {
+            BLK_WAIT.notify_all();
+        }
+    }
+    batch.result
+}
+
+/// Completion IRQ handler: acknowledges the device and lets the waiting
+/// tasks collect their requests.
+fn handle_blk_irq(_irq: usize) {
+    if let Some(dev) = BLOCK_DEVICE.lock().as_mut() {
+        dev.ack_interrupt();
+    }
+    BLK_WAIT.notify_all();
+}
+
 fn block_read_blocks(block_id: usize, dst: &mut [u8]) -> TinyResult<()> {
-    with_block_device(|dev| {
-        VirtIOBlk::read_blocks(dev, block_id, dst)
-            .map_err(|e| anyhow::anyhow!("virtio-blk read failed: {:?}", e))
-    })
+    run(&mut [Request::new(block_id, Buffer::Read(dst))])
 }
 
 fn block_write_blocks(block_id: usize, src: &[u8]) -> TinyResult<()> {
-    with_block_device(|dev| {
-        VirtIOBlk::write_blocks(dev, block_id, src)
-            .map_err(|e| anyhow::anyhow!("virtio-blk write failed: {:?}", e))
-    })
+    run(&mut [Request::new(block_id, Buffer::Write(src))])
+}
+
+fn block_read_blocks_sg(segments: &mut [(usize, &mut [u8])]) -> TinyResult<()> {
+    let mut reqs: Vec<Request> = segments
+        .iter_mut()
+        .map(|(block_id, dst)| Request::new(*block_id, Buffer::Read(dst)))
+        .collect();
+    run(&mut reqs)
+}
+
+fn block_write_blocks_sg(segments: &[(usize, &[u8])]) -> TinyResult<()> {
+    let mut reqs: Vec<Request> = segments
+        .iter()
+        .map(|&(block_id, src)| Request::new(block_id, Buffer::Write(src)))
+        .collect();
+    run(&mut reqs)
 }
 
 fn block_capacity_blocks() -> TinyResult<u64> {
@@ -66,6 +290,12 @@ fn probe(dev: &DeviceInfo) -> TinyResult<()> {
 
     let blk = VirtIOBlk::new(transport).expect("failed to create blk driver");
     *BLOCK_DEVICE.lock() = Some(blk);
+    if let Some(irq) = dev.irq.filter(|&irq| irq >= 32) {
+        let intid = IntId::spi(irq - 32);
+        with_provider::<IrqProvider>().register(intid, handle_blk_irq);
+        with_provider::<IrqProvider>().enable(intid, 0xa0);
+        BLK_IRQ.init_once(intid);
+    }
     info!("virtio-blk initialized");
     Ok(())
 }
@@ -78,6 +308,8 @@ provider_core::define_provider!(
     ops: crate::device::provider::BlockProvider {
         read_blocks: block_read_blocks,
         write_blocks: block_write_blocks,
+        read_blocks_sg: block_read_blocks_sg,
+        write_blocks_sg: block_write_blocks_sg,
         capacity_blocks: block_capacity_blocks,
     },
     driver: {
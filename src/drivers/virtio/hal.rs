@@ -1,37 +1,31 @@
-use alloc::alloc::{alloc_zeroed, dealloc, handle_alloc_error};
+use alloc::alloc::handle_alloc_error;
 use core::alloc::Layout;
 use core::ptr::NonNull;
 use log::trace;
 use memory_addr::{PAGE_SIZE_4K, pa, va};
 use virtio_drivers::{BufferDirection, Hal, PhysAddr};
 
+use crate::mm::frame;
+
 pub struct VirtioHalImpl;
 
 unsafe impl Hal for VirtioHalImpl {
     fn dma_alloc(pages: usize, _direction: BufferDirection) -> (PhysAddr, NonNull<u8>) {
-        let layout = Layout::from_size_align(pages * PAGE_SIZE_4K, PAGE_SIZE_4K).unwrap();
-        // Safe because the layout has a non-zero size.
-        let vaddr = unsafe { alloc_zeroed(layout) };
-        let vaddr = if let Some(vaddr) = NonNull::new(vaddr) {
-            vaddr
-        } else {
-            handle_alloc_error(layout)
+        // DMA buffers are whole frames, so take them from the frame allocator
+        // rather than carving page-aligned blocks out of the heap.
+        let Some(paddr) = frame::alloc_frames(pages, 1) else {
+            handle_alloc_error(Layout::from_size_align(pages * PAGE_SIZE_4K, PAGE_SIZE_4K).unwrap())
         };
+        let vaddr = crate::mm::phys_to_virt(paddr).as_mut_ptr();
+        unsafe { core::ptr::write_bytes(vaddr, 0, pages * PAGE_SIZE_4K) };
 
-        let paddr = crate::mm::virt_to_phys(va!(vaddr.as_ptr() as usize)).as_usize();
-
-        trace!("alloc DMA: paddr={:#x}, pages={}", paddr, pages);
-        (paddr as u64, vaddr)
+        trace!("alloc DMA: paddr={:#x}, pages={}", paddr.as_usize(), pages);
+        (paddr.as_usize() as u64, NonNull::new(vaddr).unwrap())
     }
 
-    unsafe fn dma_dealloc(paddr: PhysAddr, vaddr: NonNull<u8>, pages: usize) -> i32 {
+    unsafe fn dma_dealloc(paddr: PhysAddr, _vaddr: NonNull<u8>, pages: usize) -> i32 {
         trace!("dealloc DMA: paddr={:#x}, pages={}", paddr, pages);
-        let layout = Layout::from_size_align(pages * PAGE_SIZE_4K, PAGE_SIZE_4K).unwrap();
-        // Safe because the memory was allocated by `dma_alloc` above using the same allocator, and
-        // the layout is the same as was used then.
-        unsafe {
-            dealloc(vaddr.as_ptr(), layout);
-        }
+        frame::free_frames(pa!(paddr as usize), pages);
         0
     }
 
@@ -0,0 +1,445 @@
+//! Write-back sector cache in front of the block device.
+//!
+//! Sectors live in a fixed set of slots, replaced with the CLOCK algorithm:
+//! a hit sets the slot's reference bit, and the hand clears reference bits
+//! until it finds a slot that was not used since its last pass. Writes only
+//! dirty the cached copy; dirty sectors reach the device on eviction or
+//! [`sync`].
+//!
+//! Device I/O is coalesced: a read loads each run of missing sectors with a
+//! single request, and write-back sends each run of consecutive dirty
+//! sectors as one request, with all runs of a sync submitted together.
+//!
+//! Reads that continue where an earlier one ended grow that stream's
+//! read-ahead window, doubling up to `BLOCK_READAHEAD_MAX_SECTORS`; a miss
+//! then also loads that many sectors past the request. Contiguous clusters
+//! of a file are contiguous on the device, so streaming a file turns into a
+//! few large transfers. A few streams are tracked at once, so the FAT
+//! lookups between clusters do not reset the window of the data stream.
+
+use alloc::collections::BTreeMap;
+use alloc::vec;
+use alloc::vec::Vec;
+
+use lazy_static::lazy_static;
+use provider_core::with_provider;
+
+use crate::{
+    TinyResult,
+    config::kernel::{
+        BLOCK_CACHE_SECTORS, BLOCK_IO_MAX_SECTORS, BLOCK_READAHEAD_MAX_SECTORS,
+        BLOCK_READAHEAD_MIN_SECTORS,
+    },
+    device::provider::BlockProvider,
+    hal::simd,
+    task::sleep_lock::SleepMutex,
+};
+
+/// Size of a device sector.
+pub const SECTOR_SIZE: usize = 512;
+
+/// Sector number of an unused slot.
+const NO_SECTOR: u64 = u64::MAX;
+
+/// Sequential read streams tracked for read-ahead.
+const RA_STREAMS: usize = 4;
+
+#[derive(Clone, Copy, Default)]
+struct Stream {
+    /// Sector after the end of the stream's last read.
+    next: u64,
+    /// Read-ahead window in sectors, 0 until the stream is sequential.
+    window: u64,
+}
+
+#[derive(Clone, Copy)]
+struct Slot {
+    sector: u64,
+    dirty: bool,
+    referenced: bool,
+}
+
+/// Cache counters since boot.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct BlockCacheStats {
+    /// Sector accesses served from the cache.
+    pub hits: u64,
+    /// Sector accesses that had to load or claim a slot.
+    pub misses: u64,
+    /// Dirty sectors written to the device.
+    pub writebacks: u64,
+    /// Sectors loaded ahead of a sequential read.
+    pub prefetched: u64,
+}
+
+struct BlockCache {
+    slots: Vec<Slot>,
+    /// Sector data, `SECTOR_SIZE` bytes per slot.
+    data: Vec<u8>,
+    /// Cached sector -> slot.
+    index: BTreeMap<u64, usize>,
+    hand: usize,
+    streams: [Stream; RA_STREAMS],
+    /// Stream replaced by the next read that continues none of them.
+    next_stream: usize,
+    /// Device size in sectors, read on first use.
+    capacity: Option<u64>,
+    stats: BlockCacheStats,
+}
+
+impl BlockCache {
+    fn new(capacity: usize) -> Self {
+        Self {
+            slots: vec![
+                Slot {
+                    sector: NO_SECTOR,
+                    dirty: false,
+                    referenced: false,
+                };
+                capacity
+            ],
+            data: vec![0; capacity * SECTOR_SIZE],
+            index: BTreeMap::new(),
+            hand: 0,
+            streams: [Stream::default(); RA_STREAMS],
+            next_stream: 0,
+            capacity: None,
+            stats: BlockCacheStats::default(),
+        }
+    }
+
+    fn data_mut(&mut self, slot: usize) -> &mut [u8] {
+        &mut self.data[slot * SECTOR_SIZE..(slot + 1) * SECTOR_SIZE]
+    }
+
+    fn slot_data(&self, slot: usize) -> &[u8] {
+        &self.data[slot * SECTOR_SIZE..(slot + 1) * SECTOR_SIZE]
+    }
+
+    fn is_dirty(&self, sector: u64) -> bool {
+        self.index
+            .get(&sector)
+            .is_some_and(|&slot| self.slots[slot].dirty)
+    }
+
+    /// Copies the dirty run `[start, end)` into one buffer and marks it clean.
+    fn take_run(&mut self, start: u64, end: u64) -> Vec<u8> {
+        let mut buf = Vec::with_capacity((end - start) as usize * SECTOR_SIZE);
+        for sector in start..end {
+            let slot = self.index[&sector];
+            buf.extend_from_slice(self.slot_data(slot));
+            self.slots[slot].dirty = false;
+        }
+        self.stats.writebacks += end - start;
+        buf
+    }
+
+    /// Writes back the run of consecutive dirty sectors around `sector`
+    /// with one request.
+    fn write_back_run(&mut self, sector: u64) -> TinyResult<()> {
+        let max_run = BLOCK_IO_MAX_SECTORS as u64;
+        let mut start = sector;
+        while start > 0 && sector - start + 1 < max_run && self.is_dirty(start - 1) {
+            start -= 1;
+        }
+        let mut end = sector + 1;
+        while end - start < max_run && self.is_dirty(end) {
+            end += 1;
+        }
+        let buf = self.take_run(start, end);
+        with_provider::<BlockProvider>().write_blocks(start as usize, &buf)
+    }
+
+    /// Frees a slot, writing back its sector first if it is dirty.
+    fn evict(&mut self) -> TinyResult<usize> {
+        loop {
+            let slot = self.hand;
+            self.hand = (self.hand + 1) % self.slots.len();
+            let entry = self.slots[slot];
+            if entry.sector == NO_SECTOR {
+                return Ok(slot);
+            }
+            if entry.referenced {
+                self.slots[slot].referenced = false;
+                continue;
+            }
+            if entry.dirty {
+                self.write_back_run(entry.sector)?;
+            }
+            self.index.remove(&entry.sector);
+            self.slots[slot].sector = NO_SECTOR;
+            return Ok(slot);
+        }
+    }
+
+    /// Returns the slot holding `sector`. On a miss the sector is read from
+    /// the device, unless the caller is about to overwrite all of it.
+    fn get(&mut self, sector: u64, overwrite: bool) -> TinyResult<usize> {
+        if let Some(&slot) = self.index.get(&sector) {
+            self.slots[slot].referenced = true;
+            self.stats.hits += 1;
+            return Ok(slot);
+        }
+        self.stats.misses += 1;
+
+        let slot = self.evict()?;
+        if !overwrite {
+            with_provider::<BlockProvider>().read_blocks(sector as usize, self.data_mut(slot))?;
+        }
+        self.slots[slot] = Slot {
+            sector,
+            dirty: false,
+            referenced: true,
+        };
+        self.index.insert(sector, slot);
+        Ok(slot)
+    }
+
+    /// Caches `data` as the clean contents of `sector`, which must not be
+    /// cached yet.
+    fn install(&mut self, sector: u64, data: &[u8]) -> TinyResult<usize> {
+        let slot = self.evict()?;
+        simd::copy(self.data_mut(slot), data);
+        self.slots[slot] = Slot {
+            sector,
+            dirty: false,
+            referenced: true,
+        };
+        self.index.insert(sector, slot);
+        Ok(slot)
+    }
+
+    fn capacity(&mut self) -> TinyResult<u64> {
+        match self.capacity {
+            Some(capacity) => Ok(capacity),
+            None => {
+                let capacity = with_provider::<BlockProvider>().capacity_blocks()?;
+                self.capacity = Some(capacity);
+                Ok(capacity)
+            }
+        }
+    }
+
+    /// Records a read of `[first, end)` and returns its read-ahead window.
+    fn track_sequential(&mut self, first: u64, end: u64) -> u64 {
+        // A read may start in the sector where the previous one stopped.
+        let found = self
+            .streams
+            .iter()
+            .position(|s| s.next != 0 && (first == s.next || first + 1 == s.next));
+        let stream = match found {
+            Some(i) => {
+                let stream = &mut self.streams[i];
+                stream.window = (stream.window * 2).clamp(
+                    BLOCK_READAHEAD_MIN_SECTORS as u64,
+                    BLOCK_READAHEAD_MAX_SECTORS as u64,
+                );
+                stream
+            }
+            None => {
+                let i = self.next_stream;
+                self.next_stream = (i + 1) % RA_STREAMS;
+                self.streams[i].window = 0;
+                &mut self.streams[i]
+            }
+        };
+        stream.next = end;
+        stream.window
+    }
+
+    fn read(&mut self, pos: u64, buf: &mut [u8]) -> TinyResult<()> {
+        let end_pos = pos + buf.len() as u64;
+        let mut sector = pos / SECTOR_SIZE as u64;
+        let req_end = end_pos.div_ceil(SECTOR_SIZE as u64);
+        let window = self.track_sequential(sector, req_end);
+        while sector < req_end {
+            if let Some(&slot) = self.index.get(&sector) {
+                self.slots[slot].referenced = true;
+                self.stats.hits += 1;
+                copy_out(buf, pos, sector, self.slot_data(slot));
+                sector += 1;
+                continue;
+            }
+
+            // Load the whole run of missing sectors with one request, and
+            // the read-ahead window past the end of a sequential read.
+            let limit = (req_end + window).min(self.capacity()?);
+            let mut end = sector + 1;
+            while end < limit
+                && end - sector < BLOCK_IO_MAX_SECTORS as u64
+                && !self.index.contains_key(&end)
+            {
+                end += 1;
+            }
+            self.stats.misses += end.min(req_end) - sector;
+            self.stats.prefetched += end.saturating_sub(req_end);
+
+            // Sectors `buf` covers completely are read by the device right
+            // into it; a partial first or last sector and the read-ahead go
+            // through bounce buffers, all in one submission.
+            let ss = SECTOR_SIZE as u64;
+            let first_full = sector.max(pos.div_ceil(ss));
+            let last_full = end.min(end_pos / ss);
+            let (direct_start, direct_end) = if first_full < last_full {
+                (first_full, last_full)
+            } else {
+                (end, end)
+            };
+            let mut head = vec![0; (direct_start - sector) as usize * SECTOR_SIZE];
+            let mut tail = vec![0; (end - direct_end) as usize * SECTOR_SIZE];
+            {
+                let direct: &mut [u8] = if direct_start < direct_end {
+                    let off = (direct_start * ss - pos) as usize;
+                    &mut buf[off..off + (direct_end - direct_start) as usize * SECTOR_SIZE]
+                } else {
+                    &mut []
+                };
+                let mut segments: Vec<(usize, &mut [u8])> = Vec::with_capacity(3);
+                for (start, data) in [
+                    (sector, &mut head[..]),
+                    (direct_start, direct),
+                    (direct_end, &mut tail[..]),
+                ] {
+                    if !data.is_empty() {
+                        segments.push((start as usize, data));
+                    }
+                }
+                with_provider::<BlockProvider>().read_blocks_sg(&mut segments)?;
+            }
+
+            for loaded in sector..end {
+                let data = if loaded < direct_start {
+                    let off = (loaded - sector) as usize * SECTOR_SIZE;
+                    if loaded < req_end {
+                        copy_out(buf, pos, loaded, &head[off..off + SECTOR_SIZE]);
+                    }
+                    &head[off..off + SECTOR_SIZE]
+                } else if loaded < direct_end {
+                    let off = (loaded * ss - pos) as usize;
+                    &buf[off..off + SECTOR_SIZE]
+                } else {
+                    let off = (loaded - direct_end) as usize * SECTOR_SIZE;
+                    if loaded < req_end {
+                        copy_out(buf, pos, loaded, &tail[off..off + SECTOR_SIZE]);
+                    }
+                    &tail[off..off + SECTOR_SIZE]
+                };
+                self.install(loaded, data)?;
+            }
+            sector = end;
+        }
+        Ok(())
+    }
+
+    fn write(&mut self, pos: u64, buf: &[u8]) -> TinyResult<()> {
+        let end_pos = pos + buf.len() as u64;
+        let mut sector = pos / SECTOR_SIZE as u64;
+        while sector * (SECTOR_SIZE as u64) < end_pos {
+            let start = sector * SECTOR_SIZE as u64;
+            let lo = pos.max(start);
+            let hi = end_pos.min(start + SECTOR_SIZE as u64);
+            let slot = self.get(sector, hi - lo == SECTOR_SIZE as u64)?;
+            simd::copy(
+                &mut self.data_mut(slot)[(lo - start) as usize..(hi - start) as usize],
+                &buf[(lo - pos) as usize..(hi - pos) as usize],
+            );
+            self.slots[slot].dirty = true;
+            sector += 1;
+        }
+        Ok(())
+    }
+
+    /// Writes back every dirty sector, one request per run of consecutive
+    /// sectors and all runs submitted together.
+    fn sync(&mut self) -> TinyResult<()> {
+        let dirty: Vec<u64> = self
+            .index
+            .iter()
+            .filter(|&(_, &slot)| self.slots[slot].dirty)
+            .map(|(&sector, _)| sector)
+            .collect();
+
+        let mut runs: Vec<(usize, Vec<u8>)> = Vec::new();
+        let mut i = 0;
+        while i < dirty.len() {
+            let start = dirty[i];
+            let mut end = start + 1;
+            i += 1;
+            while i < dirty.len() && dirty[i] == end && end - start < BLOCK_IO_MAX_SECTORS as u64 {
+                end += 1;
+                i += 1;
+            }
+            runs.push((start as usize, self.take_run(start, end)));
+        }
+        if runs.is_empty() {
+            return Ok(());
+        }
+
+        let segments: Vec<(usize, &[u8])> = runs
+            .iter()
+            .map(|(sector, buf)| (*sector, buf.as_slice()))
+            .collect();
+        with_provider::<BlockProvider>().write_blocks_sg(&segments)
+    }
+}
+
+/// Copies the part of `data`, the contents of `sector`, that overlaps the
+/// byte range of `buf` starting at `pos`.
+fn copy_out(buf: &mut [u8], pos: u64, sector: u64, data: &[u8]) {
+    let start = sector * SECTOR_SIZE as u64;
+    let lo = pos.max(start);
+    let hi = (pos + buf.len() as u64).min(start + SECTOR_SIZE as u64);
+    simd::copy(
+        &mut buf[(lo - pos) as usize..(hi - pos) as usize],
+        &data[(lo - start) as usize..(hi - start) as usize],
+    );
+}
+
+lazy_static! {
+    /// Held across device I/O, so it is a sleeping lock.
+    static ref BLOCK_CACHE: SleepMutex<BlockCache> =
+        SleepMutex::new(BlockCache::new(BLOCK_CACHE_SECTORS));
+}
+
+/// Reads `buf.len()` bytes at byte offset `pos` of the device.
+pub fn read(pos: u64, buf: &mut [u8]) -> TinyResult<()> {
+    BLOCK_CACHE.lock().read(pos, buf)
+}
+
+/// Writes `buf` at byte offset `pos` of the device, marking the sectors
+/// dirty.
+///
+/// Sectors the write covers completely are not read first.
+pub fn write(pos: u64, buf: &[u8]) -> TinyResult<()> {
+    BLOCK_CACHE.lock().write(pos, buf)
+}
+
+/// Writes every dirty sector back to the device.
+pub fn sync() -> TinyResult<()> {
+    BLOCK_CACHE.lock().sync()
+}
+
+/// Writes back dirty sectors and empties the cache, e.g. before the disk
+/// is unmounted or swapped.
+pub fn invalidate() -> TinyResult<()> {
+    let mut cache = BLOCK_CACHE.lock();
+    cache.sync()?;
+    for slot in cache.slots.iter_mut() {
+        *slot = Slot {
+            sector: NO_SECTOR,
+            dirty: false,
+            referenced: false,
+        };
+    }
+    cache.index.clear();
+    cache.hand = 0;
+    cache.streams = [Stream::default(); RA_STREAMS];
+    cache.capacity = None;
+    Ok(())
+}
+
+/// Returns the cache counters.
+#[allow(unused)]
+pub fn stats() -> BlockCacheStats {
+    BLOCK_CACHE.lock().stats
+}
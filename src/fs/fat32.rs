@@ -1,12 +1,16 @@
+use alloc::boxed::Box;
 use alloc::string::String;
 use alloc::vec::Vec;
 use alloc::{collections::BTreeMap, format};
-use core::cmp;
-use core::cmp::min;
 use fatfs::{IoBase, Read, Seek, SeekFrom, Write};
 use log::error;
 
-use super::ops::{FileHandle, FsOps, OpenOptions, resolve_path, set_cwd};
+use super::FS;
+use super::block_cache;
+use super::ops::{
+    DirEntry, FileHandle, FileMetadata, FileType, FsOps, OpenOptions, resolve_path, set_cwd,
+};
+use crate::config::kernel::DENTRY_CACHE_ENTRIES;
 use crate::device::provider::BlockProvider;
 use provider_core::with_provider;
 
@@ -49,73 +53,34 @@ impl IoBase for DiskIo {
     type Error = IoError;
 }
 
-const SECTOR_SIZE: u64 = 512;
+const SECTOR_SIZE: u64 = block_cache::SECTOR_SIZE as u64;
 
 impl Read for DiskIo {
     fn read(&mut self, buf: &mut [u8]) -> Result<usize, Self::Error> {
-        let mut read_len = 0;
-        let mut trash = [0u8; SECTOR_SIZE as usize];
-
-        while read_len < buf.len() {
-            let sector = self.pos / SECTOR_SIZE;
-            let offset = (self.pos % SECTOR_SIZE) as usize;
-
-            with_provider::<BlockProvider>()
-                .read_blocks(sector as usize, &mut trash)
-                .map_err(|e| {
-                    error!("block read error: {:?}", e);
-                    IoError::ReadError
-                })?;
-
-            let bytes_to_copy = cmp::min(buf.len() - read_len, SECTOR_SIZE as usize - offset);
-            buf[read_len..read_len + bytes_to_copy]
-                .copy_from_slice(&trash[offset..offset + bytes_to_copy]);
-
-            self.pos += bytes_to_copy as u64;
-            read_len += bytes_to_copy;
-        }
-
-        Ok(read_len)
+        block_cache::read(self.pos, buf).map_err(|e| {
+            error!("block read error: {:?}", e);
+            IoError::ReadError
+        })?;
+        self.pos += buf.len() as u64;
+        Ok(buf.len())
     }
 }
 
 impl Write for DiskIo {
     fn write(&mut self, buf: &[u8]) -> Result<usize, Self::Error> {
-        let mut written_len = 0;
-        let mut trash = [0u8; SECTOR_SIZE as usize];
-
-        while written_len < buf.len() {
-            let sector = self.pos / SECTOR_SIZE;
-            let offset = (self.pos % SECTOR_SIZE) as usize;
-
-            // Read-Modify-Write
-            with_provider::<BlockProvider>()
-                .read_blocks(sector as usize, &mut trash)
-                .map_err(|e| {
-                    error!("block read-for-write error: {:?}", e);
-                    IoError::WriteError
-                })?;
-
-            let bytes_to_copy = cmp::min(buf.len() - written_len, SECTOR_SIZE as usize - offset);
-            trash[offset..offset + bytes_to_copy]
-                .copy_from_slice(&buf[written_len..written_len + bytes_to_copy]);
-
-            with_provider::<BlockProvider>()
-                .write_blocks(sector as usize, &trash)
-                .map_err(|e| {
-                    error!("block write error: {:?}", e);
-                    IoError::WriteError
-                })?;
-
-            self.pos += bytes_to_copy as u64;
-            written_len += bytes_to_copy;
-        }
-
-        Ok(written_len)
+        block_cache::write(self.pos, buf).map_err(|e| {
+            error!("block write error: {:?}", e);
+            IoError::WriteError
+        })?;
+        self.pos += buf.len() as u64;
+        Ok(buf.len())
     }
 
     fn flush(&mut self) -> Result<(), Self::Error> {
-        Ok(())
+        block_cache::sync().map_err(|e| {
+            error!("block cache sync error: {:?}", e);
+            IoError::WriteError
+        })
     }
 }
 
@@ -136,24 +101,150 @@ impl Seek for DiskIo {
     }
 }
 
+type Fat32File = fatfs::File<'static, DiskIo, fatfs::NullTimeProvider, fatfs::LossyOemCpConverter>;
+type Fat32Dir = fatfs::Dir<'static, DiskIo, fatfs::NullTimeProvider, fatfs::LossyOemCpConverter>;
+
+/// Cached result of looking up a path.
+///
+/// Paths are keyed in lowercase, as FAT names compare case-insensitively.
+/// A lookup miss lists the parent directory once and caches every entry in
+/// it, so the names it does not contain become negative entries without
+/// touching the disk again.
+#[derive(Clone)]
+enum Dentry {
+    /// A directory, opened at its first cluster.
+    Dir(Fat32Dir),
+    /// A file and its size as of its directory entry.
+    File { size: u64 },
+    /// Nothing exists at this path.
+    Negative,
+}
+
+fn metadata(dentry: &Dentry) -> Option<FileMetadata> {
+    match *dentry {
+        Dentry::Dir(_) => Some(dir_metadata()),
+        Dentry::File { size } => Some(FileMetadata {
+            file_type: FileType::File,
+            size,
+            mode: 0o644,
+            ..dir_metadata()
+        }),
+        Dentry::Negative => None,
+    }
+}
+
+fn dir_metadata() -> FileMetadata {
+    FileMetadata {
+        file_type: FileType::Directory,
+        size: 0,
+        mode: 0o755,
+        nlink: 1,
+        uid: 0,
+        gid: 0,
+        atime: 0,
+        mtime: 0,
+        ctime: 0,
+    }
+}
+
+fn dentry_key(path: &str) -> String {
+    path.to_ascii_lowercase()
+}
+
+/// Splits an absolute path other than `/` into its parent and last name.
+fn split_parent(path: &str) -> (&str, &str) {
+    match path.rfind('/') {
+        Some(0) => ("/", &path[1..]),
+        Some(i) => (&path[..i], &path[i + 1..]),
+        None => ("/", path),
+    }
+}
+
+fn join_path(parent: &str, name: &str) -> String {
+    if parent == "/" {
+        format!("/{}", name)
+    } else {
+        format!("{}/{}", parent, name)
+    }
+}
+
 struct Fat32OpenEntry {
-    path: String,
+    /// Key of the live file in `files`.
+    key: String,
     options: OpenOptions,
 }
 
+/// A file kept open while any handle refers to it.
+///
+/// Seeking a fatfs file walks its cluster chain from the start, so the
+/// position is kept between calls and sequential access never seeks.
+/// Handles on the same path share one file, and so one size and chain.
+struct Fat32OpenFile {
+    file: Fat32File,
+    /// Current position of `file`.
+    pos: u64,
+    /// Size of the file, known once the file has been seeked to its end.
+    size: Option<u64>,
+    handles: usize,
+}
+
+impl Fat32OpenFile {
+    fn seek_to(&mut self, offset: u64) -> Result<(), String> {
+        if self.pos != offset {
+            self.pos = self
+                .file
+                .seek(SeekFrom::Start(offset))
+                .map_err(|e| format!("Failed to seek: {:?}", e))?;
+        }
+        Ok(())
+    }
+
+    fn seek_to_end(&mut self) -> Result<(), String> {
+        if self.size != Some(self.pos) {
+            self.pos = self
+                .file
+                .seek(SeekFrom::End(0))
+                .map_err(|e| format!("Failed to seek: {:?}", e))?;
+            self.size = Some(self.pos);
+        }
+        Ok(())
+    }
+}
+
 pub struct Fat32Backend {
+    /// Mounted filesystem, leaked so open files can borrow it until umount.
+    fs: Option<&'static FS>,
     open_files: BTreeMap<FileHandle, Fat32OpenEntry>,
+    /// Live files by [`dentry_key`] of their absolute path, so every
+    /// spelling of a name shares one file.
+    files: BTreeMap<String, Fat32OpenFile>,
+    dentries: BTreeMap<String, Dentry>,
     next_handle: FileHandle,
 }
 
+// Safety: the filesystem and the files borrowing it are only reached through
+// the backend, which is only used under the `BACKEND` lock. The only `&self`
+// entry point, `stat_cached`, reads plain cached metadata and never touches
+// fatfs state.
+unsafe impl Send for Fat32Backend {}
+unsafe impl Sync for Fat32Backend {}
+
 impl Fat32Backend {
     pub fn new() -> Self {
         Self {
+            fs: None,
             open_files: BTreeMap::new(),
+            files: BTreeMap::new(),
+            dentries: BTreeMap::new(),
             next_handle: 1,
         }
     }
 
+    fn fs(&self) -> Result<&'static FS, String> {
+        self.fs
+            .ok_or_else(|| String::from("Filesystem not initialized"))
+    }
+
     fn alloc_handle(&mut self, entry: Fat32OpenEntry) -> FileHandle {
         let handle = self.next_handle;
         self.next_handle = self.next_handle.wrapping_add(1).max(1);
@@ -161,86 +252,204 @@ impl Fat32Backend {
         handle
     }
 
-    fn lookup(&self, handle: FileHandle) -> Result<&Fat32OpenEntry, String> {
-        self.open_files
+    /// Returns the open options of `handle` and its live file.
+    fn file(&mut self, handle: FileHandle) -> Result<(OpenOptions, &mut Fat32OpenFile), String> {
+        let entry = self
+            .open_files
             .get(&handle)
-            .ok_or_else(|| String::from("invalid file handle"))
+            .ok_or_else(|| String::from("invalid file handle"))?;
+        let file = self
+            .files
+            .get_mut(&entry.key)
+            .expect("open handle without a live file");
+        Ok((entry.options, file))
+    }
+
+    fn cache_dentry(&mut self, path: &str, dentry: Dentry) {
+        if self.dentries.len() >= DENTRY_CACHE_ENTRIES {
+            self.dentries.clear();
+        }
+        self.dentries.insert(dentry_key(path), dentry);
+    }
+
+    /// Forgets `path` and everything below it.
+    fn invalidate_dentry(&mut self, path: &str) {
+        let key = dentry_key(path);
+        let prefix = join_path(&key, "");
+        self.dentries
+            .retain(|k, _| *k != key && !k.starts_with(&prefix));
+    }
+
+    /// Lists `dir`, found at `path`, and caches every entry in it.
+    fn list_dir(&mut self, path: &str, dir: &Fat32Dir) -> Result<Vec<DirEntry>, String> {
+        self.scan_dir(path, dir, None).map(|(entries, _)| entries)
+    }
+
+    /// Like [`list_dir`](Self::list_dir), and also returns the entry named
+    /// `wanted`, if there is one.
+    ///
+    /// The entry comes from the listing itself rather than the cache,
+    /// which may fill up and be cleared half way through the listing.
+    fn scan_dir(
+        &mut self,
+        path: &str,
+        dir: &Fat32Dir,
+        wanted: Option<&str>,
+    ) -> Result<(Vec<DirEntry>, Option<Dentry>), String> {
+        let mut entries = Vec::new();
+        let mut found = None;
+        for entry in dir.iter() {
+            let e = entry.map_err(|e| format!("Error reading entry: {:?}", e))?;
+            let name = e.file_name();
+            let (file_type, dentry) = if e.is_dir() {
+                (FileType::Directory, Dentry::Dir(e.to_dir()))
+            } else {
+                (FileType::File, Dentry::File { size: e.len() })
+            };
+            if name != "." && name != ".." {
+                if wanted.is_some_and(|wanted| name.eq_ignore_ascii_case(wanted)) {
+                    found = Some(dentry.clone());
+                }
+                self.cache_dentry(&join_path(path, &name), dentry);
+            }
+            entries.push(DirEntry { name, file_type });
+        }
+        Ok((entries, found))
+    }
+
+    /// Looks up an absolute, normalized path.
+    fn lookup(&mut self, path: &str) -> Result<Dentry, String> {
+        if path == "/" {
+            return Ok(Dentry::Dir(self.fs()?.root_dir()));
+        }
+        if let Some(dentry) = self.dentries.get(&dentry_key(path)) {
+            return Ok(dentry.clone());
+        }
+
+        let (parent, name) = split_parent(path);
+        let found = match self.lookup(parent)? {
+            Dentry::Dir(dir) => self.scan_dir(parent, &dir, Some(name))?.1,
+            _ => None,
+        };
+        let dentry = found.unwrap_or(Dentry::Negative);
+        self.cache_dentry(path, dentry.clone());
+        Ok(dentry)
+    }
+
+    /// Looks up the directory containing `path` and returns it with the
+    /// last name of `path`.
+    fn parent_dir<'p>(&mut self, path: &'p str) -> Result<(Fat32Dir, &'p str), String> {
+        let (parent, name) = split_parent(path);
+        match self.lookup(parent)? {
+            Dentry::Dir(dir) => Ok((dir, name)),
+            _ => Err(format!("Not a directory: {}", parent)),
+        }
+    }
+
+    fn lookup_dir(&mut self, path: &str) -> Result<Fat32Dir, String> {
+        match self.lookup(path)? {
+            Dentry::Dir(dir) => Ok(dir),
+            _ => Err(format!("Failed to open dir: {}", path)),
+        }
+    }
+
+    /// Closes every file and frees the filesystem.
+    fn release(&mut self) {
+        // Dropping a file writes back its directory entry, so this must
+        // happen while the filesystem is still alive.
+        self.open_files.clear();
+        self.files.clear();
+        self.dentries.clear();
+        if let Some(fs) = self.fs.take() {
+            // Safety: `fs` came from `Box::leak` in `mount`, and nothing
+            // borrowing it is left.
+            drop(unsafe { Box::from_raw(fs as *const FS as *mut FS) });
+        }
     }
 }
 
 impl FsOps for Fat32Backend {
     fn mount(&mut self) -> Result<(), String> {
+        self.release();
+        // Nothing cached may predate this mount.
+        block_cache::invalidate().map_err(|e| format!("Failed to sync block cache: {:?}", e))?;
         let disk = DiskIo::new();
         let options = fatfs::FsOptions::new().update_accessed_date(false);
         let fs = fatfs::FileSystem::new(disk, options)
             .map_err(|e| format!("Failed to mount FAT32: {:?}", e))?;
-        *crate::fs::FILESYSTEM.lock() = Some(fs);
+        self.fs = Some(Box::leak(Box::new(fs)));
         set_cwd("/");
         Ok(())
     }
 
     fn umount(&mut self) -> Result<(), String> {
-        *crate::fs::FILESYSTEM.lock() = None;
-        self.open_files.clear();
+        // Dropping the filesystem writes its FSInfo, then the dirty sectors go out.
+        self.release();
+        block_cache::invalidate().map_err(|e| format!("Failed to sync block cache: {:?}", e))?;
         set_cwd("/");
         Ok(())
     }
 
     fn open(&mut self, path: &str, options: OpenOptions) -> Result<FileHandle, String> {
         let target_path = resolve_path(path);
-        let rel_path = target_path.strip_prefix('/').unwrap_or(&target_path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        let root = fs.root_dir();
-        let mut file = if options.create {
-            root.create_file(rel_path)
-                .map_err(|e| format!("Failed to create file: {:?}", e))?
-        } else {
-            root.open_file(rel_path)
-                .map_err(|e| format!("Failed to open file: {:?}", e))?
-        };
+        let key = dentry_key(&target_path);
+        if !self.files.contains_key(&key) {
+            let (dir, name) = self.parent_dir(&target_path)?;
+            let file = if options.create {
+                dir.create_file(name)
+                    .map_err(|e| format!("Failed to create file: {:?}", e))?
+            } else {
+                if let Dentry::Negative = self.lookup(&target_path)? {
+                    return Err(format!("Failed to open file: {}: not found", target_path));
+                }
+                dir.open_file(name)
+                    .map_err(|e| format!("Failed to open file: {:?}", e))?
+            };
+            self.files.insert(
+                key.clone(),
+                Fat32OpenFile {
+                    file,
+                    pos: 0,
+                    size: None,
+                    handles: 0,
+                },
+            );
+        }
 
+        let open = self.files.get_mut(&key).unwrap();
         if options.truncate {
-            use fatfs::Seek;
-            use fatfs::SeekFrom;
-            file.seek(SeekFrom::Start(0))
-                .map_err(|e| format!("Failed to seek: {:?}", e))?;
-            file.truncate()
+            open.seek_to(0)?;
+            open.file
+                .truncate()
                 .map_err(|e| format!("Failed to truncate file: {:?}", e))?;
+            open.size = Some(0);
         }
+        open.handles += 1;
+        // The size in the cached entry goes stale while the file is open.
+        self.invalidate_dentry(&target_path);
 
-        Ok(self.alloc_handle(Fat32OpenEntry {
-            path: target_path,
-            options,
-        }))
+        Ok(self.alloc_handle(Fat32OpenEntry { key, options }))
     }
 
     fn close(&mut self, handle: FileHandle) -> Result<(), String> {
-        self.open_files
+        let entry = self
+            .open_files
             .remove(&handle)
-            .map(|_| ())
-            .ok_or_else(|| String::from("invalid file handle"))
+            .ok_or_else(|| String::from("invalid file handle"))?;
+        let open = self.files.get_mut(&entry.key).unwrap();
+        open.handles -= 1;
+        if open.handles == 0 {
+            self.files.remove(&entry.key);
+            self.invalidate_dentry(&entry.key);
+        }
+        Ok(())
     }
 
     fn lsdir(&mut self, path: &str) -> Result<Vec<String>, String> {
         let target_path = resolve_path(path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        let root = fs.root_dir();
-        let dir = if target_path == "/" {
-            root
-        } else {
-            let rel_path = target_path.strip_prefix('/').unwrap_or(&target_path);
-            root.open_dir(rel_path)
-                .map_err(|e| format!("Failed to open dir: {:?}", e))?
-        };
-
-        let mut entries = Vec::new();
-        for entry in dir.iter() {
-            let e = entry.map_err(|e| format!("Error reading entry: {:?}", e))?;
-            entries.push(e.file_name());
-        }
-        Ok(entries)
+        let dir = self.lookup_dir(&target_path)?;
+        let entries = self.list_dir(&target_path, &dir)?;
+        Ok(entries.into_iter().map(|e| e.name).collect())
     }
 
     fn mkdir(&mut self, path: &str) -> Result<(), String> {
@@ -248,64 +457,40 @@ impl FsOps for Fat32Backend {
         if target_path == "/" {
             return Err(String::from("Cannot create root directory"));
         }
-        let rel_path = target_path.strip_prefix('/').unwrap_or(&target_path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        fs.root_dir()
-            .create_dir(rel_path)
+        let (parent, name) = self.parent_dir(&target_path)?;
+        let dir = parent
+            .create_dir(name)
             .map_err(|e| format!("Failed to create dir: {:?}", e))?;
+        self.invalidate_dentry(&target_path);
+        self.cache_dentry(&target_path, Dentry::Dir(dir));
         Ok(())
     }
 
-    fn read_file(
+    fn read_into(
         &mut self,
         handle: FileHandle,
         offset: u64,
-        len: usize,
-    ) -> Result<Vec<u8>, String> {
-        use fatfs::Read;
-        use fatfs::Seek;
-        use fatfs::SeekFrom;
-
-        let entry = self.lookup(handle)?;
-        let rel_path = entry.path.strip_prefix('/').unwrap_or(&entry.path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        let root = fs.root_dir();
-        let mut file = root
-            .open_file(rel_path)
-            .map_err(|e| format!("Failed to open file: {:?}", e))?;
-        file.seek(SeekFrom::Start(offset))
-            .map_err(|e| format!("Failed to seek: {:?}", e))?;
-
-        let mut out = Vec::new();
-        if len == 0 {
-            let mut buf = [0u8; 1024];
-            loop {
-                let read = file
-                    .read(&mut buf)
-                    .map_err(|e| format!("Failed to read file: {:?}", e))?;
-                if read == 0 {
-                    break;
-                }
-                out.extend_from_slice(&buf[..read]);
-            }
-        } else {
-            let mut remaining = len;
-            let mut buf = [0u8; 1024];
-            while remaining > 0 {
-                let take = min(remaining, buf.len());
-                let read = file
-                    .read(&mut buf[..take])
-                    .map_err(|e| format!("Failed to read file: {:?}", e))?;
-                if read == 0 {
-                    break;
-                }
-                out.extend_from_slice(&buf[..read]);
-                remaining -= read;
+        buf: &mut [u8],
+    ) -> Result<usize, String> {
+        let (_, open) = self.file(handle)?;
+        open.seek_to(offset)?;
+
+        // fatfs reads file data straight into `buf`, at most a cluster per
+        // call.
+        let mut read = 0;
+        while read < buf.len() {
+            let n = open
+                .file
+                .read(&mut buf[read..])
+                .map_err(|e| format!("Failed to read file: {:?}", e))?;
+            open.pos += n as u64;
+            if n == 0 {
+                open.size = Some(open.pos);
+                break;
             }
+            read += n;
         }
-        Ok(out)
+        Ok(read)
     }
 
     fn read_link(&mut self, _path: &str) -> Result<String, String> {
@@ -323,39 +508,35 @@ impl FsOps for Fat32Backend {
         self.open(path, options)
     }
 
-    fn write_file(
+    fn write_from(
         &mut self,
         handle: FileHandle,
         offset: u64,
         data: &[u8],
     ) -> Result<usize, String> {
-        use fatfs::Seek;
-        use fatfs::SeekFrom;
-        use fatfs::Write;
-
-        let entry = self.lookup(handle)?;
-        let rel_path = entry.path.strip_prefix('/').unwrap_or(&entry.path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        let root = fs.root_dir();
-        let mut file = if entry.options.create {
-            root.create_file(rel_path)
-                .map_err(|e| format!("Failed to create file: {:?}", e))?
-        } else {
-            root.open_file(rel_path)
-                .map_err(|e| format!("Failed to open file: {:?}", e))?
-        };
-
-        if entry.options.append {
-            file.seek(SeekFrom::End(0))
-                .map_err(|e| format!("Failed to seek: {:?}", e))?;
+        let (options, open) = self.file(handle)?;
+        if options.append {
+            open.seek_to_end()?;
         } else {
-            file.seek(SeekFrom::Start(offset))
-                .map_err(|e| format!("Failed to seek: {:?}", e))?;
+            open.seek_to(offset)?;
         }
 
-        file.write(data)
-            .map_err(|e| format!("Failed to write file: {:?}", e))
+        let mut written = 0;
+        while written < data.len() {
+            let n = open
+                .file
+                .write(&data[written..])
+                .map_err(|e| format!("Failed to write file: {:?}", e))?;
+            if n == 0 {
+                return Err(String::from("Failed to write file: no space left"));
+            }
+            open.pos += n as u64;
+            written += n;
+        }
+        if let Some(size) = open.size {
+            open.size = Some(size.max(open.pos));
+        }
+        Ok(written)
     }
 
     fn link(&mut self, _target: &str, _link_path: &str) -> Result<(), String> {
@@ -367,21 +548,12 @@ impl FsOps for Fat32Backend {
     }
 
     fn file_truncate(&mut self, handle: FileHandle, size: u64) -> Result<(), String> {
-        use fatfs::Seek;
-        use fatfs::SeekFrom;
-
-        let entry = self.lookup(handle)?;
-        let rel_path = entry.path.strip_prefix('/').unwrap_or(&entry.path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        let root = fs.root_dir();
-        let mut file = root
-            .open_file(rel_path)
-            .map_err(|e| format!("Failed to open file: {:?}", e))?;
-        file.seek(SeekFrom::Start(size))
-            .map_err(|e| format!("Failed to seek: {:?}", e))?;
-        file.truncate()
+        let (_, open) = self.file(handle)?;
+        open.seek_to(size)?;
+        open.file
+            .truncate()
             .map_err(|e| format!("Failed to truncate file: {:?}", e))?;
+        open.size = Some(size);
         Ok(())
     }
 
@@ -390,12 +562,14 @@ impl FsOps for Fat32Backend {
         if target_path == "/" {
             return Err(String::from("Cannot remove root directory"));
         }
-        let rel_path = target_path.strip_prefix('/').unwrap_or(&target_path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        fs.root_dir()
-            .remove(rel_path)
+        if self.files.contains_key(&dentry_key(&target_path)) {
+            return Err(String::from("Cannot remove an open file"));
+        }
+        let (dir, name) = self.parent_dir(&target_path)?;
+        dir.remove(name)
             .map_err(|e| format!("Failed to remove file: {:?}", e))?;
+        self.invalidate_dentry(&target_path);
+        self.cache_dentry(&target_path, Dentry::Negative);
         Ok(())
     }
 
@@ -403,54 +577,29 @@ impl FsOps for Fat32Backend {
         self.file_remove(path)
     }
 
-    fn stat(&mut self, path: &str) -> Result<super::ops::FileMetadata, String> {
-        use super::ops::{FileMetadata, FileType};
+    fn stat(&mut self, path: &str) -> Result<FileMetadata, String> {
         let target_path = resolve_path(path);
-        if target_path == "/" {
-            return Ok(FileMetadata {
-                file_type: FileType::Directory,
-                size: 0,
-                mode: 0o755,
-                nlink: 1,
-                uid: 0,
-                gid: 0,
-                atime: 0,
-                mtime: 0,
-                ctime: 0,
-            });
+        // An open file's directory entry is only current once flushed.
+        if let Some(open) = self.files.get_mut(&dentry_key(&target_path)) {
+            open.file
+                .flush()
+                .map_err(|e| format!("Failed to flush file: {:?}", e))?;
+            self.invalidate_dentry(&target_path);
         }
-        let rel_path = target_path.strip_prefix('/').unwrap_or(&target_path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        let root = fs.root_dir();
-        // Try opening as directory first
-        if root.open_dir(rel_path).is_ok() {
-            return Ok(FileMetadata {
-                file_type: FileType::Directory,
-                size: 0,
-                mode: 0o755,
-                nlink: 1,
-                uid: 0,
-                gid: 0,
-                atime: 0,
-                mtime: 0,
-                ctime: 0,
-            });
+
+        metadata(&self.lookup(&target_path)?).ok_or_else(|| format!("not found: {}", target_path))
+    }
+
+    fn stat_cached(&self, path: &str) -> Option<FileMetadata> {
+        if path == "/" {
+            return self.fs.map(|_| dir_metadata());
         }
-        // Try opening as file
-        match root.open_file(rel_path) {
-            Ok(_file) => Ok(FileMetadata {
-                file_type: FileType::File,
-                size: 0,
-                mode: 0o644,
-                nlink: 1,
-                uid: 0,
-                gid: 0,
-                atime: 0,
-                mtime: 0,
-                ctime: 0,
-            }),
-            Err(e) => Err(format!("not found: {:?}", e)),
+        if self.files.contains_key(&dentry_key(path)) {
+            return None;
+        }
+        match self.dentries.get(&dentry_key(path))? {
+            Dentry::Negative => None,
+            dentry => metadata(dentry),
         }
     }
 
@@ -466,37 +615,18 @@ impl FsOps for Fat32Backend {
         Err(String::from("chmod is not supported on FAT32"))
     }
 
-    fn readdir(&mut self, path: &str) -> Result<Vec<super::ops::DirEntry>, String> {
-        use super::ops::{DirEntry, FileType};
+    fn readdir(&mut self, path: &str) -> Result<Vec<DirEntry>, String> {
         let target_path = resolve_path(path);
-        let fs_guard = crate::fs::FILESYSTEM.lock();
-        let fs = fs_guard.as_ref().ok_or("Filesystem not initialized")?;
-        let root = fs.root_dir();
-        let dir = if target_path == "/" {
-            root
-        } else {
-            let rel_path = target_path.strip_prefix('/').unwrap_or(&target_path);
-            root.open_dir(rel_path)
-                .map_err(|e| format!("Failed to open dir: {:?}", e))?
-        };
-        let mut entries = Vec::new();
-        for entry in dir.iter() {
-            let e = entry.map_err(|e| format!("Error reading entry: {:?}", e))?;
-            let file_type = if e.is_dir() {
-                FileType::Directory
-            } else {
-                FileType::File
-            };
-            entries.push(DirEntry {
-                name: e.file_name(),
-                file_type,
-            });
-        }
-        Ok(entries)
+        let dir = self.lookup_dir(&target_path)?;
+        self.list_dir(&target_path, &dir)
     }
 
-    fn fsync(&mut self, _handle: FileHandle) -> Result<(), String> {
-        // FAT32 via fatfs has no explicit fsync; writes go through immediately.
-        Ok(())
+    fn fsync(&mut self, handle: FileHandle) -> Result<(), String> {
+        let (_, open) = self.file(handle)?;
+        open.file
+            .flush()
+            .map_err(|e| format!("Failed to flush file: {:?}", e))?;
+        // Sectors are cached per device, not per file, so sync all of them.
+        block_cache::sync().map_err(|e| format!("Failed to sync block cache: {:?}", e))
     }
 }
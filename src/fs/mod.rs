@@ -1,3 +1,4 @@
+pub mod block_cache;
 mod ops;
 
 #[cfg(feature = "fat32")]
@@ -11,8 +12,9 @@ use lazy_static::lazy_static;
 pub use ops::{
     DirEntry, FileHandle, FileMetadata, FileType, OpenOptions, change_dir, chmod, close, copy_file,
     create_file, current_dir, dir_remove, exists, file_remove, file_size, file_truncate, fsync,
-    is_dir, is_file, link, list_dir, make_dir, mkdir, mkdir_all, mount, open, read_file, read_link,
-    readdir, remove_all, rename, stat, symlink, umount, unlink, walk, write_file,
+    is_dir, is_file, link, list_dir, make_dir, mkdir, mkdir_all, mount, open, read_file, read_into,
+    read_link, readdir, remove_all, rename, stat, symlink, umount, unlink, walk, with_fs_idle,
+    write_file, write_from,
 };
 
 #[cfg(feature = "fat32")]
@@ -25,11 +27,6 @@ lazy_static! {
     pub static ref CWD: Mutex<String> = Mutex::new(String::from("/"));
 }
 
-#[cfg(feature = "fat32")]
-lazy_static! {
-    pub static ref FILESYSTEM: Mutex<Option<FS>> = Mutex::new(None);
-}
-
 #[cfg(not(feature = "fat32"))]
 compile_error!("fat32 feature must be enabled.");
 
@@ -3,13 +3,17 @@
 use alloc::boxed::Box;
 use alloc::format;
 use alloc::string::{String, ToString};
+use alloc::vec;
 use alloc::vec::Vec;
 
 use crate::fs::CWD;
-use crate::hal::Mutex;
+use crate::task::sleep_lock::SleepRwLock;
 
 pub type FileHandle = u32;
 
+/// Buffer size for whole-file reads and copies.
+const READ_CHUNK: usize = 64 * 1024;
+
 #[derive(Clone, Copy, Debug, Default)]
 pub struct OpenOptions {
     pub read: bool,
@@ -46,7 +50,7 @@ pub struct DirEntry {
     pub file_type: FileType,
 }
 
-pub trait FsOps: Send {
+pub trait FsOps: Send + Sync {
     fn mount(&mut self) -> Result<(), String>;
     fn umount(&mut self) -> Result<(), String>;
 
@@ -56,11 +60,18 @@ pub trait FsOps: Send {
     fn lsdir(&mut self, path: &str) -> Result<Vec<String>, String>;
     fn mkdir(&mut self, path: &str) -> Result<(), String>;
 
-    fn read_file(&mut self, handle: FileHandle, offset: u64, len: usize)
-    -> Result<Vec<u8>, String>;
+    /// Reads from `offset` into `buf`, returning the number of bytes read;
+    /// fewer than `buf.len()` only at the end of the file.
+    fn read_into(
+        &mut self,
+        handle: FileHandle,
+        offset: u64,
+        buf: &mut [u8],
+    ) -> Result<usize, String>;
     fn read_link(&mut self, path: &str) -> Result<String, String>;
     fn create_file(&mut self, path: &str) -> Result<FileHandle, String>;
-    fn write_file(&mut self, handle: FileHandle, offset: u64, data: &[u8])
+    /// Writes all of `data` at `offset` and returns its length.
+    fn write_from(&mut self, handle: FileHandle, offset: u64, data: &[u8])
     -> Result<usize, String>;
     fn link(&mut self, target: &str, link_path: &str) -> Result<(), String>;
     fn unlink(&mut self, path: &str) -> Result<(), String>;
@@ -69,6 +80,11 @@ pub trait FsOps: Send {
     fn dir_remove(&mut self, path: &str) -> Result<(), String>;
 
     fn stat(&mut self, path: &str) -> Result<FileMetadata, String>;
+    /// Answers [`FsOps::stat`] from memory, or returns `None` if that would
+    /// need the disk. Runs concurrently with other cached lookups.
+    fn stat_cached(&self, path: &str) -> Option<FileMetadata> {
+        None
+    }
     fn rename(&mut self, old_path: &str, new_path: &str) -> Result<(), String>;
     fn symlink(&mut self, target: &str, link_path: &str) -> Result<(), String>;
     fn chmod(&mut self, path: &str, mode: u32) -> Result<(), String>;
@@ -76,14 +92,30 @@ pub trait FsOps: Send {
     fn fsync(&mut self, handle: FileHandle) -> Result<(), String>;
 }
 
+/// Returns `true` if `path` is absolute with no empty, `.` or `..` parts.
+fn is_normalized(path: &str) -> bool {
+    path == "/"
+        || (path.starts_with('/')
+            && path[1..]
+                .split('/')
+                .all(|part| !part.is_empty() && part != "." && part != ".."))
+}
+
 pub(crate) fn resolve_path(path: &str) -> String {
-    let cwd = CWD.lock().clone();
+    // Paths from the backends' callers are usually normalized already.
+    if is_normalized(path) {
+        return String::from(path);
+    }
+
     let abs_path = if path.starts_with('/') {
         String::from(path)
-    } else if cwd.ends_with('/') {
-        format!("{}{}", cwd, path)
     } else {
-        format!("{}/{}", cwd, path)
+        let cwd = CWD.lock();
+        if cwd.ends_with('/') {
+            format!("{}{}", cwd, path)
+        } else {
+            format!("{}/{}", cwd, path)
+        }
     };
 
     let mut parts = Vec::new();
@@ -108,7 +140,10 @@ pub(crate) fn set_cwd(path: &str) {
 }
 
 lazy_static::lazy_static! {
-    static ref BACKEND: Mutex<Box<dyn FsOps>> = Mutex::new(select_backend());
+    /// Lookups answered from the backend's caches share the lock; anything
+    /// that may reach the disk takes it exclusively. It is a sleeping lock,
+    /// so tasks waiting for the disk keep IRQs enabled.
+    static ref BACKEND: SleepRwLock<Box<dyn FsOps>> = SleepRwLock::new(select_backend());
 }
 
 fn select_backend() -> Box<dyn FsOps> {
@@ -141,12 +176,12 @@ impl FsOps for NullBackend {
     fn mkdir(&mut self, _path: &str) -> Result<(), String> {
         Err(String::from("no filesystem backend selected"))
     }
-    fn read_file(
+    fn read_into(
         &mut self,
         _handle: FileHandle,
         _offset: u64,
-        _len: usize,
-    ) -> Result<Vec<u8>, String> {
+        _buf: &mut [u8],
+    ) -> Result<usize, String> {
         Err(String::from("no filesystem backend selected"))
     }
     fn read_link(&mut self, _path: &str) -> Result<String, String> {
@@ -155,7 +190,7 @@ impl FsOps for NullBackend {
     fn create_file(&mut self, _path: &str) -> Result<FileHandle, String> {
         Err(String::from("no filesystem backend selected"))
     }
-    fn write_file(
+    fn write_from(
         &mut self,
         _handle: FileHandle,
         _offset: u64,
@@ -199,24 +234,24 @@ impl FsOps for NullBackend {
 }
 
 pub fn mount() -> Result<(), String> {
-    BACKEND.lock().mount()
+    BACKEND.write().mount()
 }
 
 pub fn umount() -> Result<(), String> {
-    BACKEND.lock().umount()
+    BACKEND.write().umount()
 }
 
 pub fn open(path: &str, options: OpenOptions) -> Result<FileHandle, String> {
-    BACKEND.lock().open(path, options)
+    BACKEND.write().open(path, options)
 }
 
 pub fn close(handle: FileHandle) -> Result<(), String> {
-    BACKEND.lock().close(handle)
+    BACKEND.write().close(handle)
 }
 
 pub fn list_dir(path: Option<&str>) -> Result<(), String> {
     let target_path = resolve_path(path.unwrap_or(""));
-    let entries = BACKEND.lock().lsdir(&target_path)?;
+    let entries = BACKEND.write().lsdir(&target_path)?;
     for name in entries {
         println!("{}", name);
     }
@@ -225,61 +260,91 @@ pub fn list_dir(path: Option<&str>) -> Result<(), String> {
 
 pub fn change_dir(path: &str) -> Result<(), String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().lsdir(&target_path)?;
+    BACKEND.write().lsdir(&target_path)?;
     set_cwd(&target_path);
     Ok(())
 }
 
 pub fn mkdir(path: &str) -> Result<(), String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().mkdir(&target_path)
+    BACKEND.write().mkdir(&target_path)
 }
 
 pub fn make_dir(path: &str) -> Result<(), String> {
     mkdir(path)
 }
 
+/// Reads from `offset` into `buf`, returning the number of bytes read.
+///
+/// Sector-aligned parts of `buf` are filled by the device directly.
+pub fn read_into(handle: FileHandle, offset: u64, buf: &mut [u8]) -> Result<usize, String> {
+    BACKEND.write().read_into(handle, offset, buf)
+}
+
+/// Reads `len` bytes from `offset` into a new vector, or up to the end of
+/// the file if `len` is 0.
 pub fn read_file(handle: FileHandle, offset: u64, len: usize) -> Result<Vec<u8>, String> {
-    BACKEND.lock().read_file(handle, offset, len)
+    if len != 0 {
+        let mut out = vec![0; len];
+        let read = read_into(handle, offset, &mut out)?;
+        out.truncate(read);
+        return Ok(out);
+    }
+
+    let mut out = Vec::new();
+    loop {
+        let start = out.len();
+        out.resize(start + READ_CHUNK, 0);
+        let read = read_into(handle, offset + start as u64, &mut out[start..])?;
+        out.truncate(start + read);
+        if read < READ_CHUNK {
+            return Ok(out);
+        }
+    }
 }
 
 pub fn read_link(path: &str) -> Result<String, String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().read_link(&target_path)
+    BACKEND.write().read_link(&target_path)
 }
 
 pub fn create_file(path: &str) -> Result<FileHandle, String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().create_file(&target_path)
+    BACKEND.write().create_file(&target_path)
+}
+
+/// Writes all of `data` at `offset`, straight from the caller's buffer.
+pub fn write_from(handle: FileHandle, offset: u64, data: &[u8]) -> Result<usize, String> {
+    BACKEND.write().write_from(handle, offset, data)
 }
 
 pub fn write_file(handle: FileHandle, offset: u64, data: &[u8]) -> Result<usize, String> {
-    BACKEND.lock().write_file(handle, offset, data)
+    write_from(handle, offset, data)
 }
 
 pub fn link(target: &str, link_path: &str) -> Result<(), String> {
     let target_path = resolve_path(target);
     let link_path = resolve_path(link_path);
-    BACKEND.lock().link(&target_path, &link_path)
+    BACKEND.write().link(&target_path, &link_path)
 }
 
 pub fn unlink(path: &str) -> Result<(), String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().unlink(&target_path)
+    BACKEND.write().unlink(&target_path)
 }
 
 pub fn file_truncate(handle: FileHandle, size: u64) -> Result<(), String> {
-    BACKEND.lock().file_truncate(handle, size)
+    BACKEND.write().file_truncate(handle, size)
 }
 
 pub fn file_remove(path: &str) -> Result<(), String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().file_remove(&target_path)
+    BACKEND.write().file_remove(&target_path)
 }
 
 pub fn dir_remove(path: &str) -> Result<(), String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().dir_remove(&target_path)
+    BACKEND.write().dir_remove(&target_path)
 }
 
 pub fn current_dir() -> String {
@@ -288,29 +353,32 @@ pub fn current_dir() -> String {
 
 pub fn stat(path: &str) -> Result<FileMetadata, String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().stat(&target_path)
+    if let Some(meta) = BACKEND.read().stat_cached(&target_path) {
+        return Ok(meta);
+    }
+    BACKEND.write().stat(&target_path)
 }
 
 pub fn rename(old_path: &str, new_path: &str) -> Result<(), String> {
     let old = resolve_path(old_path);
     let new = resolve_path(new_path);
-    BACKEND.lock().rename(&old, &new)
+    BACKEND.write().rename(&old, &new)
 }
 
 pub fn symlink(target: &str, link_path: &str) -> Result<(), String> {
     let target_path = resolve_path(target);
     let link = resolve_path(link_path);
-    BACKEND.lock().symlink(&target_path, &link)
+    BACKEND.write().symlink(&target_path, &link)
 }
 
 pub fn chmod(path: &str, mode: u32) -> Result<(), String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().chmod(&target_path, mode)
+    BACKEND.write().chmod(&target_path, mode)
 }
 
 pub fn readdir(path: &str) -> Result<Vec<DirEntry>, String> {
     let target_path = resolve_path(path);
-    BACKEND.lock().readdir(&target_path)
+    BACKEND.write().readdir(&target_path)
 }
 
 pub fn exists(path: &str) -> bool {
@@ -340,13 +408,14 @@ pub fn copy_file(src: &str, dst: &str) -> Result<u64, String> {
     };
     let src_handle = open(src, src_options)?;
     let dst_handle = create_file(dst)?;
+    let mut buf = vec![0; READ_CHUNK];
     let mut offset = 0u64;
     loop {
-        let data = read_file(src_handle, offset, 4096)?;
-        if data.is_empty() {
+        let read = read_into(src_handle, offset, &mut buf)?;
+        if read == 0 {
             break;
         }
-        let written = write_file(dst_handle, offset, &data)?;
+        let written = write_from(dst_handle, offset, &buf[..read])?;
         offset += written as u64;
     }
     close(src_handle)?;
@@ -441,5 +510,13 @@ where
 
 /// Flush file data to persistent storage.
 pub fn fsync(handle: FileHandle) -> Result<(), String> {
-    BACKEND.lock().fsync(handle)
+    BACKEND.write().fsync(handle)
+}
+
+/// Runs `f` with the filesystem held still: dirty sectors are written back
+/// first, and every other filesystem call waits until `f` returns.
+pub fn with_fs_idle<R>(f: impl FnOnce() -> R) -> Result<R, String> {
+    let _backend = BACKEND.write();
+    crate::fs::block_cache::sync().map_err(|e| format!("Failed to sync block cache: {:?}", e))?;
+    Ok(f())
 }
@@ -141,9 +141,9 @@ pub struct FpState {
     /// 128-bit SIMD & FP registers (V0..V31)
     pub regs: [u128; 32],
     /// Floating-point Control Register (FPCR)
-    pub fpcr: u32,
+    pub fpcr: u64,
     /// Floating-point Status Register (FPSR)
-    pub fpsr: u32,
+    pub fpsr: u64,
 }
 
 impl FpState {
@@ -168,7 +168,8 @@ impl FpState {
 /// - FP/SIMD registers
 ///
 /// On context switch, current task saves its context from CPU to memory,
-/// and the next task restores its context from memory to CPU.
+/// and the next task restores its context from memory to CPU. The FP/SIMD
+/// registers are switched lazily, see [`fp`](super::fp).
 #[allow(missing_docs)]
 #[repr(C)]
 #[derive(Debug, Default)]
@@ -216,8 +217,7 @@ impl TaskContext {
     /// It first saves the current task's context from CPU to this place, and then
     /// restores the next task's context from `next_ctx` to CPU.
     pub fn switch_to(&mut self, next_ctx: &Self) {
-        self.fp_state.save();
-        next_ctx.fp_state.restore();
+        super::fp::switch(&mut self.fp_state, &next_ctx.fp_state);
 
         unsafe { context_switch(self, next_ctx) }
     }
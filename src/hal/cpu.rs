@@ -46,6 +46,54 @@ pub fn flush_tlb(vaddr: Option<VirtAddr>) {
     }
 }
 
+/// Range flushes longer than this many entries drop the whole ASID (or the
+/// whole TLB) instead, which is cheaper than a long run of TLBIs.
+const TLB_FLUSH_RANGE_LIMIT: usize = 64;
+
+/// Builds a TLBI operand from a virtual address and an ASID.
+#[inline]
+fn tlbi_operand(vaddr: usize, asid: u16) -> usize {
+    const VA_MASK: usize = (1 << 44) - 1; // VA[55:12] => bits[43:0]
+    ((asid as usize) << 48) | ((vaddr >> 12) & VA_MASK)
+}
+
+/// Flushes the TLB entries covering `[vaddr, vaddr + size)` on all CPUs.
+///
+/// With `asid`, only the non-global entries tagged with it are dropped;
+/// without, the entries of every ASID are. The range is walked in `stride`
+/// steps, the smallest mapping size in it, so a range of 2M blocks costs
+/// one TLBI per block.
+pub fn flush_tlb_range(vaddr: VirtAddr, size: usize, stride: usize, asid: Option<u16>) {
+    let start = vaddr.as_usize();
+    if size.div_ceil(stride) > TLB_FLUSH_RANGE_LIMIT {
+        return match asid {
+            Some(asid) => flush_tlb_asid(asid),
+            None => unsafe { asm!("dsb ishst; tlbi vmalle1is; dsb ish; isb") },
+        };
+    }
+
+    unsafe { asm!("dsb ishst") };
+    for vaddr in (start..start + size).step_by(stride) {
+        unsafe {
+            match asid {
+                // TLB Invalidate by VA and ASID, EL1, Inner Shareable
+                Some(asid) => asm!("tlbi vae1is, {}", in(reg) tlbi_operand(vaddr, asid)),
+                // TLB Invalidate by VA, All ASID, EL1, Inner Shareable
+                None => asm!("tlbi vaae1is, {}", in(reg) tlbi_operand(vaddr, 0)),
+            }
+        }
+    }
+    unsafe { asm!("dsb ish; isb") };
+}
+
+/// Flushes every non-global TLB entry tagged with `asid` on all CPUs.
+pub fn flush_tlb_asid(asid: u16) {
+    unsafe {
+        // TLB Invalidate by ASID, EL1, Inner Shareable
+        asm!("dsb ishst; tlbi aside1is, {}; dsb ish; isb", in(reg) tlbi_operand(0, asid))
+    }
+}
+
 /// Fills the `.bss` section with zeros.
 ///
 /// It requires the symbols `_sbss` and `_ebss` to be defined in the linker script.
@@ -83,6 +131,23 @@ pub fn disable_irqs() {
     unsafe { asm!("msr daifset, #2") };
 }
 
+/// Disables interrupts and returns whether they were enabled before.
+#[inline]
+pub fn local_irq_save() -> bool {
+    let enabled = !irqs_disabled();
+    disable_irqs();
+    enabled
+}
+
+/// Re-enables interrupts if `enabled` says they were on before
+/// [`local_irq_save`].
+#[inline]
+pub fn local_irq_restore(enabled: bool) {
+    if enabled {
+        enable_irqs();
+    }
+}
+
 /// Checks if interrupts are disabled.
 ///
 /// Returns `true` if the DAIF I bit is set (masked).
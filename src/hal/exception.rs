@@ -7,7 +7,16 @@ use crate::device::provider::IrqProvider;
 use crate::hal::TrapFrame;
 use provider_core::with_provider;
 
-core::arch::global_asm!(include_str!("trap.S"));
+core::arch::global_asm!(
+    include_str!("trap.S"),
+    // The hard-float kernel uses FP/SIMD registers in exception handlers,
+    // so the interrupted code's ones are saved below the trap frame.
+    FP_FRAME_SIZE = const if crate::hal::fp::HARD_FLOAT {
+        core::mem::size_of::<crate::hal::context::FpState>()
+    } else {
+        0
+    },
+);
 
 #[repr(u8)]
 #[derive(Debug)]
@@ -42,11 +51,13 @@ fn invalid_exception(tf: &TrapFrame, kind: TrapKind, source: TrapSource) {
 }
 
 #[unsafe(no_mangle)]
-fn handle_irq_exception(_tf: &mut TrapFrame) {
+fn handle_irq_exception(tf: &mut TrapFrame) {
+    // For handlers that sample where the CPU was, such as the profiler.
+    crate::hal::percpu::set_irq_pc(tf.elr as usize);
     with_provider::<IrqProvider>().handle();
 
-    // After handling interrupt, check if we need to schedule
-    crate::task::task_ops::task_timer_tick();
+    // Switch away before returning if the current task used up its slice.
+    crate::task::task_ops::task_preempt();
 }
 
 fn handle_instruction_abort(tf: &TrapFrame, _iss: u64) {
@@ -80,6 +91,7 @@ fn handle_sync_exception(tf: &mut TrapFrame) {
     match esr.read_as_enum(ESR_EL1::EC) {
         Some(ESR_EL1::EC::Value::InstrAbortCurrentEL) => handle_instruction_abort(tf, iss),
         Some(ESR_EL1::EC::Value::DataAbortCurrentEL) => handle_data_abort(tf, iss),
+        Some(ESR_EL1::EC::Value::TrappedFP) => crate::hal::fp::handle_trap(),
         Some(ESR_EL1::EC::Value::Brk64) => {
             debug!("BRK #{:#x} @ {:#x} ", iss, tf.elr);
             tf.elr += 4;
@@ -0,0 +1,95 @@
+//! Lazy FP/SIMD context switching.
+//!
+//! The default kernel is built soft-float, so the compiler never touches
+//! the FP/SIMD registers and only the explicit routines in
+//! [`simd`](super::simd) do. Tasks therefore start every time slice with FP
+//! access trapped by `CPACR_EL1`. The first FP instruction traps into
+//! [`handle_trap`], which loads the task's saved registers and lets it
+//! continue. On the way out, only a task that trapped in has its
+//! registers saved.
+//!
+//! The hard-float build (target `aarch64-unknown-none`) emits SIMD
+//! instructions in every task and exception handler. There, FP access
+//! stays enabled, task switches save and restore the registers eagerly, and
+//! the exception entry saves them in the trap frame.
+
+use aarch64_cpu::registers::{CPACR_EL1, ReadWriteable, Readable};
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use super::context::FpState;
+use crate::hal::percpu::{self, PerCpuVar};
+
+/// `true` when the kernel itself is compiled to use FP/SIMD registers.
+pub const HARD_FLOAT: bool = cfg!(target_feature = "neon");
+
+crate::define_percpu! {
+    /// Times a task trapped on its first FP instruction of a slice.
+    static TRAPS: AtomicU64 = AtomicU64::new(0);
+    /// Times a task's registers were saved on switching out.
+    static SAVES: AtomicU64 = AtomicU64::new(0);
+}
+
+#[inline]
+fn count(counters: &'static PerCpuVar<AtomicU64>) {
+    let counter = counters.current();
+    counter.store(counter.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+}
+
+/// Returns `true` if FP/SIMD instructions run without trapping.
+#[inline]
+pub fn is_enabled() -> bool {
+    CPACR_EL1.matches_all(CPACR_EL1::FPEN::TrapNothing)
+}
+
+/// Lets FP/SIMD instructions run at EL1.
+#[inline]
+pub fn enable() {
+    CPACR_EL1.modify(CPACR_EL1::FPEN::TrapNothing);
+    unsafe { core::arch::asm!("isb") };
+}
+
+/// Makes the next FP/SIMD instruction trap.
+#[inline]
+pub fn disable() {
+    CPACR_EL1.modify(CPACR_EL1::FPEN::TrapEl0El1);
+    unsafe { core::arch::asm!("isb") };
+}
+
+/// Saves the outgoing task's registers to `prev` and arranges for the
+/// incoming task to get `next`. Runs with IRQs masked.
+#[inline]
+pub(crate) fn switch(prev: &mut FpState, next: &FpState) {
+    if HARD_FLOAT {
+        prev.save();
+        next.restore();
+        return;
+    }
+    // Enabled means the outgoing task trapped in this slice, so the
+    // registers are its own.
+    if is_enabled() {
+        prev.save();
+        count(&SAVES);
+        disable();
+    }
+}
+
+/// Handles an FP access trap: loads the current task's registers and
+/// leaves FP enabled for the rest of its slice.
+///
+/// Only soft-float kernel code can trap, and it uses FP only from tasks
+/// with IRQs enabled, so the trapping code is always the current task.
+pub(crate) fn handle_trap() {
+    enable();
+    let task = percpu::current_task();
+    // Safety: only this CPU touches the context of its running task.
+    unsafe { task.context_mut().fp_state.restore() };
+    count(&TRAPS);
+}
+
+/// Returns the number of FP traps and FP register saves on `cpu_id`.
+pub fn stats(cpu_id: usize) -> (u64, u64) {
+    (
+        TRAPS.remote(cpu_id).load(Ordering::Relaxed),
+        SAVES.remote(cpu_id).load(Ordering::Relaxed),
+    )
+}
@@ -6,10 +6,16 @@
 pub mod context;
 pub mod cpu;
 pub mod exception;
+pub mod fp;
 pub mod percpu;
+pub mod pmu;
+pub mod simd;
 mod spin;
 
 pub use context::TrapFrame;
-pub use cpu::{clear_bss, flush_tlb};
+pub use cpu::{clear_bss, flush_tlb, flush_tlb_asid, flush_tlb_range};
 pub use exception::init_exception;
-pub use spin::{Mutex, SpinNoIrq};
+pub use spin::{
+    LockStats, Mutex, SpinMutex, SpinNoIrq, TicketNoIrq, lock_stats, lock_stats_enabled,
+    register_lock, reset_lock_stats,
+};
@@ -1,7 +1,13 @@
 //! Per-CPU data structure and operations.
 //!
-//! This module provides per-CPU local storage using the TPIDR_EL1 register.
-//! Each CPU has its own PerCpu structure that stores CPU-local data such as
+//! Variables declared with [`define_percpu!`](crate::define_percpu) are
+//! linked into the `.percpu` section, which serves as a template. At boot,
+//! [`init`] copies the template once per CPU into 64-byte-aligned areas in
+//! `.bss`, so no two CPUs share a cache line, and points each CPU's
+//! TPIDR_EL1 at the distance from the template to its own area. A CPU finds
+//! its copy of a variable by adding TPIDR_EL1 to the variable's address.
+//!
+//! [`PerCpu`] itself is such a variable and stores CPU-local data such as
 //! the currently running task.
 
 use alloc::sync::Arc;
@@ -11,29 +17,147 @@ use super::cpu::{set_thread_pointer, thread_pointer};
 use crate::config::kernel::TINYENV_SMP;
 use crate::task::{SchedulableTask, TaskRef};
 
+/// Declares variables with one copy per CPU.
+///
+/// ```ignore
+/// define_percpu! {
+///     /// Times something happened on each CPU.
+///     static EVENTS: AtomicU64 = AtomicU64::new(0);
+/// }
+/// EVENTS.current().fetch_add(1, Ordering::Relaxed);
+/// ```
+///
+/// Each variable is a [`PerCpuVar`]. The initializer is the value every
+/// CPU starts with.
+#[macro_export]
+macro_rules! define_percpu {
+    ($($(#[$attr:meta])* $vis:vis static $name:ident: $ty:ty = $init:expr;)+) => {
+        $(
+            $(#[$attr])*
+            #[unsafe(link_section = ".percpu")]
+            $vis static $name: $crate::hal::percpu::PerCpuVar<$ty> =
+                $crate::hal::percpu::PerCpuVar::new($init);
+        )+
+    };
+}
+
+unsafe extern "C" {
+    fn _percpu_load_start();
+    fn _percpu_load_end();
+    fn _percpu_start();
+    fn _percpu_end();
+}
+
+/// Size of the template, and of each CPU's area. The linker script rounds
+/// it up to a cache line.
+#[inline]
+fn area_size() -> usize {
+    _percpu_load_end as *const () as usize - _percpu_load_start as *const () as usize
+}
+
+/// Distance from a variable's template to its copy on `cpu_id`.
+#[inline]
+fn area_offset(cpu_id: usize) -> usize {
+    _percpu_start as *const () as usize + cpu_id * area_size()
+        - _percpu_load_start as *const () as usize
+}
+
+/// A variable with one copy per CPU, declared with
+/// [`define_percpu!`](crate::define_percpu).
+///
+/// The static itself is the template in `.percpu` and is never accessed
+/// directly.
+#[repr(transparent)]
+pub struct PerCpuVar<T>(T);
+
+// Safety: every CPU gets its own copy; sharing one across CPUs through
+// `remote` or `current` requires `T: Sync`.
+unsafe impl<T> Sync for PerCpuVar<T> {}
+
+impl<T> PerCpuVar<T> {
+    #[doc(hidden)]
+    pub const fn new(value: T) -> Self {
+        Self(value)
+    }
+
+    /// Returns a pointer to this CPU's copy.
+    ///
+    /// The pointer keeps pointing at the same CPU's copy if the task
+    /// migrates afterwards.
+    #[inline]
+    pub fn current_ptr(&'static self) -> *mut T {
+        debug_assert!(thread_pointer() != 0, "PerCpu not initialized");
+        (&raw const self.0 as usize).wrapping_add(thread_pointer()) as *mut T
+    }
+
+    /// Returns a pointer to the copy of `cpu_id`.
+    #[inline]
+    pub fn remote_ptr(&'static self, cpu_id: usize) -> *mut T {
+        assert!(cpu_id < TINYENV_SMP, "CPU ID {} out of range", cpu_id);
+        (&raw const self.0 as usize).wrapping_add(area_offset(cpu_id)) as *mut T
+    }
+
+    /// Returns this CPU's copy for modification.
+    ///
+    /// # Safety
+    ///
+    /// The caller must keep everything else on this CPU away from the
+    /// copy, usually by disabling IRQs, and nothing on other CPUs may
+    /// access it.
+    #[inline]
+    pub unsafe fn current_mut(&'static self) -> &'static mut T {
+        unsafe { &mut *self.current_ptr() }
+    }
+}
+
+impl<T: Sync> PerCpuVar<T> {
+    /// Returns this CPU's copy.
+    ///
+    /// A task that migrates keeps using the copy of the CPU it read this
+    /// on, which is harmless for counters and the like.
+    #[inline]
+    pub fn current(&'static self) -> &'static T {
+        unsafe { &*self.current_ptr() }
+    }
+
+    /// Returns the copy of `cpu_id`.
+    #[inline]
+    pub fn remote(&'static self, cpu_id: usize) -> &'static T {
+        unsafe { &*self.remote_ptr(cpu_id) }
+    }
+}
+
 /// Per-CPU data structure.
 ///
-/// This structure is stored in each CPU's TPIDR_EL1 register and contains
-/// CPU-local data that can be accessed without locking.
+/// Each CPU has its own copy, found through TPIDR_EL1, containing CPU-local
+/// data that can be accessed without locking.
 #[repr(C)]
 pub struct PerCpu {
     /// Pointer to the currently running task.
     current_task: *const SchedulableTask,
+    /// Task being switched away from, until the switch completes. Owns the
+    /// reference that `current_task` held.
+    prev_task: *const SchedulableTask,
+    /// Set by the timer tick when the current task should give up the CPU.
+    need_resched: bool,
+    /// Time (in nanoseconds) at which the current task's slice runs out.
+    slice_end_ns: u64,
     /// The CPU ID.
     cpu_id: usize,
+    /// Address the IRQ being handled interrupted.
+    irq_pc: usize,
 }
 
-// Safety: PerCpu is only accessed by the CPU it belongs to.
-unsafe impl Send for PerCpu {}
-unsafe impl Sync for PerCpu {}
-
-/// Static storage for per-CPU areas (one for each CPU).
-static mut PERCPU_AREAS: [PerCpu; TINYENV_SMP] = [const {
-    PerCpu {
+define_percpu! {
+    static PERCPU: PerCpu = PerCpu {
         current_task: core::ptr::null(),
+        prev_task: core::ptr::null(),
+        need_resched: false,
+        slice_end_ns: u64::MAX,
         cpu_id: 0,
-    }
-}; TINYENV_SMP];
+        irq_pc: 0,
+    };
+}
 
 impl PerCpu {
     /// Returns the current task pointer.
@@ -57,20 +181,33 @@ impl PerCpu {
 /// Initializes the per-CPU data for the current CPU.
 ///
 /// This function must be called early in the boot process, before any
-/// task-related operations.
+/// task-related operations. CPU 0 calls it first and copies the template to
+/// every CPU's area, before the other CPUs are started.
 ///
 /// # Safety
 ///
 /// This function must only be called once per CPU during initialization.
 pub fn init(cpu_id: usize) {
     assert!(cpu_id < TINYENV_SMP, "CPU ID {} out of range", cpu_id);
+    if cpu_id == 0 {
+        let reserved = _percpu_end as *const () as usize - _percpu_start as *const () as usize;
+        assert!(
+            TINYENV_SMP * area_size() <= reserved,
+            "Per-CPU areas do not fit in the linker script's reservation"
+        );
+        for cpu in 0..TINYENV_SMP {
+            unsafe {
+                core::ptr::copy_nonoverlapping(
+                    _percpu_load_start as *const () as *const u8,
+                    (_percpu_start as *const () as usize + cpu * area_size()) as *mut u8,
+                    area_size(),
+                );
+            }
+        }
+    }
     unsafe {
-        let percpu = &raw mut PERCPU_AREAS[cpu_id];
-        (*percpu).cpu_id = cpu_id;
-        (*percpu).current_task = core::ptr::null();
-
-        // Set TPIDR_EL1 to point to the PerCpu structure
-        set_thread_pointer(percpu as usize);
+        set_thread_pointer(area_offset(cpu_id));
+        current_cpu_mut().cpu_id = cpu_id;
     }
 }
 
@@ -81,9 +218,8 @@ pub fn init(cpu_id: usize) {
 /// Panics if called before `init()` has been called.
 #[inline]
 pub fn current_cpu() -> &'static PerCpu {
-    let ptr = thread_pointer() as *const PerCpu;
-    assert!(!ptr.is_null(), "PerCpu not initialized");
-    unsafe { &*ptr }
+    assert!(thread_pointer() != 0, "PerCpu not initialized");
+    unsafe { &*PERCPU.current_ptr() }
 }
 
 /// Returns a mutable reference to the current CPU's PerCpu structure.
@@ -93,9 +229,8 @@ pub fn current_cpu() -> &'static PerCpu {
 /// The caller must ensure exclusive access to the PerCpu structure.
 #[inline]
 unsafe fn current_cpu_mut() -> &'static mut PerCpu {
-    let ptr = thread_pointer() as *mut PerCpu;
-    assert!(!ptr.is_null(), "PerCpu not initialized");
-    unsafe { &mut *ptr }
+    assert!(thread_pointer() != 0, "PerCpu not initialized");
+    unsafe { PERCPU.current_mut() }
 }
 
 /// Returns the current task's raw pointer.
@@ -154,8 +289,84 @@ pub fn set_current_task(task: &TaskRef) {
     }
 }
 
+/// Makes `next` the current task during a context switch.
+///
+/// Takes a reference to `next` and parks the reference to the old current
+/// task in the prev slot, for [`take_prev_task_ptr`] to release once the
+/// switch is done.
+#[inline]
+pub fn switch_current_task(next: &TaskRef) {
+    let next = Arc::into_raw(next.clone());
+    unsafe {
+        let cpu = current_cpu_mut();
+        cpu.prev_task = core::mem::replace(&mut cpu.current_task, next);
+    }
+}
+
+/// Takes the task recorded by [`switch_current_task`], leaving null behind.
+///
+/// The caller owns the returned reference.
+#[inline]
+pub fn take_prev_task_ptr() -> *const SchedulableTask {
+    unsafe { core::mem::replace(&mut current_cpu_mut().prev_task, core::ptr::null()) }
+}
+
+/// Starts a new time slice on this CPU that ends at `end_ns`.
+#[inline]
+pub fn start_time_slice(end_ns: u64) {
+    unsafe {
+        let cpu = current_cpu_mut();
+        cpu.slice_end_ns = end_ns;
+        cpu.need_resched = false;
+    }
+}
+
+/// Flags the current task for preemption once its slice has run out.
+///
+/// Must be called with IRQs disabled.
+#[inline]
+pub fn check_time_slice(now_ns: u64) {
+    unsafe {
+        let cpu = current_cpu_mut();
+        if now_ns >= cpu.slice_end_ns {
+            cpu.need_resched = true;
+        }
+    }
+}
+
+/// Returns when the current time slice of this CPU runs out.
+#[inline]
+pub fn slice_end_ns() -> u64 {
+    current_cpu().slice_end_ns
+}
+
+/// Returns and clears the need-resched flag of this CPU.
+#[inline]
+pub fn take_need_resched() -> bool {
+    unsafe { core::mem::replace(&mut current_cpu_mut().need_resched, false) }
+}
+
+/// Records the address the current IRQ interrupted.
+#[inline]
+pub fn set_irq_pc(pc: usize) {
+    unsafe { current_cpu_mut().irq_pc = pc };
+}
+
+/// Returns the address the IRQ being handled on this CPU interrupted.
+#[inline]
+pub fn irq_pc() -> usize {
+    current_cpu().irq_pc
+}
+
 /// Returns the current CPU ID.
 #[inline]
 pub fn cpu_id() -> usize {
     current_cpu().cpu_id
 }
+
+/// Returns the current CPU ID, or `None` if [`init`] has not run on this
+/// CPU yet.
+#[inline]
+pub fn try_cpu_id() -> Option<usize> {
+    (thread_pointer() != 0).then(|| current_cpu().cpu_id)
+}
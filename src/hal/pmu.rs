@@ -0,0 +1,121 @@
+//! AArch64 PMUv3 performance monitors of the current CPU.
+//!
+//! Thin wrappers around the PMU system registers. Event counters are
+//! selected through `PMSELR_EL0`, so callers must keep IRQs masked while
+//! programming one, or an IRQ handler touching the PMU could change the
+//! selection in between.
+
+use core::arch::asm;
+
+/// Common architectural event numbers.
+pub const EVENT_L1D_CACHE_REFILL: u16 = 0x03;
+pub const EVENT_INST_RETIRED: u16 = 0x08;
+pub const EVENT_BR_MIS_PRED: u16 = 0x10;
+pub const EVENT_CPU_CYCLES: u16 = 0x11;
+pub const EVENT_L2D_CACHE_REFILL: u16 = 0x17;
+
+/// Bit of the cycle counter in the enable, interrupt and overflow masks.
+pub const CYCLE_COUNTER: u32 = 1 << 31;
+
+const PMCR_E: u64 = 1 << 0;
+const PMCR_P: u64 = 1 << 1;
+const PMCR_C: u64 = 1 << 2;
+/// Cycle counter overflows at 64 bits rather than 32.
+const PMCR_LC: u64 = 1 << 6;
+
+macro_rules! read_reg {
+    ($reg:literal) => {{
+        let value: u64;
+        unsafe { asm!(concat!("mrs {}, ", $reg), out(reg) value) };
+        value
+    }};
+}
+
+macro_rules! write_reg {
+    ($reg:literal, $value:expr) => {{
+        let value: u64 = $value;
+        unsafe { asm!(concat!("msr ", $reg, ", {}"), in(reg) value) };
+    }};
+}
+
+/// Returns `true` if the CPU implements PMUv3.
+pub fn is_present() -> bool {
+    // ID_AA64DFR0_EL1.PMUVer: 0 is no PMU, 0xf an IMPLEMENTATION DEFINED one.
+    let version = (read_reg!("id_aa64dfr0_el1") >> 8) & 0xf;
+    version != 0 && version != 0xf
+}
+
+/// Returns the number of event counters, not counting the cycle counter.
+pub fn num_counters() -> usize {
+    ((read_reg!("pmcr_el0") >> 11) & 0x1f) as usize
+}
+
+/// Zeroes every counter and turns the PMU on. Counters still have to be
+/// enabled one by one with [`enable_counters`].
+pub fn reset() {
+    write_reg!("pmcr_el0", PMCR_E | PMCR_P | PMCR_C | PMCR_LC);
+    // Count cycles at EL0 and EL1.
+    write_reg!("pmccfiltr_el0", 0);
+    unsafe { asm!("isb") };
+}
+
+/// Turns the whole PMU off.
+pub fn stop() {
+    write_reg!("pmcr_el0", read_reg!("pmcr_el0") & !PMCR_E);
+    unsafe { asm!("isb") };
+}
+
+/// Makes event counter `index` count `event`, at EL0 and EL1.
+pub fn set_event(index: usize, event: u16) {
+    write_reg!("pmselr_el0", index as u64);
+    unsafe { asm!("isb") };
+    write_reg!("pmxevtyper_el0", event as u64);
+}
+
+/// Reads event counter `index`.
+pub fn read_counter(index: usize) -> u64 {
+    write_reg!("pmselr_el0", index as u64);
+    unsafe { asm!("isb") };
+    read_reg!("pmxevcntr_el0")
+}
+
+/// Sets event counter `index`; it is 32 bits wide.
+pub fn write_counter(index: usize, value: u32) {
+    write_reg!("pmselr_el0", index as u64);
+    unsafe { asm!("isb") };
+    write_reg!("pmxevcntr_el0", value as u64);
+}
+
+/// Reads the cycle counter.
+#[inline]
+pub fn cycles() -> u64 {
+    read_reg!("pmccntr_el0")
+}
+
+/// Starts the counters in `mask` (bit `n` for event counter `n`, and
+/// [`CYCLE_COUNTER`]).
+pub fn enable_counters(mask: u32) {
+    write_reg!("pmcntenset_el0", mask as u64);
+}
+
+/// Stops the counters in `mask`.
+pub fn disable_counters(mask: u32) {
+    write_reg!("pmcntenclr_el0", mask as u64);
+}
+
+/// Raises the PMU interrupt when a counter in `mask` overflows.
+pub fn enable_overflow_irq(mask: u32) {
+    write_reg!("pmintenset_el1", mask as u64);
+}
+
+/// Stops raising the PMU interrupt for the counters in `mask`.
+pub fn disable_overflow_irq(mask: u32) {
+    write_reg!("pmintenclr_el1", mask as u64);
+}
+
+/// Returns and clears the set of counters that overflowed.
+pub fn take_overflow() -> u32 {
+    let overflowed = read_reg!("pmovsclr_el0");
+    write_reg!("pmovsclr_el0", overflowed);
+    overflowed as u32
+}
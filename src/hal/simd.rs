@@ -0,0 +1,136 @@
+//! NEON bulk memory routines: copy, fill and compare.
+//!
+//! The loops move 64 bytes per iteration through `q0`-`q7` and leave the
+//! tail to the scalar code. In the soft-float kernel the first call of a
+//! time slice traps once to load the task's FP registers (see
+//! [`fp`](super::fp)), so short buffers, and callers with IRQs masked that
+//! might be IRQ handlers, stay scalar.
+
+use core::arch::naked_asm;
+use core::cmp::Ordering;
+
+use super::cpu::irqs_disabled;
+use super::fp::HARD_FLOAT;
+
+/// Bytes moved per loop iteration.
+const BLOCK: usize = 64;
+
+/// Shortest buffer worth the NEON loop.
+const SIMD_THRESHOLD: usize = 256;
+
+/// Returns `true` if a buffer of `len` bytes should take the NEON loop.
+#[inline]
+fn use_simd(len: usize) -> bool {
+    // Soft-float IRQ handlers must not touch the interrupted task's FP
+    // registers, and IRQ handlers are the ones running with IRQs masked.
+    len >= SIMD_THRESHOLD && (HARD_FLOAT || !irqs_disabled())
+}
+
+/// Copies `src` into `dst`, which must have the same length.
+pub fn copy(dst: &mut [u8], src: &[u8]) {
+    assert_eq!(
+        dst.len(),
+        src.len(),
+        "copy between slices of unequal length"
+    );
+    let blocks = if use_simd(dst.len()) {
+        dst.len() / BLOCK
+    } else {
+        0
+    };
+    if blocks > 0 {
+        unsafe { neon_copy_blocks(dst.as_mut_ptr(), src.as_ptr(), blocks) };
+    }
+    let done = blocks * BLOCK;
+    dst[done..].copy_from_slice(&src[done..]);
+}
+
+/// Sets every byte of `dst` to `value`.
+pub fn fill(dst: &mut [u8], value: u8) {
+    let blocks = if use_simd(dst.len()) {
+        dst.len() / BLOCK
+    } else {
+        0
+    };
+    if blocks > 0 {
+        unsafe { neon_fill_blocks(dst.as_mut_ptr(), value, blocks) };
+    }
+    dst[blocks * BLOCK..].fill(value);
+}
+
+/// Compares `a` and `b` lexicographically, like `memcmp` followed by a
+/// length comparison.
+pub fn compare(a: &[u8], b: &[u8]) -> Ordering {
+    let len = a.len().min(b.len());
+    let blocks = if use_simd(len) { len / BLOCK } else { 0 };
+    // Skip the blocks that are equal; the first differing one, if any, is
+    // compared byte by byte below.
+    let equal = if blocks > 0 {
+        unsafe { neon_equal_blocks(a.as_ptr(), b.as_ptr(), blocks) }
+    } else {
+        0
+    };
+    let done = equal * BLOCK;
+    a[done..].cmp(&b[done..])
+}
+
+#[unsafe(naked)]
+unsafe extern "C" fn neon_copy_blocks(_dst: *mut u8, _src: *const u8, _blocks: usize) {
+    naked_asm!(
+        ".arch armv8
+    1:
+        ldp     q0, q1, [x1], #32
+        ldp     q2, q3, [x1], #32
+        stp     q0, q1, [x0], #32
+        stp     q2, q3, [x0], #32
+        subs    x2, x2, #1
+        b.ne    1b
+        ret"
+    )
+}
+
+#[unsafe(naked)]
+unsafe extern "C" fn neon_fill_blocks(_dst: *mut u8, _value: u8, _blocks: usize) {
+    naked_asm!(
+        ".arch armv8
+        dup     v0.16b, w1
+        mov     v1.16b, v0.16b
+    1:
+        stp     q0, q1, [x0], #32
+        stp     q0, q1, [x0], #32
+        subs    x2, x2, #1
+        b.ne    1b
+        ret"
+    )
+}
+
+/// Returns how many leading blocks of `a` and `b` are equal.
+#[unsafe(naked)]
+unsafe extern "C" fn neon_equal_blocks(_a: *const u8, _b: *const u8, _blocks: usize) -> usize {
+    naked_asm!(
+        ".arch armv8
+        mov     x3, #0
+    1:
+        ldp     q0, q1, [x0], #32
+        ldp     q2, q3, [x0], #32
+        ldp     q4, q5, [x1], #32
+        ldp     q6, q7, [x1], #32
+        cmeq    v0.16b, v0.16b, v4.16b
+        cmeq    v1.16b, v1.16b, v5.16b
+        cmeq    v2.16b, v2.16b, v6.16b
+        cmeq    v3.16b, v3.16b, v7.16b
+        and     v0.16b, v0.16b, v1.16b
+        and     v2.16b, v2.16b, v3.16b
+        and     v0.16b, v0.16b, v2.16b
+        // All ones only if all 64 byte pairs matched.
+        uminv   b0, v0.16b
+        umov    w4, v0.b[0]
+        cbz     w4, 2f
+        add     x3, x3, #1
+        cmp     x3, x2
+        b.ne    1b
+    2:
+        mov     x0, x3
+        ret"
+    )
+}
@@ -1,5 +1,18 @@
+//! IRQ-safe spinlocks.
+//!
+//! [`Mutex`] is backed by [`TicketNoIrq`], a ticket lock that hands the lock
+//! to waiters in arrival order and lets them sleep in `wfe` instead of
+//! hammering the lock word. [`SpinNoIrq`] is the plain test-and-set lock it
+//! replaced, still used where fairness does not matter.
+//!
+//! Built with the `lock_stats` feature, every ticket lock also counts its
+//! acquisitions, contended acquisitions, `wfe` wakeups and longest hold
+//! time. Locks given a name with [`TicketNoIrq::named`] or [`register_lock`]
+//! show up in [`lock_stats`].
+
+use core::arch::asm;
 use core::cell::UnsafeCell;
-use core::sync::atomic::{AtomicBool, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicU16, Ordering};
 
 use crate::hal::cpu::{disable_irqs, enable_irqs, irqs_disabled};
 use lock_api::RawMutex;
@@ -61,4 +74,349 @@ unsafe impl RawMutex for SpinNoIrq {
     }
 }
 
-pub type Mutex<T> = lock_api::Mutex<SpinNoIrq, T>;
+/// Waits in `wfe` until `owner` reads `ticket`.
+///
+/// The exclusive load arms this CPU's monitor on the lock word, so the
+/// releasing store of the previous holder wakes `wfe` without a `sev`. A
+/// store that lands between the load and `wfe` leaves the event pending,
+/// and `wfe` returns at once. Returns the number of wakeups.
+#[inline]
+fn wait_for_ticket(owner: &AtomicU16, ticket: u16) -> u64 {
+    let mut wakeups = 0;
+    loop {
+        let serving: u32;
+        unsafe {
+            asm!(
+                "ldaxrh {serving:w}, [{owner}]",
+                serving = out(reg) serving,
+                owner = in(reg) owner.as_ptr(),
+                options(nostack, readonly)
+            );
+        }
+        if serving as u16 == ticket {
+            return wakeups;
+        }
+        unsafe { asm!("wfe", options(nomem, nostack)) };
+        wakeups += 1;
+    }
+}
+
+/// A fair spinlock that also masks IRQs while held.
+///
+/// `next` hands out tickets and `owner` is the ticket being served, so the
+/// lock goes to waiters in the order they arrived and no CPU starves.
+pub struct TicketNoIrq {
+    next: AtomicU16,
+    owner: AtomicU16,
+    saved_irq: UnsafeCell<bool>,
+    #[cfg(feature = "lock_stats")]
+    stats: stats::Counters,
+}
+
+unsafe impl Sync for TicketNoIrq {}
+unsafe impl Send for TicketNoIrq {}
+
+impl TicketNoIrq {
+    /// Creates an unlocked lock listed in [`lock_stats`] under `name`.
+    ///
+    /// # Safety
+    ///
+    /// The lock is listed by address the first time it is taken, so it
+    /// must never move or be freed after that, as is the case for locks in
+    /// statics.
+    pub const unsafe fn named(name: &'static str) -> Self {
+        #[cfg(not(feature = "lock_stats"))]
+        let _ = name;
+        Self {
+            next: AtomicU16::new(0),
+            owner: AtomicU16::new(0),
+            saved_irq: UnsafeCell::new(false),
+            #[cfg(feature = "lock_stats")]
+            stats: stats::Counters::new(Some(name)),
+        }
+    }
+}
+
+unsafe impl RawMutex for TicketNoIrq {
+    type GuardMarker = lock_api::GuardSend;
+    const INIT: Self = Self {
+        next: AtomicU16::new(0),
+        owner: AtomicU16::new(0),
+        saved_irq: UnsafeCell::new(false),
+        #[cfg(feature = "lock_stats")]
+        stats: stats::Counters::new(None),
+    };
+
+    fn lock(&self) {
+        let irq_enabled_before = !irqs_disabled();
+        disable_irqs();
+        let ticket = self.next.fetch_add(1, Ordering::Relaxed);
+        let contended = self.owner.load(Ordering::Acquire) != ticket;
+        let _wakeups = if contended {
+            wait_for_ticket(&self.owner, ticket)
+        } else {
+            0
+        };
+        unsafe { *self.saved_irq.get() = irq_enabled_before };
+        #[cfg(feature = "lock_stats")]
+        self.stats.acquired(self, contended, _wakeups);
+    }
+
+    fn try_lock(&self) -> bool {
+        let irq_enabled_before = !irqs_disabled();
+        disable_irqs();
+        // Only free if nobody holds or waits for it, i.e. the next ticket
+        // is the one being served.
+        let owner = self.owner.load(Ordering::Acquire);
+        if self
+            .next
+            .compare_exchange(
+                owner,
+                owner.wrapping_add(1),
+                Ordering::Acquire,
+                Ordering::Relaxed,
+            )
+            .is_ok()
+        {
+            unsafe { *self.saved_irq.get() = irq_enabled_before };
+            #[cfg(feature = "lock_stats")]
+            self.stats.acquired(self, false, 0);
+            true
+        } else {
+            if irq_enabled_before {
+                enable_irqs();
+            }
+            false
+        }
+    }
+
+    unsafe fn unlock(&self) {
+        #[cfg(feature = "lock_stats")]
+        self.stats.released();
+        let irq_enabled_before = unsafe { *self.saved_irq.get() };
+        // Only the holder writes `owner`.
+        let owner = self.owner.load(Ordering::Relaxed);
+        self.owner.store(owner.wrapping_add(1), Ordering::Release);
+        if irq_enabled_before {
+            enable_irqs();
+        }
+    }
+
+    fn is_locked(&self) -> bool {
+        self.next.load(Ordering::Relaxed) != self.owner.load(Ordering::Relaxed)
+    }
+}
+
+pub type Mutex<T> = lock_api::Mutex<TicketNoIrq, T>;
+
+/// A [`Mutex`] on the unfair test-and-set lock.
+pub type SpinMutex<T> = lock_api::Mutex<SpinNoIrq, T>;
+
+/// Contention counters of one named lock.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct LockStats {
+    pub name: &'static str,
+    /// Address of the lock, telling locks of the same name apart.
+    pub addr: usize,
+    pub acquires: u64,
+    /// Acquisitions that found the lock taken.
+    pub contended: u64,
+    /// Times a waiter woke up from `wfe` while the lock was still taken.
+    pub spins: u64,
+    /// Longest time the lock was held, in nanoseconds.
+    pub max_hold_ns: u64,
+}
+
+/// Returns `true` if the kernel was built to count lock contention.
+pub const fn lock_stats_enabled() -> bool {
+    cfg!(feature = "lock_stats")
+}
+
+/// Lists `lock` in [`lock_stats`] under `name`, for ticket locks built
+/// with [`RawMutex::INIT`], e.g. inside other types.
+pub fn register_lock(name: &'static str, lock: &'static TicketNoIrq) {
+    #[cfg(feature = "lock_stats")]
+    stats::register(name, lock);
+    #[cfg(not(feature = "lock_stats"))]
+    let _ = (name, lock);
+}
+
+/// Returns the counters of every named lock, in the order they were
+/// first taken. Empty without the `lock_stats` feature.
+pub fn lock_stats() -> alloc::vec::Vec<LockStats> {
+    #[cfg(feature = "lock_stats")]
+    return stats::snapshot();
+    #[cfg(not(feature = "lock_stats"))]
+    alloc::vec::Vec::new()
+}
+
+/// Zeroes the counters of every named lock.
+pub fn reset_lock_stats() {
+    #[cfg(feature = "lock_stats")]
+    stats::reset();
+}
+
+#[cfg(feature = "lock_stats")]
+mod stats {
+    use core::sync::atomic::{AtomicPtr, AtomicU8, AtomicU64, AtomicUsize, Ordering};
+
+    use aarch64_cpu::registers::{CNTFRQ_EL0, CNTPCT_EL0, Readable};
+
+    use super::{LockStats, TicketNoIrq};
+
+    /// Named locks that can be listed at once.
+    const MAX_NAMED_LOCKS: usize = 64;
+
+    const UNREGISTERED: u8 = 0;
+    const REGISTERING: u8 = 1;
+    const REGISTERED: u8 = 2;
+
+    /// Counters kept inside each lock. Apart from `registered`, they are
+    /// only written by the lock holder, so plain loads and stores do.
+    pub(super) struct Counters {
+        name: Option<&'static str>,
+        registered: AtomicU8,
+        acquires: AtomicU64,
+        contended: AtomicU64,
+        spins: AtomicU64,
+        acquired_at: AtomicU64,
+        max_hold_ticks: AtomicU64,
+    }
+
+    #[inline]
+    fn add(counter: &AtomicU64, n: u64) {
+        counter.store(counter.load(Ordering::Relaxed) + n, Ordering::Relaxed);
+    }
+
+    impl Counters {
+        pub(super) const fn new(name: Option<&'static str>) -> Self {
+            Self {
+                name,
+                registered: AtomicU8::new(UNREGISTERED),
+                acquires: AtomicU64::new(0),
+                contended: AtomicU64::new(0),
+                spins: AtomicU64::new(0),
+                acquired_at: AtomicU64::new(0),
+                max_hold_ticks: AtomicU64::new(0),
+            }
+        }
+
+        #[inline]
+        pub(super) fn acquired(&self, lock: &TicketNoIrq, contended: bool, wakeups: u64) {
+            if let Some(name) = self.name
+                && self.registered.load(Ordering::Relaxed) == UNREGISTERED
+            {
+                // Safety: `TicketNoIrq::named` requires the lock to stay put.
+                register(name, unsafe { &*(lock as *const TicketNoIrq) });
+            }
+            add(&self.acquires, 1);
+            if contended {
+                add(&self.contended, 1);
+                add(&self.spins, wakeups.saturating_sub(1));
+            }
+            self.acquired_at.store(CNTPCT_EL0.get(), Ordering::Relaxed);
+        }
+
+        #[inline]
+        pub(super) fn released(&self) {
+            let held = CNTPCT_EL0.get() - self.acquired_at.load(Ordering::Relaxed);
+            if held > self.max_hold_ticks.load(Ordering::Relaxed) {
+                self.max_hold_ticks.store(held, Ordering::Relaxed);
+            }
+        }
+    }
+
+    struct Entry {
+        lock: AtomicPtr<TicketNoIrq>,
+        name: AtomicPtr<u8>,
+        name_len: AtomicUsize,
+    }
+
+    static NAMED_LOCKS: [Entry; MAX_NAMED_LOCKS] = [const {
+        Entry {
+            lock: AtomicPtr::new(core::ptr::null_mut()),
+            name: AtomicPtr::new(core::ptr::null_mut()),
+            name_len: AtomicUsize::new(0),
+        }
+    }; MAX_NAMED_LOCKS];
+    static NUM_NAMED: AtomicUsize = AtomicUsize::new(0);
+
+    /// Registration runs inside `lock`, so it takes no lock and does not
+    /// allocate. Locks beyond [`MAX_NAMED_LOCKS`] are not listed.
+    pub(super) fn register(name: &'static str, lock: &'static TicketNoIrq) {
+        if lock
+            .stats
+            .registered
+            .compare_exchange(
+                UNREGISTERED,
+                REGISTERING,
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            )
+            .is_err()
+        {
+            return;
+        }
+        let slot = NUM_NAMED.fetch_add(1, Ordering::Relaxed);
+        if let Some(entry) = NAMED_LOCKS.get(slot) {
+            entry
+                .name
+                .store(name.as_ptr().cast_mut(), Ordering::Relaxed);
+            entry.name_len.store(name.len(), Ordering::Relaxed);
+            entry
+                .lock
+                .store(lock as *const _ as *mut TicketNoIrq, Ordering::Release);
+        }
+        lock.stats.registered.store(REGISTERED, Ordering::Relaxed);
+    }
+
+    pub(super) fn snapshot() -> alloc::vec::Vec<LockStats> {
+        let freq = CNTFRQ_EL0.get().max(1) as u128;
+        NAMED_LOCKS
+            .iter()
+            .filter_map(|entry| {
+                let lock = entry.lock.load(Ordering::Acquire);
+                if lock.is_null() {
+                    return None;
+                }
+                // Safety: only `'static` locks and names are registered, and
+                // both are published before the lock pointer.
+                let (lock, name) = unsafe {
+                    let name = core::slice::from_raw_parts(
+                        entry.name.load(Ordering::Relaxed),
+                        entry.name_len.load(Ordering::Relaxed),
+                    );
+                    (&*lock, core::str::from_utf8_unchecked(name))
+                };
+                let counters = &lock.stats;
+                let max_hold_ticks = counters.max_hold_ticks.load(Ordering::Relaxed) as u128;
+                Some(LockStats {
+                    name,
+                    addr: lock as *const _ as usize,
+                    acquires: counters.acquires.load(Ordering::Relaxed),
+                    contended: counters.contended.load(Ordering::Relaxed),
+                    spins: counters.spins.load(Ordering::Relaxed),
+                    max_hold_ns: (max_hold_ticks * 1_000_000_000 / freq) as u64,
+                })
+            })
+            .collect()
+    }
+
+    pub(super) fn reset() {
+        for entry in &NAMED_LOCKS {
+            let lock = entry.lock.load(Ordering::Acquire);
+            if lock.is_null() {
+                continue;
+            }
+            let counters = unsafe { &(*lock).stats };
+            for counter in [
+                &counters.acquires,
+                &counters.contended,
+                &counters.spins,
+                &counters.max_hold_ticks,
+            ] {
+                counter.store(0, Ordering::Relaxed);
+            }
+        }
+    }
+}
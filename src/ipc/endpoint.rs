@@ -0,0 +1,150 @@
+//! IPC endpoints: rendezvous points between clients and servers.
+
+use intrusive_collections::LinkedList;
+
+use super::Message;
+use crate::TinyResult;
+use crate::hal::{Mutex, percpu};
+use crate::task::manager::NodeAdapter;
+use crate::task::task_ops::{task_block, task_handoff, task_unblock};
+use crate::task::task_ref::{TaskInner, TaskState};
+use crate::task::wait_queue::can_block;
+
+/// Tasks parked on an endpoint, through the same intrusive link the run
+/// queues use. At most one of the two lists is non-empty.
+struct Waiters {
+    /// Servers blocked in `recv`.
+    receivers: LinkedList<NodeAdapter<TaskInner>>,
+    /// Clients blocked in `call` until a server takes their message.
+    senders: LinkedList<NodeAdapter<TaskInner>>,
+}
+
+/// A synchronous IPC endpoint.
+pub struct Endpoint {
+    waiters: Mutex<Waiters>,
+}
+
+impl Endpoint {
+    /// Creates an endpoint with nobody waiting on it.
+    pub const fn new() -> Self {
+        Self {
+            waiters: Mutex::new(Waiters {
+                receivers: LinkedList::new(NodeAdapter::NEW),
+                senders: LinkedList::new(NodeAdapter::NEW),
+            }),
+        }
+    }
+
+    /// Sends `msg` to a server and blocks until it replies. Returns the
+    /// reply.
+    ///
+    /// If a server is waiting, the message goes straight to it and so does
+    /// the CPU, for the rest of the caller's time slice.
+    pub fn call(&self, msg: Message) -> Message {
+        let curr_task = percpu::current_task();
+        assert!(can_block(), "IPC call from a context that cannot block");
+
+        let mut waiters = self.waiters.lock();
+        curr_task.set_state(TaskState::Blocked);
+        match waiters.receivers.pop_front() {
+            Some(server) => {
+                drop(waiters);
+                // Safety: the server is blocked and we just took it off
+                // the endpoint.
+                unsafe {
+                    server.ipc().deliver(msg);
+                    *server.ipc().reply_to() = Some(curr_task.clone());
+                }
+                task_handoff(&curr_task, server);
+            }
+            None => {
+                // Safety: this is our own slot.
+                unsafe { curr_task.ipc().deliver(msg) };
+                waiters.senders.push_back(curr_task.clone());
+                drop(waiters);
+                task_block(&curr_task);
+            }
+        }
+        // Only a reply wakes us, and it left the reply in our slot.
+        unsafe { curr_task.ipc().message() }
+    }
+
+    /// Blocks until a client calls, and returns its message. The caller
+    /// owes that client a reply.
+    pub fn recv(&self) -> Message {
+        let curr_task = percpu::current_task();
+        assert!(can_block(), "IPC recv from a context that cannot block");
+        // Safety: this is our own slot.
+        assert!(
+            unsafe { curr_task.ipc().reply_to().is_none() },
+            "IPC recv with a reply outstanding"
+        );
+
+        let mut waiters = self.waiters.lock();
+        if let Some(client) = waiters.senders.pop_front() {
+            drop(waiters);
+            // Safety: the client is blocked and we just took it off the
+            // endpoint; it stays blocked until we reply.
+            let msg = unsafe { client.ipc().message() };
+            unsafe { *curr_task.ipc().reply_to() = Some(client) };
+            return msg;
+        }
+        curr_task.set_state(TaskState::Blocked);
+        waiters.receivers.push_back(curr_task.clone());
+        drop(waiters);
+        task_block(&curr_task);
+        // The caller that woke us left its message and itself in our slot.
+        unsafe { curr_task.ipc().message() }
+    }
+
+    /// Sends `msg` as the reply to the client last received from, and
+    /// keeps running.
+    pub fn reply(&self, msg: Message) -> TinyResult<()> {
+        let client = take_client()?;
+        // Safety: the client is blocked until this reply, and off every
+        // queue.
+        unsafe { client.ipc().deliver(msg) };
+        task_unblock(client);
+        Ok(())
+    }
+
+    /// Replies with `msg` and waits for the next call, the usual loop of a
+    /// server.
+    ///
+    /// With no other call pending, the CPU goes straight back to the
+    /// client.
+    pub fn reply_recv(&self, msg: Message) -> TinyResult<Message> {
+        let curr_task = percpu::current_task();
+        let client = take_client()?;
+        // Safety: as in `reply`.
+        unsafe { client.ipc().deliver(msg) };
+
+        let mut waiters = self.waiters.lock();
+        if let Some(next) = waiters.senders.pop_front() {
+            drop(waiters);
+            task_unblock(client);
+            let msg = unsafe { next.ipc().message() };
+            unsafe { *curr_task.ipc().reply_to() = Some(next) };
+            return Ok(msg);
+        }
+        curr_task.set_state(TaskState::Blocked);
+        waiters.receivers.push_back(curr_task.clone());
+        drop(waiters);
+        task_handoff(&curr_task, client);
+        Ok(unsafe { curr_task.ipc().message() })
+    }
+}
+
+impl Default for Endpoint {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Takes the client the current task owes a reply.
+fn take_client() -> TinyResult<crate::task::TaskRef> {
+    let curr_task = percpu::current_task();
+    // Safety: this is our own slot.
+    unsafe { curr_task.ipc().reply_to().take() }
+        .ok_or_else(|| anyhow::anyhow!("IPC reply without a caller"))
+}
@@ -0,0 +1,103 @@
+//! Register-sized IPC messages.
+//!
+//! A message fits in `x0`-`x7`: the header in `x0` and up to
+//! [`MSG_WORDS`] message registers in `x1`-`x7`. That is what the syscall
+//! layer will copy out of and back into the [`TrapFrame`], so a message
+//! never goes through a kernel buffer. Bulk data goes through shared pages.
+
+use crate::hal::context::TrapFrame;
+
+/// Message registers besides the header.
+pub const MSG_WORDS: usize = 7;
+
+/// First word of a message.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct MessageHeader {
+    /// Operation or reply code, chosen by the protocol.
+    pub label: u32,
+    pub flags: u16,
+    /// Message registers in use.
+    pub words: u16,
+}
+
+impl MessageHeader {
+    /// Packs the header into one register: label in the low 32 bits, then
+    /// flags, then the word count.
+    pub const fn to_bits(self) -> u64 {
+        self.label as u64 | (self.flags as u64) << 32 | (self.words as u64) << 48
+    }
+
+    /// Unpacks a header packed by [`to_bits`](Self::to_bits). A word count
+    /// beyond [`MSG_WORDS`] is clamped.
+    pub const fn from_bits(bits: u64) -> Self {
+        let words = (bits >> 48) as u16;
+        Self {
+            label: bits as u32,
+            flags: (bits >> 32) as u16,
+            words: if words as usize > MSG_WORDS {
+                MSG_WORDS as u16
+            } else {
+                words
+            },
+        }
+    }
+}
+
+/// A short IPC message.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct Message {
+    pub header: MessageHeader,
+    /// Message registers; only the first `header.words` are meaningful.
+    pub mr: [u64; MSG_WORDS],
+}
+
+impl Message {
+    /// Builds a message with `label` carrying `words`.
+    ///
+    /// # Panics
+    ///
+    /// Panics if there are more than [`MSG_WORDS`] words.
+    pub fn new(label: u32, words: &[u64]) -> Self {
+        assert!(
+            words.len() <= MSG_WORDS,
+            "IPC message of {} words",
+            words.len()
+        );
+        let mut mr = [0; MSG_WORDS];
+        mr[..words.len()].copy_from_slice(words);
+        Self {
+            header: MessageHeader {
+                label,
+                flags: 0,
+                words: words.len() as u16,
+            },
+            mr,
+        }
+    }
+
+    /// Returns the label of the message.
+    #[inline]
+    pub fn label(&self) -> u32 {
+        self.header.label
+    }
+
+    /// Returns the message registers in use.
+    #[inline]
+    pub fn words(&self) -> &[u64] {
+        &self.mr[..self.header.words as usize]
+    }
+
+    /// Reads a message from `x0`-`x7` of a trap frame.
+    pub fn from_regs(tf: &TrapFrame) -> Self {
+        let header = MessageHeader::from_bits(tf.x[0]);
+        let mut mr = [0; MSG_WORDS];
+        mr.copy_from_slice(&tf.x[1..=MSG_WORDS]);
+        Self { header, mr }
+    }
+
+    /// Writes the message to `x0`-`x7` of a trap frame.
+    pub fn to_regs(&self, tf: &mut TrapFrame) {
+        tf.x[0] = self.header.to_bits();
+        tf.x[1..=MSG_WORDS].copy_from_slice(&self.mr);
+    }
+}
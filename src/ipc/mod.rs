@@ -0,0 +1,78 @@
+//! Synchronous IPC, as planned in `MICROKERNEL_DESIGN.md`.
+//!
+//! A client [`call`](Endpoint::call)s an endpoint and blocks until a server
+//! that [`recv`](Endpoint::recv)ed on it replies. Messages are register
+//! sized ([`Message`]) and are copied straight into the per-task
+//! [`IpcSlot`] of the partner, so passing one allocates nothing. When the
+//! partner is already waiting, the CPU is handed to it directly instead of
+//! going through a run queue.
+
+pub mod endpoint;
+pub mod message;
+
+use core::cell::UnsafeCell;
+
+pub use endpoint::Endpoint;
+pub use message::{MSG_WORDS, Message, MessageHeader};
+
+use crate::task::TaskRef;
+
+/// IPC state embedded in every task.
+///
+/// The message is written by the partner while the task is blocked and
+/// off every queue, and read by the task once it runs again. The switch
+/// between the two orders the accesses.
+pub struct IpcSlot {
+    /// Message being delivered to the task.
+    msg: UnsafeCell<Message>,
+    /// Client waiting for this task's reply.
+    reply_to: UnsafeCell<Option<TaskRef>>,
+}
+
+impl IpcSlot {
+    pub const fn new() -> Self {
+        Self {
+            msg: UnsafeCell::new(Message {
+                header: MessageHeader {
+                    label: 0,
+                    flags: 0,
+                    words: 0,
+                },
+                mr: [0; MSG_WORDS],
+            }),
+            reply_to: UnsafeCell::new(None),
+        }
+    }
+
+    /// Delivers `msg` to the task.
+    ///
+    /// # Safety
+    ///
+    /// The task must be blocked, and the caller must have taken it off the
+    /// queue it was parked on, or be the task itself.
+    #[inline]
+    unsafe fn deliver(&self, msg: Message) {
+        unsafe { *self.msg.get() = msg };
+    }
+
+    /// Returns the message last delivered to the task, or the one it is
+    /// blocked sending.
+    ///
+    /// # Safety
+    ///
+    /// As for [`deliver`](Self::deliver).
+    #[inline]
+    unsafe fn message(&self) -> Message {
+        unsafe { *self.msg.get() }
+    }
+
+    /// Sets or takes the client the task owes a reply.
+    ///
+    /// # Safety
+    ///
+    /// As for [`deliver`](Self::deliver).
+    #[inline]
+    unsafe fn reply_to(&self) -> &mut Option<TaskRef> {
+        unsafe { &mut *self.reply_to.get() }
+    }
+}
@@ -19,8 +19,10 @@ mod device;
 mod drivers;
 mod fs;
 mod hal;
+mod ipc;
 mod mm;
 mod platform;
+mod profile;
 mod task;
 mod tests;
 mod user;
@@ -1,20 +1,339 @@
 //! Heap allocator implementation.
+//!
+//! Small allocations are served from per-CPU caches of free objects, one
+//! cache per power-of-two size class from 16 B to 1 KiB. A cache is only
+//! touched by its own CPU with IRQs disabled, so the fast path takes no lock.
+//! Caches refill from and flush to the talc heap in batches, which amortizes
+//! the heap lock. Large or over-aligned layouts go straight to talc.
+//!
+//! Talc starts on a small static arena in `.bss` and grows by claiming
+//! frames from the physical frame allocator when it runs out.
 
 use core::alloc::{GlobalAlloc, Layout};
+use core::cell::UnsafeCell;
+use core::ptr::{self, NonNull};
+use core::sync::atomic::{AtomicU64, Ordering};
 
 use talc::*;
 
-use crate::{config::kernel::HEAP_ALLOCATOR_SIZE, hal::SpinNoIrq};
+use super::{frame, phys_to_virt};
+use crate::{
+    config::kernel::{HEAP_ALLOCATOR_SIZE, HEAP_GROW_SIZE, TINYENV_SMP},
+    hal::{
+        TicketNoIrq,
+        cpu::{local_irq_restore, local_irq_save},
+        percpu,
+    },
+    profile::{TraceKind, trace},
+};
 
 static mut ARENA: [u8; HEAP_ALLOCATOR_SIZE] = [0; HEAP_ALLOCATOR_SIZE];
 
+/// Grows the heap when talc runs out of memory.
+///
+/// The boot arena is claimed on the first allocation. After that, every
+/// OOM claims a fresh span of at least `HEAP_GROW_SIZE` from the frame
+/// allocator, which never allocates itself, so taking the frame lock with
+/// the talc lock held is safe.
+pub struct GrowOnOom {
+    boot_arena: Span,
+}
+
+impl GrowOnOom {
+    const fn new(boot_arena: Span) -> Self {
+        Self { boot_arena }
+    }
+}
+
+impl OomHandler for GrowOnOom {
+    fn handle_oom(talc: &mut Talc<Self>, layout: Layout) -> Result<(), ()> {
+        if !talc.oom_handler.boot_arena.is_empty() {
+            let arena = core::mem::replace(&mut talc.oom_handler.boot_arena, Span::empty());
+            return unsafe { talc.claim(arena) }.map(|_| ());
+        }
+
+        // Leave room for alignment and talc's own metadata.
+        let size = (layout.size() + layout.align() + frame::FRAME_SIZE)
+            .max(HEAP_GROW_SIZE)
+            .next_multiple_of(frame::FRAME_SIZE);
+        let paddr = frame::alloc_frames(size / frame::FRAME_SIZE, 1).ok_or(())?;
+        let base = phys_to_virt(paddr).as_mut_ptr();
+        unsafe { talc.claim(Span::from_base_size(base, size)) }.map(|_| ())
+    }
+}
+
+/// Smallest size class is `1 << MIN_CLASS_SHIFT` bytes.
+const MIN_CLASS_SHIFT: u32 = 4;
+/// Number of size classes: 16 B, 32 B, ..., 1 KiB.
+///
+/// 1 KiB covers `Arc<FifoTask<TaskInner>>`, whose saved FP context alone is
+/// 512 B.
+pub const SIZE_CLASSES: usize = 7;
+/// Largest object served by the per-CPU caches.
+const MAX_CLASS_SIZE: usize = 1 << (MIN_CLASS_SHIFT as usize + SIZE_CLASSES - 1);
+/// Free objects a CPU keeps per class before flushing back to talc.
+const CACHE_CAPACITY: usize = 64;
+/// Objects moved between a cache and talc per lock acquisition.
+const BATCH_SIZE: usize = CACHE_CAPACITY / 4;
+
+/// Returns the size class of `layout`, or `None` if talc should serve it.
+#[inline]
+fn size_class(layout: &Layout) -> Option<usize> {
+    let size = layout.size().max(layout.align());
+    if size > MAX_CLASS_SIZE {
+        return None;
+    }
+    let shift = size
+        .max(1 << MIN_CLASS_SHIFT)
+        .next_power_of_two()
+        .trailing_zeros();
+    Some((shift - MIN_CLASS_SHIFT) as usize)
+}
+
+/// Layout every object of `class` is allocated from talc with.
+#[inline]
+fn class_layout(class: usize) -> Layout {
+    let size = 1 << (MIN_CLASS_SHIFT as usize + class);
+    unsafe { Layout::from_size_align_unchecked(size, size) }
+}
+
+/// A free object, linked through its first word.
+struct FreeObject {
+    next: *mut FreeObject,
+}
+
+/// Free objects of one size class on one CPU.
+struct ClassCache {
+    head: *mut FreeObject,
+    len: usize,
+}
+
+impl ClassCache {
+    const fn new() -> Self {
+        Self {
+            head: ptr::null_mut(),
+            len: 0,
+        }
+    }
+
+    unsafe fn push(&mut self, obj: *mut u8) {
+        let obj = obj as *mut FreeObject;
+        unsafe { (*obj).next = self.head };
+        self.head = obj;
+        self.len += 1;
+    }
+
+    unsafe fn pop(&mut self) -> Option<*mut u8> {
+        if self.head.is_null() {
+            return None;
+        }
+        let obj = self.head;
+        self.head = unsafe { (*obj).next };
+        self.len -= 1;
+        Some(obj as *mut u8)
+    }
+}
+
+/// Hit/miss counters of one size class on one CPU.
+///
+/// Only the owning CPU writes them, so plain loads and stores suffice.
+struct ClassStats {
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+impl ClassStats {
+    const fn new() -> Self {
+        Self {
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        }
+    }
+}
+
+#[inline]
+fn bump(counter: &AtomicU64) {
+    counter.store(counter.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+}
+
+/// One CPU's caches and counters. It lives in that CPU's per-CPU area, so
+/// the counters bumped on every allocation share no cache line with
+/// another CPU's.
+struct CpuCache {
+    classes: UnsafeCell<[ClassCache; SIZE_CLASSES]>,
+    stats: [ClassStats; SIZE_CLASSES],
+}
+
+// Safety: `classes` is only touched by its own CPU with IRQs disabled;
+// other CPUs only read `stats`.
+unsafe impl Sync for CpuCache {}
+
+impl CpuCache {
+    const fn new() -> Self {
+        Self {
+            classes: UnsafeCell::new([const { ClassCache::new() }; SIZE_CLASSES]),
+            stats: [const { ClassStats::new() }; SIZE_CLASSES],
+        }
+    }
+}
+
+crate::define_percpu! {
+    /// This CPU's slab caches.
+    static CPU_CACHE: CpuCache = CpuCache::new();
+}
+
+/// The kernel's global allocator: per-CPU caches in front of talc.
+pub struct SlabAllocator {
+    talc: Talck<TicketNoIrq, GrowOnOom>,
+}
+
+impl SlabAllocator {
+    const fn new(talc: Talck<TicketNoIrq, GrowOnOom>) -> Self {
+        Self { talc }
+    }
+
+    /// Runs `f` on this CPU's cache with IRQs disabled.
+    ///
+    /// Returns `None` before per-CPU data is set up, when there is no way
+    /// to tell which cache is ours.
+    #[inline]
+    fn with_local_cache<R>(&self, f: impl FnOnce(&CpuCache, &mut [ClassCache]) -> R) -> Option<R> {
+        let irq_enabled = local_irq_save();
+        let result = percpu::try_cpu_id().map(|_| {
+            let cache = CPU_CACHE.current();
+            // Safety: IRQs are off, so nothing else on this CPU can get here.
+            f(cache, unsafe { &mut *cache.classes.get() })
+        });
+        local_irq_restore(irq_enabled);
+        result
+    }
+
+    /// Allocates a batch of `class` objects from talc into `cache`.
+    fn refill(&self, cache: &mut ClassCache, class: usize) {
+        let layout = class_layout(class);
+        let mut talc = self.talc.lock();
+        for _ in 0..BATCH_SIZE {
+            match unsafe { talc.malloc(layout) } {
+                Ok(obj) => unsafe { cache.push(obj.as_ptr()) },
+                Err(()) => break,
+            }
+        }
+    }
+
+    /// Returns a batch of `class` objects from `cache` to talc.
+    fn flush(&self, cache: &mut ClassCache, class: usize) {
+        let layout = class_layout(class);
+        let mut talc = self.talc.lock();
+        for _ in 0..BATCH_SIZE {
+            match unsafe { cache.pop() } {
+                Some(obj) => unsafe { talc.free(NonNull::new_unchecked(obj), layout) },
+                None => break,
+            }
+        }
+    }
+}
+
+unsafe impl GlobalAlloc for SlabAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        trace(
+            TraceKind::Alloc,
+            layout.size() as u64,
+            layout.align() as u64,
+        );
+        let Some(class) = size_class(&layout) else {
+            return unsafe { self.talc.alloc(layout) };
+        };
+        self.with_local_cache(|cache, classes| {
+            let local = &mut classes[class];
+            if let Some(obj) = unsafe { local.pop() } {
+                bump(&cache.stats[class].hits);
+                return obj;
+            }
+            bump(&cache.stats[class].misses);
+            self.refill(local, class);
+            unsafe { local.pop() }.unwrap_or(ptr::null_mut())
+        })
+        .unwrap_or_else(|| unsafe { self.talc.alloc(class_layout(class)) })
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        trace(TraceKind::Dealloc, ptr as u64, layout.size() as u64);
+        let Some(class) = size_class(&layout) else {
+            return unsafe { self.talc.dealloc(ptr, layout) };
+        };
+        let cached = self.with_local_cache(|_, classes| {
+            let local = &mut classes[class];
+            unsafe { local.push(ptr) };
+            if local.len > CACHE_CAPACITY {
+                self.flush(local, class);
+            }
+        });
+        if cached.is_none() {
+            unsafe { self.talc.dealloc(ptr, class_layout(class)) };
+        }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_layout = unsafe { Layout::from_size_align_unchecked(new_size, layout.align()) };
+        match (size_class(&layout), size_class(&new_layout)) {
+            // Still fits the object it already has.
+            (Some(old), Some(new)) if old == new => ptr,
+            // Talc can often grow or shrink in place.
+            (None, None) => unsafe { self.talc.realloc(ptr, layout, new_size) },
+            _ => {
+                let new_ptr = unsafe { self.alloc(new_layout) };
+                if !new_ptr.is_null() {
+                    unsafe {
+                        ptr::copy_nonoverlapping(ptr, new_ptr, layout.size().min(new_size));
+                        self.dealloc(ptr, layout);
+                    }
+                }
+                new_ptr
+            }
+        }
+    }
+}
+
 #[global_allocator]
-static ALLOCATOR: Talck<SpinNoIrq, ClaimOnOom> = Talc::new(unsafe {
-    // if we're in a hosted environment, the Rust runtime may allocate before
-    // main() is called, so we need to initialize the arena automatically
-    ClaimOnOom::new(Span::from_array(core::ptr::addr_of!(ARENA).cast_mut()))
-})
-.lock();
+static ALLOCATOR: SlabAllocator = SlabAllocator::new(
+    Talc::new(GrowOnOom::new(Span::from_array(
+        core::ptr::addr_of!(ARENA).cast_mut(),
+    )))
+    .lock(),
+);
+
+/// Per-CPU cache counters of one size class, summed over all CPUs.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SlabClassStats {
+    /// Object size of the class in bytes.
+    pub size: usize,
+    /// Allocations served from a per-CPU cache.
+    pub hits: u64,
+    /// Allocations that had to refill the cache from talc.
+    pub misses: u64,
+}
+
+/// Returns the per-CPU cache counters of every size class.
+pub fn slab_stats() -> [SlabClassStats; SIZE_CLASSES] {
+    core::array::from_fn(|class| {
+        let mut stats = SlabClassStats {
+            size: class_layout(class).size(),
+            ..Default::default()
+        };
+        for cache in (0..TINYENV_SMP).map(|cpu_id| CPU_CACHE.remote(cpu_id)) {
+            stats.hits += cache.stats[class].hits.load(Ordering::Relaxed);
+            stats.misses += cache.stats[class].misses.load(Ordering::Relaxed);
+        }
+        stats
+    })
+}
+
+/// Lists the talc heap lock in the lock statistics.
+pub fn register_lock() {
+    let talc = ALLOCATOR.talc.lock();
+    let raw = unsafe { lock_api::MutexGuard::mutex(&talc).raw() };
+    crate::hal::register_lock("ALLOCATOR", raw);
+}
 
 #[alloc_error_handler]
 pub fn handle_alloc_error(layout: Layout) -> ! {
@@ -0,0 +1,483 @@
+//! Physical page frame allocator.
+//!
+//! RAM is discovered from the FDT `memory` nodes. Each region gets a bitmap
+//! (one bit per 4K frame, set = in use) stored in the region itself. The
+//! kernel image, the device tree blob and `/reserved-memory` are marked in
+//! use up front.
+//!
+//! Single frames are served from small per-CPU caches, refilled and
+//! flushed in batches, so the global lock is only taken once per batch.
+//! The allocator never touches the heap, which lets the heap grow from it.
+
+use memory_addr::{PAGE_SIZE_4K, PhysAddr, VirtAddr, pa};
+use provider_core::with_provider;
+
+use super::{phys_to_virt, virt_to_phys};
+use crate::{
+    device::provider::BootProvider,
+    hal::{
+        Mutex, TicketNoIrq,
+        cpu::{local_irq_restore, local_irq_save},
+        percpu,
+    },
+};
+
+/// Size of a physical frame.
+pub const FRAME_SIZE: usize = PAGE_SIZE_4K;
+
+/// End of the physical range covered by the boot linear map (0-4 GiB).
+/// RAM above it is only added once the kernel page table maps it.
+const BOOT_LINEAR_MAP_END: usize = 0x1_0000_0000;
+/// Maximum number of RAM regions tracked.
+const MAX_RAM_REGIONS: usize = 8;
+/// Maximum number of zones, a RAM region splits at `BOOT_LINEAR_MAP_END`.
+const MAX_ZONES: usize = 2 * MAX_RAM_REGIONS;
+/// Maximum number of reserved ranges honoured at init.
+const MAX_RESERVED: usize = 16;
+/// Frames a CPU keeps cached before flushing.
+const PCPU_CAPACITY: usize = 32;
+/// Frames moved between a per-CPU cache and the bitmap per lock acquisition.
+const PCPU_BATCH: usize = PCPU_CAPACITY / 4;
+
+/// A half-open physical address range.
+#[derive(Clone, Copy)]
+struct Range {
+    start: usize,
+    end: usize,
+}
+
+impl Range {
+    fn intersect(self, other: Range) -> Option<Range> {
+        let start = self.start.max(other.start);
+        let end = self.end.min(other.end);
+        (start < end).then_some(Range { start, end })
+    }
+}
+
+/// Frames of one contiguous RAM region.
+struct Zone {
+    base: usize,
+    frames: usize,
+    bitmap: *mut u64,
+    free: usize,
+    /// Word to start the next single-frame search from.
+    hint: usize,
+}
+
+impl Zone {
+    fn words(&self) -> usize {
+        self.frames.div_ceil(64)
+    }
+
+    fn word(&self, idx: usize) -> &mut u64 {
+        unsafe { &mut *self.bitmap.add(idx) }
+    }
+
+    fn is_used(&self, frame: usize) -> bool {
+        *self.word(frame / 64) & (1 << (frame % 64)) != 0
+    }
+
+    fn contains(&self, paddr: usize) -> bool {
+        paddr >= self.base && paddr < self.base + self.frames * FRAME_SIZE
+    }
+
+    /// Marks `count` frames starting at `first` used or free.
+    fn set_range(&mut self, first: usize, count: usize, used: bool) {
+        for frame in first..first + count {
+            let bit = 1u64 << (frame % 64);
+            let word = self.word(frame / 64);
+            if used {
+                *word |= bit;
+            } else {
+                *word &= !bit;
+            }
+        }
+    }
+
+    /// Marks the frames overlapping `range` used or free, and keeps the free
+    /// count in sync.
+    fn mark(&mut self, range: Range, used: bool) {
+        let zone = Range {
+            start: self.base,
+            end: self.base + self.frames * FRAME_SIZE,
+        };
+        let Some(range) = range.intersect(zone) else {
+            return;
+        };
+        let first = (range.start - self.base) / FRAME_SIZE;
+        let last = (range.end - self.base).div_ceil(FRAME_SIZE);
+        for frame in first..last {
+            if self.is_used(frame) != used {
+                self.set_range(frame, 1, used);
+                if used {
+                    self.free -= 1;
+                } else {
+                    self.free += 1;
+                }
+            }
+        }
+    }
+
+    fn alloc_one(&mut self) -> Option<usize> {
+        if self.free == 0 {
+            return None;
+        }
+        let words = self.words();
+        for i in 0..words {
+            let idx = (self.hint + i) % words;
+            let word = self.word(idx);
+            if *word != u64::MAX {
+                let frame = idx * 64 + word.trailing_ones() as usize;
+                *word |= 1 << (frame % 64);
+                self.free -= 1;
+                self.hint = idx;
+                return Some(self.base + frame * FRAME_SIZE);
+            }
+        }
+        None
+    }
+
+    fn alloc_contig(&mut self, count: usize, align: usize) -> Option<usize> {
+        if self.free < count {
+            return None;
+        }
+        // Align physical addresses, not frame indices.
+        let align_bytes = align * FRAME_SIZE;
+        let mut frame = (self.base.next_multiple_of(align_bytes) - self.base) / FRAME_SIZE;
+        while frame + count <= self.frames {
+            match (frame..frame + count).find(|&f| self.is_used(f)) {
+                None => {
+                    self.set_range(frame, count, true);
+                    self.free -= count;
+                    return Some(self.base + frame * FRAME_SIZE);
+                }
+                Some(used) => {
+                    let next = self.base + (used + 1) * FRAME_SIZE;
+                    frame = (next.next_multiple_of(align_bytes) - self.base) / FRAME_SIZE;
+                }
+            }
+        }
+        None
+    }
+
+    fn free(&mut self, paddr: usize, count: usize) {
+        let first = (paddr - self.base) / FRAME_SIZE;
+        debug_assert!((first..first + count).all(|f| self.is_used(f)));
+        self.set_range(first, count, false);
+        self.free += count;
+    }
+}
+
+struct FrameAllocator {
+    zones: [Option<Zone>; MAX_ZONES],
+    ram: [Range; MAX_RAM_REGIONS],
+    nr_ram: usize,
+    reserved: [Range; MAX_RESERVED],
+    nr_reserved: usize,
+}
+
+// Safety: the bitmaps are only reached through the allocator lock.
+unsafe impl Send for FrameAllocator {}
+
+impl FrameAllocator {
+    fn zones_mut(&mut self) -> impl Iterator<Item = &mut Zone> {
+        self.zones.iter_mut().flatten()
+    }
+
+    fn alloc(&mut self, count: usize, align: usize) -> Option<usize> {
+        self.zones_mut().find_map(|zone| {
+            if count == 1 && align == 1 {
+                zone.alloc_one()
+            } else {
+                zone.alloc_contig(count, align)
+            }
+        })
+    }
+
+    fn free(&mut self, paddr: usize, count: usize) {
+        match self.zones_mut().find(|zone| zone.contains(paddr)) {
+            Some(zone) => zone.free(paddr, count),
+            None => panic!("Freeing frame {:#x} outside of RAM", paddr),
+        }
+    }
+}
+
+const EMPTY_RANGE: Range = Range { start: 0, end: 0 };
+
+static FRAME_ALLOCATOR: Mutex<FrameAllocator> = Mutex::const_new(
+    unsafe { TicketNoIrq::named("FRAME_ALLOCATOR") },
+    FrameAllocator {
+        zones: [const { None }; MAX_ZONES],
+        ram: [EMPTY_RANGE; MAX_RAM_REGIONS],
+        nr_ram: 0,
+        reserved: [EMPTY_RANGE; MAX_RESERVED],
+        nr_reserved: 0,
+    },
+);
+
+crate::define_percpu! {
+    /// Cached free frames of this CPU and their count.
+    static PCPU_FRAMES: ([usize; PCPU_CAPACITY], usize) = ([0; PCPU_CAPACITY], 0);
+}
+
+/// Runs `f` on this CPU's frame cache with IRQs disabled.
+fn with_pcpu_frames<R>(f: impl FnOnce(&mut [usize; PCPU_CAPACITY], &mut usize) -> R) -> Option<R> {
+    let irq_enabled = local_irq_save();
+    let result = percpu::try_cpu_id().map(|_| {
+        // Safety: the cache is only touched by its own CPU with IRQs disabled.
+        let (frames, len) = unsafe { PCPU_FRAMES.current_mut() };
+        f(frames, len)
+    });
+    local_irq_restore(irq_enabled);
+    result
+}
+
+/// Allocates one frame, preferably from this CPU's cache.
+pub fn alloc_frame() -> Option<PhysAddr> {
+    let cached = with_pcpu_frames(|frames, len| {
+        if *len == 0 {
+            let mut allocator = FRAME_ALLOCATOR.lock();
+            while *len < PCPU_BATCH {
+                let Some(paddr) = allocator.alloc(1, 1) else {
+                    break;
+                };
+                frames[*len] = paddr;
+                *len += 1;
+            }
+        }
+        if *len == 0 {
+            return None;
+        }
+        *len -= 1;
+        Some(frames[*len])
+    });
+    match cached {
+        Some(paddr) => paddr.map(|paddr| pa!(paddr)),
+        None => FRAME_ALLOCATOR.lock().alloc(1, 1).map(|paddr| pa!(paddr)),
+    }
+}
+
+/// Returns one frame, to this CPU's cache if it has room.
+pub fn free_frame(paddr: PhysAddr) {
+    let paddr = paddr.as_usize();
+    let cached = with_pcpu_frames(|frames, len| {
+        if *len == PCPU_CAPACITY {
+            let mut allocator = FRAME_ALLOCATOR.lock();
+            for _ in 0..PCPU_BATCH {
+                *len -= 1;
+                allocator.free(frames[*len], 1);
+            }
+        }
+        frames[*len] = paddr;
+        *len += 1;
+    });
+    if cached.is_none() {
+        FRAME_ALLOCATOR.lock().free(paddr, 1);
+    }
+}
+
+/// Allocates `count` physically contiguous frames aligned to `align` frames
+/// (a power of two).
+pub fn alloc_frames(count: usize, align: usize) -> Option<PhysAddr> {
+    assert!(count > 0 && align.is_power_of_two());
+    if count == 1 && align == 1 {
+        return alloc_frame();
+    }
+    FRAME_ALLOCATOR
+        .lock()
+        .alloc(count, align)
+        .map(|paddr| pa!(paddr))
+}
+
+/// Frees frames returned by [`alloc_frames`].
+pub fn free_frames(paddr: PhysAddr, count: usize) {
+    if count == 1 {
+        return free_frame(paddr);
+    }
+    FRAME_ALLOCATOR.lock().free(paddr.as_usize(), count);
+}
+
+/// Frame counters, in frames.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct FrameStats {
+    /// Frames of RAM managed by the allocator.
+    pub total: usize,
+    /// Frames neither allocated nor reserved. Frames parked in per-CPU
+    /// caches count as allocated.
+    pub free: usize,
+}
+
+/// Returns the current frame counters.
+pub fn frame_stats() -> FrameStats {
+    let mut allocator = FRAME_ALLOCATOR.lock();
+    allocator
+        .zones_mut()
+        .fold(FrameStats::default(), |stats, zone| FrameStats {
+            total: stats.total + zone.frames,
+            free: stats.free + zone.free,
+        })
+}
+
+/// Returns the first `len`-byte, page-aligned span of `region` that
+/// overlaps none of `reserved`.
+fn find_free_span(region: Range, reserved: &[Range], len: usize) -> Option<usize> {
+    let candidates = core::iter::once(region.start)
+        .chain(reserved.iter().map(|r| r.end.next_multiple_of(FRAME_SIZE)));
+    candidates
+        .filter(|&start| start >= region.start && start + len <= region.end)
+        .filter(|&start| {
+            let span = Range {
+                start,
+                end: start + len,
+            };
+            reserved.iter().all(|r| r.intersect(span).is_none())
+        })
+        .min()
+}
+
+/// Returns the start and size of every RAM region, including memory that
+/// is reserved or not handed to the allocator yet.
+pub fn ram_regions() -> impl Iterator<Item = (PhysAddr, usize)> {
+    let allocator = FRAME_ALLOCATOR.lock();
+    let (ram, nr_ram) = (allocator.ram, allocator.nr_ram);
+    drop(allocator);
+    ram.into_iter()
+        .take(nr_ram)
+        .map(|range| (pa!(range.start), range.end - range.start))
+}
+
+/// Adds the frames of `region` that fall inside `window` as a new zone.
+fn add_zone(allocator: &mut FrameAllocator, region: Range, window: Range) {
+    let Some(region) = region.intersect(window) else {
+        return;
+    };
+    let Some(slot) = allocator.zones.iter().position(|zone| zone.is_none()) else {
+        warn!("Too many memory zones, ignoring {:#x}", region.start);
+        return;
+    };
+    let reserved = &allocator.reserved[..allocator.nr_reserved];
+
+    let frames = (region.end - region.start) / FRAME_SIZE;
+    let bitmap_bytes = (frames.div_ceil(64) * 8).next_multiple_of(FRAME_SIZE);
+    let Some(bitmap_paddr) = find_free_span(region, reserved, bitmap_bytes) else {
+        warn!("No room for the frame bitmap of RAM {:#x}", region.start);
+        return;
+    };
+    let bitmap = phys_to_virt(pa!(bitmap_paddr)).as_mut_ptr() as *mut u64;
+    unsafe { core::ptr::write_bytes(bitmap, 0xff, bitmap_bytes / 8) };
+
+    let mut zone = Zone {
+        base: region.start,
+        frames,
+        bitmap,
+        free: 0,
+        hint: 0,
+    };
+    zone.mark(region, false);
+    for &range in reserved {
+        zone.mark(range, true);
+    }
+    zone.mark(
+        Range {
+            start: bitmap_paddr,
+            end: bitmap_paddr + bitmap_bytes,
+        },
+        true,
+    );
+
+    info!(
+        "RAM {:#x}..{:#x}: {} frames, {} free",
+        region.start, region.end, zone.frames, zone.free
+    );
+    allocator.zones[slot] = Some(zone);
+}
+
+/// Seeds the allocator from the FDT memory nodes.
+///
+/// `dtb_paddr` is the physical address of the device tree blob, which must
+/// stay untouched. Only RAM inside the boot linear map is usable afterwards,
+/// the rest is added by [`init_high_memory`].
+pub fn init(dtb_paddr: usize) {
+    unsafe extern "C" {
+        static _skernel: u8;
+        static _ekernel: u8;
+    }
+
+    let fdt = with_provider::<BootProvider>().get_fdt().lock();
+    let mut allocator = FRAME_ALLOCATOR.lock();
+
+    let reserve = |allocator: &mut FrameAllocator, start: usize, size: usize| {
+        if allocator.nr_reserved == MAX_RESERVED {
+            warn!("Too many reserved ranges, ignoring {:#x}", start);
+            return;
+        }
+        allocator.reserved[allocator.nr_reserved] = Range {
+            start: start / FRAME_SIZE * FRAME_SIZE,
+            end: start + size,
+        };
+        allocator.nr_reserved += 1;
+    };
+
+    let kernel_start = virt_to_phys(VirtAddr::from(&raw const _skernel as usize)).as_usize();
+    let kernel_end = virt_to_phys(VirtAddr::from(&raw const _ekernel as usize)).as_usize();
+    reserve(&mut allocator, kernel_start, kernel_end - kernel_start);
+    reserve(&mut allocator, dtb_paddr, fdt.total_size());
+    if let Some(node) = fdt.find_node("/reserved-memory") {
+        for child in node.children() {
+            for reg in child.reg() {
+                if let Some(size) = reg.size {
+                    reserve(&mut allocator, reg.starting_address as usize, size);
+                }
+            }
+        }
+    }
+
+    for node in fdt.all_nodes() {
+        if node.name != "memory" && !node.name.starts_with("memory@") {
+            continue;
+        }
+        for reg in node.reg() {
+            let Some(size) = reg.size else {
+                continue;
+            };
+            let start = reg.starting_address as usize;
+            if allocator.nr_ram == MAX_RAM_REGIONS {
+                warn!("Too many RAM regions, ignoring {:#x}", start);
+                continue;
+            }
+            let region = Range {
+                start: start.next_multiple_of(FRAME_SIZE),
+                end: (start + size) / FRAME_SIZE * FRAME_SIZE,
+            };
+            if region.start < region.end {
+                let idx = allocator.nr_ram;
+                allocator.ram[idx] = region;
+                allocator.nr_ram += 1;
+            }
+        }
+    }
+
+    let boot_window = Range {
+        start: 0,
+        end: BOOT_LINEAR_MAP_END,
+    };
+    for idx in 0..allocator.nr_ram {
+        let region = allocator.ram[idx];
+        add_zone(&mut allocator, region, boot_window);
+    }
+}
+
+/// Hands RAM above the boot linear map to the allocator.
+///
+/// Must be called once the kernel page table maps all of RAM.
+pub fn init_high_memory() {
+    let high_window = Range {
+        start: BOOT_LINEAR_MAP_END,
+        end: usize::MAX,
+    };
+    let mut allocator = FRAME_ALLOCATOR.lock();
+    for idx in 0..allocator.nr_ram {
+        let region = allocator.ram[idx];
+        add_zone(&mut allocator, region, high_window);
+    }
+}
@@ -2,12 +2,14 @@
 //!
 //! This module provides memory management facilities including:
 //! - Heap allocation
-//! - Physical memory management
+//! - Physical memory management and page frame allocation
 //! - Address translation
-//! - Future: Page table management, virtual memory
+//! - Kernel and user page tables
 
 pub mod addr;
 pub mod allocator;
+pub mod frame;
+pub mod page_table;
 pub mod phys;
 
 #[allow(unused)]
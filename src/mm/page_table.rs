@@ -0,0 +1,544 @@
+//! Kernel and user page tables.
+//!
+//! Four-level, 4K-granule translation tables built from page frames. A
+//! mapping uses the largest block its alignment allows (1G at level 1, 2M
+//! at level 2), so the whole linear map costs a handful of TLB entries.
+//!
+//! The kernel table is loaded in `TTBR1_EL1` and its entries are global.
+//! User tables go in `TTBR0_EL1` with non-global entries tagged by an ASID,
+//! so switching address spaces does not flush the TLB. ASIDs are handed
+//! out per generation; only running out of them bumps the generation and
+//! flushes, keeping the ASIDs that CPUs are running at that moment.
+
+use alloc::sync::Arc;
+use alloc::vec::Vec;
+use core::cell::UnsafeCell;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+use aarch64_cpu::asm::barrier;
+use aarch64_cpu::registers::{ID_AA64MMFR0_EL1, TTBR0_EL1, TTBR1_EL1};
+use lazyinit::LazyInit;
+use memory_addr::{PAGE_SIZE_4K, PhysAddr, VirtAddr, pa, va};
+use page_table_entry::{GenericPTE, MappingFlags, aarch64::A64PTE};
+use tock_registers::interfaces::{Readable, Writeable};
+
+use super::{frame, phys_to_virt, virt_to_phys};
+use crate::{
+    TinyResult,
+    config::kernel::TINYENV_SMP,
+    hal::{
+        Mutex,
+        cpu::{local_irq_restore, local_irq_save},
+        flush_tlb, flush_tlb_range, percpu,
+    },
+};
+
+/// Size of a level 3 page.
+pub const SIZE_4K: usize = PAGE_SIZE_4K;
+/// Size of a level 2 block.
+pub const SIZE_2M: usize = 0x20_0000;
+/// Size of a level 1 block.
+pub const SIZE_1G: usize = 0x4000_0000;
+
+const ENTRY_COUNT: usize = 512;
+/// Not-global bit of block and page descriptors.
+const PTE_NG: u64 = 1 << 11;
+
+/// Bit position of the generation in an ASID value.
+const ASID_GEN_SHIFT: u32 = 16;
+const ASID_MASK: u64 = (1 << ASID_GEN_SHIFT) - 1;
+/// Largest number of ASIDs a CPU may implement.
+const MAX_ASIDS: usize = 1 << ASID_GEN_SHIFT;
+
+#[inline]
+const fn level_size(level: usize) -> usize {
+    1 << (12 + 9 * (3 - level))
+}
+
+#[inline]
+const fn pte_index(vaddr: usize, level: usize) -> usize {
+    (vaddr / level_size(level)) % ENTRY_COUNT
+}
+
+fn table_mut<'a>(paddr: PhysAddr) -> &'a mut [A64PTE; ENTRY_COUNT] {
+    unsafe { &mut *(phys_to_virt(paddr).as_mut_ptr() as *mut [A64PTE; ENTRY_COUNT]) }
+}
+
+fn alloc_table() -> TinyResult<PhysAddr> {
+    let paddr =
+        frame::alloc_frame().ok_or_else(|| anyhow::anyhow!("Out of memory for page tables"))?;
+    unsafe { core::ptr::write_bytes(phys_to_virt(paddr).as_mut_ptr(), 0, SIZE_4K) };
+    Ok(paddr)
+}
+
+/// A four-level translation table.
+pub struct PageTable {
+    root: PhysAddr,
+    /// Whether entries are global (kernel) or ASID-tagged (user).
+    global: bool,
+    /// ASID in the low bits, its generation above, `0` if none assigned.
+    asid: AtomicU64,
+    /// Serializes changes to the tables.
+    lock: Mutex<()>,
+}
+
+impl PageTable {
+    /// Creates an empty user page table, loaded through [`switch_user`].
+    pub fn try_new() -> TinyResult<Self> {
+        Self::with_root(false)
+    }
+
+    fn with_root(global: bool) -> TinyResult<Self> {
+        Ok(Self {
+            root: alloc_table()?,
+            global,
+            asid: AtomicU64::new(0),
+            lock: Mutex::new(()),
+        })
+    }
+
+    /// Returns the physical address of the level 0 table.
+    #[inline]
+    pub fn root_paddr(&self) -> PhysAddr {
+        self.root
+    }
+
+    /// Returns the ASID assigned by the last activation, `0` if none.
+    #[inline]
+    pub fn asid(&self) -> u16 {
+        (self.asid.load(Ordering::Relaxed) & ASID_MASK) as u16
+    }
+
+    /// Maps `[vaddr, vaddr + size)` to `[paddr, paddr + size)`.
+    ///
+    /// Each step uses the largest block both addresses are aligned to. All
+    /// three arguments must be 4K aligned, and nothing in the range may be
+    /// mapped yet. On error, the part mapped so far stays mapped.
+    pub fn map(
+        &self,
+        vaddr: VirtAddr,
+        paddr: PhysAddr,
+        size: usize,
+        flags: MappingFlags,
+    ) -> TinyResult<()> {
+        let (mut vaddr, mut paddr) = (vaddr.as_usize(), paddr.as_usize());
+        if (vaddr | paddr | size) % SIZE_4K != 0 {
+            anyhow::bail!("Unaligned mapping {:#x} -> {:#x}", vaddr, paddr);
+        }
+        let _guard = self.lock.lock();
+        let end = vaddr + size;
+        while vaddr < end {
+            let level = [1, 2]
+                .into_iter()
+                .find(|&level| {
+                    let block = level_size(level);
+                    (vaddr | paddr) % block == 0 && end - vaddr >= block
+                })
+                .unwrap_or(3);
+            let pte = self.entry_create(vaddr, level)?;
+            if !pte.is_unused() {
+                anyhow::bail!("{:#x} is already mapped", vaddr);
+            }
+            let mut entry = A64PTE::new_page(pa!(paddr), flags, level != 3);
+            if !self.global {
+                // Safety: `A64PTE` is a transparent wrapper around the descriptor.
+                let bits = entry.bits() as u64 | PTE_NG;
+                entry = unsafe { core::mem::transmute::<u64, A64PTE>(bits) };
+            }
+            *pte = entry;
+            vaddr += level_size(level);
+            paddr += level_size(level);
+        }
+        // Make the new entries visible to the table walker.
+        barrier::dsb(barrier::ISHST);
+        barrier::isb(barrier::SY);
+        Ok(())
+    }
+
+    /// Unmaps `[vaddr, vaddr + size)` and flushes it from every TLB.
+    ///
+    /// The range must be fully mapped and may not cut through a block.
+    /// Tables left empty are kept until the page table is dropped.
+    pub fn unmap(&self, vaddr: VirtAddr, size: usize) -> TinyResult<()> {
+        let _guard = self.lock.lock();
+        let start = vaddr.as_usize();
+        let end = start + size;
+        let mut vaddr = start;
+        let mut stride = SIZE_1G;
+        while vaddr < end {
+            let Some((pte, level)) = self.entry(vaddr) else {
+                anyhow::bail!("{:#x} is not mapped", vaddr);
+            };
+            let page_size = level_size(level);
+            if vaddr % page_size != 0 || end - vaddr < page_size {
+                anyhow::bail!("Unmap of {:#x} splits a {:#x} block", vaddr, page_size);
+            }
+            pte.clear();
+            stride = stride.min(page_size);
+            vaddr += page_size;
+        }
+        let asid = (!self.global).then(|| self.asid());
+        flush_tlb_range(va!(start), size, stride, asid);
+        Ok(())
+    }
+
+    /// Returns the physical address `vaddr` maps to, the mapping flags and
+    /// the size of the page or block containing it.
+    pub fn query(&self, vaddr: VirtAddr) -> Option<(PhysAddr, MappingFlags, usize)> {
+        let _guard = self.lock.lock();
+        let vaddr = vaddr.as_usize();
+        let (pte, level) = self.entry(vaddr)?;
+        let page_size = level_size(level);
+        Some((
+            pa!(pte.paddr().as_usize() + vaddr % page_size),
+            pte.flags(),
+            page_size,
+        ))
+    }
+
+    /// Returns the leaf entry of `vaddr` and its level, `None` if unmapped.
+    fn entry(&self, vaddr: usize) -> Option<(&mut A64PTE, usize)> {
+        let mut table = self.root;
+        for level in 0..4 {
+            let pte = &mut table_mut(table)[pte_index(vaddr, level)];
+            if !pte.is_present() {
+                return None;
+            }
+            if level == 3 || (level > 0 && pte.is_huge()) {
+                return Some((pte, level));
+            }
+            table = pte.paddr();
+        }
+        unreachable!()
+    }
+
+    /// Returns the entry of `vaddr` at `leaf_level`, allocating the tables
+    /// above it.
+    fn entry_create(&self, vaddr: usize, leaf_level: usize) -> TinyResult<&mut A64PTE> {
+        let mut table = self.root;
+        for level in 0..leaf_level {
+            let pte = &mut table_mut(table)[pte_index(vaddr, level)];
+            if pte.is_unused() {
+                *pte = A64PTE::new_table(alloc_table()?);
+            } else if level > 0 && pte.is_huge() {
+                anyhow::bail!("{:#x} is inside a block mapping", vaddr);
+            }
+            table = pte.paddr();
+        }
+        Ok(&mut table_mut(table)[pte_index(vaddr, leaf_level)])
+    }
+
+    /// Loads this table in `TTBR0_EL1` on the current CPU.
+    ///
+    /// A table whose ASID is from the current generation goes straight in;
+    /// otherwise it gets a new ASID first.
+    fn activate(&self) {
+        let irq_enabled = local_irq_save();
+        let cpu_id = percpu::cpu_id();
+        let active = &ACTIVE_ASIDS[cpu_id];
+
+        let mut asid = self.asid.load(Ordering::Relaxed);
+        let old_active = active.load(Ordering::Relaxed);
+        // A zero active ASID means a rollover is reclaiming this CPU's
+        // ASID, and the exchange fails if one starts under us.
+        let fast = old_active != 0
+            && asid >> ASID_GEN_SHIFT == ASID_GENERATION.load(Ordering::Relaxed) >> ASID_GEN_SHIFT
+            && active
+                .compare_exchange(old_active, asid, Ordering::Relaxed, Ordering::Relaxed)
+                .is_ok();
+        if !fast {
+            let mut allocator = ASID_ALLOCATOR.lock();
+            asid = self.asid.load(Ordering::Relaxed);
+            if asid >> ASID_GEN_SHIFT != ASID_GENERATION.load(Ordering::Relaxed) >> ASID_GEN_SHIFT {
+                asid = allocator.new_asid(asid);
+                self.asid.store(asid, Ordering::Relaxed);
+            }
+            if allocator.flush_pending & (1 << cpu_id) != 0 {
+                allocator.flush_pending &= !(1 << cpu_id);
+                flush_tlb(None);
+            }
+            active.store(asid, Ordering::Relaxed);
+        }
+
+        TTBR0_EL1.set(((asid & ASID_MASK) << 48) | self.root.as_usize() as u64);
+        barrier::isb(barrier::SY);
+        local_irq_restore(irq_enabled);
+    }
+
+    /// Frees the tables below `table`, which sits at `level`.
+    fn free_tables(table: PhysAddr, level: usize) {
+        if level < 3 {
+            for pte in table_mut(table).iter() {
+                if pte.is_present() && (level == 0 || !pte.is_huge()) {
+                    Self::free_tables(pte.paddr(), level + 1);
+                }
+            }
+        }
+        frame::free_frame(table);
+    }
+}
+
+impl Drop for PageTable {
+    /// Frees the translation tables, not the memory they map.
+    fn drop(&mut self) {
+        Self::free_tables(self.root, 0);
+    }
+}
+
+/// Current ASID generation, in the bits above `ASID_GEN_SHIFT`.
+static ASID_GENERATION: AtomicU64 = AtomicU64::new(1 << ASID_GEN_SHIFT);
+
+/// ASID (with generation) each CPU has in `TTBR0_EL1`.
+static ACTIVE_ASIDS: [AtomicU64; TINYENV_SMP] = [const { AtomicU64::new(0) }; TINYENV_SMP];
+
+struct AsidAllocator {
+    /// ASIDs handed out in the current generation.
+    map: [u64; MAX_ASIDS / 64],
+    /// ASIDs carried over the last rollover because a CPU was running them.
+    reserved: [u64; TINYENV_SMP],
+    /// CPUs that must flush their TLB before loading a new-generation ASID.
+    flush_pending: u64,
+    /// Where the search for a free ASID starts.
+    next: usize,
+}
+
+static ASID_ALLOCATOR: Mutex<AsidAllocator> = Mutex::new(AsidAllocator {
+    // ASID 0 is the kernel's, with the empty TTBR0 table.
+    map: {
+        let mut map = [0; MAX_ASIDS / 64];
+        map[0] = 1;
+        map
+    },
+    reserved: [0; TINYENV_SMP],
+    flush_pending: 0,
+    next: 1,
+});
+
+/// Returns the number of ASIDs the CPU implements.
+fn asid_count() -> usize {
+    if ID_AA64MMFR0_EL1.matches_all(ID_AA64MMFR0_EL1::ASIDBits::Bits_16) {
+        1 << 16
+    } else {
+        1 << 8
+    }
+}
+
+impl AsidAllocator {
+    fn test_and_set(&mut self, asid: usize) -> bool {
+        let bit = 1 << (asid % 64);
+        let used = self.map[asid / 64] & bit != 0;
+        self.map[asid / 64] |= bit;
+        used
+    }
+
+    fn find_free(&self, from: usize) -> Option<usize> {
+        (from..asid_count()).find(|&asid| self.map[asid / 64] & (1 << (asid % 64)) == 0)
+    }
+
+    /// Returns an ASID of the current generation for a table that held
+    /// `old` (`0` for none).
+    fn new_asid(&mut self, old: u64) -> u64 {
+        let mut generation = ASID_GENERATION.load(Ordering::Relaxed);
+        if old != 0 {
+            let asid = old & ASID_MASK;
+            // Carried over the rollover: keep it, under the new generation.
+            let mut hit = false;
+            for reserved in self.reserved.iter_mut().filter(|r| **r == old) {
+                *reserved = generation | asid;
+                hit = true;
+            }
+            if hit {
+                return generation | asid;
+            }
+            // Not taken by anyone else since: keep the number.
+            if !self.test_and_set(asid as usize) {
+                return generation | asid;
+            }
+        }
+
+        let asid = match self.find_free(self.next) {
+            Some(asid) => asid,
+            None => {
+                generation = self.rollover();
+                self.find_free(1).expect("No free ASID after rollover")
+            }
+        };
+        self.test_and_set(asid);
+        self.next = asid + 1;
+        generation | asid as u64
+    }
+
+    /// Starts a new generation, keeping only the ASIDs CPUs are running.
+    fn rollover(&mut self) -> u64 {
+        let generation = ASID_GENERATION.fetch_add(1 << ASID_GEN_SHIFT, Ordering::Relaxed)
+            + (1 << ASID_GEN_SHIFT);
+        self.map.fill(0);
+        self.map[0] = 1;
+        for cpu_id in 0..TINYENV_SMP {
+            let active = ACTIVE_ASIDS[cpu_id].swap(0, Ordering::Relaxed);
+            // A CPU that has not switched since the previous rollover is
+            // still running its reserved ASID.
+            let asid = if active == 0 {
+                self.reserved[cpu_id]
+            } else {
+                active
+            };
+            self.map[(asid & ASID_MASK) as usize / 64] |= 1 << (asid % 64);
+            self.reserved[cpu_id] = asid;
+        }
+        self.flush_pending = (1 << TINYENV_SMP) - 1;
+        generation
+    }
+}
+
+struct LoadedTable(UnsafeCell<Option<Arc<PageTable>>>);
+
+// Safety: each slot is only touched by its own CPU with IRQs disabled.
+unsafe impl Sync for LoadedTable {}
+
+/// User table in each CPU's `TTBR0_EL1`.
+///
+/// Kernel-only tasks leave TTBR0 alone, so switching between a user task
+/// and kernel tasks such as idle reloads nothing. Holding the reference keeps a table that
+/// is still loaded from being freed.
+static LOADED_TABLES: [LoadedTable; TINYENV_SMP] =
+    [const { LoadedTable(UnsafeCell::new(None)) }; TINYENV_SMP];
+
+/// Switches the current CPU to the user page table `table`.
+///
+/// Called with IRQs disabled on context switch.
+pub(crate) fn switch_user(table: &Arc<PageTable>) {
+    let loaded = unsafe { &mut *LOADED_TABLES[percpu::cpu_id()].0.get() };
+    if loaded
+        .as_ref()
+        .is_some_and(|loaded| Arc::ptr_eq(loaded, table))
+    {
+        return;
+    }
+    table.activate();
+    *loaded = Some(table.clone());
+}
+
+/// The kernel page table, in `TTBR1_EL1` on every CPU.
+static KERNEL_PAGE_TABLE: LazyInit<PageTable> = LazyInit::new();
+
+/// Empty table for `TTBR0_EL1` while no user table is loaded, so stray low
+/// addresses fault instead of going through the boot identity map.
+static EMPTY_TTBR0: AtomicUsize = AtomicUsize::new(0);
+
+/// Returns the kernel page table.
+pub fn kernel_page_table() -> &'static PageTable {
+    KERNEL_PAGE_TABLE
+        .get()
+        .expect("Kernel page table not initialized")
+}
+
+/// Calls `f` on every part of `[start, end)` that none of `holes` covers.
+fn for_each_gap(
+    start: usize,
+    end: usize,
+    holes: &mut [(usize, usize)],
+    mut f: impl FnMut(usize, usize) -> TinyResult<()>,
+) -> TinyResult<()> {
+    holes.sort_unstable();
+    let mut cursor = start;
+    for &(hole_start, hole_end) in holes.iter() {
+        if hole_end <= cursor || hole_start >= end {
+            continue;
+        }
+        if hole_start > cursor {
+            f(cursor, hole_start)?;
+        }
+        cursor = hole_end;
+    }
+    if cursor < end {
+        f(cursor, end)?;
+    }
+    Ok(())
+}
+
+/// Maps the kernel image with per-section permissions and all of RAM in
+/// the linear map, and keeps the MMIO windows of the boot page table.
+fn build_kernel_table(table: &PageTable) -> TinyResult<()> {
+    unsafe extern "C" {
+        safe static _skernel: [u8; 0];
+        safe static _etext: [u8; 0];
+        safe static _srodata: [u8; 0];
+        safe static _erodata: [u8; 0];
+        safe static _ekernel: [u8; 0];
+    }
+
+    let map_linear = |start: usize, end: usize, flags: MappingFlags| {
+        table.map(phys_to_virt(pa!(start)), pa!(start), end - start, flags)
+    };
+    let kernel_paddr = |sym: &[u8; 0]| virt_to_phys(va!(sym.as_ptr() as usize)).as_usize();
+
+    let image = (kernel_paddr(&_skernel), kernel_paddr(&_ekernel));
+    map_linear(
+        image.0,
+        kernel_paddr(&_etext),
+        MappingFlags::READ | MappingFlags::EXECUTE,
+    )?;
+    map_linear(
+        kernel_paddr(&_srodata),
+        kernel_paddr(&_erodata),
+        MappingFlags::READ,
+    )?;
+    map_linear(
+        kernel_paddr(&_erodata),
+        image.1,
+        MappingFlags::READ | MappingFlags::WRITE,
+    )?;
+
+    let mut ram: Vec<(usize, usize)> = frame::ram_regions()
+        .map(|(start, size)| (start.as_usize(), start.as_usize() + size))
+        .collect();
+    for (start, end) in ram.clone() {
+        for_each_gap(start, end, &mut [image], |start, end| {
+            map_linear(start, end, MappingFlags::READ | MappingFlags::WRITE)
+        })?;
+    }
+
+    // Whatever the boot table maps outside RAM is MMIO; keep it as it was.
+    let boot_l1 = unsafe { &*(&raw const crate::boot::init::BOOT_PT_L1) };
+    for (idx, pte) in boot_l1.iter().enumerate() {
+        if !pte.is_present() {
+            continue;
+        }
+        let flags = pte.flags();
+        let start = idx * SIZE_1G;
+        for_each_gap(start, start + SIZE_1G, &mut ram, |start, end| {
+            map_linear(start, end, flags)
+        })?;
+    }
+    Ok(())
+}
+
+/// Loads the kernel table in TTBR1 and the empty table in TTBR0.
+fn load_kernel_tables() {
+    let kernel_root = kernel_page_table().root_paddr();
+    TTBR1_EL1.set(kernel_root.as_usize() as u64);
+    TTBR0_EL1.set(EMPTY_TTBR0.load(Ordering::Relaxed) as u64);
+    barrier::isb(barrier::SY);
+    flush_tlb(None);
+}
+
+/// Builds the kernel page table and switches the boot CPU to it.
+///
+/// Must run after [`frame::init`]. RAM above the boot linear map is handed
+/// to the frame allocator once it is mapped.
+pub fn init() {
+    let table = PageTable::with_root(true).expect("Failed to allocate kernel page table");
+    build_kernel_table(&table).expect("Failed to build kernel page table");
+    KERNEL_PAGE_TABLE.init_once(table);
+    let empty = alloc_table().expect("Failed to allocate empty page table");
+    EMPTY_TTBR0.store(empty.as_usize(), Ordering::Relaxed);
+
+    load_kernel_tables();
+    frame::init_high_memory();
+}
+
+/// Switches a secondary CPU from the boot page table to the kernel one.
+pub fn init_secondary() {
+    load_kernel_tables();
+}
@@ -0,0 +1,12 @@
+//! Kernel profiling: PMU counters, PC sampling and tracepoints.
+
+pub mod sampler;
+pub mod trace;
+
+pub use trace::{TraceKind, record as trace};
+
+/// Prepares profiling on this CPU. Called on every CPU before it starts
+/// scheduling, as the PMU interrupt and IPIs are banked per CPU.
+pub fn init_cpu() {
+    sampler::init_cpu();
+}
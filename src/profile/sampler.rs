@@ -0,0 +1,288 @@
+//! PMU counting and PC sampling sessions.
+//!
+//! A session runs on every CPU at once. Event counter 0 counts the sampling
+//! event and starts `period` events short of overflowing, so its overflow
+//! IRQ fires every `period` events; the handler records the interrupted PC
+//! and re-arms the counter. The next counters count [`EVENTS`], as many as
+//! the CPU has, and the cycle counter runs throughout.
+//!
+//! A CPU's PMU can only be programmed from that CPU, so starting and
+//! stopping a session is broadcast with [`PROFILE_IPI`], and the caller
+//! waits until every CPU has applied it.
+
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicU16, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+use core::time::Duration;
+
+use anyhow::bail;
+use provider_core::with_provider;
+
+use crate::TinyResult;
+use crate::config::kernel::{PMU_IRQ, PROFILE_IPI, PROFILE_SAMPLES, TINYENV_SMP};
+use crate::device::provider::IrqProvider;
+use crate::hal::cpu::{local_irq_restore, local_irq_save};
+use crate::hal::{percpu, pmu};
+use crate::task::sleep_lock::SleepMutex;
+
+/// Events counted alongside cycles, with the names they are reported as.
+pub const EVENTS: [(u16, &str); 4] = [
+    (pmu::EVENT_INST_RETIRED, "instructions"),
+    (pmu::EVENT_L1D_CACHE_REFILL, "l1d-misses"),
+    (pmu::EVENT_L2D_CACHE_REFILL, "l2-misses"),
+    (pmu::EVENT_BR_MIS_PRED, "branch-misses"),
+];
+
+/// Counter totals of one CPU over the last session.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct CpuCounts {
+    pub cycles: u64,
+    /// One entry per [`EVENTS`]; `None` if the CPU has too few counters.
+    pub events: [Option<u64>; EVENTS.len()],
+    /// PC samples taken, and the ones that did not fit the buffer.
+    pub samples: usize,
+    pub dropped: u64,
+}
+
+/// What one CPU collects during a session. Only that CPU writes it.
+struct CpuProfile {
+    pcs: [AtomicUsize; PROFILE_SAMPLES],
+    samples: AtomicUsize,
+    dropped: AtomicU64,
+    /// Number of [`EVENTS`] this CPU has counters for.
+    counted: AtomicUsize,
+    /// Overflows of each 32-bit event counter, pre-shifted.
+    wraps: [AtomicU64; EVENTS.len()],
+    /// Totals, taken when the session stops.
+    cycles: AtomicU64,
+    events: [AtomicU64; EVENTS.len()],
+}
+
+impl CpuProfile {
+    const fn new() -> Self {
+        Self {
+            pcs: [const { AtomicUsize::new(0) }; PROFILE_SAMPLES],
+            samples: AtomicUsize::new(0),
+            dropped: AtomicU64::new(0),
+            counted: AtomicUsize::new(0),
+            wraps: [const { AtomicU64::new(0) }; EVENTS.len()],
+            cycles: AtomicU64::new(0),
+            events: [const { AtomicU64::new(0) }; EVENTS.len()],
+        }
+    }
+}
+
+static PROFILES: [CpuProfile; TINYENV_SMP] = [const { CpuProfile::new() }; TINYENV_SMP];
+
+/// Serializes sessions being started and stopped.
+static SESSION: SleepMutex<()> = SleepMutex::new(());
+static RUNNING: AtomicBool = AtomicBool::new(false);
+
+/// The request broadcast last: `true` to start, `false` to stop.
+static REQUEST_START: AtomicBool = AtomicBool::new(false);
+/// CPUs that have applied the request broadcast last.
+static ACKS: AtomicUsize = AtomicUsize::new(0);
+
+static SAMPLE_EVENT: AtomicU16 = AtomicU16::new(pmu::EVENT_CPU_CYCLES);
+static PERIOD: AtomicU32 = AtomicU32::new(0);
+
+/// Value that makes counter 0 overflow after `period` more events.
+fn reload() -> u32 {
+    0u32.wrapping_sub(PERIOD.load(Ordering::Relaxed))
+}
+
+fn start_local() {
+    let profile = &PROFILES[percpu::cpu_id()];
+    profile.samples.store(0, Ordering::Relaxed);
+    profile.dropped.store(0, Ordering::Relaxed);
+    for wraps in &profile.wraps {
+        wraps.store(0, Ordering::Relaxed);
+    }
+
+    pmu::disable_overflow_irq(u32::MAX);
+    pmu::disable_counters(u32::MAX);
+    pmu::take_overflow();
+    pmu::reset();
+
+    let counters = pmu::num_counters();
+    let mut mask = 0;
+    if counters > 0 {
+        pmu::set_event(0, SAMPLE_EVENT.load(Ordering::Relaxed));
+        pmu::write_counter(0, reload());
+        mask |= 1;
+    }
+    let counted = EVENTS.len().min(counters.saturating_sub(1));
+    for (i, &(event, _)) in EVENTS[..counted].iter().enumerate() {
+        pmu::set_event(i + 1, event);
+        mask |= 1 << (i + 1);
+    }
+    profile.counted.store(counted, Ordering::Relaxed);
+
+    pmu::enable_counters(mask | pmu::CYCLE_COUNTER);
+    pmu::enable_overflow_irq(mask);
+}
+
+fn stop_local() {
+    let profile = &PROFILES[percpu::cpu_id()];
+    pmu::disable_overflow_irq(u32::MAX);
+    pmu::disable_counters(u32::MAX);
+
+    profile.cycles.store(pmu::cycles(), Ordering::Relaxed);
+    for i in 0..profile.counted.load(Ordering::Relaxed) {
+        let total = profile.wraps[i].load(Ordering::Relaxed) + pmu::read_counter(i + 1);
+        profile.events[i].store(total, Ordering::Relaxed);
+    }
+    pmu::take_overflow();
+    pmu::stop();
+}
+
+/// Applies the request broadcast last on this CPU. Runs with IRQs masked.
+fn apply_request() {
+    if REQUEST_START.load(Ordering::Acquire) {
+        start_local();
+    } else {
+        stop_local();
+    }
+    ACKS.fetch_add(1, Ordering::Release);
+}
+
+fn handle_profile_ipi(_irq: usize) {
+    apply_request();
+}
+
+/// PMU overflow IRQ handler: takes a sample, and carries the event
+/// counters into their upper halves.
+fn handle_pmu_irq(_irq: usize) {
+    let profile = &PROFILES[percpu::cpu_id()];
+    let overflowed = pmu::take_overflow();
+
+    if overflowed & 1 != 0 {
+        let samples = profile.samples.load(Ordering::Relaxed);
+        if samples < PROFILE_SAMPLES {
+            profile.pcs[samples].store(percpu::irq_pc(), Ordering::Relaxed);
+            profile.samples.store(samples + 1, Ordering::Relaxed);
+        } else {
+            let dropped = &profile.dropped;
+            dropped.store(dropped.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+        }
+        pmu::write_counter(0, reload());
+    }
+    for (i, wraps) in profile.wraps.iter().enumerate() {
+        if overflowed & (1 << (i + 1)) != 0 {
+            wraps.store(wraps.load(Ordering::Relaxed) + (1 << 32), Ordering::Relaxed);
+        }
+    }
+}
+
+/// Sends the request to every CPU and waits until all have applied it.
+fn broadcast(start: bool) -> TinyResult<()> {
+    REQUEST_START.store(start, Ordering::Release);
+    ACKS.store(0, Ordering::Release);
+
+    // Stay on this CPU while telling the others.
+    let irq_enabled = local_irq_save();
+    let this_cpu = percpu::cpu_id();
+    apply_request();
+    for cpu_id in (0..TINYENV_SMP).filter(|&cpu_id| cpu_id != this_cpu) {
+        with_provider::<IrqProvider>().send_sgi(PROFILE_IPI, cpu_id);
+    }
+    local_irq_restore(irq_enabled);
+
+    for _ in 0..100 {
+        if ACKS.load(Ordering::Acquire) == TINYENV_SMP {
+            return Ok(());
+        }
+        crate::task::thread::sleep(Duration::from_millis(1));
+    }
+    bail!(
+        "only {} of {} CPUs answered the profiler",
+        ACKS.load(Ordering::Acquire),
+        TINYENV_SMP
+    )
+}
+
+/// Starts counting on every CPU, sampling the PC every `period`
+/// occurrences of `event`.
+pub fn start(event: u16, period: u32) -> TinyResult<()> {
+    if !pmu::is_present() {
+        bail!("this CPU has no PMUv3");
+    }
+    if period == 0 {
+        bail!("the sampling period must not be zero");
+    }
+    let _guard = SESSION.lock();
+    if RUNNING.load(Ordering::Relaxed) {
+        bail!("a profiling session is already running");
+    }
+    SAMPLE_EVENT.store(event, Ordering::Relaxed);
+    PERIOD.store(period, Ordering::Relaxed);
+    RUNNING.store(true, Ordering::Relaxed);
+    broadcast(true)
+}
+
+/// Stops the session on every CPU and takes the counter totals.
+pub fn stop() -> TinyResult<()> {
+    let _guard = SESSION.lock();
+    if !RUNNING.load(Ordering::Relaxed) {
+        bail!("no profiling session is running");
+    }
+    RUNNING.store(false, Ordering::Relaxed);
+    broadcast(false)
+}
+
+/// Returns `true` while a session is running.
+pub fn is_running() -> bool {
+    RUNNING.load(Ordering::Relaxed)
+}
+
+/// Returns the counter totals of each CPU over the last session.
+pub fn counts() -> [CpuCounts; TINYENV_SMP] {
+    core::array::from_fn(|cpu_id| {
+        let profile = &PROFILES[cpu_id];
+        let counted = profile.counted.load(Ordering::Relaxed);
+        CpuCounts {
+            cycles: profile.cycles.load(Ordering::Relaxed),
+            events: core::array::from_fn(|i| {
+                (i < counted).then(|| profile.events[i].load(Ordering::Relaxed))
+            }),
+            samples: profile.samples.load(Ordering::Relaxed),
+            dropped: profile.dropped.load(Ordering::Relaxed),
+        }
+    })
+}
+
+/// Returns the sampled PCs of all CPUs with their sample counts, most
+/// frequent first.
+pub fn hot_spots() -> Vec<(usize, usize)> {
+    let mut pcs: Vec<usize> = PROFILES
+        .iter()
+        .flat_map(|profile| {
+            let samples = profile.samples.load(Ordering::Relaxed).min(PROFILE_SAMPLES);
+            profile.pcs[..samples]
+                .iter()
+                .map(|pc| pc.load(Ordering::Relaxed))
+        })
+        .collect();
+    pcs.sort_unstable();
+
+    let mut spots: Vec<(usize, usize)> = Vec::new();
+    for pc in pcs {
+        match spots.last_mut() {
+            Some((last, count)) if *last == pc => *count += 1,
+            _ => spots.push((pc, 1)),
+        }
+    }
+    spots.sort_unstable_by(|a, b| b.1.cmp(&a.1));
+    spots
+}
+
+/// Hooks up the PMU overflow IRQ and the profiling IPI on this CPU.
+pub fn init_cpu() {
+    if !pmu::is_present() {
+        return;
+    }
+    let irq = with_provider::<IrqProvider>();
+    irq.register(PMU_IRQ, handle_pmu_irq);
+    irq.enable(PMU_IRQ, 0x80);
+    irq.register(PROFILE_IPI, handle_profile_ipi);
+    irq.enable(PROFILE_IPI, 0x80);
+}
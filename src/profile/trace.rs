@@ -0,0 +1,168 @@
+//! Static tracepoints recorded into per-CPU buffers.
+//!
+//! A tracepoint is a call to [`record`]. While tracing is off it costs one
+//! relaxed load. While it is on, the event is stamped with the counter
+//! ticks and written to this CPU's buffer, which keeps the last
+//! [`TRACE_ENTRIES`] events. IRQ handlers may record while a task on the
+//! same CPU is in the middle of a record: each claims its own slot.
+
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+use aarch64_cpu::registers::{CNTFRQ_EL0, CNTPCT_EL0, Readable};
+
+use crate::config::kernel::{TINYENV_SMP, TRACE_ENTRIES};
+use crate::hal::percpu;
+
+/// What a trace record describes, and the meaning of its two arguments.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(u8)]
+pub enum TraceKind {
+    /// Previous and next task IDs.
+    ContextSwitch = 1,
+    /// Interrupt ID.
+    IrqEntry,
+    /// Interrupt ID and counter ticks spent in its handler.
+    IrqExit,
+    /// First block and number of blocks.
+    BlockSubmit,
+    /// First block and number of blocks.
+    BlockComplete,
+    /// Size and alignment.
+    Alloc,
+    /// Address and size.
+    Dealloc,
+}
+
+impl TraceKind {
+    fn from_raw(raw: u64) -> Option<Self> {
+        const KINDS: [TraceKind; 7] = [
+            TraceKind::ContextSwitch,
+            TraceKind::IrqEntry,
+            TraceKind::IrqExit,
+            TraceKind::BlockSubmit,
+            TraceKind::BlockComplete,
+            TraceKind::Alloc,
+            TraceKind::Dealloc,
+        ];
+        KINDS.into_iter().find(|&kind| kind as u64 == raw)
+    }
+}
+
+/// One recorded event.
+#[derive(Clone, Copy, Debug)]
+pub struct TraceRecord {
+    /// Time since tracing was turned on, in nanoseconds.
+    pub time_ns: u64,
+    pub cpu_id: usize,
+    pub kind: TraceKind,
+    pub args: [u64; 2],
+}
+
+struct Slot {
+    ticks: AtomicU64,
+    /// `0` while the slot has never been written.
+    kind: AtomicU64,
+    args: [AtomicU64; 2],
+}
+
+struct TraceBuffer {
+    slots: [Slot; TRACE_ENTRIES],
+    /// Records claimed on this CPU, ever.
+    next: AtomicUsize,
+}
+
+impl TraceBuffer {
+    const fn new() -> Self {
+        Self {
+            slots: [const {
+                Slot {
+                    ticks: AtomicU64::new(0),
+                    kind: AtomicU64::new(0),
+                    args: [const { AtomicU64::new(0) }; 2],
+                }
+            }; TRACE_ENTRIES],
+            next: AtomicUsize::new(0),
+        }
+    }
+}
+
+static BUFFERS: [TraceBuffer; TINYENV_SMP] = [const { TraceBuffer::new() }; TINYENV_SMP];
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+/// Counter value when tracing was last turned on.
+static START_TICKS: AtomicU64 = AtomicU64::new(0);
+
+/// Records an event, if tracing is on.
+#[inline]
+pub fn record(kind: TraceKind, arg0: u64, arg1: u64) {
+    if ENABLED.load(Ordering::Relaxed) {
+        record_slow(kind, arg0, arg1);
+    }
+}
+
+#[cold]
+fn record_slow(kind: TraceKind, arg0: u64, arg1: u64) {
+    let Some(cpu_id) = percpu::try_cpu_id() else {
+        return;
+    };
+    let buffer = &BUFFERS[cpu_id];
+    let slot = &buffer.slots[buffer.next.fetch_add(1, Ordering::Relaxed) % TRACE_ENTRIES];
+    slot.ticks.store(CNTPCT_EL0.get(), Ordering::Relaxed);
+    slot.args[0].store(arg0, Ordering::Relaxed);
+    slot.args[1].store(arg1, Ordering::Relaxed);
+    slot.kind.store(kind as u64, Ordering::Release);
+}
+
+/// Turns tracing on or off. Turning it on clears the buffers.
+pub fn set_enabled(enabled: bool) {
+    if enabled {
+        clear();
+        START_TICKS.store(CNTPCT_EL0.get(), Ordering::Relaxed);
+    }
+    ENABLED.store(enabled, Ordering::Release);
+}
+
+/// Returns `true` while tracepoints record.
+pub fn is_enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// Forgets every recorded event.
+pub fn clear() {
+    for buffer in &BUFFERS {
+        for slot in &buffer.slots {
+            slot.kind.store(0, Ordering::Relaxed);
+        }
+        buffer.next.store(0, Ordering::Relaxed);
+    }
+}
+
+/// Returns the recorded events of all CPUs, oldest first.
+///
+/// Tracing should be off: events recorded meanwhile may be half written.
+pub fn snapshot() -> Vec<TraceRecord> {
+    let freq = CNTFRQ_EL0.get().max(1) as u128;
+    let start = START_TICKS.load(Ordering::Relaxed);
+    let mut records = Vec::new();
+    for (cpu_id, buffer) in BUFFERS.iter().enumerate() {
+        for slot in &buffer.slots {
+            let Some(kind) = TraceKind::from_raw(slot.kind.load(Ordering::Acquire)) else {
+                continue;
+            };
+            let ticks = slot.ticks.load(Ordering::Relaxed).saturating_sub(start);
+            records.push(TraceRecord {
+                time_ns: (ticks as u128 * 1_000_000_000 / freq) as u64,
+                cpu_id,
+                kind,
+                args: [
+                    slot.args[0].load(Ordering::Relaxed),
+                    slot.args[1].load(Ordering::Relaxed),
+                ],
+            });
+        }
+    }
+    records.sort_unstable_by_key(|record| record.time_ns);
+    records
+}
@@ -1,9 +1,14 @@
 use alloc::sync::Arc;
 use core::array;
 use core::ops::Deref;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
 use intrusive_collections::{LinkedList, LinkedListAtomicLink, intrusive_adapter};
+use provider_core::with_provider;
 
 use super::{TaskRef, task_ref::TaskInner};
+use crate::config::kernel::{RESCHED_IPI, TINYENV_SMP};
+use crate::device::provider::{IrqProvider, TimerProvider};
+use crate::hal::{Mutex, TicketNoIrq, percpu};
 
 /// A task wrapper for the [`FifoScheduler`].
 ///
@@ -29,32 +34,206 @@ impl<T> Deref for FifoTask<T> {
     }
 }
 
-intrusive_adapter!(NodeAdapter<T> = Arc<FifoTask<T>>: FifoTask<T> { link => LinkedListAtomicLink });
+intrusive_adapter!(pub(crate) NodeAdapter<T> = Arc<FifoTask<T>>: FifoTask<T> { link => LinkedListAtomicLink });
 
+/// A per-CPU ready queue.
+///
+/// Each queue has its own lock, so CPUs only contend with each other when
+/// one of them steals work. `len` mirrors the queue length and `running`
+/// tells whether the CPU is off its idle task; both can be read without
+/// taking the lock.
 struct RunQueue {
-    run_queue: LinkedList<NodeAdapter<TaskInner>>,
+    run_queue: Mutex<LinkedList<NodeAdapter<TaskInner>>>,
+    len: AtomicUsize,
+    /// Deepest the queue has been, for the scheduler statistics.
+    max_len: AtomicUsize,
+    running: AtomicBool,
+}
+
+impl RunQueue {
+    fn new() -> Self {
+        Self {
+            // Safety: run queues live in `TASK_MANAGER` for good.
+            run_queue: Mutex::const_new(
+                unsafe { TicketNoIrq::named("TASK_MANAGER") },
+                LinkedList::new(NodeAdapter::NEW),
+            ),
+            len: AtomicUsize::new(0),
+            max_len: AtomicUsize::new(0),
+            running: AtomicBool::new(false),
+        }
+    }
+
+    fn len(&self) -> usize {
+        self.len.load(Ordering::Relaxed)
+    }
+
+    /// Number of runnable tasks on this CPU, counting the one it is running.
+    fn load(&self) -> usize {
+        self.len() + self.running.load(Ordering::Relaxed) as usize
+    }
+
+    fn push_back(&self, task: TaskRef) {
+        let mut queue = self.run_queue.lock();
+        queue.push_back(task);
+        let len = self.len.fetch_add(1, Ordering::Relaxed) + 1;
+        self.max_len.fetch_max(len, Ordering::Relaxed);
+    }
+
+    fn pop_front(&self) -> Option<TaskRef> {
+        // Skip the lock entirely when there is nothing to take.
+        if self.len() == 0 {
+            return None;
+        }
+        let mut queue = self.run_queue.lock();
+        let task = queue.pop_front();
+        if task.is_some() {
+            self.len.fetch_sub(1, Ordering::Relaxed);
+        }
+        task
+    }
+
+    /// Takes the task nearest the back of this queue that may run on
+    /// `thief`, i.e. the one that would otherwise wait the longest.
+    ///
+    /// Uses `try_lock` so a thief never spins behind the owning CPU.
+    fn steal_back(&self, thief: usize) -> Option<TaskRef> {
+        if self.len() == 0 {
+            return None;
+        }
+        let mut queue = self.run_queue.try_lock()?;
+        let mut cursor = queue.back_mut();
+        loop {
+            let allowed = cursor.get()?.cpu_mask().contains(thief);
+            if allowed {
+                let task = cursor.remove();
+                self.len.fetch_sub(1, Ordering::Relaxed);
+                return task;
+            }
+            cursor.move_prev();
+        }
+    }
 }
 
 /// Task manager that handles all task scheduling operations.
+///
+/// The manager itself is never locked as a whole: every CPU owns one
+/// [`RunQueue`] and idle CPUs steal from the others.
 pub struct TaskManager {
     /// Scheduler for ready tasks.
-    ready_queues: [RunQueue; crate::config::kernel::TINYENV_SMP],
+    ready_queues: [RunQueue; TINYENV_SMP],
 }
 
 impl TaskManager {
     pub fn new() -> Self {
-        let ready_queues = array::from_fn(|_| RunQueue {
-            run_queue: LinkedList::new(NodeAdapter::NEW),
-        });
+        let ready_queues = array::from_fn(|_| RunQueue::new());
         Self { ready_queues }
     }
 
-    pub fn pick_next_task(&mut self, cpu_id: usize) -> Option<TaskRef> {
-        self.ready_queues[cpu_id].run_queue.pop_front()
+    /// Picks the next task for `cpu_id`, stealing from other CPUs when the
+    /// local queue is empty.
+    ///
+    /// On success the CPU counts as busy until [`TaskManager::put_idle`].
+    pub fn pick_next_task(&self, cpu_id: usize) -> Option<TaskRef> {
+        let task = self.ready_queues[cpu_id]
+            .pop_front()
+            .or_else(|| self.steal_task(cpu_id))?;
+        task.set_last_cpu(cpu_id);
+        self.ready_queues[cpu_id]
+            .running
+            .store(true, Ordering::Relaxed);
+        Some(task)
+    }
+
+    /// Returns the number of tasks waiting in the queue of `cpu_id`, and the
+    /// most that ever did.
+    pub fn queue_depth(&self, cpu_id: usize) -> (usize, usize) {
+        let queue = &self.ready_queues[cpu_id];
+        (queue.len(), queue.max_len.load(Ordering::Relaxed))
+    }
+
+    /// Returns `true` if `cpu_id` has tasks waiting in its own queue.
+    pub fn has_local_work(&self, cpu_id: usize) -> bool {
+        self.ready_queues[cpu_id].len() != 0
+    }
+
+    /// Marks `cpu_id` as back on its idle task.
+    pub fn put_idle(&self, cpu_id: usize) {
+        self.ready_queues[cpu_id]
+            .running
+            .store(false, Ordering::Relaxed);
     }
 
-    pub fn put_prev_task(&mut self, task: TaskRef, _preempt: bool) {
-        let cpu_id = task.id() % crate::config::kernel::TINYENV_SMP;
-        self.ready_queues[cpu_id].run_queue.push_back(task);
+    /// Steals one task from the other CPUs, starting with the next CPU so
+    /// that thieves spread out instead of all hitting CPU 0.
+    fn steal_task(&self, cpu_id: usize) -> Option<TaskRef> {
+        (1..TINYENV_SMP)
+            .map(|offset| (cpu_id + offset) % TINYENV_SMP)
+            .find_map(|victim| {
+                let task = self.ready_queues[victim].steal_back(cpu_id)?;
+                trace!(
+                    "CPU {} stole task id={} from CPU {}",
+                    cpu_id,
+                    task.id(),
+                    victim
+                );
+                Some(task)
+            })
+    }
+
+    /// Queues a ready task on the CPU chosen by [`TaskManager::select_cpu`]
+    /// and kicks that CPU out of `wfi` if it is idle.
+    ///
+    /// `preempt` is set when the task is being put back by the CPU that was
+    /// running it, as opposed to a spawn or a wakeup.
+    pub fn put_prev_task(&self, task: TaskRef, preempt: bool) {
+        task.stats()
+            .mark_ready(with_provider::<TimerProvider>().current_nanoseconds());
+        let this_cpu = percpu::cpu_id();
+        let cpu_id = self.select_cpu(&task, this_cpu, preempt);
+        let mask = task.cpu_mask();
+        let queue = &self.ready_queues[cpu_id];
+        queue.push_back(task);
+        if cpu_id != this_cpu {
+            if !queue.running.load(Ordering::Relaxed) {
+                with_provider::<IrqProvider>().send_sgi(RESCHED_IPI, cpu_id);
+            }
+        } else if queue.len() > 1 {
+            // Idle CPUs don't tick, so wake one up to steal the backlog.
+            if let Some(idle) = (1..TINYENV_SMP)
+                .map(|offset| (this_cpu + offset) % TINYENV_SMP)
+                .find(|&cpu_id| mask.contains(cpu_id) && self.ready_queues[cpu_id].load() == 0)
+            {
+                with_provider::<IrqProvider>().send_sgi(RESCHED_IPI, idle);
+            }
+        }
+    }
+
+    /// Chooses the run queue for `task`.
+    ///
+    /// A task put back by its own CPU stays there, since its cache is still
+    /// warm and idle CPUs will steal it if they run dry. Otherwise the least
+    /// loaded allowed CPU wins, scanning from `this_cpu` so that ties don't
+    /// all land on CPU 0, and the CPU the task last ran on is kept whenever
+    /// it is no busier than that.
+    fn select_cpu(&self, task: &TaskRef, this_cpu: usize, preempt: bool) -> usize {
+        let mask = task.cpu_mask();
+        if preempt && mask.contains(this_cpu) {
+            return this_cpu;
+        }
+
+        let (best_cpu, best_load) = (0..TINYENV_SMP)
+            .map(|offset| (this_cpu + offset) % TINYENV_SMP)
+            .filter(|&cpu_id| mask.contains(cpu_id))
+            .map(|cpu_id| (cpu_id, self.ready_queues[cpu_id].load()))
+            .min_by_key(|&(_, load)| load)
+            .unwrap_or((this_cpu, 0));
+
+        match task.last_cpu() {
+            Some(last) if mask.contains(last) && self.ready_queues[last].load() <= best_load => {
+                last
+            }
+            _ => best_cpu,
+        }
     }
 }
@@ -1,13 +1,21 @@
 #![allow(unused)]
 
 pub mod manager;
+pub mod sleep_lock;
+pub mod stack_pool;
+pub mod stats;
 pub mod task_ops;
 pub mod task_ref;
 pub mod thread;
 pub mod timers;
+pub mod wait_queue;
 
 use alloc::sync::Arc;
 
+use provider_core::with_provider;
+
+use crate::config::kernel::RESCHED_IPI;
+use crate::device::provider::IrqProvider;
 use crate::hal::percpu;
 // Re-export commonly used types and functions
 pub use crate::hal::percpu::current_task;
@@ -22,6 +30,8 @@ pub fn start_scheduling() -> ! {
 
 pub fn init_taskmanager() {
     percpu::set_current_task(&task_ops::get_idle_task());
+    // Nothing to do in the handler: taking the IRQ is enough to wake `wfi`.
+    with_provider::<IrqProvider>().register(RESCHED_IPI, |_| {});
 
     debug!("Task manager initialized on CPU 0");
 }
@@ -0,0 +1,118 @@
+//! Sleeping locks for long critical sections.
+//!
+//! Unlike the IRQ-masking spinlocks in [`crate::hal`], these leave IRQs
+//! enabled while held and park contending tasks on a wait queue, so they
+//! may be held across device I/O. Where the caller cannot block (the idle
+//! task, or IRQs masked), they fall back to spinning.
+
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use lock_api::{GuardSend, RawMutex, RawRwLock};
+
+use super::wait_queue::{WaitQueue, can_block};
+
+/// Waits on `queue` until `try_acquire` succeeds.
+fn acquire(queue: &WaitQueue, mut try_acquire: impl FnMut() -> bool) {
+    if try_acquire() {
+        return;
+    }
+    if can_block() {
+        queue.wait_until(try_acquire);
+    } else {
+        while !try_acquire() {
+            core::hint::spin_loop();
+        }
+    }
+}
+
+/// Raw sleeping mutex.
+pub struct RawSleepMutex {
+    locked: AtomicBool,
+    waiters: WaitQueue,
+}
+
+unsafe impl RawMutex for RawSleepMutex {
+    type GuardMarker = GuardSend;
+    const INIT: Self = Self {
+        locked: AtomicBool::new(false),
+        waiters: WaitQueue::new(),
+    };
+
+    fn lock(&self) {
+        acquire(&self.waiters, || self.try_lock());
+    }
+
+    fn try_lock(&self) -> bool {
+        self.locked
+            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+            .is_ok()
+    }
+
+    unsafe fn unlock(&self) {
+        self.locked.store(false, Ordering::Release);
+        self.waiters.notify_one();
+    }
+}
+
+/// Set in the reader/writer state while a writer holds the lock.
+const WRITER: usize = 1 << (usize::BITS - 1);
+
+/// Raw sleeping reader/writer lock.
+pub struct RawSleepRwLock {
+    /// Number of readers, or `WRITER`.
+    state: AtomicUsize,
+    waiters: WaitQueue,
+}
+
+unsafe impl RawRwLock for RawSleepRwLock {
+    type GuardMarker = GuardSend;
+    const INIT: Self = Self {
+        state: AtomicUsize::new(0),
+        waiters: WaitQueue::new(),
+    };
+
+    fn lock_shared(&self) {
+        acquire(&self.waiters, || self.try_lock_shared());
+    }
+
+    fn try_lock_shared(&self) -> bool {
+        let mut state = self.state.load(Ordering::Relaxed);
+        while state & WRITER == 0 {
+            match self.state.compare_exchange_weak(
+                state,
+                state + 1,
+                Ordering::Acquire,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => return true,
+                Err(current) => state = current,
+            }
+        }
+        false
+    }
+
+    unsafe fn unlock_shared(&self) {
+        if self.state.fetch_sub(1, Ordering::Release) == 1 {
+            // Only writers wait while readers hold the lock.
+            self.waiters.notify_all();
+        }
+    }
+
+    fn lock_exclusive(&self) {
+        acquire(&self.waiters, || self.try_lock_exclusive());
+    }
+
+    fn try_lock_exclusive(&self) -> bool {
+        self.state
+            .compare_exchange(0, WRITER, Ordering::Acquire, Ordering::Relaxed)
+            .is_ok()
+    }
+
+    unsafe fn unlock_exclusive(&self) {
+        self.state.store(0, Ordering::Release);
+        self.waiters.notify_all();
+    }
+}
+
+pub type SleepMutex<T> = lock_api::Mutex<RawSleepMutex, T>;
+pub type SleepRwLock<T> = lock_api::RwLock<RawSleepRwLock, T>;
@@ -0,0 +1,73 @@
+//! Recycled kernel stacks for tasks.
+//!
+//! Stacks of exited tasks are kept in a small pool and handed to the next
+//! spawned task as they are. Nothing on a fresh stack is read before it is
+//! written, so the memory is never zeroed.
+
+use alloc::alloc::{alloc, dealloc, handle_alloc_error};
+use alloc::vec::Vec;
+use core::alloc::Layout;
+use core::ptr::NonNull;
+
+use crate::{
+    config::kernel::{TASK_STACK_POOL_SIZE, TASK_STACK_SIZE},
+    hal::Mutex,
+};
+
+const STACK_LAYOUT: Layout = match Layout::from_size_align(TASK_STACK_SIZE, 16) {
+    Ok(layout) => layout,
+    Err(_) => panic!("invalid task stack layout"),
+};
+
+/// Base addresses of free stacks.
+static STACK_POOL: Mutex<Vec<usize>> = Mutex::new(Vec::new());
+
+/// A `TASK_STACK_SIZE` kernel stack, returned to the pool on drop.
+pub struct TaskStack {
+    base: NonNull<u8>,
+}
+
+// Safety: the stack memory is owned exclusively by this handle.
+unsafe impl Send for TaskStack {}
+unsafe impl Sync for TaskStack {}
+
+impl TaskStack {
+    /// Takes a stack from the pool, or allocates a new one if it is empty.
+    ///
+    /// The contents are left as they were.
+    pub fn alloc() -> Self {
+        let pooled = STACK_POOL.lock().pop();
+        let base = match pooled {
+            Some(base) => base as *mut u8,
+            None => unsafe { alloc(STACK_LAYOUT) },
+        };
+        match NonNull::new(base) {
+            Some(base) => Self { base },
+            None => handle_alloc_error(STACK_LAYOUT),
+        }
+    }
+
+    /// Returns the initial stack pointer (the stack grows down).
+    #[inline]
+    pub fn top(&self) -> usize {
+        self.base.as_ptr() as usize + TASK_STACK_SIZE
+    }
+}
+
+impl Drop for TaskStack {
+    fn drop(&mut self) {
+        let mut pool = STACK_POOL.lock();
+        if pool.len() < TASK_STACK_POOL_SIZE {
+            pool.push(self.base.as_ptr() as usize);
+            return;
+        }
+        drop(pool);
+        unsafe { dealloc(self.base.as_ptr(), STACK_LAYOUT) };
+    }
+}
+
+/// Returns the number of stacks waiting in the pool.
+#[allow(unused)]
+pub fn pooled_stacks() -> usize {
+    STACK_POOL.lock().len()
+}
@@ -0,0 +1,202 @@
+//! Scheduler accounting: per-task run time and switches, per-CPU idle time
+//! and wakeup-to-run latency histograms.
+//!
+//! Everything is kept in relaxed atomics that are only updated by the CPU
+//! doing the scheduling, so readers such as the `top` command get a
+//! slightly stale but cheap snapshot.
+
+use alloc::sync::{Arc, Weak};
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use crate::hal::Mutex;
+
+use super::{SchedulableTask, TaskRef};
+
+/// Number of latency histogram buckets. Bucket 0 counts latencies under
+/// 1 us, bucket `i` those in `[2^(i-1), 2^i)` us, and the last one
+/// everything longer.
+pub const LATENCY_BUCKETS: usize = 24;
+
+#[inline]
+fn add(counter: &AtomicU64, n: u64) {
+    counter.store(counter.load(Ordering::Relaxed) + n, Ordering::Relaxed);
+}
+
+/// Returns the histogram bucket of a latency.
+pub fn latency_bucket(latency_ns: u64) -> usize {
+    let us = latency_ns / 1000;
+    let bucket = if us == 0 {
+        0
+    } else {
+        64 - us.leading_zeros() as usize
+    };
+    bucket.min(LATENCY_BUCKETS - 1)
+}
+
+/// Accounting of one task.
+pub struct TaskStats {
+    /// When the task was last made ready, `0` while it is not waiting.
+    ready_since_ns: AtomicU64,
+    /// When the task last started running.
+    running_since_ns: AtomicU64,
+    runtime_ns: AtomicU64,
+    /// Times the task was switched to.
+    switches: AtomicU64,
+    /// Switches away that the task asked for (yield, sleep, block, exit).
+    voluntary: AtomicU64,
+    /// Switches away because the time slice ran out.
+    involuntary: AtomicU64,
+    total_latency_ns: AtomicU64,
+    max_latency_ns: AtomicU64,
+}
+
+/// A copy of [`TaskStats`] at one point in time.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct TaskStatsSnapshot {
+    pub runtime_ns: u64,
+    pub switches: u64,
+    pub voluntary: u64,
+    pub involuntary: u64,
+    pub total_latency_ns: u64,
+    pub max_latency_ns: u64,
+}
+
+impl TaskStats {
+    pub const fn new() -> Self {
+        Self {
+            ready_since_ns: AtomicU64::new(0),
+            running_since_ns: AtomicU64::new(0),
+            runtime_ns: AtomicU64::new(0),
+            switches: AtomicU64::new(0),
+            voluntary: AtomicU64::new(0),
+            involuntary: AtomicU64::new(0),
+            total_latency_ns: AtomicU64::new(0),
+            max_latency_ns: AtomicU64::new(0),
+        }
+    }
+
+    /// Notes that the task was put on a run queue at `now_ns`.
+    #[inline]
+    pub fn mark_ready(&self, now_ns: u64) {
+        self.ready_since_ns.store(now_ns, Ordering::Relaxed);
+    }
+
+    /// Notes that the task starts running at `now_ns`, and returns how long
+    /// it waited since it was made ready.
+    pub fn start_run(&self, now_ns: u64) -> Option<u64> {
+        add(&self.switches, 1);
+        self.running_since_ns.store(now_ns, Ordering::Relaxed);
+        let ready_since = self.ready_since_ns.swap(0, Ordering::Relaxed);
+        if ready_since == 0 {
+            return None;
+        }
+        let latency = now_ns.saturating_sub(ready_since);
+        add(&self.total_latency_ns, latency);
+        if latency > self.max_latency_ns.load(Ordering::Relaxed) {
+            self.max_latency_ns.store(latency, Ordering::Relaxed);
+        }
+        Some(latency)
+    }
+
+    /// Notes that the task stops running at `now_ns`, and counts the
+    /// switch away from it.
+    #[inline]
+    pub fn stop_run(&self, now_ns: u64, voluntary: bool) {
+        let running_since = self.running_since_ns.load(Ordering::Relaxed);
+        add(&self.runtime_ns, now_ns.saturating_sub(running_since));
+        add(
+            if voluntary {
+                &self.voluntary
+            } else {
+                &self.involuntary
+            },
+            1,
+        );
+    }
+
+    pub fn snapshot(&self) -> TaskStatsSnapshot {
+        TaskStatsSnapshot {
+            runtime_ns: self.runtime_ns.load(Ordering::Relaxed),
+            switches: self.switches.load(Ordering::Relaxed),
+            voluntary: self.voluntary.load(Ordering::Relaxed),
+            involuntary: self.involuntary.load(Ordering::Relaxed),
+            total_latency_ns: self.total_latency_ns.load(Ordering::Relaxed),
+            max_latency_ns: self.max_latency_ns.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Accounting of one CPU.
+pub struct CpuSchedStats {
+    idle_ns: AtomicU64,
+    /// Tasks switched to, including ones that got the CPU straight back.
+    switches: AtomicU64,
+    latency: [AtomicU64; LATENCY_BUCKETS],
+}
+
+impl CpuSchedStats {
+    const fn new() -> Self {
+        Self {
+            idle_ns: AtomicU64::new(0),
+            switches: AtomicU64::new(0),
+            latency: [const { AtomicU64::new(0) }; LATENCY_BUCKETS],
+        }
+    }
+
+    /// Time spent waiting for interrupts, in nanoseconds.
+    pub fn idle_ns(&self) -> u64 {
+        self.idle_ns.load(Ordering::Relaxed)
+    }
+
+    pub fn switches(&self) -> u64 {
+        self.switches.load(Ordering::Relaxed)
+    }
+
+    /// Counts of wakeup-to-run latencies per [`latency_bucket`].
+    pub fn latency_histogram(&self) -> [u64; LATENCY_BUCKETS] {
+        core::array::from_fn(|i| self.latency[i].load(Ordering::Relaxed))
+    }
+}
+
+crate::define_percpu! {
+    static CPU_STATS: CpuSchedStats = CpuSchedStats::new();
+}
+
+/// Returns the accounting of `cpu_id`.
+pub fn cpu_stats(cpu_id: usize) -> &'static CpuSchedStats {
+    CPU_STATS.remote(cpu_id)
+}
+
+/// Records a switch to a task on `cpu_id` that waited `latency_ns`.
+pub(crate) fn record_switch(cpu_id: usize, latency_ns: Option<u64>) {
+    let stats = cpu_stats(cpu_id);
+    add(&stats.switches, 1);
+    if let Some(latency_ns) = latency_ns {
+        add(&stats.latency[latency_bucket(latency_ns)], 1);
+    }
+}
+
+/// Adds a stretch of idling to `cpu_id`.
+pub(crate) fn record_idle(cpu_id: usize, idle_ns: u64) {
+    add(&cpu_stats(cpu_id).idle_ns, idle_ns);
+}
+
+/// Every task spawned so far that may still be alive.
+static TASKS: Mutex<Vec<Weak<SchedulableTask>>> = Mutex::new(Vec::new());
+
+/// Makes `task` show up in [`tasks`].
+pub(crate) fn register_task(task: &TaskRef) {
+    let mut tasks = TASKS.lock();
+    // Drop dead entries whenever the list doubles, so it stays
+    // proportional to the live tasks.
+    if tasks.len() >= 64 && tasks.len().is_power_of_two() {
+        tasks.retain(|task| task.strong_count() > 0);
+    }
+    tasks.push(Arc::downgrade(task));
+}
+
+/// Returns the tasks that are still alive, oldest first.
+pub fn tasks() -> Vec<TaskRef> {
+    TASKS.lock().iter().filter_map(Weak::upgrade).collect()
+}
@@ -2,14 +2,14 @@ use alloc::sync::Arc;
 use provider_core::with_provider;
 
 use crate::{
-    config::kernel::TINYENV_SMP,
-    device::provider::{PowerProvider, TimerProvider},
-    hal::Mutex,
+    config::kernel::{RESCHED_IPI, SCHED_SLICE_TICKS, TICKS_PER_SEC, TINYENV_SMP},
+    device::provider::{IrqProvider, PowerProvider, TimerProvider},
     task::{
         manager::TaskManager,
-        task_ref::TaskState,
+        stats,
+        task_ref::{CpuMask, TaskState},
         thread::JoinHandle,
-        timers::{check_events, set_timer},
+        timers::{check_events, reprogram, set_timer},
     },
 };
 
@@ -27,6 +27,9 @@ static TASK_PID: AtomicUsize = AtomicUsize::new(1);
 
 static ACTIVE_TASK_COUNT: AtomicUsize = AtomicUsize::new(0);
 
+/// How long a task may run before the timer tick preempts it.
+const SCHED_SLICE_NANOS: u64 = 1_000_000_000 / TICKS_PER_SEC as u64 * SCHED_SLICE_TICKS as u64;
+
 lazy_static::lazy_static! {
     /// Public lock for accessing the task manager.
     pub static ref IDLE_TASK: [Arc<FifoTask<TaskInner>>; TINYENV_SMP] = {
@@ -42,9 +45,9 @@ lazy_static::lazy_static! {
 }
 
 lazy_static::lazy_static! {
-    pub static ref TASK_MANAGER: Mutex<TaskManager> = {
-        Mutex::new(TaskManager::new())
-    };
+    /// Per-CPU run queues. Each queue carries its own lock, so there is no
+    /// global scheduler lock.
+    pub static ref TASK_MANAGER: TaskManager = TaskManager::new();
 }
 
 /// Creates a new task and returns its TaskRef.
@@ -69,36 +72,137 @@ where
     FifoTask::new(task_inner)
 }
 
-/// Timer tick handler for task scheduling.
-/// Checks and processes expired timer events to wake up sleeping tasks.
+/// Called from the timer IRQ.
+/// Wakes tasks whose sleep deadline has passed and programs the next event.
 pub fn task_timer_tick() {
     check_events();
 }
 
+/// Time slice accounting, called from the timer IRQ of each CPU.
+///
+/// Only flags the current task; the switch itself happens in
+/// [`task_preempt`] on the way out of the IRQ handler.
+pub fn task_scheduler_tick(now_ns: u64) {
+    crate::hal::percpu::check_time_slice(now_ns);
+}
+
+/// Preempts the current task if its time slice has run out.
+///
+/// Called at the end of the IRQ handler, on the interrupted task's stack.
+/// The trap frame stays there while the task is switched out, and the
+/// interrupted code resumes through the normal IRQ return once the task
+/// is picked again.
+pub fn task_preempt() {
+    if !crate::hal::percpu::take_need_resched() {
+        return;
+    }
+    let curr_task = crate::hal::percpu::current_task();
+    // The idle task just polls for work, and a task that is halfway into
+    // sleeping or exiting is already leaving the CPU.
+    if curr_task.is_idle() || !curr_task.try_set_state(TaskState::Running, TaskState::Ready) {
+        return;
+    }
+
+    trace!(
+        "Task Preempted: id={}, name={}, cpu={}",
+        curr_task.id(),
+        curr_task.name(),
+        crate::hal::percpu::cpu_id()
+    );
+
+    TASK_MANAGER.put_prev_task(curr_task.clone(), true);
+    task_switch_out(&curr_task, false);
+}
+
 /// Spawns a new user task with the given entry function.
 /// Adds the task to the ready queue and returns a JoinHandle for synchronization.
 pub fn task_spawn<F, T>(name: &'static str, f: F) -> JoinHandle<T>
+where
+    F: FnOnce() -> T + Send + 'static,
+    T: Send + 'static,
+{
+    task_spawn_on(name, CpuMask::all(), f)
+}
+
+/// Spawns a new user task that may only run on the CPUs in `cpu_mask`.
+pub fn task_spawn_on<F, T>(name: &'static str, cpu_mask: CpuMask, f: F) -> JoinHandle<T>
 where
     F: FnOnce() -> T + Send + 'static,
     T: Send + 'static,
 {
     let task = super::task_ops::task_create(name, f, false);
-    let mut manager = TASK_MANAGER.lock();
+    task.set_cpu_mask(cpu_mask);
     let task_ref = Arc::new(task);
-    manager.put_prev_task(task_ref.clone(), false);
+    stats::register_task(&task_ref);
     ACTIVE_TASK_COUNT.fetch_add(1, Ordering::SeqCst);
+    TASK_MANAGER.put_prev_task(task_ref.clone(), false);
     JoinHandle::new(task_ref)
 }
 
-/// Switches the current task back to the idle task.
-/// Called when a task yields, sleeps, or exits.
-fn task_drop_to_idle(curr_task: &TaskRef) {
-    let idle_task = get_idle_task();
-    curr_task.switch_to(&idle_task);
+/// Spawns a new user task that runs in the address space of `page_table`.
+pub fn task_spawn_in<F, T>(
+    name: &'static str,
+    page_table: Arc<crate::mm::page_table::PageTable>,
+    f: F,
+) -> JoinHandle<T>
+where
+    F: FnOnce() -> T + Send + 'static,
+    T: Send + 'static,
+{
+    let task = super::task_ops::task_create(name, f, false);
+    task.set_page_table(page_table);
+    let task_ref = Arc::new(task);
+    stats::register_task(&task_ref);
+    ACTIVE_TASK_COUNT.fetch_add(1, Ordering::SeqCst);
+    TASK_MANAGER.put_prev_task(task_ref.clone(), false);
+    JoinHandle::new(task_ref)
+}
+
+/// Starts the time slice of `next` on `cpu_id` and switches to it.
+fn run_task(curr_task: &TaskInner, next: &TaskRef, cpu_id: usize, now_ns: u64) {
+    next.set_state(TaskState::Running);
+    stats::record_switch(cpu_id, next.stats().start_run(now_ns));
+    crate::hal::percpu::start_time_slice(now_ns + SCHED_SLICE_NANOS);
+    reprogram();
+    curr_task.switch_to(next);
+}
+
+/// Switches the current task out.
+/// Called when a task yields, sleeps, blocks or exits (`voluntary`), or is
+/// preempted.
+///
+/// Goes straight to the next ready task, and to the idle task only when
+/// no CPU has one to spare. A task that was woken or put back and comes
+/// up again just keeps running. An exited task's stack is released by
+/// [`finish_switch`](super::task_ref::finish_switch) on the stack of
+/// whichever task runs next.
+fn task_switch_out(curr_task: &TaskInner, voluntary: bool) {
+    let cpu_id = crate::hal::percpu::cpu_id();
+    let now_ns = with_provider::<TimerProvider>().current_nanoseconds();
+    curr_task.stats().stop_run(now_ns, voluntary);
+
+    match TASK_MANAGER.pick_next_task(cpu_id) {
+        Some(next) if next.id() == curr_task.id() => {
+            next.set_state(TaskState::Running);
+            stats::record_switch(cpu_id, next.stats().start_run(now_ns));
+            crate::hal::percpu::start_time_slice(now_ns + SCHED_SLICE_NANOS);
+            reprogram();
+        }
+        // `next` is still being switched out by another CPU, which may in
+        // turn be waiting for this task. Save this one first by going
+        // through idle, which will pick `next` again.
+        Some(next) if next.on_cpu() => {
+            TASK_MANAGER.put_prev_task(next, true);
+            curr_task.switch_to(&IDLE_TASK[cpu_id]);
+        }
+        Some(next) => run_task(curr_task, &next, cpu_id, now_ns),
+        // The idle task marks the CPU idle once it is back on it.
+        None => curr_task.switch_to(&IDLE_TASK[cpu_id]),
+    }
 }
 
 /// Voluntarily yields the CPU to other tasks.
-/// Puts the current task back into the ready queue and switches to idle.
+/// Puts the current task back into the ready queue and switches to the next one.
 pub fn task_yield() {
     let curr_task = crate::hal::percpu::current_task();
     let cpu_id = crate::hal::percpu::cpu_id();
@@ -114,13 +218,69 @@ pub fn task_yield() {
     );
 
     curr_task.set_state(TaskState::Ready);
-    TASK_MANAGER.lock().put_prev_task(curr_task.clone(), true);
+    TASK_MANAGER.put_prev_task(curr_task.clone(), true);
+
+    task_switch_out(&curr_task, true);
+}
+
+/// Switches away from the current task, which the caller has already
+/// marked [`TaskState::Blocked`] and parked on a wait queue.
+pub fn task_block(curr_task: &TaskRef) {
+    assert!(!curr_task.is_idle());
+
+    debug!(
+        "Task Blocked: id={}, name={}, cpu={}",
+        curr_task.id(),
+        curr_task.name(),
+        crate::hal::percpu::cpu_id()
+    );
 
-    task_drop_to_idle(&curr_task);
+    task_switch_out(curr_task, true);
+}
+
+/// Switches from the current task, which the caller has already marked
+/// [`TaskState::Blocked`] and parked, straight to `next`, a blocked task
+/// the caller has taken off its queue. `next` gets the rest of the time
+/// slice and skips the run queue.
+///
+/// When `next` cannot run here right away, because it may not run on this
+/// CPU or another CPU is still switching away from it, it is woken the
+/// normal way instead.
+pub fn task_handoff(curr_task: &TaskRef, next: TaskRef) {
+    assert!(!curr_task.is_idle());
+    let cpu_id = crate::hal::percpu::cpu_id();
+
+    if next.on_cpu() || !next.cpu_mask().contains(cpu_id) {
+        task_unblock(next);
+        task_block(curr_task);
+        return;
+    }
+
+    trace!(
+        "Task Handoff: from id={} to id={}, cpu={}",
+        curr_task.id(),
+        next.id(),
+        cpu_id
+    );
+
+    let now_ns = with_provider::<TimerProvider>().current_nanoseconds();
+    curr_task.stats().stop_run(now_ns, true);
+    next.set_state(TaskState::Running);
+    stats::record_switch(cpu_id, next.stats().start_run(now_ns));
+    curr_task.switch_to(&next);
+}
+
+/// Makes a blocked task ready again.
+///
+/// Does nothing if the task has been woken already.
+pub fn task_unblock(task: TaskRef) {
+    if task.try_set_state(TaskState::Blocked, TaskState::Ready) {
+        TASK_MANAGER.put_prev_task(task, false);
+    }
 }
 
 /// Handles task exit and cleanup.
-/// Sets the task state to Exited and switches to idle. Shuts down the system if no tasks remain.
+/// Sets the task state to Exited and switches to the next task. Shuts down the system if no tasks remain.
 pub fn task_exit(curr_task: TaskRef) {
     let cpu_id = crate::hal::percpu::cpu_id();
     debug!(
@@ -134,20 +294,28 @@ pub fn task_exit(curr_task: TaskRef) {
     assert!(curr_task.state() == TaskState::Running);
 
     curr_task.set_state(TaskState::Exited);
+    curr_task.exit_wait().notify_all();
 
     let remaining = ACTIVE_TASK_COUNT.fetch_sub(1, Ordering::SeqCst) - 1;
     if remaining == 0 {
         debug!("All tasks have exited. System will halt.");
+        crate::console::flush();
         with_provider::<PowerProvider>().system_off();
     }
 
-    task_drop_to_idle(&curr_task);
+    // This frame never returns, so drop its reference by hand. The per-CPU
+    // current-task reference keeps the task alive until the switch is done.
+    let curr_task = Arc::into_raw(curr_task);
+    unsafe {
+        Arc::decrement_strong_count(curr_task);
+        task_switch_out(&*curr_task, true);
+    }
 
     unreachable!("task exited!");
 }
 
 /// Puts the current task to sleep for the specified duration.
-/// Sets a timer and switches to idle until the deadline is reached.
+/// Sets a timer and switches to other tasks until the deadline is reached.
 pub fn task_sleep(duration: Duration) {
     let nanos = duration.as_nanos() as u64;
     let curr_task = crate::hal::percpu::current_task();
@@ -168,14 +336,22 @@ pub fn task_sleep(duration: Duration) {
     );
 
     curr_task.set_state(TaskState::Sleeping);
-    set_timer(deadline_ns, &curr_task);
+    if set_timer(deadline_ns, &curr_task).is_none() {
+        // The deadline already passed, nothing would ever wake us.
+        curr_task.set_state(TaskState::Running);
+        return;
+    }
 
-    task_drop_to_idle(&curr_task);
+    task_switch_out(&curr_task, true);
 }
 
 /// Starts the task scheduling system.
 /// Enters the idle loop and never returns.
 pub fn task_start() -> ! {
+    // SGIs are banked per CPU, so every CPU enables its own.
+    with_provider::<IrqProvider>().enable(RESCHED_IPI, 0x80);
+    crate::console::log_ring::init_cpu();
+    crate::profile::init_cpu();
     idle_loop();
 
     // unreachable!("IDLE Task exited!");
@@ -192,21 +368,30 @@ pub(crate) fn idle_loop() -> ! {
     let cpu_id = crate::hal::percpu::cpu_id();
     debug!("Starting idle loop on CPU {}", cpu_id);
     loop {
-        let pick_task = TASK_MANAGER.lock().pick_next_task(cpu_id);
+        let pick_task = TASK_MANAGER.pick_next_task(cpu_id);
         if let Some(task) = pick_task {
             let idle_task = get_idle_task();
-            task.set_state(TaskState::Running);
-            trace!(
-                "Idle Loop: Switching from idle to task id={},state={:?}",
-                task.id(),
-                task.state()
-            );
-            // with_provider::<TimerProvider>().busy_wait(Duration::from_nanos(10));
-            idle_task.switch_to(&task);
+            trace!("Idle Loop: Switching from idle to task id={}", task.id());
+            let now_ns = with_provider::<TimerProvider>().current_nanoseconds();
+            run_task(&idle_task, &task, cpu_id, now_ns);
+            // Tasks switch among themselves, so getting back here means the
+            // last one found nothing else to run.
+            TASK_MANAGER.put_idle(cpu_id);
+            crate::hal::percpu::start_time_slice(u64::MAX);
+            reprogram();
 
             continue;
         }
-        // No task available, wait for interrupt
-        aarch64_cpu::asm::wfi();
+        // No task available, wait for interrupt. IRQs stay masked between
+        // the re-check and `wfi`, so a reschedule IPI raised in that window
+        // is left pending and wakes `wfi` instead of being consumed early.
+        crate::hal::cpu::disable_irqs();
+        if !TASK_MANAGER.has_local_work(cpu_id) {
+            let idle_start = with_provider::<TimerProvider>().current_nanoseconds();
+            aarch64_cpu::asm::wfi();
+            let idle_end = with_provider::<TimerProvider>().current_nanoseconds();
+            stats::record_idle(cpu_id, idle_end - idle_start);
+        }
+        crate::hal::cpu::enable_irqs();
     }
 }
@@ -1,20 +1,66 @@
 use core::{
     any::Any,
     cell::UnsafeCell,
-    sync::atomic::{AtomicU8, Ordering},
+    sync::atomic::{AtomicBool, AtomicU8, AtomicU64, AtomicUsize, Ordering},
 };
 
-use alloc::{boxed::Box, vec::Vec};
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use lazyinit::LazyInit;
 
 use crate::{
-    config::kernel::TASK_STACK_SIZE,
-    hal::{Mutex, context::TaskContext, percpu},
-    task::TaskRef,
+    config::kernel::TINYENV_SMP,
+    hal::{
+        Mutex,
+        context::TaskContext,
+        cpu::{enable_irqs, local_irq_restore, local_irq_save},
+        percpu,
+    },
+    ipc::IpcSlot,
+    mm::page_table::{self, PageTable},
+    profile::{TraceKind, trace},
+    task::{TaskRef, stack_pool::TaskStack, stats::TaskStats, wait_queue::WaitQueue},
 };
 
 /// Task identifier type.
 pub type TaskId = usize;
 
+/// Set of CPUs a task may run on, one bit per CPU.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct CpuMask(u64);
+
+impl CpuMask {
+    /// Every online CPU.
+    pub const fn all() -> Self {
+        if TINYENV_SMP >= 64 {
+            Self(u64::MAX)
+        } else {
+            Self((1u64 << TINYENV_SMP) - 1)
+        }
+    }
+
+    /// Only the given CPU.
+    pub const fn one(cpu_id: usize) -> Self {
+        Self::from_bits(1u64 << cpu_id)
+    }
+
+    /// Builds a mask from raw bits. Bits beyond `TINYENV_SMP` are dropped,
+    /// and a mask that ends up empty falls back to [`CpuMask::all`].
+    pub const fn from_bits(bits: u64) -> Self {
+        let bits = bits & Self::all().0;
+        if bits == 0 { Self::all() } else { Self(bits) }
+    }
+
+    /// Returns the raw bits of the mask.
+    pub const fn bits(self) -> u64 {
+        self.0
+    }
+
+    /// Returns `true` if `cpu_id` is in the mask.
+    pub const fn contains(self, cpu_id: usize) -> bool {
+        cpu_id < 64 && self.0 & (1u64 << cpu_id) != 0
+    }
+}
+
 /// Task state enumeration.
 #[repr(u8)]
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
@@ -27,6 +73,8 @@ pub enum TaskState {
     Sleeping = 2,
     /// Task has exited and is waiting for cleanup.
     Exited = 3,
+    /// Task is parked on a [`WaitQueue`], waiting to be notified.
+    Blocked = 4,
 }
 
 impl From<u8> for TaskState {
@@ -36,6 +84,7 @@ impl From<u8> for TaskState {
             1 => TaskState::Running,
             2 => TaskState::Sleeping,
             3 => TaskState::Exited,
+            4 => TaskState::Blocked,
             _ => TaskState::Ready,
         }
     }
@@ -50,6 +99,14 @@ pub struct TaskInner {
     name: &'static str,
     /// Current task state (atomic for safe concurrent access).
     state: AtomicU8,
+    /// Set while the task's context is loaded on (or being saved by) a CPU.
+    on_cpu: AtomicBool,
+    /// CPUs this task may be placed on (raw [`CpuMask`] bits).
+    cpu_mask: AtomicU64,
+    /// CPU that last picked this task, `usize::MAX` if it never ran.
+    last_cpu: AtomicUsize,
+    /// Key of the armed sleep timer, `0` if none.
+    timer_key: AtomicU64,
     /// Parent task ID.
     parent_id: TaskId,
     /// List of child task IDs.
@@ -57,13 +114,22 @@ pub struct TaskInner {
     /// Task context (registers, stack pointer, etc.).
     context: UnsafeCell<TaskContext>,
     /// Kernel stack for this task. None for ROOT which uses bootstrap stack.
-    kstack: Option<Box<[u8]>>,
+    kstack: Option<TaskStack>,
     /// Entry function pointer (type-erased closure that returns a boxed Any).
     entry: Option<Box<dyn FnOnce() -> Box<dyn Any + Send> + Send>>,
     /// Task result (type-erased return value).
     result: Mutex<Option<Box<dyn Any + Send>>>,
+    /// Tasks joining this one, woken when it exits.
+    exit_wait: WaitQueue,
+    /// User page table, set once before the task first runs. Kernel-only
+    /// tasks have none and run on whatever TTBR0 holds.
+    page_table: LazyInit<Arc<PageTable>>,
     /// is idle task
     is_idle: bool,
+    /// Run time, switch and latency accounting.
+    stats: TaskStats,
+    /// Message slot and pending reply for IPC.
+    ipc: IpcSlot,
 }
 
 // Safety: TaskInner is designed to be shared across threads with proper synchronization.
@@ -84,8 +150,8 @@ impl TaskInner {
         T: Send + 'static,
     {
         // Allocate kernel stack
-        let kstack = alloc::vec![0u8; TASK_STACK_SIZE].into_boxed_slice();
-        let kstack_top = kstack.as_ptr() as usize + TASK_STACK_SIZE;
+        let kstack = TaskStack::alloc();
+        let kstack_top = kstack.top();
 
         let mut context = TaskContext::new();
         // Initialize context with entry point and stack
@@ -103,6 +169,10 @@ impl TaskInner {
             id,
             name,
             state: AtomicU8::new(TaskState::Ready as u8),
+            on_cpu: AtomicBool::new(false),
+            cpu_mask: AtomicU64::new(CpuMask::all().bits()),
+            last_cpu: AtomicUsize::new(usize::MAX),
+            timer_key: AtomicU64::new(0),
             parent_id,
             children: Mutex::new(Vec::new()),
             context: UnsafeCell::new(context),
@@ -110,6 +180,10 @@ impl TaskInner {
             is_idle,
             entry: Some(wrapped_entry),
             result: Mutex::new(None),
+            exit_wait: WaitQueue::new(),
+            page_table: LazyInit::new(),
+            stats: TaskStats::new(),
+            ipc: IpcSlot::new(),
         }
     }
 
@@ -192,6 +266,12 @@ impl TaskInner {
         self.result.lock().take()
     }
 
+    /// Returns the queue of tasks waiting for this task to exit.
+    #[inline]
+    pub fn exit_wait(&self) -> &WaitQueue {
+        &self.exit_wait
+    }
+
     /// Checks if this is an idle task.
     ///
     /// Idle tasks have IDs in the range 0..MAX_CPUS (one per CPU).
@@ -200,11 +280,129 @@ impl TaskInner {
         self.is_idle
     }
 
+    /// Returns `true` while the task's context is live on some CPU.
+    #[inline]
+    pub fn on_cpu(&self) -> bool {
+        self.on_cpu.load(Ordering::Acquire)
+    }
+
+    /// Returns the CPUs this task may run on.
+    #[inline]
+    pub fn cpu_mask(&self) -> CpuMask {
+        CpuMask(self.cpu_mask.load(Ordering::Relaxed))
+    }
+
+    /// Restricts the task to `mask`. Takes effect the next time the task is
+    /// placed on a run queue.
+    #[inline]
+    pub fn set_cpu_mask(&self, mask: CpuMask) {
+        self.cpu_mask.store(mask.bits(), Ordering::Relaxed);
+    }
+
+    /// Returns the task's user page table, if it has one.
+    #[inline]
+    pub fn page_table(&self) -> Option<&Arc<PageTable>> {
+        self.page_table.get()
+    }
+
+    /// Gives the task a user page table. Must be called before it first runs.
+    pub fn set_page_table(&self, table: Arc<PageTable>) {
+        self.page_table.init_once(table);
+    }
+
+    /// Returns the task's scheduler accounting.
+    #[inline]
+    pub fn stats(&self) -> &TaskStats {
+        &self.stats
+    }
+
+    /// Returns the task's IPC state.
+    #[inline]
+    pub(crate) fn ipc(&self) -> &IpcSlot {
+        &self.ipc
+    }
+
+    /// Returns the CPU that last ran this task, if any.
+    #[inline]
+    pub fn last_cpu(&self) -> Option<usize> {
+        match self.last_cpu.load(Ordering::Relaxed) {
+            usize::MAX => None,
+            cpu_id => Some(cpu_id),
+        }
+    }
+
+    /// Records the CPU the task is about to run on.
+    #[inline]
+    pub fn set_last_cpu(&self, cpu_id: usize) {
+        self.last_cpu.store(cpu_id, Ordering::Relaxed);
+    }
+
+    /// Returns the key of the armed sleep timer, `0` if none.
+    #[inline]
+    pub(crate) fn timer_key(&self) -> u64 {
+        self.timer_key.load(Ordering::Acquire)
+    }
+
+    /// Records `key` as the armed sleep timer, replacing any earlier one.
+    #[inline]
+    pub(crate) fn set_timer_key(&self, key: u64) {
+        self.timer_key.store(key, Ordering::Release);
+    }
+
+    /// Disarms the timer if `key` is still the armed one.
+    ///
+    /// Returns `false` if that timer was cancelled or replaced.
+    #[inline]
+    pub(crate) fn clear_timer_key(&self, key: u64) -> bool {
+        self.timer_key
+            .compare_exchange(key, 0, Ordering::AcqRel, Ordering::Acquire)
+            .is_ok()
+    }
+
+    /// Switches from this task, which must be the current one, to `next`.
+    ///
+    /// IRQs are masked across the switch and each side restores its own
+    /// IRQ state afterwards, so a task preempted from the IRQ handler does
+    /// not leak its masked state into the task that runs next.
     pub fn switch_to(&self, next: &TaskRef) {
-        percpu::set_current_task(&next);
+        let irq_enabled = local_irq_save();
+
+        // With work stealing, `next` may have been queued by a CPU that is
+        // still switching away from it. Wait until its context is saved.
+        while next.on_cpu() {
+            core::hint::spin_loop();
+        }
+        next.on_cpu.store(true, Ordering::Relaxed);
+        trace(TraceKind::ContextSwitch, self.id() as u64, next.id() as u64);
+
+        if let Some(table) = next.page_table() {
+            page_table::switch_user(table);
+        }
+
+        // The per-CPU reference to `self` moves to the prev slot, where
+        // `finish_switch` drops it once we are off this stack.
+        percpu::switch_current_task(&next);
         unsafe {
             (*self.context_mut()).switch_to(next.context());
         }
+        finish_switch();
+        local_irq_restore(irq_enabled);
+    }
+}
+
+/// Completes a context switch on the stack of the task that was switched to.
+///
+/// Clears `on_cpu` of the previous task, which lets other CPUs run it, and
+/// drops the per-CPU reference to it. For an exited task that is usually
+/// the last one, so its stack goes back to the pool here, where nothing is
+/// running on it any more.
+pub(crate) fn finish_switch() {
+    let prev = percpu::take_prev_task_ptr();
+    if !prev.is_null() {
+        unsafe {
+            (*prev).on_cpu.store(false, Ordering::Release);
+            drop(alloc::sync::Arc::from_raw(prev));
+        }
     }
 }
 
@@ -214,6 +412,9 @@ impl TaskInner {
 /// the task's entry function and calls it, then handles task exit.
 #[unsafe(no_mangle)]
 extern "C" fn task_entry_trampoline() {
+    finish_switch();
+    // New tasks start with IRQs on, whatever state the switch left behind.
+    enable_irqs();
     let task = super::current_task();
 
     // Take and call the actual entry function, storing the result
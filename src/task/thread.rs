@@ -1,11 +1,15 @@
+use alloc::sync::Arc;
 use core::{marker::PhantomData, time::Duration};
 
 use crate::{
     hal::percpu,
-    task::task_ops::{task_sleep, task_spawn, task_yield},
+    mm::page_table::PageTable,
+    task::task_ops::{task_sleep, task_spawn, task_spawn_in, task_spawn_on, task_yield},
     task::task_ref::TaskState,
 };
 
+pub use crate::task::task_ref::CpuMask;
+
 /// A handle to a spawned task that can be used to wait for its completion
 /// and retrieve its return value.
 pub struct JoinHandle<T> {
@@ -43,10 +47,10 @@ impl<T: Send + 'static> JoinHandle<T> {
             anyhow::bail!("Cannot join thread from itself");
         }
 
-        // Poll until the target task exits
-        while self.task.state() != TaskState::Exited {
-            task_yield();
-        }
+        // Sleep until the target task exits
+        let task = &self.task;
+        task.exit_wait()
+            .wait_until(|| task.state() == TaskState::Exited);
 
         // Retrieve and downcast the result
         if let Some(result) = self.task.take_result() {
@@ -72,6 +76,26 @@ where
     task_spawn(name, f)
 }
 
+/// Spawns a new thread that may only run on the CPUs in `cpu_mask`.
+///
+/// An empty mask, or one naming only CPUs that don't exist, means any CPU.
+pub fn spawn_with_affinity<F, T>(name: &'static str, cpu_mask: CpuMask, f: F) -> JoinHandle<T>
+where
+    F: FnOnce() -> T + Send + 'static,
+    T: Send + 'static,
+{
+    task_spawn_on(name, cpu_mask, f)
+}
+
+/// Spawns a new thread that runs with `page_table` in TTBR0.
+pub fn spawn_in<F, T>(name: &'static str, page_table: Arc<PageTable>, f: F) -> JoinHandle<T>
+where
+    F: FnOnce() -> T + Send + 'static,
+    T: Send + 'static,
+{
+    task_spawn_in(name, page_table, f)
+}
+
 /// Puts the current thread to sleep for the specified duration.
 pub fn sleep(duration: Duration) {
     task_sleep(duration);
@@ -1,13 +1,35 @@
+//! Per-CPU sleep timers.
+//!
+//! Every CPU keeps its own min-heap of deadlines, so arming a timer only
+//! touches the local queue lock. Cancelling is O(1): the task forgets its
+//! timer key and the stale heap entry is dropped when it reaches the top.
+//!
+//! There is no periodic tick. After every change the CPU programs its
+//! one-shot timer for the earliest of its next deadline and the end of the
+//! running task's time slice, so an idle CPU sleeps in `wfi` until it has
+//! real work.
+
+use alloc::collections::BinaryHeap;
+use core::cmp::Ordering as CmpOrdering;
 use core::sync::atomic::{AtomicU64, Ordering};
 
 use provider_core::with_provider;
-use weak_map::WeakMap;
 
-use crate::{device::provider::TimerProvider, hal::Mutex, task::task_ref::TaskState};
+use crate::{
+    config::kernel::TINYENV_SMP,
+    device::provider::TimerProvider,
+    hal::{
+        Mutex,
+        cpu::{local_irq_restore, local_irq_save},
+        percpu,
+    },
+    task::task_ref::TaskState,
+};
 
 type WeakTaskRef = alloc::sync::Weak<super::SchedulableTask>;
 
-static TIMER_KEY: AtomicU64 = AtomicU64::new(0);
+/// Key `0` is reserved for "no timer armed".
+static TIMER_KEY: AtomicU64 = AtomicU64::new(1);
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 pub(crate) struct TimerKey {
@@ -15,55 +37,134 @@ pub(crate) struct TimerKey {
     key: u64,
 }
 
-static TIMER_WHEEL: Mutex<WeakMap<TimerKey, WeakTaskRef>> = Mutex::new(WeakMap::new());
+struct TimerEntry {
+    key: TimerKey,
+    task: WeakTaskRef,
+}
+
+impl PartialEq for TimerEntry {
+    fn eq(&self, other: &Self) -> bool {
+        self.key == other.key
+    }
+}
+
+impl Eq for TimerEntry {}
+
+impl PartialOrd for TimerEntry {
+    fn partial_cmp(&self, other: &Self) -> Option<CmpOrdering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for TimerEntry {
+    /// Reversed, so that [`BinaryHeap`] pops the earliest deadline first.
+    fn cmp(&self, other: &Self) -> CmpOrdering {
+        other.key.cmp(&self.key)
+    }
+}
+
+static TIMER_QUEUES: [Mutex<BinaryHeap<TimerEntry>>; TINYENV_SMP] =
+    [const { Mutex::new(BinaryHeap::new()) }; TINYENV_SMP];
 
+fn current_nanoseconds() -> u64 {
+    with_provider::<TimerProvider>().current_nanoseconds()
+}
+
+/// Arms a timer on the current CPU that wakes `task` at `deadline`.
+///
+/// Arming a new timer for a task replaces the one it had before.
 pub(crate) fn set_timer(deadline: u64, task: &super::TaskRef) -> Option<TimerKey> {
-    if deadline <= with_provider::<TimerProvider>().current_nanoseconds() {
+    if deadline <= current_nanoseconds() {
         return None;
     }
 
-    let mut wheel = TIMER_WHEEL.lock();
     let key = TimerKey {
         deadline,
-        key: TIMER_KEY.fetch_add(1, Ordering::AcqRel),
+        key: TIMER_KEY.fetch_add(1, Ordering::Relaxed),
     };
-    wheel.insert(key, task);
+    task.set_timer_key(key.key);
+
+    // Stay on this CPU until its hardware timer has been programmed.
+    let irq_enabled = local_irq_save();
+    let mut queue = TIMER_QUEUES[percpu::cpu_id()].lock();
+    let is_earliest = queue.peek().is_none_or(|head| head.key > key);
+    queue.push(TimerEntry {
+        key,
+        task: alloc::sync::Arc::downgrade(task),
+    });
+    let next = queue.peek().map(|head| head.key.deadline);
+    drop(queue);
+
+    if is_earliest {
+        program_next_event(next);
+    }
+    local_irq_restore(irq_enabled);
 
     Some(key)
 }
 
+/// Disarms the pending timer of `task`, if any.
 #[allow(unused)]
-pub(crate) fn cancel_timer(key: &TimerKey) {
-    let mut wheel = TIMER_WHEEL.lock();
-    wheel.remove(key);
+pub(crate) fn cancel_timer(task: &super::TaskRef) {
+    task.set_timer_key(0);
 }
 
+/// Returns `true` if `task` has a timer that has not fired yet.
 #[allow(unused)]
-pub(crate) fn has_timer(key: &TimerKey) -> bool {
-    TIMER_WHEEL.lock().contains_key(key)
+pub(crate) fn has_timer(task: &super::TaskRef) -> bool {
+    task.timer_key() != 0
 }
 
+/// Wakes every task on this CPU whose deadline has passed, then programs
+/// the next one-shot event.
 pub(crate) fn check_events() {
-    let mut wheel = TIMER_WHEEL.lock();
-    for (key, maybe_task) in &mut *wheel {
-        if key.deadline <= with_provider::<TimerProvider>().current_nanoseconds() {
-            if let Some(task) = maybe_task.upgrade() {
-                // task_unblock(&task);
-                if task.try_set_state(TaskState::Sleeping, TaskState::Ready) {
-                    super::task_ops::TASK_MANAGER
-                        .lock()
-                        .put_prev_task(task.clone(), false);
-                    core::mem::take(maybe_task);
-                } else {
-                    error!(
-                        "Failed to wake up task id={} from timer: current state={:?}",
-                        task.id(),
-                        task.state()
-                    );
-                }
-            }
+    let now = current_nanoseconds();
+    let mut queue = TIMER_QUEUES[percpu::cpu_id()].lock();
+    while queue.peek().is_some_and(|head| head.key.deadline <= now) {
+        let entry = queue.pop().unwrap();
+        let Some(task) = entry.task.upgrade() else {
+            continue;
+        };
+        // A cancelled or re-armed timer leaves a stale entry behind.
+        if !task.clear_timer_key(entry.key.key) {
+            continue;
+        }
+        if task.try_set_state(TaskState::Sleeping, TaskState::Ready) {
+            super::task_ops::TASK_MANAGER.put_prev_task(task, false);
         } else {
-            break;
+            error!(
+                "Failed to wake up task id={} from timer: current state={:?}",
+                task.id(),
+                task.state()
+            );
         }
     }
+    let next = queue.peek().map(|head| head.key.deadline);
+    drop(queue);
+
+    program_next_event(next);
+}
+
+/// Reprograms this CPU's one-shot timer after the time slice changed.
+pub(crate) fn reprogram() {
+    let next = TIMER_QUEUES[percpu::cpu_id()]
+        .lock()
+        .peek()
+        .map(|head| head.key.deadline);
+    program_next_event(next);
+}
+
+/// Programs the one-shot timer for the earlier of `next_timer` and the end
+/// of the current time slice.
+///
+/// A slice that has already run out is ignored: its IRQ has been taken and
+/// the task is about to be preempted.
+fn program_next_event(next_timer: Option<u64>) {
+    let now = current_nanoseconds();
+    let mut deadline = next_timer.unwrap_or(u64::MAX);
+    let slice_end = percpu::slice_end_ns();
+    if slice_end > now {
+        deadline = deadline.min(slice_end);
+    }
+    with_provider::<TimerProvider>().set_oneshot_timer(deadline);
 }
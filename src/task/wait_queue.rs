@@ -0,0 +1,87 @@
+//! Wait queues for blocking tasks until an event happens.
+//!
+//! A blocked task is parked on the queue through the same intrusive link
+//! the run queues use (a task is never on both), so waiting and waking
+//! allocate nothing and a wakeup is a single enqueue on a run queue.
+
+use intrusive_collections::LinkedList;
+
+use super::manager::NodeAdapter;
+use super::task_ops::{task_block, task_unblock};
+use super::task_ref::{TaskInner, TaskState};
+use crate::hal::{Mutex, cpu::irqs_disabled, percpu};
+
+/// Returns `true` if the current context may block on a wait queue.
+///
+/// The idle task never blocks, and neither does code running with IRQs
+/// masked (under a spinlock or in an IRQ handler), as it could not be woken.
+pub fn can_block() -> bool {
+    !irqs_disabled() && !percpu::current_task().is_idle()
+}
+
+/// A queue of tasks waiting for an event.
+pub struct WaitQueue {
+    waiters: Mutex<LinkedList<NodeAdapter<TaskInner>>>,
+}
+
+impl WaitQueue {
+    /// Creates an empty wait queue.
+    pub const fn new() -> Self {
+        Self {
+            waiters: Mutex::new(LinkedList::new(NodeAdapter::NEW)),
+        }
+    }
+
+    /// Blocks the current task until `condition` returns `true`.
+    ///
+    /// `condition` is evaluated with the queue locked, and notifiers take
+    /// the same lock, so a wakeup between the check and blocking is never
+    /// lost. It must not block itself.
+    pub fn wait_until<F>(&self, mut condition: F)
+    where
+        F: FnMut() -> bool,
+    {
+        let curr_task = percpu::current_task();
+        assert!(!curr_task.is_idle(), "Idle task cannot block");
+        loop {
+            let mut waiters = self.waiters.lock();
+            if condition() {
+                return;
+            }
+            curr_task.set_state(TaskState::Blocked);
+            waiters.push_back(curr_task.clone());
+            drop(waiters);
+
+            task_block(&curr_task);
+        }
+    }
+
+    /// Wakes the task that has waited the longest.
+    ///
+    /// Returns `false` if no task was waiting.
+    pub fn notify_one(&self) -> bool {
+        let task = self.waiters.lock().pop_front();
+        match task {
+            Some(task) => {
+                task_unblock(task);
+                true
+            }
+            None => false,
+        }
+    }
+
+    /// Wakes every waiting task.
+    pub fn notify_all(&self) {
+        let waiters =
+            core::mem::replace(&mut *self.waiters.lock(), LinkedList::new(NodeAdapter::NEW));
+        for task in waiters {
+            task_unblock(task);
+        }
+    }
+}
+
+impl Default for WaitQueue {
+    fn default() -> Self {
+        Self::new()
+    }
+}
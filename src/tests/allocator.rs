@@ -46,6 +46,8 @@ impl AllocatorTestSuite {
         self.test_large_allocation();
         self.test_many_small_allocations();
         self.test_zero_size_allocation();
+        self.test_slab_cache();
+        self.test_frame_allocator();
 
         self.print_results();
     }
@@ -308,6 +310,120 @@ impl AllocatorTestSuite {
     }
 
     /// Print test results.
+    /// Per-CPU slab cache test: repeated small allocations should be served
+    /// from the cache, not from talc.
+    fn test_slab_cache(&mut self) {
+        let test_name = "Per-CPU slab cache test";
+        info!("Running test: {}", test_name);
+
+        let mut passed = true;
+        let mut error_msg = None;
+
+        let before = crate::mm::allocator::slab_stats();
+        for round in 0..100u64 {
+            let boxes: Vec<Box<[u64; 8]>> = (0..16).map(|i| Box::new([round + i; 8])).collect();
+            if boxes
+                .iter()
+                .enumerate()
+                .any(|(i, b)| b[7] != round + i as u64)
+            {
+                passed = false;
+                error_msg = Some("Cached object corrupted");
+                break;
+            }
+        }
+        let after = crate::mm::allocator::slab_stats();
+
+        for (old, new) in before.iter().zip(after.iter()) {
+            let hits = new.hits - old.hits;
+            let misses = new.misses - old.misses;
+            if hits + misses != 0 {
+                info!(
+                    "  {:>4} B class: {} hits, {} misses ({}% hit rate)",
+                    new.size,
+                    hits,
+                    misses,
+                    hits * 100 / (hits + misses)
+                );
+            }
+        }
+
+        // 64-byte boxes land in the 64 B class (index 2).
+        if passed && after[2].hits - before[2].hits < after[2].misses - before[2].misses {
+            passed = false;
+            error_msg = Some("Slab cache mostly missed");
+        }
+
+        self.results
+            .push(TestResult::new(test_name, passed, error_msg));
+    }
+
+    /// Physical frame allocator test.
+    fn test_frame_allocator(&mut self) {
+        use crate::mm::frame::{self, FRAME_SIZE};
+
+        let test_name = "Physical frame allocator test";
+        info!("Running test: {}", test_name);
+
+        let mut passed = true;
+        let mut error_msg = None;
+
+        let before = frame::frame_stats();
+        info!("  {} frames total, {} free", before.total, before.free);
+
+        // Single frames, through the per-CPU cache.
+        let frames: Vec<_> = (0..64).filter_map(|_| frame::alloc_frame()).collect();
+        if frames.len() != 64 {
+            passed = false;
+            error_msg = Some("Single frame allocation failed");
+        }
+        let mut sorted: Vec<usize> = frames.iter().map(|f| f.as_usize()).collect();
+        sorted.sort_unstable();
+        sorted.dedup();
+        if passed && (sorted.len() != frames.len() || sorted.iter().any(|f| f % FRAME_SIZE != 0)) {
+            passed = false;
+            error_msg = Some("Duplicate or misaligned frame");
+        }
+        for &paddr in &frames {
+            frame::free_frame(paddr);
+        }
+
+        // A 2MB-aligned contiguous run.
+        const BLOCK_FRAMES: usize = 512;
+        match frame::alloc_frames(BLOCK_FRAMES, BLOCK_FRAMES) {
+            Some(paddr) if passed => {
+                if paddr.as_usize() % (BLOCK_FRAMES * FRAME_SIZE) != 0 {
+                    passed = false;
+                    error_msg = Some("Contiguous frames misaligned");
+                }
+                let vaddr = crate::mm::phys_to_virt(paddr).as_mut_ptr();
+                unsafe {
+                    core::ptr::write_bytes(vaddr, 0xa5, BLOCK_FRAMES * FRAME_SIZE);
+                    if *vaddr.add(BLOCK_FRAMES * FRAME_SIZE - 1) != 0xa5 {
+                        passed = false;
+                        error_msg = Some("Contiguous frames not writable");
+                    }
+                }
+                frame::free_frames(paddr, BLOCK_FRAMES);
+            }
+            Some(paddr) => frame::free_frames(paddr, BLOCK_FRAMES),
+            None => {
+                passed = false;
+                error_msg = Some("Contiguous frame allocation failed");
+            }
+        }
+
+        // Cached single frames are counted as used, so allow for them.
+        let after = frame::frame_stats();
+        if passed && after.free + 64 < before.free {
+            passed = false;
+            error_msg = Some("Frames leaked");
+        }
+
+        self.results
+            .push(TestResult::new(test_name, passed, error_msg));
+    }
+
     fn print_results(&self) {
         info!("=== Memory Allocator Test Results ===");
 
@@ -0,0 +1,423 @@
+//! Benchmark suite with machine-readable results.
+//!
+//! Every result is printed on the console as one JSON object per line:
+//!
+//! ```text
+//! {"bench":"yield","metric":"latency","value":812,"unit":"ns","better":"lower"}
+//! ```
+//!
+//! and the run ends with `{"bench_done":<results>}`, so `cargo xtask bench`
+//! can pick the results out of the boot log and compare them against a
+//! baseline. Values are integers; the kernel is built soft-float.
+
+use alloc::vec::Vec;
+use core::sync::atomic::{AtomicU64, Ordering};
+use core::time::Duration;
+
+use arm_gic::IntId;
+use provider_core::with_provider;
+
+use crate::config::kernel::TINYENV_SMP;
+use crate::device::provider::{BlockProvider, IrqProvider, TimerProvider};
+use crate::fs;
+use crate::hal::Mutex;
+use crate::task::thread::{self, CpuMask};
+
+/// SGI the IRQ latency bench sends; the kernel uses 1, 2 and 4.
+const BENCH_IPI: IntId = IntId::sgi(3);
+
+fn now_ns() -> u64 {
+    with_provider::<TimerProvider>().current_nanoseconds()
+}
+
+/// Whether a smaller or a larger value is an improvement.
+#[derive(Clone, Copy)]
+enum Better {
+    Lower,
+    Higher,
+}
+
+/// Prints the results of one bench.
+struct Report {
+    bench: &'static str,
+    results: usize,
+}
+
+impl Report {
+    fn record(&mut self, metric: &str, value: u64, unit: &str, better: Better) {
+        let better = match better {
+            Better::Lower => "lower",
+            Better::Higher => "higher",
+        };
+        println!(
+            "{{\"bench\":\"{}\",\"metric\":\"{}\",\"value\":{},\"unit\":\"{}\",\"better\":\"{}\"}}",
+            self.bench, metric, value, unit, better
+        );
+        self.results += 1;
+    }
+
+    /// Records a duration in nanoseconds.
+    fn latency(&mut self, metric: &str, ns: u64) {
+        self.record(metric, ns, "ns", Better::Lower);
+    }
+
+    /// Records a rate, `count` things in `ns` nanoseconds, per second.
+    fn rate(&mut self, metric: &str, count: u64, ns: u64, unit: &str) {
+        let per_sec = (count as u128 * 1_000_000_000 / ns.max(1) as u128) as u64;
+        self.record(metric, per_sec, unit, Better::Higher);
+    }
+}
+
+struct Bench {
+    name: &'static str,
+    run: fn(&mut Report),
+    /// Overwrites part of the disk under the filesystem, so it only runs
+    /// when asked to.
+    raw_disk: bool,
+}
+
+static BENCHES: &[Bench] = &[
+    Bench {
+        name: "yield",
+        run: bench_yield,
+        raw_disk: false,
+    },
+    Bench {
+        name: "spawn",
+        run: bench_spawn,
+        raw_disk: false,
+    },
+    Bench {
+        name: "alloc",
+        run: bench_alloc,
+        raw_disk: false,
+    },
+    Bench {
+        name: "timer",
+        run: bench_timer,
+        raw_disk: false,
+    },
+    Bench {
+        name: "irq",
+        run: bench_irq,
+        raw_disk: false,
+    },
+    Bench {
+        name: "lock",
+        run: bench_lock,
+        raw_disk: false,
+    },
+    Bench {
+        name: "block",
+        run: bench_block,
+        raw_disk: true,
+    },
+    Bench {
+        name: "fs",
+        run: bench_fs,
+        raw_disk: false,
+    },
+];
+
+/// Returns the names of the benches, in the order they run.
+pub fn bench_names() -> impl Iterator<Item = &'static str> {
+    BENCHES.iter().map(|bench| bench.name)
+}
+
+/// Runs the benches named in `filter`, or all of them if it is empty, and
+/// returns the number of results printed. Benches that write to the raw
+/// disk are skipped unless `raw_disk` is set.
+pub fn run_benches(filter: &[&str], raw_disk: bool) -> usize {
+    let mut results = 0;
+    for bench in BENCHES {
+        if !filter.is_empty() && !filter.contains(&bench.name) {
+            continue;
+        }
+        if bench.raw_disk && !raw_disk {
+            warn!(
+                "[Bench] {} writes to the raw disk, skipping without --raw-disk",
+                bench.name
+            );
+            continue;
+        }
+        let mut report = Report {
+            bench: bench.name,
+            results: 0,
+        };
+        (bench.run)(&mut report);
+        results += report.results;
+    }
+    println!("{{\"bench_done\":{}}}", results);
+    results
+}
+
+/// Two tasks on one CPU yielding to each other: the cost of a context
+/// switch.
+fn bench_yield(report: &mut Report) {
+    const ROUNDS: u64 = 10_000;
+
+    let cpu_mask = CpuMask::one(TINYENV_SMP - 1);
+    let start = now_ns();
+    let handles: Vec<_> = (0..2)
+        .map(|_| {
+            thread::spawn_with_affinity("Bench Yield", cpu_mask, || {
+                for _ in 0..ROUNDS {
+                    thread::yield_now();
+                }
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+    report.latency("latency", (now_ns() - start) / (2 * ROUNDS));
+}
+
+/// Spawning and joining an empty task.
+fn bench_spawn(report: &mut Report) {
+    const ROUNDS: u64 = 1000;
+
+    let start = now_ns();
+    for _ in 0..ROUNDS {
+        thread::spawn("Bench Spawn", || {}).join().unwrap();
+    }
+    report.latency("spawn_join", (now_ns() - start) / ROUNDS);
+}
+
+/// Allocates and frees `rounds` blocks of each size, and returns how many
+/// allocations that was.
+fn alloc_loop(rounds: u64) -> u64 {
+    const SIZES: [usize; 4] = [16, 64, 512, 4096];
+    let mut live = Vec::with_capacity(16);
+    for _ in 0..rounds {
+        for size in SIZES {
+            live.push(alloc::vec![0u8; size]);
+            if live.len() == live.capacity() {
+                live.clear();
+            }
+        }
+    }
+    rounds * SIZES.len() as u64
+}
+
+/// Allocator throughput on one CPU, and on all of them at once.
+fn bench_alloc(report: &mut Report) {
+    const ROUNDS: u64 = 20_000;
+
+    let start = now_ns();
+    let ops = alloc_loop(ROUNDS);
+    report.rate("single_core", ops, now_ns() - start, "ops/s");
+
+    let start = now_ns();
+    let handles: Vec<_> = (0..TINYENV_SMP)
+        .map(|cpu_id| {
+            thread::spawn_with_affinity("Bench Alloc", CpuMask::one(cpu_id), || alloc_loop(ROUNDS))
+        })
+        .collect();
+    let ops: u64 = handles.into_iter().map(|h| h.join().unwrap()).sum();
+    report.rate("all_cores", ops, now_ns() - start, "ops/s");
+}
+
+/// Cost of reading the clock, and how late 1 ms sleeps wake up.
+fn bench_timer(report: &mut Report) {
+    const READS: u64 = 10_000;
+    const SLEEPS: u64 = 50;
+    const SLEEP: Duration = Duration::from_millis(1);
+
+    let start = now_ns();
+    for _ in 0..READS {
+        core::hint::black_box(now_ns());
+    }
+    report.latency("clock_read", (now_ns() - start) / READS);
+
+    let (mut total, mut max) = (0, 0);
+    for _ in 0..SLEEPS {
+        let start = now_ns();
+        thread::sleep(SLEEP);
+        let late = (now_ns() - start).saturating_sub(SLEEP.as_nanos() as u64);
+        total += late;
+        max = max.max(late);
+    }
+    report.latency("sleep_lateness_avg", total / SLEEPS);
+    report.latency("sleep_lateness_max", max);
+}
+
+/// Time the [`BENCH_IPI`] handler last ran, `0` until it does.
+static IPI_RECEIVED_NS: AtomicU64 = AtomicU64::new(0);
+
+/// Time from sending an SGI to its handler running on another CPU, which
+/// is idle in `wfi`.
+fn bench_irq(report: &mut Report) {
+    const ROUNDS: u64 = 200;
+    const TIMEOUT_NS: u64 = 100_000_000;
+
+    let target = TINYENV_SMP - 1;
+    with_provider::<IrqProvider>().register(BENCH_IPI, |_| {
+        IPI_RECEIVED_NS.store(now_ns(), Ordering::Release);
+    });
+    // SGIs are banked, the target CPU has to enable its own.
+    let set_enabled = move |enabled: bool| {
+        thread::spawn_with_affinity("Bench IRQ", CpuMask::one(target), move || {
+            let irq = with_provider::<IrqProvider>();
+            if enabled {
+                irq.enable(BENCH_IPI, 0x80);
+            } else {
+                irq.disable(BENCH_IPI);
+            }
+        })
+        .join()
+        .unwrap();
+    };
+    set_enabled(true);
+
+    // Send from CPU 0, so the sender never shares the target's CPU.
+    let (total, max, received) =
+        thread::spawn_with_affinity("Bench IRQ", CpuMask::one(0), move || {
+            let irq = with_provider::<IrqProvider>();
+            let (mut total, mut max, mut received) = (0, 0, 0);
+            for _ in 0..ROUNDS {
+                // Let the target settle back into `wfi`.
+                thread::sleep(Duration::from_micros(100));
+                IPI_RECEIVED_NS.store(0, Ordering::Relaxed);
+                let sent = now_ns();
+                irq.send_sgi(BENCH_IPI, target);
+                let handled = loop {
+                    let handled = IPI_RECEIVED_NS.load(Ordering::Acquire);
+                    if handled != 0 || now_ns() - sent > TIMEOUT_NS {
+                        break handled;
+                    }
+                    core::hint::spin_loop();
+                };
+                if handled != 0 {
+                    let latency = handled.saturating_sub(sent);
+                    total += latency;
+                    max = max.max(latency);
+                    received += 1;
+                }
+            }
+            (total, max, received)
+        })
+        .join()
+        .unwrap();
+    set_enabled(false);
+    with_provider::<IrqProvider>().unregister(BENCH_IPI);
+    if received == 0 {
+        warn!("[Bench] no IRQ reached CPU {}", target);
+        return;
+    }
+    report.latency("sgi_latency_avg", total / received);
+    report.latency("sgi_latency_max", max);
+}
+
+/// Lock and unlock with nobody else around, and increments of one counter
+/// from every CPU.
+fn bench_lock(report: &mut Report) {
+    const ROUNDS: u64 = 100_000;
+    static COUNTER: Mutex<u64> = Mutex::new(0);
+
+    let start = now_ns();
+    for _ in 0..ROUNDS {
+        *COUNTER.lock() += 1;
+    }
+    report.latency("uncontended", (now_ns() - start) / ROUNDS);
+
+    let start = now_ns();
+    let handles: Vec<_> = (0..TINYENV_SMP)
+        .map(|cpu_id| {
+            thread::spawn_with_affinity("Bench Lock", CpuMask::one(cpu_id), || {
+                for _ in 0..ROUNDS {
+                    *COUNTER.lock() += 1;
+                }
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+    report.rate(
+        "contended",
+        ROUNDS * TINYENV_SMP as u64,
+        now_ns() - start,
+        "ops/s",
+    );
+}
+
+/// Raw block device throughput, at the end of the disk, under the block
+/// cache. The written data is what was read there, and the filesystem is
+/// held still meanwhile, so the disk and the cache are left as they were.
+fn bench_block(report: &mut Report) {
+    const BLOCK_SIZE: usize = 512;
+    const CHUNK: usize = 64 * 1024;
+    const TOTAL: usize = 4 * 1024 * 1024;
+
+    let block = with_provider::<BlockProvider>();
+    let Ok(capacity) = block.capacity_blocks() else {
+        warn!("[Bench] no block device, skipping");
+        return;
+    };
+    let blocks = (TOTAL / BLOCK_SIZE) as u64;
+    if capacity < blocks {
+        warn!("[Bench] disk too small, skipping");
+        return;
+    }
+    let first = (capacity - blocks) as usize;
+    let mut data = alloc::vec![0u8; TOTAL];
+
+    // Nothing may write these sectors between reading and restoring them,
+    // and dirty cached ones would be newer than what we read back.
+    let (read_ns, write_ns) = fs::with_fs_idle(|| {
+        let start = now_ns();
+        for (i, chunk) in data.chunks_mut(CHUNK).enumerate() {
+            block
+                .read_blocks(first + i * CHUNK / BLOCK_SIZE, chunk)
+                .unwrap();
+        }
+        let read_ns = now_ns() - start;
+
+        let start = now_ns();
+        for (i, chunk) in data.chunks(CHUNK).enumerate() {
+            block
+                .write_blocks(first + i * CHUNK / BLOCK_SIZE, chunk)
+                .unwrap();
+        }
+        (read_ns, now_ns() - start)
+    })
+    .unwrap();
+
+    let kib = (TOTAL / 1024) as u64;
+    report.rate("read", kib, read_ns, "KiB/s");
+    report.rate("write", kib, write_ns, "KiB/s");
+}
+
+/// File create, write, close and remove on the mounted filesystem.
+fn bench_fs(report: &mut Report) {
+    const DIR: &str = "/bench_fs";
+    const FILES: u64 = 50;
+
+    if !fs::is_dir("/") && fs::mount().is_err() {
+        warn!("[Bench] no filesystem, skipping");
+        return;
+    }
+    let _ = fs::remove_all(DIR);
+    fs::mkdir(DIR).unwrap();
+
+    let data = [0x5au8; 4096];
+    let start = now_ns();
+    for i in 0..FILES {
+        let path = alloc::format!("{}/file{}", DIR, i);
+        let handle = fs::create_file(&path).unwrap();
+        fs::write_file(handle, 0, &data).unwrap();
+        fs::close(handle).unwrap();
+    }
+    let create_ns = now_ns() - start;
+
+    let start = now_ns();
+    for i in 0..FILES {
+        fs::file_remove(&alloc::format!("{}/file{}", DIR, i)).unwrap();
+    }
+    let remove_ns = now_ns() - start;
+    let _ = fs::dir_remove(DIR);
+
+    report.rate("create_write_4k", FILES, create_ns, "ops/s");
+    report.rate("remove", FILES, remove_ns, "ops/s");
+}
@@ -439,3 +439,227 @@ fn test_fsops_fsync() {
 
     cleanup();
 }
+
+fn test_fsops_block_cache() {
+    use crate::fs::block_cache;
+
+    assert!(fs::mount().is_ok());
+    cleanup();
+
+    assert!(fs::mkdir(TEST_DIR).is_ok());
+
+    // Several sectors, not sector aligned at the end.
+    let data: Vec<u8> = (0..5000u32).map(|i| (i * 7) as u8).collect();
+    let handle = fs::create_file(TEST_FILE).expect("create_file failed");
+    assert_eq!(fs::write_file(handle, 0, &data), Ok(data.len()));
+    assert!(fs::fsync(handle).is_ok());
+    assert!(fs::close(handle).is_ok());
+
+    // Remounting drops the cache, so this reads what reached the disk.
+    assert!(fs::umount().is_ok());
+    assert!(fs::mount().is_ok());
+    let handle = fs::open(
+        TEST_FILE,
+        OpenOptions {
+            read: true,
+            ..Default::default()
+        },
+    )
+    .expect("open failed");
+    assert_eq!(fs::read_file(handle, 0, 0).as_deref(), Ok(&data[..]));
+
+    // A second read is served from the cache.
+    let before = block_cache::stats();
+    assert_eq!(fs::read_file(handle, 0, 0).as_deref(), Ok(&data[..]));
+    let after = block_cache::stats();
+    println!(
+        "  block cache: {} hits, {} misses on re-read",
+        after.hits - before.hits,
+        after.misses - before.misses
+    );
+    assert_eq!(after.misses, before.misses);
+
+    assert!(fs::close(handle).is_ok());
+    cleanup();
+}
+
+fn test_fsops_open_file_state() {
+    assert!(fs::mount().is_ok());
+    cleanup();
+
+    assert!(fs::mkdir(TEST_DIR).is_ok());
+
+    // Appends in small chunks, as a log writer would.
+    let log = OpenOptions {
+        read: true,
+        write: true,
+        create: true,
+        truncate: true,
+        append: true,
+    };
+    let writer = fs::open(TEST_FILE, log).expect("open append failed");
+    let mut expected = Vec::new();
+    for i in 0..200u32 {
+        let line = alloc::format!("line {}\n", i);
+        assert_eq!(fs::write_file(writer, 0, line.as_bytes()), Ok(line.len()));
+        expected.extend_from_slice(line.as_bytes());
+    }
+
+    // A second handle on the same path sees the data, read back in chunks.
+    let reader = fs::open(
+        TEST_FILE,
+        OpenOptions {
+            read: true,
+            ..Default::default()
+        },
+    )
+    .expect("open failed");
+    let mut content = Vec::new();
+    loop {
+        let chunk = fs::read_file(reader, content.len() as u64, 100).expect("read failed");
+        if chunk.is_empty() {
+            break;
+        }
+        content.extend_from_slice(&chunk);
+    }
+    assert_eq!(content, expected);
+
+    // FAT names are case-insensitive: another spelling is the same live
+    // file, not a second one with its own stale size.
+    const TEST_FILE_UPPER: &str = "/FSOPS_TEST/HELLO.TXT";
+    let upper = fs::open(
+        TEST_FILE_UPPER,
+        OpenOptions {
+            read: true,
+            ..Default::default()
+        },
+    )
+    .expect("open failed");
+    assert_eq!(
+        fs::read_file(upper, 0, expected.len() + 1),
+        Ok(expected.clone())
+    );
+    assert!(fs::close(upper).is_ok());
+
+    // The file stays in use until its last handle is closed.
+    assert!(fs::close(writer).is_ok());
+    assert!(fs::file_remove(TEST_FILE).is_err());
+    assert!(fs::file_remove(TEST_FILE_UPPER).is_err());
+    assert!(fs::close(reader).is_ok());
+    assert!(fs::file_remove(TEST_FILE).is_ok());
+
+    cleanup();
+}
+
+fn test_fsops_read_into() {
+    assert!(fs::mount().is_ok());
+    cleanup();
+
+    assert!(fs::mkdir(TEST_DIR).is_ok());
+
+    let data: Vec<u8> = (0..3000u32).map(|i| (i * 13) as u8).collect();
+    let handle = fs::create_file(TEST_FILE).expect("create_file failed");
+    assert_eq!(fs::write_from(handle, 0, &data), Ok(data.len()));
+    assert!(fs::fsync(handle).is_ok());
+
+    // Aligned, unaligned and past-the-end ranges into caller buffers.
+    let mut buf = [0u8; 2048];
+    for (offset, len) in [(0usize, 2048usize), (100, 1000), (511, 1026), (2500, 2048)] {
+        let read = fs::read_into(handle, offset as u64, &mut buf[..len]).expect("read_into failed");
+        let expected = &data[offset..(offset + len).min(data.len())];
+        assert_eq!(&buf[..read], expected);
+    }
+
+    assert!(fs::close(handle).is_ok());
+    cleanup();
+}
+
+fn test_fsops_dentry_cache() {
+    use crate::fs::block_cache;
+
+    assert!(fs::mount().is_ok());
+    cleanup();
+
+    assert!(fs::mkdir_all(TEST_NESTED).is_ok());
+    let handle = fs::create_file(TEST_FILE).expect("create_file failed");
+    assert_eq!(fs::write_file(handle, 0, b"dentry"), Ok(6));
+    assert!(fs::close(handle).is_ok());
+    assert_eq!(fs::file_size(TEST_FILE), Ok(6));
+
+    // Once listed, lookups in the tree, including misses, touch no sectors.
+    assert!(fs::readdir(TEST_DIR).is_ok());
+    let before = block_cache::stats();
+    assert!(fs::is_dir(TEST_NESTED));
+    assert!(fs::is_file(TEST_FILE));
+    assert!(!fs::exists(TEST_FILE2));
+    assert!(!fs::exists("/fsops_test/a/missing"));
+    let after = block_cache::stats();
+    assert_eq!(after.hits + after.misses, before.hits + before.misses);
+
+    // Negative entries go away when the path is created, and removing a
+    // directory forgets what was below it.
+    let handle = fs::create_file(TEST_FILE2).expect("create_file failed");
+    assert!(fs::close(handle).is_ok());
+    assert!(fs::is_file(TEST_FILE2));
+    assert!(fs::remove_all("/fsops_test/a").is_ok());
+    assert!(!fs::exists(TEST_NESTED));
+
+    cleanup();
+}
+
+fn test_fsops_dentry_cache_full() {
+    use crate::config::kernel::DENTRY_CACHE_ENTRIES;
+
+    const DIR: &str = "/fsops_test/many";
+    const FILES: usize = 16;
+
+    assert!(fs::mount().is_ok());
+    cleanup();
+
+    assert!(fs::mkdir_all(DIR).is_ok());
+    for i in 0..FILES {
+        let handle =
+            fs::create_file(&alloc::format!("{}/f{}", DIR, i)).expect("create_file failed");
+        assert!(fs::close(handle).is_ok());
+    }
+
+    // Fill the cache to just short of its limit, by a different amount each
+    // time, so that it overflows at every point of listing `DIR`.
+    for offset in 0..FILES + 4 {
+        assert!(fs::mount().is_ok());
+        for i in 0..DENTRY_CACHE_ENTRIES - offset {
+            assert!(!fs::exists(&alloc::format!("{}/miss{}", TEST_DIR, i)));
+        }
+        for i in 0..FILES {
+            assert!(fs::is_file(&alloc::format!("{}/f{}", DIR, i)));
+        }
+    }
+
+    cleanup();
+}
+
+#[cfg(feature = "fat32")]
+pub fn run_fsops_tests() {
+    warn!("\n=== Running Filesystem Tests ===");
+
+    test_fsops_mount_umount();
+    test_fsops_basic_ops();
+    test_fsops_link_and_readlink();
+    test_fsops_open_close_unlink();
+    test_fsops_stat_and_helpers();
+    test_fsops_readdir();
+    test_fsops_rename();
+    test_fsops_symlink();
+    test_fsops_chmod();
+    test_fsops_copy_file();
+    test_fsops_open_options_append();
+    test_fsops_mkdir_all();
+    test_fsops_remove_all();
+    test_fsops_walk();
+    test_fsops_fsync();
+    test_fsops_block_cache();
+    test_fsops_open_file_state();
+    test_fsops_read_into();
+    test_fsops_dentry_cache();
+    test_fsops_dentry_cache_full();
+}
@@ -28,6 +28,9 @@ pub fn gicv3_tests() {
         IS_INTERRUPT.store(true, Ordering::Relaxed);
     });
     with_provider::<IrqProvider>().enable(sgi_intid, 0x80);
+    let count_before = with_provider::<IrqProvider>()
+        .stats(cpu_id, u32::from(sgi_intid) as usize)
+        .count;
     if GicCpuInterface::send_sgi(
         sgi_intid,
         SgiTarget::List {
@@ -53,6 +56,9 @@ pub fn gicv3_tests() {
 
     if IS_INTERRUPT.load(Ordering::Relaxed) {
         info!("SGI interrupt was successfully handled.");
+        let stats = with_provider::<IrqProvider>().stats(cpu_id, u32::from(sgi_intid) as usize);
+        info!("SGI statistics on CPU {}: {:?}", cpu_id, stats);
+        assert_eq!(stats.count, count_before + 1);
     } else {
         error!("SGI interrupt was not handled within the expected time.");
     }
@@ -0,0 +1,181 @@
+//! IPC endpoint tests and round-trip benchmark.
+
+use aarch64_cpu::registers::{MIDR_EL1, Readable};
+use provider_core::with_provider;
+
+use crate::config::kernel::TINYENV_SMP;
+use crate::device::provider::TimerProvider;
+use crate::hal::context::TrapFrame;
+use crate::hal::pmu;
+use crate::ipc::{Endpoint, MSG_WORDS, Message, MessageHeader};
+use crate::profile::sampler;
+use crate::task::thread::{self, CpuMask};
+
+/// Adds up the message words.
+const OP_ADD: u32 = 1;
+/// Replies with the number of calls served and stops the server.
+const OP_STOP: u32 = 2;
+
+/// Round-trip budgets in cycles. QEMU's cycle counter follows the virtual
+/// clock, so its budget is loose.
+const TARGET_CYCLES_CORTEX_A76: u64 = 1_500;
+const TARGET_CYCLES_QEMU: u64 = 10_000;
+
+/// MIDR_EL1 part number of the Cortex-A76.
+const PART_CORTEX_A76: u64 = 0xd0b;
+
+/// Serves `endpoint` until told to stop, and returns the calls served.
+fn serve(endpoint: &Endpoint) -> u64 {
+    let mut served = 0;
+    let mut msg = endpoint.recv();
+    loop {
+        match msg.label() {
+            OP_ADD => {
+                served += 1;
+                let sum = msg.words().iter().sum::<u64>();
+                msg = endpoint.reply_recv(Message::new(0, &[sum])).unwrap();
+            }
+            OP_STOP => {
+                endpoint.reply(Message::new(0, &[served])).unwrap();
+                return served;
+            }
+            label => panic!("Unknown IPC label {}", label),
+        }
+    }
+}
+
+/// Stops the server of `endpoint` and returns the calls it served.
+fn stop(endpoint: &Endpoint) -> u64 {
+    endpoint.call(Message::new(OP_STOP, &[])).words()[0]
+}
+
+/// Messages survive the trip through the registers and the endpoint.
+fn test_ipc_call_reply() {
+    info!("=== Test: IPC Call/Reply ===");
+
+    let header = MessageHeader {
+        label: 0xdead_beef,
+        flags: 0x1234,
+        words: MSG_WORDS as u16,
+    };
+    assert_eq!(MessageHeader::from_bits(header.to_bits()), header);
+    let msg = Message::new(7, &[1, 2, 3, 4, 5, 6, 7]);
+    let mut tf = TrapFrame::default();
+    msg.to_regs(&mut tf);
+    assert_eq!(Message::from_regs(&tf), msg);
+
+    static ENDPOINT: Endpoint = Endpoint::new();
+    assert!(
+        ENDPOINT.reply(Message::default()).is_err(),
+        "Reply without a caller succeeded"
+    );
+
+    let server = thread::spawn("IPC Server", || serve(&ENDPOINT));
+    for n in 0..MSG_WORDS as u64 {
+        let words: alloc::vec::Vec<u64> = (1..=n).collect();
+        let reply = ENDPOINT.call(Message::new(OP_ADD, &words));
+        assert_eq!(reply.words(), &[n * (n + 1) / 2], "Wrong sum");
+    }
+    assert_eq!(stop(&ENDPOINT), MSG_WORDS as u64);
+    assert_eq!(server.join().unwrap(), MSG_WORDS as u64);
+    info!("IPC call/reply passed!");
+}
+
+/// Clients on every CPU share one server, and every call gets its own
+/// reply.
+fn test_ipc_many_clients() {
+    info!("=== Test: IPC Many Clients ===");
+
+    const CALLS: u64 = 200;
+    static ENDPOINT: Endpoint = Endpoint::new();
+
+    let server = thread::spawn("IPC Server", || serve(&ENDPOINT));
+    let clients: alloc::vec::Vec<_> = (0..TINYENV_SMP)
+        .map(|cpu_id| {
+            thread::spawn_with_affinity("IPC Client", CpuMask::one(cpu_id), move || {
+                for i in 0..CALLS {
+                    let id = cpu_id as u64;
+                    let reply = ENDPOINT.call(Message::new(OP_ADD, &[id, i]));
+                    assert_eq!(reply.words(), &[id + i], "Reply went to the wrong client");
+                }
+            })
+        })
+        .collect();
+    for client in clients {
+        client.join().unwrap();
+    }
+
+    let served = stop(&ENDPOINT);
+    server.join().unwrap();
+    info!("[IPC] {} calls from {} CPUs", served, TINYENV_SMP);
+    assert_eq!(served, CALLS * TINYENV_SMP as u64, "Calls were lost");
+}
+
+/// Round trips between a client and a server sharing a CPU, where every
+/// call and reply hands the CPU over directly.
+fn bench_ipc_round_trip() {
+    info!("=== Bench: IPC Round Trip ===");
+
+    const ROUNDS: u64 = 10_000;
+    static ENDPOINT: Endpoint = Endpoint::new();
+
+    let cpu_mask = CpuMask::one(TINYENV_SMP - 1);
+    let server = thread::spawn_with_affinity("IPC Server", cpu_mask, || serve(&ENDPOINT));
+    let (cycles, ns, part) = thread::spawn_with_affinity("IPC Client", cpu_mask, || {
+        // Let the server block in recv first.
+        thread::yield_now();
+
+        // Leave the PMU alone while the profiler owns it.
+        let count_cycles = pmu::is_present() && !sampler::is_running();
+        if count_cycles {
+            pmu::reset();
+            pmu::enable_counters(pmu::CYCLE_COUNTER);
+        }
+        let timer = with_provider::<TimerProvider>();
+        let msg = Message::new(OP_ADD, &[1, 2, 3, 4, 5, 6, 7]);
+
+        let start_ns = timer.current_nanoseconds();
+        let start_cycles = pmu::cycles();
+        for _ in 0..ROUNDS {
+            core::hint::black_box(ENDPOINT.call(msg));
+        }
+        let cycles = pmu::cycles() - start_cycles;
+        let ns = timer.current_nanoseconds() - start_ns;
+
+        if count_cycles {
+            pmu::disable_counters(pmu::CYCLE_COUNTER);
+        }
+        let cycles = count_cycles.then_some(cycles / ROUNDS);
+        (cycles, ns / ROUNDS, MIDR_EL1.read(MIDR_EL1::PartNum))
+    })
+    .join()
+    .unwrap();
+    stop(&ENDPOINT);
+    server.join().unwrap();
+
+    let (target, core) = if part == PART_CORTEX_A76 {
+        (TARGET_CYCLES_CORTEX_A76, "Cortex-A76")
+    } else {
+        (TARGET_CYCLES_QEMU, "QEMU")
+    };
+    match cycles {
+        Some(cycles) => {
+            info!(
+                "[IPC] round trip: {} cycles, {} ns (target on {}: {} cycles)",
+                cycles, ns, core, target
+            );
+            if cycles > target {
+                warn!("[IPC] round trip is over the {} target", core);
+            }
+        }
+        None => info!("[IPC] round trip: {} ns, no cycle counter", ns),
+    }
+}
+
+pub fn run_ipc_tests() {
+    warn!("\n=== Running IPC Tests ===");
+
+    test_ipc_call_reply();
+    test_ipc_many_clients();
+    bench_ipc_round_trip();
+}
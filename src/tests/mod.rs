@@ -2,9 +2,14 @@
 #![allow(unused)]
 
 mod allocator;
+pub mod bench;
 mod fs_ops;
 mod gicv3;
+mod ipc;
+mod page_table;
 mod perf;
+mod profile;
+mod simd;
 mod task;
 mod tests;
 
@@ -23,6 +28,8 @@ pub fn rstiny_tests() {
 
     allocator::run_allocator_tests();
 
+    page_table::run_page_table_tests();
+
     gicv3::gicv3_tests();
 
     // // Run scheduler tests
@@ -30,4 +37,13 @@ pub fn rstiny_tests() {
 
     // Run performance tests (single-core and multi-core)
     perf::run_perf_tests();
+
+    profile::run_profile_tests();
+
+    simd::run_simd_tests();
+
+    ipc::run_ipc_tests();
+
+    #[cfg(feature = "fat32")]
+    fs_ops::run_fsops_tests();
 }
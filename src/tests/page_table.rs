@@ -0,0 +1,111 @@
+//! Page table tests.
+
+use alloc::{sync::Arc, vec::Vec};
+
+use memory_addr::{pa, va};
+use page_table_entry::MappingFlags;
+
+use crate::{
+    mm::{
+        frame,
+        page_table::{self, PageTable, SIZE_1G, SIZE_2M, SIZE_4K},
+        phys_to_virt, virt_to_phys,
+    },
+    task::thread,
+};
+
+/// Low address both test address spaces map, each to its own frame.
+const USER_VADDR: usize = 0x4000_0000;
+
+/// The kernel linear map uses blocks, and kernel text is executable only.
+fn test_kernel_mappings() {
+    info!("=== Test: Kernel Mappings ===");
+
+    let table = page_table::kernel_page_table();
+
+    let text = test_kernel_mappings as *const () as usize;
+    let (paddr, flags, _) = table.query(va!(text)).expect("Kernel text not mapped");
+    assert_eq!(paddr, virt_to_phys(va!(text)));
+    assert!(flags.contains(MappingFlags::EXECUTE));
+    assert!(!flags.contains(MappingFlags::WRITE));
+
+    let mut block_sizes = Vec::new();
+    for (start, size) in frame::ram_regions() {
+        let (paddr, _, page_size) = table
+            .query(phys_to_virt(pa!(start.as_usize() + size - SIZE_4K)))
+            .expect("End of RAM not mapped");
+        assert_eq!(paddr.as_usize(), start.as_usize() + size - SIZE_4K);
+        block_sizes.push(page_size);
+    }
+    info!(
+        "Linear map leaf sizes at the end of RAM: {:x?}",
+        block_sizes
+    );
+    assert!(
+        block_sizes
+            .iter()
+            .all(|&size| size == SIZE_2M || size == SIZE_1G || size == SIZE_4K)
+    );
+
+    info!("Kernel mappings test passed!");
+}
+
+/// Two address spaces map the same address to different frames. Tasks in
+/// each keep seeing their own frame across context switches, and an unmap
+/// reaches every CPU's TLB.
+fn test_address_spaces() {
+    info!("=== Test: ASID Address Spaces ===");
+
+    let spaces: Vec<_> = (0..2u64)
+        .map(|i| {
+            let frame = frame::alloc_frame().expect("Out of frames");
+            let table = PageTable::try_new().expect("Out of page table frames");
+            table
+                .map(
+                    va!(USER_VADDR),
+                    frame,
+                    SIZE_4K,
+                    MappingFlags::READ | MappingFlags::WRITE,
+                )
+                .unwrap();
+            unsafe { (phys_to_virt(frame).as_mut_ptr() as *mut u64).write(0x5a5a_0000 + i) };
+            (Arc::new(table), frame, i)
+        })
+        .collect();
+
+    let handles: Vec<_> = spaces
+        .iter()
+        .map(|(table, _, i)| {
+            let expected = 0x5a5a_0000 + *i;
+            thread::spawn_in("ASID Task", table.clone(), move || {
+                let ptr = USER_VADDR as *mut u64;
+                for _ in 0..20 {
+                    if unsafe { ptr.read_volatile() } != expected {
+                        return false;
+                    }
+                    thread::yield_now();
+                }
+                true
+            })
+        })
+        .collect();
+    for handle in handles {
+        assert!(handle.join().unwrap(), "Task saw another address space");
+    }
+
+    for (table, frame, _) in spaces {
+        assert_ne!(table.asid(), 0);
+        table.unmap(va!(USER_VADDR), SIZE_4K).unwrap();
+        assert!(table.query(va!(USER_VADDR)).is_none());
+        frame::free_frame(frame);
+    }
+
+    info!("ASID address space test passed!");
+}
+
+pub fn run_page_table_tests() {
+    warn!("\n=== Running Page Table Tests ===");
+
+    test_kernel_mappings();
+    test_address_spaces();
+}
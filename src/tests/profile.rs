@@ -0,0 +1,60 @@
+//! Profiler and tracepoint tests.
+
+use alloc::vec::Vec;
+
+use crate::hal::pmu;
+use crate::profile::{TraceKind, sampler, trace};
+use crate::task::thread;
+
+/// Context switches and allocations land in the trace buffers, in order.
+fn test_tracepoints() {
+    info!("=== Test: Tracepoints ===");
+
+    trace::set_enabled(true);
+    let buf: Vec<u8> = Vec::with_capacity(4096);
+    drop(buf);
+    thread::spawn("Trace Task", || ()).join().unwrap();
+    trace::set_enabled(false);
+
+    let records = trace::snapshot();
+    info!("{} trace records", records.len());
+    assert!(records.windows(2).all(|w| w[0].time_ns <= w[1].time_ns));
+    assert!(
+        records
+            .iter()
+            .any(|r| r.kind == TraceKind::Alloc && r.args[0] == 4096)
+    );
+    assert!(records.iter().any(|r| r.kind == TraceKind::ContextSwitch));
+
+    info!("Tracepoint test passed!");
+}
+
+/// A sampling session counts cycles on every CPU and takes samples.
+fn test_pmu_session() {
+    info!("=== Test: PMU Session ===");
+
+    if !pmu::is_present() {
+        warn!("No PMUv3, skipping");
+        return;
+    }
+    sampler::start(pmu::EVENT_CPU_CYCLES, 10_000).unwrap();
+    let mut x = 0u64;
+    for i in 0..2_000_000u64 {
+        x = core::hint::black_box(x.wrapping_mul(31).wrapping_add(i));
+    }
+    sampler::stop().unwrap();
+
+    let counts = sampler::counts();
+    info!("{:?}", counts);
+    assert!(counts.iter().all(|c| c.cycles > 0));
+    assert!(!sampler::hot_spots().is_empty());
+
+    info!("PMU session test passed!");
+}
+
+pub fn run_profile_tests() {
+    warn!("\n=== Running Profiler Tests ===");
+
+    test_tracepoints();
+    test_pmu_session();
+}
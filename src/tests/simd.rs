@@ -0,0 +1,104 @@
+//! SIMD routine and lazy FP switching tests.
+
+use alloc::vec;
+use core::arch::naked_asm;
+use core::cmp::Ordering;
+
+use crate::config::kernel::TINYENV_SMP;
+use crate::hal::{fp, simd};
+use crate::task::thread::{self, CpuMask};
+
+/// Copies, fills and compares of every length around the block size and
+/// the NEON threshold, at odd offsets, match the scalar results.
+fn test_simd_routines() {
+    info!("=== Test: SIMD Routines ===");
+
+    let src: alloc::vec::Vec<u8> = (0..2048u32).map(|i| (i * 7 + 3) as u8).collect();
+    for len in [0, 1, 63, 64, 65, 255, 256, 257, 511, 512, 1000, 2000] {
+        for offset in [0, 1, 15] {
+            let src = &src[offset..offset + len];
+
+            let mut dst = vec![0u8; len];
+            simd::copy(&mut dst, src);
+            assert_eq!(dst, src, "copy of {} bytes at +{}", len, offset);
+
+            let mut filled = vec![0u8; len + offset];
+            simd::fill(&mut filled[offset..], 0xa5);
+            assert!(
+                filled[..offset].iter().all(|&b| b == 0),
+                "fill wrote before"
+            );
+            assert!(
+                filled[offset..].iter().all(|&b| b == 0xa5),
+                "fill of {} bytes",
+                len
+            );
+
+            assert_eq!(simd::compare(&dst, src), Ordering::Equal);
+            if len > 0 {
+                let last = len - 1;
+                dst[last] = dst[last].wrapping_add(1);
+                assert_eq!(simd::compare(&dst, src), dst[last].cmp(&src[last]));
+                assert_eq!(simd::compare(&dst[..last], src), Ordering::Less);
+            }
+        }
+    }
+    info!("SIMD routines passed!");
+}
+
+#[unsafe(naked)]
+unsafe extern "C" fn set_d8(_value: u64) {
+    naked_asm!(".arch armv8\nfmov d8, x0\nret")
+}
+
+#[unsafe(naked)]
+unsafe extern "C" fn get_d8() -> u64 {
+    naked_asm!(".arch armv8\nfmov x0, d8\nret")
+}
+
+/// Two tasks sharing a CPU each keep their own FP registers across
+/// switches, loaded by the FP trap.
+fn test_lazy_fp() {
+    info!("=== Test: Lazy FP Switching ===");
+
+    if fp::HARD_FLOAT {
+        // The compiler owns d8 here, and FP is switched eagerly anyway.
+        warn!("Hard-float kernel, skipping");
+        return;
+    }
+
+    let cpu_id = TINYENV_SMP - 1;
+    let (traps_before, _) = fp::stats(cpu_id);
+    let handles: alloc::vec::Vec<_> = (1..=2u64)
+        .map(|id| {
+            thread::spawn_with_affinity("FP Task", CpuMask::one(cpu_id), move || {
+                let value = 0x0101_0101_0101_0101 * id;
+                for _ in 0..100 {
+                    unsafe { set_d8(value) };
+                    thread::yield_now();
+                    assert_eq!(unsafe { get_d8() }, value, "d8 lost across a switch");
+                }
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+
+    let (traps, saves) = fp::stats(cpu_id);
+    info!(
+        "[LazyFp] CPU {}: {} FP traps, {} saves",
+        cpu_id,
+        traps - traps_before,
+        saves
+    );
+    assert!(traps > traps_before, "FP use did not trap");
+    info!("Lazy FP switching passed!");
+}
+
+pub fn run_simd_tests() {
+    warn!("\n=== Running SIMD Tests ===");
+
+    test_simd_routines();
+    test_lazy_fp();
+}
@@ -1,8 +1,23 @@
 //! Task scheduler tests.
 
-use core::time::Duration;
+use core::{
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+    time::Duration,
+};
 
-use crate::{hal::percpu, task::thread};
+use provider_core::with_provider;
+
+use crate::{
+    config::kernel::TINYENV_SMP,
+    device::provider::TimerProvider,
+    hal::{Mutex, percpu},
+    task::{
+        sleep_lock::{SleepMutex, SleepRwLock},
+        stats::{self, LATENCY_BUCKETS, latency_bucket},
+        thread::{self, CpuMask},
+        wait_queue::WaitQueue,
+    },
+};
 
 /// Task 1: Print every 500ms, 10 times
 fn task1_periodic(interval: u64) {
@@ -86,10 +101,430 @@ fn test_task_return_value() {
     info!("=== Task Return Value Test Passed! ===");
 }
 
+/// Test that pinned tasks only ever run on their CPU, across yields and
+/// sleeps, and that unpinned tasks spread over more than one CPU.
+fn test_task_affinity() {
+    info!("=== Test: Task Affinity ===");
+
+    let target = TINYENV_SMP - 1;
+    let pinned: alloc::vec::Vec<_> = (0..4)
+        .map(|_| {
+            thread::spawn_with_affinity("Pinned Task", CpuMask::one(target), move || {
+                for _ in 0..5 {
+                    assert!(percpu::cpu_id() == target, "Pinned task left its CPU");
+                    thread::yield_now();
+                    thread::sleep(Duration::from_millis(10));
+                }
+                percpu::cpu_id()
+            })
+        })
+        .collect();
+    for handle in pinned {
+        let cpu = handle.join().expect("Failed to join pinned task");
+        assert!(cpu == target, "Pinned task finished on CPU {}", cpu);
+    }
+    info!("[Affinity] Pinned tasks stayed on CPU {}", target);
+
+    if TINYENV_SMP > 1 {
+        // Busy tasks that never block, spawned back to back: placement must
+        // put them on different CPUs.
+        let busy: alloc::vec::Vec<_> = (0..TINYENV_SMP)
+            .map(|_| {
+                thread::spawn("Busy Task", || {
+                    let cpu = percpu::cpu_id();
+                    with_provider::<TimerProvider>().busy_wait(Duration::from_millis(50));
+                    cpu
+                })
+            })
+            .collect();
+        let mut seen = 0u64;
+        for handle in busy {
+            seen |= 1 << handle.join().expect("Failed to join busy task");
+        }
+        info!("[Affinity] Busy tasks ran on CPU mask {:#x}", seen);
+        assert!(seen.count_ones() > 1, "All busy tasks ran on one CPU");
+    }
+
+    info!("=== Task Affinity Test Passed! ===");
+}
+
+/// Test that a CPU-bound task is preempted by the timer: a task sharing
+/// its CPU keeps making progress while the other spins without yielding.
+fn test_preemption() {
+    info!("=== Test: Preemption ===");
+
+    static STARTED: AtomicBool = AtomicBool::new(false);
+    static DONE: AtomicBool = AtomicBool::new(false);
+    STARTED.store(false, Ordering::SeqCst);
+    DONE.store(false, Ordering::SeqCst);
+
+    let mask = CpuMask::one(0);
+    let spinner = thread::spawn_with_affinity("Spin Task", mask, || {
+        STARTED.store(true, Ordering::SeqCst);
+        with_provider::<TimerProvider>().busy_wait(Duration::from_millis(300));
+        DONE.store(true, Ordering::SeqCst);
+    });
+    let ticker = thread::spawn_with_affinity("Tick Task", mask, || {
+        while !STARTED.load(Ordering::SeqCst) {
+            thread::sleep(Duration::from_millis(1));
+        }
+        let mut ticks = 0usize;
+        while !DONE.load(Ordering::SeqCst) {
+            thread::sleep(Duration::from_millis(10));
+            ticks += 1;
+        }
+        ticks
+    });
+
+    spinner.join().expect("Failed to join spin task");
+    let ticks = ticker.join().expect("Failed to join tick task");
+    info!(
+        "[Preempt] Tick task ran {} times while spin task was busy",
+        ticks
+    );
+    assert!(ticks >= 2, "Spinning task was never preempted");
+
+    info!("=== Preemption Test Passed! ===");
+}
+
+/// Test that short sleeps wake close to their deadline instead of on the
+/// next scheduler tick.
+fn test_sleep_precision() {
+    info!("=== Test: Sleep Precision ===");
+
+    let timer = with_provider::<TimerProvider>();
+    let mut worst_ns = 0u64;
+    for _ in 0..10 {
+        let start = timer.current_nanoseconds();
+        thread::sleep(Duration::from_micros(500));
+        let late_ns = timer.current_nanoseconds() - start - 500_000;
+        worst_ns = worst_ns.max(late_ns);
+    }
+    info!("[Sleep] Worst wakeup latency: {} us", worst_ns / 1_000);
+    assert!(worst_ns < 5_000_000, "Sleep overshot by {} ns", worst_ns);
+
+    info!("=== Sleep Precision Test Passed! ===");
+}
+
+/// Test that tasks blocked on a wait queue sleep until notified, and that
+/// every notification reaches a waiter.
+fn test_wait_queue() {
+    info!("=== Test: Wait Queue ===");
+
+    static WQ: WaitQueue = WaitQueue::new();
+    static TOKENS: AtomicUsize = AtomicUsize::new(0);
+    const WAITERS: usize = 4;
+
+    let waiters: alloc::vec::Vec<_> = (0..WAITERS)
+        .map(|_| {
+            thread::spawn("Waiter Task", || {
+                // Take exactly one token, blocking while none are left.
+                WQ.wait_until(|| {
+                    TOKENS
+                        .fetch_update(Ordering::AcqRel, Ordering::Acquire, |n| n.checked_sub(1))
+                        .is_ok()
+                });
+            })
+        })
+        .collect();
+
+    // Give the waiters time to block; none of them may finish yet.
+    thread::sleep(Duration::from_millis(20));
+    for handle in &waiters {
+        assert!(
+            handle.task.state() != crate::task::task_ref::TaskState::Exited,
+            "Waiter finished without a token"
+        );
+    }
+
+    for _ in 0..WAITERS {
+        TOKENS.fetch_add(1, Ordering::AcqRel);
+        WQ.notify_one();
+    }
+    for handle in waiters {
+        handle.join().expect("Failed to join waiter task");
+    }
+    assert!(TOKENS.load(Ordering::Acquire) == 0, "Tokens left over");
+
+    info!("=== Wait Queue Test Passed! ===");
+}
+
+/// Test that sleeping locks exclude writers, admit readers together, and
+/// leave IRQs enabled while held.
+fn test_sleep_locks() {
+    info!("=== Test: Sleep Locks ===");
+
+    static COUNTER: SleepMutex<usize> = SleepMutex::new(0);
+    static RW: SleepRwLock<usize> = SleepRwLock::new(0);
+    static READERS_IN: AtomicUsize = AtomicUsize::new(0);
+    const TASKS: usize = 4;
+    const ROUNDS: usize = 100;
+
+    let handles: alloc::vec::Vec<_> = (0..TASKS)
+        .map(|_| {
+            thread::spawn("Lock Task", || {
+                for _ in 0..ROUNDS {
+                    let mut counter = COUNTER.lock();
+                    assert!(!crate::hal::cpu::irqs_disabled());
+                    let value = *counter;
+                    // Give up the CPU while holding the lock.
+                    thread::yield_now();
+                    *counter = value + 1;
+                }
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().expect("Failed to join lock task");
+    }
+    assert_eq!(*COUNTER.lock(), TASKS * ROUNDS, "Lost an update");
+
+    // Readers overlap: each one waits until all of them hold the lock.
+    let readers: alloc::vec::Vec<_> = (0..TASKS)
+        .map(|_| {
+            thread::spawn("Reader Task", || {
+                let _guard = RW.read();
+                READERS_IN.fetch_add(1, Ordering::AcqRel);
+                while READERS_IN.load(Ordering::Acquire) < TASKS {
+                    thread::yield_now();
+                }
+            })
+        })
+        .collect();
+    for handle in readers {
+        handle.join().expect("Failed to join reader task");
+    }
+    *RW.write() += 1;
+    assert_eq!(*RW.read(), 1);
+
+    info!("=== Sleep Lock Test Passed! ===");
+}
+
+/// Spawn-latency benchmark.
+///
+/// Compares the zeroed 64 KB stack every spawn used to allocate with a
+/// stack from the pool, then times a full spawn plus join of an empty task.
+fn bench_spawn_latency() {
+    info!("=== Bench: Spawn Latency ===");
+
+    const ROUNDS: u64 = 200;
+    let timer = with_provider::<TimerProvider>();
+
+    // Warm the pool so the comparison is against a recycled stack.
+    for _ in 0..4 {
+        thread::spawn("Warmup Task", || {}).join().unwrap();
+    }
+
+    let start = timer.current_nanoseconds();
+    for _ in 0..ROUNDS {
+        let stack = alloc::vec![0u8; crate::config::kernel::TASK_STACK_SIZE];
+        core::hint::black_box(&stack);
+    }
+    let zeroed_ns = (timer.current_nanoseconds() - start) / ROUNDS;
+
+    let start = timer.current_nanoseconds();
+    for _ in 0..ROUNDS {
+        let stack = crate::task::stack_pool::TaskStack::alloc();
+        core::hint::black_box(&stack);
+    }
+    let pooled_ns = (timer.current_nanoseconds() - start) / ROUNDS;
+
+    let start = timer.current_nanoseconds();
+    for _ in 0..ROUNDS {
+        thread::spawn("Bench Task", || {}).join().unwrap();
+    }
+    let spawn_ns = (timer.current_nanoseconds() - start) / ROUNDS;
+
+    info!(
+        "[Spawn] zeroed stack: {} ns, pooled stack: {} ns, spawn+join: {} ns",
+        zeroed_ns, pooled_ns, spawn_ns
+    );
+    assert!(
+        pooled_ns < zeroed_ns,
+        "Pooled stacks are not faster than zeroed ones"
+    );
+}
+
+/// Test that the ticket lock behind `hal::Mutex` excludes every CPU and
+/// refuses `try_lock` while held.
+fn test_ticket_lock() {
+    info!("=== Test: Ticket Lock ===");
+
+    const ROUNDS: u64 = 10_000;
+    static COUNTER: Mutex<u64> = Mutex::new(0);
+    *COUNTER.lock() = 0;
+
+    {
+        let _guard = COUNTER.lock();
+        assert!(COUNTER.is_locked(), "Held lock reports unlocked");
+        assert!(COUNTER.try_lock().is_none(), "try_lock took a held lock");
+    }
+    assert!(!COUNTER.is_locked(), "Released lock reports locked");
+
+    let handles: alloc::vec::Vec<_> = (0..TINYENV_SMP)
+        .map(|cpu_id| {
+            thread::spawn_with_affinity("Ticket Task", CpuMask::one(cpu_id), || {
+                for _ in 0..ROUNDS {
+                    // A torn read-modify-write would lose increments.
+                    let mut counter = COUNTER.lock();
+                    let value = *counter;
+                    core::hint::black_box(value);
+                    *counter = value + 1;
+                }
+            })
+        })
+        .collect();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+
+    let total = *COUNTER.lock();
+    info!("[Ticket] {} increments from {} CPUs", total, TINYENV_SMP);
+    assert_eq!(total, ROUNDS * TINYENV_SMP as u64, "Increments were lost");
+}
+
+/// Test that switches, run time and latency are accounted.
+fn test_sched_stats() {
+    info!("=== Test: Scheduler Statistics ===");
+
+    assert_eq!(latency_bucket(999), 0);
+    assert_eq!(latency_bucket(1_000), 1);
+    assert_eq!(latency_bucket(3_999), 2);
+    assert_eq!(latency_bucket(4_000), 3);
+    assert_eq!(latency_bucket(u64::MAX), LATENCY_BUCKETS - 1);
+
+    const YIELDS: u64 = 5;
+    let snapshot = thread::spawn("Stats Task", || {
+        for _ in 0..YIELDS {
+            thread::yield_now();
+        }
+        let id = thread::current_id();
+        let task = stats::tasks()
+            .into_iter()
+            .find(|task| task.id() == id)
+            .expect("Running task is not registered");
+        task.stats().snapshot()
+    })
+    .join()
+    .unwrap();
+
+    info!("[Stats] {:?}", snapshot);
+    assert!(
+        snapshot.switches > YIELDS,
+        "Yields were not counted as switches"
+    );
+    assert!(
+        snapshot.voluntary >= YIELDS,
+        "Yields were not counted as voluntary"
+    );
+    assert!(snapshot.runtime_ns > 0, "Run time was not accounted");
+
+    let switched: u64 = (0..TINYENV_SMP)
+        .map(|cpu_id| {
+            stats::cpu_stats(cpu_id)
+                .latency_histogram()
+                .iter()
+                .sum::<u64>()
+        })
+        .sum();
+    assert!(switched > 0, "No wakeup latency was recorded");
+}
+
+/// Test that two tasks sharing a CPU hand it to each other on yield.
+fn test_direct_switch() {
+    info!("=== Test: Direct Task Switch ===");
+
+    const ROUNDS: usize = 1000;
+    static TURN: AtomicUsize = AtomicUsize::new(0);
+    TURN.store(0, Ordering::SeqCst);
+
+    let cpu_mask = CpuMask::one(TINYENV_SMP - 1);
+    let timer = with_provider::<TimerProvider>();
+    let start = timer.current_nanoseconds();
+    let handles: alloc::vec::Vec<_> = (0..2)
+        .map(|me| {
+            thread::spawn_with_affinity("Switch Task", cpu_mask, move || {
+                // Count the yields after which the other task had run.
+                let mut handoffs = 0;
+                for _ in 0..ROUNDS {
+                    TURN.store(me, Ordering::SeqCst);
+                    thread::yield_now();
+                    if TURN.load(Ordering::SeqCst) != me {
+                        handoffs += 1;
+                    }
+                }
+                handoffs
+            })
+        })
+        .collect();
+    let handoffs: usize = handles.into_iter().map(|h| h.join().unwrap()).sum();
+    let yield_ns = (timer.current_nanoseconds() - start) / (2 * ROUNDS as u64);
+
+    info!(
+        "[Switch] {} of {} yields handed off, {} ns per yield",
+        handoffs,
+        2 * ROUNDS,
+        yield_ns
+    );
+    assert!(
+        handoffs >= ROUNDS,
+        "Yields did not alternate between the tasks"
+    );
+}
+
+crate::define_percpu! {
+    static PERCPU_TEST: AtomicUsize = AtomicUsize::new(usize::MAX);
+}
+
+/// Test that every CPU has its own copy of a per-CPU variable, on its own
+/// cache line.
+fn test_percpu_vars() {
+    info!("=== Test: Per-CPU Variables ===");
+
+    let handles: alloc::vec::Vec<_> = (0..TINYENV_SMP)
+        .map(|cpu_id| {
+            thread::spawn_with_affinity("PerCpu Task", CpuMask::one(cpu_id), move || {
+                PERCPU_TEST.current().store(cpu_id, Ordering::SeqCst);
+                (
+                    percpu::cpu_id(),
+                    PERCPU_TEST.current_ptr() as usize,
+                    PERCPU_TEST.remote_ptr(cpu_id) as usize,
+                )
+            })
+        })
+        .collect();
+    let mut addrs = alloc::vec::Vec::new();
+    for (cpu_id, handle) in handles.into_iter().enumerate() {
+        let (ran_on, local, remote) = handle.join().unwrap();
+        assert_eq!(ran_on, cpu_id, "Task ran on the wrong CPU");
+        assert_eq!(local, remote, "Local and remote copies differ");
+        assert_eq!(
+            PERCPU_TEST.remote(cpu_id).load(Ordering::SeqCst),
+            cpu_id,
+            "Store did not land in the CPU's own copy"
+        );
+        addrs.push(local);
+    }
+    for pair in addrs.windows(2) {
+        assert!(pair[1] - pair[0] >= 64, "Per-CPU copies share a cache line");
+    }
+    info!("[PerCpu] copies at {:#x?}", addrs);
+}
+
 /// Run all scheduler tests.
 pub fn run_scheduler_tests() {
     warn!("\n=== Running Task Scheduler Tests ===");
 
     test_periodic_tasks();
     test_task_return_value();
+    test_task_affinity();
+    test_preemption();
+    test_sleep_precision();
+    test_wait_queue();
+    test_sleep_locks();
+    test_ticket_lock();
+    test_sched_stats();
+    test_direct_switch();
+    test_percpu_vars();
+    bench_spawn_latency();
 }
@@ -238,10 +238,12 @@ impl Command for CatCommand {
         };
         match fs::open(path, opt) {
             Ok(handle) => {
+                let mut buf = [0u8; 4096];
                 let mut offset = 0u64;
                 loop {
-                    match fs::read_file(handle, offset, 4096) {
-                        Ok(data) => {
+                    match fs::read_into(handle, offset, &mut buf) {
+                        Ok(read) => {
+                            let data = &buf[..read];
                             if data.is_empty() {
                                 break;
                             }
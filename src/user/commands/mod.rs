@@ -7,6 +7,8 @@ pub mod env;
 pub mod fs_commands;
 pub mod help;
 pub mod history;
+pub mod profile;
+pub mod sched;
 pub mod system;
 pub mod test;
 
@@ -18,5 +20,7 @@ pub use fs_commands::{
 };
 pub use help::HELP;
 pub use history::HISTORY_CMD;
-pub use system::EXIT;
-pub use test::TEST;
+pub use profile::{PROF, TRACE};
+pub use sched::TOP;
+pub use system::{BOOTTIME, EXIT, IRQSTAT, LOCKSTAT};
+pub use test::{BENCH, TEST};
@@ -0,0 +1,257 @@
+//! Profiling commands - PMU sampling sessions and tracepoint buffers.
+
+use anyhow::Context;
+
+use crate::TinyResult;
+use crate::config::kernel::PROFILE_DEFAULT_PERIOD;
+use crate::hal::pmu;
+use crate::profile::{TraceKind, sampler, trace};
+use crate::user::{Command, CommandContext};
+
+/// Hot spots listed by `prof report` unless told otherwise.
+const DEFAULT_HOT_SPOTS: usize = 20;
+
+/// Trace records printed by `trace dump` unless told otherwise.
+const DEFAULT_TRACE_LINES: usize = 100;
+
+/// Parses a decimal or `0x`-prefixed hexadecimal number.
+fn parse_number(arg: &str) -> TinyResult<u64> {
+    let parsed = match arg.strip_prefix("0x") {
+        Some(hex) => u64::from_str_radix(hex, 16),
+        None => arg.parse(),
+    };
+    parsed.with_context(|| alloc::format!("Invalid number: {}", arg))
+}
+
+/// Profiler command instance.
+pub static PROF: ProfCommand = ProfCommand;
+
+/// Profiler command implementation.
+pub struct ProfCommand;
+
+impl ProfCommand {
+    fn report(&self, limit: usize) {
+        println!(
+            "{:>4} {:>14} {:>14} {:>6} {:>12} {:>12} {:>12} {:>8}",
+            "CPU",
+            "cycles",
+            "instructions",
+            "IPC",
+            "l1d-misses",
+            "l2-misses",
+            "br-misses",
+            "samples"
+        );
+        for (cpu_id, counts) in sampler::counts().iter().enumerate() {
+            let event = |i: usize| match counts.events[i] {
+                Some(count) => alloc::format!("{}", count),
+                None => alloc::string::String::from("n/a"),
+            };
+            let ipc = match counts.events[0] {
+                Some(instructions) if counts.cycles > 0 => {
+                    let centi = instructions * 100 / counts.cycles;
+                    alloc::format!("{}.{:02}", centi / 100, centi % 100)
+                }
+                _ => alloc::string::String::from("n/a"),
+            };
+            println!(
+                "{:>4} {:>14} {:>14} {:>6} {:>12} {:>12} {:>12} {:>8}",
+                cpu_id,
+                counts.cycles,
+                event(0),
+                ipc,
+                event(1),
+                event(2),
+                event(3),
+                counts.samples
+            );
+            if counts.dropped > 0 {
+                println!("     ({} samples dropped, buffer full)", counts.dropped);
+            }
+        }
+
+        let spots = sampler::hot_spots();
+        let total: usize = spots.iter().map(|&(_, count)| count).sum();
+        if total == 0 {
+            return;
+        }
+        println!("\nHot spots ({} samples):", total);
+        for &(pc, count) in spots.iter().take(limit) {
+            let permille = count * 1000 / total;
+            println!(
+                "{:>8} {:>3}.{}%  {:#x}",
+                count,
+                permille / 10,
+                permille % 10,
+                pc
+            );
+            // The interrupted PC alone, symbolized from the embedded DWARF.
+            print!("{}", axbacktrace::Backtrace::capture_trap(0, pc, 0));
+        }
+    }
+}
+
+impl Command for ProfCommand {
+    fn name(&self) -> &'static str {
+        "prof"
+    }
+
+    fn description(&self) -> &'static str {
+        "Count PMU events and sample hot code on every CPU"
+    }
+
+    fn usage(&self) -> &'static str {
+        "Usage: prof <subcommand> [args...]\r\n\
+         \r\n\
+         Subcommands:\r\n\
+           prof start [period] [event] - Start counting, sampling the PC\r\n\
+                                         every <period> events (default\r\n\
+                                         1000000 CPU cycles, event 0x11)\r\n\
+           prof stop                   - Stop counting on every CPU\r\n\
+           prof report [n]             - Show counters and the n hottest PCs\r\n\
+         \r\n\
+         Example:\r\n\
+           prof start 100000\r\n\
+           cat /big_file\r\n\
+           prof stop\r\n\
+           prof report 10"
+    }
+
+    fn category(&self) -> &'static str {
+        "system"
+    }
+
+    fn execute(&self, ctx: &CommandContext) -> TinyResult<()> {
+        match ctx.args.get(0) {
+            Some("start") => {
+                let period = match ctx.args.get(1) {
+                    Some(arg) => u32::try_from(parse_number(arg)?).context("Period too large")?,
+                    None => PROFILE_DEFAULT_PERIOD,
+                };
+                let event = match ctx.args.get(2) {
+                    Some(arg) => u16::try_from(parse_number(arg)?).context("Invalid event")?,
+                    None => pmu::EVENT_CPU_CYCLES,
+                };
+                sampler::start(event, period)?;
+                println!(
+                    "Profiling started: one sample every {} events of {:#x}",
+                    period, event
+                );
+                Ok(())
+            }
+            Some("stop") => {
+                sampler::stop()?;
+                println!("Profiling stopped.");
+                Ok(())
+            }
+            Some("report") => {
+                let limit = match ctx.args.get(1) {
+                    Some(arg) => parse_number(arg)? as usize,
+                    None => DEFAULT_HOT_SPOTS,
+                };
+                if sampler::is_running() {
+                    println!("(session still running, samples may be incomplete)");
+                }
+                self.report(limit);
+                Ok(())
+            }
+            Some(unknown) => anyhow::bail!("Unknown subcommand: {}", unknown),
+            None => {
+                println!("{}", self.usage());
+                Ok(())
+            }
+        }
+    }
+}
+
+/// Trace command instance.
+pub static TRACE: TraceCommand = TraceCommand;
+
+/// Trace command implementation.
+pub struct TraceCommand;
+
+impl Command for TraceCommand {
+    fn name(&self) -> &'static str {
+        "trace"
+    }
+
+    fn description(&self) -> &'static str {
+        "Record and dump kernel tracepoints"
+    }
+
+    fn usage(&self) -> &'static str {
+        "Usage: trace <subcommand> [args...]\r\n\
+         \r\n\
+         Subcommands:\r\n\
+           trace on       - Clear the buffers and start recording\r\n\
+           trace off      - Stop recording\r\n\
+           trace dump [n] - Stop recording and print the last n events\r\n\
+           trace clear    - Forget every recorded event\r\n\
+         \r\n\
+         Tracepoints: context switches, IRQ entry/exit, block I/O\r\n\
+         submit/complete and heap allocation."
+    }
+
+    fn category(&self) -> &'static str {
+        "system"
+    }
+
+    fn execute(&self, ctx: &CommandContext) -> TinyResult<()> {
+        match ctx.args.get(0) {
+            Some("on") => {
+                trace::set_enabled(true);
+                println!("Tracing on.");
+                Ok(())
+            }
+            Some("off") => {
+                trace::set_enabled(false);
+                println!("Tracing off.");
+                Ok(())
+            }
+            Some("dump") => {
+                let limit = match ctx.args.get(1) {
+                    Some(arg) => parse_number(arg)? as usize,
+                    None => DEFAULT_TRACE_LINES,
+                };
+                // Dumping allocates, which would trace itself.
+                trace::set_enabled(false);
+                let records = trace::snapshot();
+                println!("{} events recorded", records.len());
+                for record in &records[records.len().saturating_sub(limit)..] {
+                    let [a, b] = record.args;
+                    let what = match record.kind {
+                        TraceKind::ContextSwitch => alloc::format!("task {} -> task {}", a, b),
+                        TraceKind::IrqEntry => alloc::format!("irq {}", a),
+                        TraceKind::IrqExit => alloc::format!("irq {} ({} ticks)", a, b),
+                        TraceKind::BlockSubmit | TraceKind::BlockComplete => {
+                            alloc::format!("block {} (+{})", a, b)
+                        }
+                        TraceKind::Alloc => alloc::format!("size {} align {}", a, b),
+                        TraceKind::Dealloc => alloc::format!("{:#x} size {}", a, b),
+                    };
+                    println!(
+                        "{:>12}ns cpu{} {:<14} {}",
+                        record.time_ns,
+                        record.cpu_id,
+                        alloc::format!("{:?}", record.kind),
+                        what
+                    );
+                }
+                Ok(())
+            }
+            Some("clear") => {
+                trace::clear();
+                println!("Trace buffers cleared.");
+                Ok(())
+            }
+            Some(unknown) => anyhow::bail!("Unknown subcommand: {}", unknown),
+            None => {
+                println!(
+                    "Tracing is {}.",
+                    if trace::is_enabled() { "on" } else { "off" }
+                );
+                Ok(())
+            }
+        }
+    }
+}
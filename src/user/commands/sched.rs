@@ -0,0 +1,119 @@
+//! Scheduler statistics command.
+
+use provider_core::with_provider;
+
+use crate::TinyResult;
+use crate::config::kernel::TINYENV_SMP;
+use crate::device::provider::TimerProvider;
+use crate::task::stats::{self, LATENCY_BUCKETS};
+use crate::task::task_ops::TASK_MANAGER;
+use crate::user::{Command, CommandContext};
+
+/// Top command instance.
+pub static TOP: TopCommand = TopCommand;
+
+/// Top command implementation.
+pub struct TopCommand;
+
+/// Formats the upper bound of latency bucket `i`, e.g. `<4us`.
+fn bucket_label(i: usize) -> alloc::string::String {
+    if i == LATENCY_BUCKETS - 1 {
+        return alloc::format!(">={}ms", (1u64 << (i - 1)) / 1000);
+    }
+    let us = 1u64 << i;
+    if us >= 1000 {
+        alloc::format!("<{}ms", us / 1000)
+    } else {
+        alloc::format!("<{}us", us)
+    }
+}
+
+impl Command for TopCommand {
+    fn name(&self) -> &'static str {
+        "top"
+    }
+
+    fn aliases(&self) -> &'static [&'static str] {
+        &["sched"]
+    }
+
+    fn description(&self) -> &'static str {
+        "Show per-CPU and per-task scheduler statistics"
+    }
+
+    fn usage(&self) -> &'static str {
+        "Usage: top\r\n\
+         Aliases: sched\r\n\
+         \r\n\
+         Per CPU: run-queue depth (now and peak), tasks switched to, idle\r\n\
+         share since boot and a histogram of ready-to-run latency.\r\n\
+         Per task: state, run time, switches (voluntary and preempted) and\r\n\
+         average and worst ready-to-run latency."
+    }
+
+    fn category(&self) -> &'static str {
+        "system"
+    }
+
+    fn execute(&self, _ctx: &CommandContext) -> TinyResult<()> {
+        let uptime_ns = with_provider::<TimerProvider>().boot_nanoseconds().max(1);
+
+        println!(
+            "{:>4} {:>6} {:>6} {:>10} {:>6}",
+            "CPU", "queue", "peak", "switches", "idle%"
+        );
+        let mut histogram = [0u64; LATENCY_BUCKETS];
+        for cpu_id in 0..TINYENV_SMP {
+            let cpu = stats::cpu_stats(cpu_id);
+            let (depth, peak) = TASK_MANAGER.queue_depth(cpu_id);
+            let idle_permille = cpu.idle_ns() * 1000 / uptime_ns;
+            println!(
+                "{:>4} {:>6} {:>6} {:>10} {:>4}.{}",
+                cpu_id,
+                depth,
+                peak,
+                cpu.switches(),
+                idle_permille / 10,
+                idle_permille % 10
+            );
+            for (total, count) in histogram.iter_mut().zip(cpu.latency_histogram()) {
+                *total += count;
+            }
+        }
+
+        let samples: u64 = histogram.iter().sum();
+        if samples > 0 {
+            println!("\nReady-to-run latency ({} switches):", samples);
+            let widest = histogram.iter().copied().max().unwrap_or(1);
+            for (i, &count) in histogram.iter().enumerate().filter(|(_, c)| **c > 0) {
+                let bar = (count * 40 / widest).max(1) as usize;
+                println!("  {:>7} {:>10} {}", bucket_label(i), count, "#".repeat(bar));
+            }
+        }
+
+        println!(
+            "\n{:>5} {:<16} {:<9} {:>10} {:>9} {:>7} {:>7} {:>9} {:>9}",
+            "ID", "NAME", "STATE", "run(ms)", "switches", "vol", "invol", "avg(us)", "max(us)"
+        );
+        for task in stats::tasks() {
+            let s = task.stats().snapshot();
+            let avg_latency_us = match s.switches {
+                0 => 0,
+                n => s.total_latency_ns / n / 1000,
+            };
+            println!(
+                "{:>5} {:<16} {:<9} {:>10} {:>9} {:>7} {:>7} {:>9} {:>9}",
+                task.id(),
+                task.name(),
+                alloc::format!("{:?}", task.state()),
+                s.runtime_ns / 1_000_000,
+                s.switches,
+                s.voluntary,
+                s.involuntary,
+                avg_latency_us,
+                s.max_latency_ns / 1000
+            );
+        }
+        Ok(())
+    }
+}
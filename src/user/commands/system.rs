@@ -1,7 +1,9 @@
-//! System commands - power management and system control.
+//! System commands - power management, system control and statistics.
 
 use crate::TinyResult;
-use crate::device::provider::PowerProvider;
+use crate::config::kernel::TINYENV_SMP;
+use crate::device::provider::{IrqProvider, IrqStats, PowerProvider};
+use crate::hal::{lock_stats, lock_stats_enabled, reset_lock_stats};
 use crate::user::{Command, CommandContext};
 use provider_core::with_provider;
 
@@ -37,6 +39,170 @@ impl Command for ExitCommand {
 
     fn execute(&self, _ctx: &CommandContext) -> TinyResult<()> {
         println!("Powering off...");
+        crate::console::flush();
         with_provider::<PowerProvider>().system_off();
     }
 }
+
+/// IRQ statistics command instance.
+pub static IRQSTAT: IrqStatCommand = IrqStatCommand;
+
+/// IRQ statistics command implementation.
+pub struct IrqStatCommand;
+
+impl Command for IrqStatCommand {
+    fn name(&self) -> &'static str {
+        "irqstat"
+    }
+
+    fn description(&self) -> &'static str {
+        "Show per-CPU interrupt counts and handler times"
+    }
+
+    fn usage(&self) -> &'static str {
+        "Usage: irqstat\r\n\
+         \r\n\
+         Lists every interrupt handled since boot with its count on each\r\n\
+         CPU, and the average and longest time spent in its handler."
+    }
+
+    fn category(&self) -> &'static str {
+        "system"
+    }
+
+    fn execute(&self, _ctx: &CommandContext) -> TinyResult<()> {
+        let irq = with_provider::<IrqProvider>();
+        print!("{:>6}", "IRQ");
+        for cpu_id in 0..TINYENV_SMP {
+            print!(" {:>10}", alloc::format!("CPU{}", cpu_id));
+        }
+        println!(" {:>10} {:>10}", "avg(ns)", "max(ns)");
+
+        for intid in 0..irq.max_irqs() {
+            let stats: [IrqStats; TINYENV_SMP] =
+                core::array::from_fn(|cpu_id| irq.stats(cpu_id, intid));
+            let count: u64 = stats.iter().map(|s| s.count).sum();
+            if count == 0 {
+                continue;
+            }
+            let total_ns: u64 = stats.iter().map(|s| s.total_ns).sum();
+            let max_ns = stats.iter().map(|s| s.max_ns).max().unwrap_or(0);
+
+            print!("{:>6}", intid);
+            for s in &stats {
+                print!(" {:>10}", s.count);
+            }
+            println!(" {:>10} {:>10}", total_ns / count, max_ns);
+        }
+        Ok(())
+    }
+}
+
+/// Lock statistics command instance.
+pub static LOCKSTAT: LockStatCommand = LockStatCommand;
+
+/// Lock statistics command implementation.
+pub struct LockStatCommand;
+
+impl Command for LockStatCommand {
+    fn name(&self) -> &'static str {
+        "lockstat"
+    }
+
+    fn description(&self) -> &'static str {
+        "Show acquisitions, contention and hold times of named spinlocks"
+    }
+
+    fn usage(&self) -> &'static str {
+        "Usage: lockstat [reset]\r\n\
+         \r\n\
+         Lists every named spinlock, most contended first, or zeroes the\r\n\
+         counters with 'reset'. Needs a kernel built with the lock_stats\r\n\
+         feature."
+    }
+
+    fn category(&self) -> &'static str {
+        "system"
+    }
+
+    fn execute(&self, ctx: &CommandContext) -> TinyResult<()> {
+        if !lock_stats_enabled() {
+            println!("Lock statistics are off, rebuild with the lock_stats feature.");
+            return Ok(());
+        }
+        match ctx.args.get(0) {
+            Some("reset") => {
+                reset_lock_stats();
+                println!("Lock statistics cleared.");
+                return Ok(());
+            }
+            Some(unknown) => anyhow::bail!("Unknown subcommand: {}", unknown),
+            None => {}
+        }
+
+        let mut locks = lock_stats();
+        locks.sort_unstable_by(|a, b| b.contended.cmp(&a.contended));
+        println!(
+            "{:<16} {:>18} {:>12} {:>10} {:>6} {:>10} {:>12}",
+            "LOCK", "address", "acquires", "contended", "%", "spins", "max hold(ns)"
+        );
+        for lock in &locks {
+            let permille = lock.contended * 1000 / lock.acquires.max(1);
+            println!(
+                "{:<16} {:>#18x} {:>12} {:>10} {:>4}.{} {:>10} {:>12}",
+                lock.name,
+                lock.addr,
+                lock.acquires,
+                lock.contended,
+                permille / 10,
+                permille % 10,
+                lock.spins,
+                lock.max_hold_ns
+            );
+        }
+        Ok(())
+    }
+}
+
+/// Boot timing command instance.
+pub static BOOTTIME: BootTimeCommand = BootTimeCommand;
+
+/// Boot timing command implementation.
+pub struct BootTimeCommand;
+
+impl Command for BootTimeCommand {
+    fn name(&self) -> &'static str {
+        "boottime"
+    }
+
+    fn description(&self) -> &'static str {
+        "Show how long each boot phase took"
+    }
+
+    fn usage(&self) -> &'static str {
+        "Usage: boottime\r\n\
+         \r\n\
+         Lists the boot phases with their duration and end time since\r\n\
+         reset, up to the shell starting. The first phase includes the\r\n\
+         firmware and bootloader."
+    }
+
+    fn category(&self) -> &'static str {
+        "system"
+    }
+
+    fn execute(&self, _ctx: &CommandContext) -> TinyResult<()> {
+        println!("{:<16} {:>12} {:>12}", "PHASE", "took(us)", "at(us)");
+        let mut prev = 0;
+        for (name, end_ns) in crate::boot::phases::phases() {
+            println!(
+                "{:<16} {:>12} {:>12}",
+                name,
+                (end_ns - prev) / 1000,
+                end_ns / 1000
+            );
+            prev = end_ns;
+        }
+        Ok(())
+    }
+}
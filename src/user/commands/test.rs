@@ -1,4 +1,8 @@
-//! Test command - run kernel tests.
+//! Test commands - run kernel tests and benchmarks.
+
+use alloc::vec::Vec;
+
+use anyhow::bail;
 
 use crate::TinyResult;
 use crate::user::{Command, CommandContext};
@@ -50,3 +54,54 @@ impl Command for TestCommand {
         }
     }
 }
+
+/// Bench command instance.
+pub static BENCH: BenchCommand = BenchCommand;
+
+/// Bench command implementation.
+pub struct BenchCommand;
+
+impl Command for BenchCommand {
+    fn name(&self) -> &'static str {
+        "bench"
+    }
+
+    fn description(&self) -> &'static str {
+        "Run kernel benchmarks"
+    }
+
+    fn usage(&self) -> &'static str {
+        "Usage: bench [--raw-disk] [NAME...]\r\n\
+         \r\n\
+         Runs the named benchmarks, or all of them, in a separate thread.\r\n\
+         Each result is printed as one JSON line, for `cargo xtask bench`.\r\n\
+         Benchmarks: yield spawn alloc timer irq lock block fs\r\n\
+         \r\n\
+         `block` reads and rewrites the last 4 MiB of the disk, under the\r\n\
+         filesystem, and only runs with --raw-disk."
+    }
+
+    fn category(&self) -> &'static str {
+        "system"
+    }
+
+    fn execute(&self, ctx: &CommandContext) -> TinyResult<()> {
+        let mut filter: Vec<&'static str> = Vec::new();
+        let mut raw_disk = false;
+        for arg in ctx.args.iter() {
+            if arg == "--raw-disk" {
+                raw_disk = true;
+                continue;
+            }
+            match crate::tests::bench::bench_names().find(|name| *name == arg) {
+                Some(name) => filter.push(name),
+                None => bail!("Unknown benchmark: {}", arg),
+            }
+        }
+
+        let handle = crate::task::thread::spawn("bench_runner", move || {
+            crate::tests::bench::run_benches(&filter, raw_disk);
+        });
+        handle.join()
+    }
+}
@@ -16,7 +16,14 @@ static COMMANDS: &[&dyn Command] = &[
     &commands::ENV,
     &commands::HISTORY_CMD,
     &commands::TEST,
+    &commands::BENCH,
     &commands::EXIT,
+    &commands::IRQSTAT,
+    &commands::LOCKSTAT,
+    &commands::BOOTTIME,
+    &commands::PROF,
+    &commands::TRACE,
+    &commands::TOP,
     &commands::LS,
     &commands::CD,
     &commands::MKDIR,
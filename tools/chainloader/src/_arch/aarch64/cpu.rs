@@ -11,7 +11,10 @@
 //!
 //! crate::cpu::arch_cpu
 
-use aarch64_cpu::asm;
+use aarch64_cpu::{
+    asm,
+    registers::{CNTFRQ_EL0, CNTPCT_EL0, Readable},
+};
 
 //--------------------------------------------------------------------------------------------------
 // Public Code
@@ -28,6 +31,15 @@ pub fn spin_for_cycles(n: usize) {
     }
 }
 
+/// Microseconds since the counter started, from the architectural timer.
+#[inline(always)]
+pub fn uptime_us() -> u64 {
+    let ticks = CNTPCT_EL0.get() as u128;
+    let freq = CNTFRQ_EL0.get() as u128;
+
+    (ticks * 1_000_000 / freq) as u64
+}
+
 /// Pause execution on the core.
 #[inline(always)]
 pub fn wait_forever() -> ! {
@@ -161,6 +161,12 @@ register_structs! {
 /// Abstraction for the associated MMIO registers.
 type Registers = MMIODerefWrapper<RegisterBlock>;
 
+/// UART reference clock, set to 48 MHz in config.txt.
+const UART_CLOCK_HZ: u32 = 48_000_000;
+
+/// Baud rate the UART is brought up with.
+const DEFAULT_BAUD_RATE: u32 = 921_600;
+
 #[derive(PartialEq)]
 enum BlockingMode {
     Blocking,
@@ -169,6 +175,7 @@ enum BlockingMode {
 
 struct PL011UartInner {
     registers: Registers,
+    baud_rate: u32,
     chars_written: usize,
     chars_read: usize,
 }
@@ -195,6 +202,7 @@ impl PL011UartInner {
     pub const unsafe fn new(mmio_start_addr: usize) -> Self {
         Self {
             registers: unsafe { Registers::new(mmio_start_addr) },
+            baud_rate: 0,
             chars_written: 0,
             chars_read: 0,
         }
@@ -203,6 +211,12 @@ impl PL011UartInner {
     /// Set up baud rate and characteristics.
     ///
     /// This results in 8N1 and 921_600 baud.
+    pub fn init(&mut self) {
+        // Cannot fail, the default is within range of the clock.
+        let _ = self.set_baud_rate(DEFAULT_BAUD_RATE);
+    }
+
+    /// Return the baud rate divisor for `baud` as `(IBRD, FBRD)`, if the clock can produce it.
     ///
     /// The calculation for the BRD is (we set the clock to 48 MHz in config.txt):
     /// `(48_000_000 / 16) / 921_600 = 3.2552083`.
@@ -217,7 +231,25 @@ impl PL011UartInner {
     /// genrated baud rate of `48_000_000 / (16 * 3.25) = 923_077`.
     ///
     /// Error = `((923_077 - 921_600) / 921_600) * 100 = 0.16%`.
-    pub fn init(&mut self) {
+    fn divisor(baud: u32) -> Option<(u32, u32)> {
+        if baud == 0 || baud > UART_CLOCK_HZ / 16 {
+            return None;
+        }
+
+        // The divider in 64ths, rounded: `UART_CLOCK_HZ * 64 / (16 * baud)`.
+        let div64 = (u64::from(UART_CLOCK_HZ) * 4 + u64::from(baud) / 2) / u64::from(baud);
+        let (int, frac) = ((div64 >> 6) as u32, (div64 & 0x3f) as u32);
+        if int == 0 || int > 0xffff {
+            return None;
+        }
+
+        Some((int, frac))
+    }
+
+    /// Reprogram the line for `baud`, 8N1 and FIFOs enabled.
+    fn set_baud_rate(&mut self, baud: u32) -> Result<(), &'static str> {
+        let (int, frac) = Self::divisor(baud).ok_or("Baud rate out of range")?;
+
         // Execution can arrive here while there are still characters queued in the TX FIFO and
         // actively being sent out by the UART hardware. If the UART is turned off in this case,
         // those queued characters would be lost.
@@ -241,8 +273,8 @@ impl PL011UartInner {
         // contents of IBRD or FBRD, a LCR_H write must always be performed at the end.
         //
         // Set the baud rate, 8N1 and FIFO enabled.
-        self.registers.IBRD.write(IBRD::BAUD_DIVINT.val(3));
-        self.registers.FBRD.write(FBRD::BAUD_DIVFRAC.val(16));
+        self.registers.IBRD.write(IBRD::BAUD_DIVINT.val(int));
+        self.registers.FBRD.write(FBRD::BAUD_DIVFRAC.val(frac));
         self.registers
             .LCR_H
             .write(LCR_H::WLEN::EightBit + LCR_H::FEN::FifosEnabled);
@@ -251,6 +283,10 @@ impl PL011UartInner {
         self.registers
             .CR
             .write(CR::UARTEN::Enabled + CR::TXE::Enabled + CR::RXE::Enabled);
+
+        self.baud_rate = baud;
+
+        Ok(())
     }
 
     /// Send a character.
@@ -379,6 +415,11 @@ impl console::interface::Read for PL011Uart {
             .lock(|inner| inner.read_char(BlockingMode::Blocking).unwrap())
     }
 
+    fn try_read_char(&self) -> Option<char> {
+        self.inner
+            .lock(|inner| inner.read_char(BlockingMode::NonBlocking))
+    }
+
     fn clear_rx(&self) {
         // Read from the RX FIFO until it is indicating empty.
         while self
@@ -399,4 +440,18 @@ impl console::interface::Statistics for PL011Uart {
     }
 }
 
+impl console::interface::Line for PL011Uart {
+    fn baud_rate(&self) -> u32 {
+        self.inner.lock(|inner| inner.baud_rate)
+    }
+
+    fn max_baud_rate(&self) -> u32 {
+        UART_CLOCK_HZ / 16
+    }
+
+    fn set_baud_rate(&self, baud: u32) -> Result<(), &'static str> {
+        self.inner.lock(|inner| inner.set_baud_rate(baud))
+    }
+}
+
 impl console::interface::All for PL011Uart {}
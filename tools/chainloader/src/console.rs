@@ -35,10 +35,33 @@ pub mod interface {
             ' '
         }
 
+        /// Read a single character, if one has been received.
+        fn try_read_char(&self) -> Option<char> {
+            None
+        }
+
         /// Clear RX buffers, if any.
         fn clear_rx(&self);
     }
 
+    /// Console line settings.
+    pub trait Line {
+        /// Return the current baud rate, or 0 if unknown.
+        fn baud_rate(&self) -> u32 {
+            0
+        }
+
+        /// Return the highest baud rate the line can be switched to.
+        fn max_baud_rate(&self) -> u32 {
+            0
+        }
+
+        /// Switch to `baud` after the last buffered character has been sent.
+        fn set_baud_rate(&self, _baud: u32) -> Result<(), &'static str> {
+            Err("Baud rate cannot be changed")
+        }
+    }
+
     /// Console statistics.
     pub trait Statistics {
         /// Return the number of characters written.
@@ -55,7 +78,7 @@ pub mod interface {
     }
 
     /// Trait alias for a full-fledged console.
-    pub trait All: Write + Read + Statistics {}
+    pub trait All: Write + Read + Statistics + Line {}
 }
 
 //--------------------------------------------------------------------------------------------------
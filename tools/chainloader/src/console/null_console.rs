@@ -38,4 +38,5 @@ impl interface::Read for NullConsole {
 }
 
 impl interface::Statistics for NullConsole {}
+impl interface::Line for NullConsole {}
 impl interface::All for NullConsole {}
@@ -13,7 +13,7 @@ mod boot;
 //--------------------------------------------------------------------------------------------------
 // Architectural Public Reexports
 //--------------------------------------------------------------------------------------------------
-pub use arch_cpu::{nop, wait_forever};
+pub use arch_cpu::{nop, uptime_us, wait_forever};
 
 #[cfg(feature = "bsp_rpi3")]
 pub use arch_cpu::spin_for_cycles;
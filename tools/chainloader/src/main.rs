@@ -118,6 +118,7 @@ mod cpu;
 mod driver;
 mod panic_wait;
 mod print;
+mod protocol;
 mod synchronization;
 
 /// Early init code.
@@ -154,33 +155,54 @@ fn kernel_main() -> ! {
     println!("{}", MINILOAD_LOGO);
     println!("{:^37}", bsp::board_name());
     println!();
-    println!("[ML] Requesting binary");
-    console().flush();
+    let kernel_addr: *mut u8 = bsp::memory::board_default_load_addr() as *mut u8;
+    loop {
+        println!("[ML] Requesting binary");
+        console().flush();
 
-    // Discard any spurious received characters before starting with the loader protocol.
-    console().clear_rx();
+        // Discard any spurious received characters before starting with the loader protocol.
+        console().clear_rx();
 
-    // Notify `Minipush` to send the binary.
-    for _ in 0..3 {
-        console().write_char(3 as char);
-    }
+        // Notify `Minipush` to send the binary.
+        for _ in 0..3 {
+            console().write_char(3 as char);
+        }
 
-    // Read the binary's size.
-    let mut size: u32 = u32::from(console().read_char() as u8);
-    size |= u32::from(console().read_char() as u8) << 8;
-    size |= u32::from(console().read_char() as u8) << 16;
-    size |= u32::from(console().read_char() as u8) << 24;
+        // Read the binary's size, or the magic of the framed protocol.
+        let mut header = [0u8; 4];
+        for byte in &mut header {
+            *byte = console().read_char() as u8;
+        }
 
-    // Trust it's not too big.
-    console().write_char('O');
-    console().write_char('K');
+        if header == protocol::MAGIC {
+            match protocol::receive(kernel_addr) {
+                Ok(size) => {
+                    println!("[ML] Received {} KiB", size / 1024);
+                    break;
+                }
+                Err(x) => {
+                    println!("[ML] Transfer failed: {}", x);
+                    continue;
+                }
+            }
+        }
 
-    let kernel_addr: *mut u8 = bsp::memory::board_default_load_addr() as *mut u8;
-    unsafe {
-        // Read the kernel byte by byte.
-        for i in 0..size {
-            core::ptr::write_volatile(kernel_addr.offset(i as isize), console().read_char() as u8)
+        let size = u32::from_le_bytes(header);
+
+        // Trust it's not too big.
+        console().write_char('O');
+        console().write_char('K');
+
+        unsafe {
+            // Read the kernel byte by byte.
+            for i in 0..size {
+                core::ptr::write_volatile(
+                    kernel_addr.offset(i as isize),
+                    console().read_char() as u8,
+                )
+            }
         }
+        break;
     }
 
     println!("[ML] Loaded! Executing the payload now\n");
@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! Framed transfer protocol.
+//!
+//! The plain `MiniLoad` protocol streams the binary byte by byte after a 4-byte size. When the host
+//! instead answers the load request with [`MAGIC`], the transfer is framed:
+//!
+//! 1. The host sends a hello: the baud rate it wants, the image size and the image's CRC-32,
+//!    followed by the CRC-32 of the hello. The loader answers `OK` and the baud rate it agrees to,
+//!    which is the current one if the requested rate is out of range.
+//! 2. Both sides switch to the agreed rate. The host sends [`SYN`] until the loader answers
+//!    [`ACK`].
+//! 3. The image follows in blocks of [`BLOCK_SIZE`] bytes, each one stored or LZ4-compressed:
+//!
+//!    ```text
+//!    SOF | seq: u16 | flags: u8 | raw_len: u16 | wire_len: u16 | header CRC: u32
+//!        | payload: [u8; wire_len] | payload CRC: u32
+//!    ```
+//!
+//!    Every block is answered with [`ACK`] or [`NAK`] and the sequence number as `u16`. The host
+//!    resends a block on `NAK` or when no answer comes. A block that is received twice because an
+//!    `ACK` got lost is acknowledged again.
+//! 4. After the last block the loader checks the image CRC-32, answers `DK` if it matches and `DE`
+//!    if it does not, and switches back to the original baud rate.
+//!
+//! All integers are little endian.
+
+mod crc32;
+mod lz4;
+
+use crate::{console::console, cpu, synchronization, synchronization::NullLock};
+
+//--------------------------------------------------------------------------------------------------
+// Public Definitions
+//--------------------------------------------------------------------------------------------------
+
+/// Sent by the host instead of the plain protocol's size.
+pub const MAGIC: [u8; 4] = *b"RTCB";
+
+/// Uncompressed size of every block but the last.
+pub const BLOCK_SIZE: usize = 32 * 1024;
+
+//--------------------------------------------------------------------------------------------------
+// Private Definitions
+//--------------------------------------------------------------------------------------------------
+
+/// Host probing the new baud rate.
+const SYN: u8 = 0x16;
+/// Block received.
+const ACK: u8 = 0x06;
+/// Block lost or damaged, send it again.
+const NAK: u8 = 0x15;
+/// Start of a block.
+const SOF: u8 = 0xa5;
+
+/// Block payload is LZ4-compressed.
+const FLAG_LZ4: u8 = 1 << 0;
+
+/// Give up on a block when the line stays silent this long in the middle of it.
+const BYTE_TIMEOUT_US: u64 = 200_000;
+/// After a damaged block, wait for the line to be this quiet before answering.
+const QUIET_US: u64 = 20_000;
+/// Give up on the whole transfer when the host stays silent this long.
+const IDLE_TIMEOUT_US: u64 = 10_000_000;
+
+/// Receive buffer for block payloads.
+static PAYLOAD: NullLock<[u8; BLOCK_SIZE]> = NullLock::new([0; BLOCK_SIZE]);
+
+struct Hello {
+    baud: u32,
+    size: u32,
+    crc: u32,
+}
+
+struct Header {
+    seq: u16,
+    flags: u8,
+    raw_len: usize,
+    wire_len: usize,
+}
+
+enum FrameError {
+    /// The host sent nothing at all.
+    Idle,
+    /// Bytes were lost or damaged.
+    Damaged,
+}
+
+//--------------------------------------------------------------------------------------------------
+// Private Code
+//--------------------------------------------------------------------------------------------------
+use synchronization::interface::Mutex;
+
+fn write_bytes(bytes: &[u8]) {
+    for &byte in bytes {
+        console().write_char(byte as char);
+    }
+}
+
+/// Read a byte, waiting at most `timeout_us`.
+fn read_byte_timeout(timeout_us: u64) -> Option<u8> {
+    let start = cpu::uptime_us();
+    loop {
+        if let Some(c) = console().try_read_char() {
+            return Some(c as u8);
+        }
+        if cpu::uptime_us() - start > timeout_us {
+            return None;
+        }
+    }
+}
+
+fn read_exact(buf: &mut [u8]) -> Result<(), FrameError> {
+    for byte in buf {
+        *byte = read_byte_timeout(BYTE_TIMEOUT_US).ok_or(FrameError::Damaged)?;
+    }
+
+    Ok(())
+}
+
+fn read_u32() -> u32 {
+    let mut bytes = [0; 4];
+    for byte in &mut bytes {
+        *byte = console().read_char() as u8;
+    }
+
+    u32::from_le_bytes(bytes)
+}
+
+/// Discard input until the line has been quiet for [`QUIET_US`].
+fn drain() {
+    while read_byte_timeout(QUIET_US).is_some() {}
+}
+
+fn reply(code: u8, seq: u16) {
+    let seq = seq.to_le_bytes();
+    write_bytes(&[code, seq[0], seq[1]]);
+}
+
+fn read_hello() -> Result<Hello, &'static str> {
+    let fields = [read_u32(), read_u32(), read_u32()];
+    let crc = read_u32();
+
+    let mut bytes = [0; 12];
+    for (chunk, field) in bytes.chunks_exact_mut(4).zip(fields) {
+        chunk.copy_from_slice(&field.to_le_bytes());
+    }
+    if crc32::checksum(&bytes) != crc {
+        return Err("Damaged hello");
+    }
+
+    Ok(Hello {
+        baud: fields[0],
+        size: fields[1],
+        crc: fields[2],
+    })
+}
+
+/// Wait for the host to probe the agreed baud rate.
+fn sync() -> Result<(), &'static str> {
+    let start = cpu::uptime_us();
+    while cpu::uptime_us() - start < IDLE_TIMEOUT_US {
+        // Bytes garbled by the switch are skipped.
+        if read_byte_timeout(QUIET_US) == Some(SYN) {
+            write_bytes(&[ACK]);
+            return Ok(());
+        }
+    }
+
+    Err("No sync at the new baud rate")
+}
+
+/// Receive the next block header, skipping anything before its start.
+fn read_header() -> Result<Header, FrameError> {
+    let start = cpu::uptime_us();
+    loop {
+        match read_byte_timeout(QUIET_US) {
+            Some(SOF) => break,
+            // Stray `SYN`s and leftovers of a damaged block.
+            Some(_) => {}
+            None if cpu::uptime_us() - start > IDLE_TIMEOUT_US => return Err(FrameError::Idle),
+            None => {}
+        }
+    }
+
+    let mut bytes = [0; 12];
+    bytes[0] = SOF;
+    read_exact(&mut bytes[1..])?;
+    let crc = u32::from_le_bytes([bytes[8], bytes[9], bytes[10], bytes[11]]);
+    if crc32::checksum(&bytes[..8]) != crc {
+        return Err(FrameError::Damaged);
+    }
+
+    let header = Header {
+        seq: u16::from_le_bytes([bytes[1], bytes[2]]),
+        flags: bytes[3],
+        raw_len: usize::from(u16::from_le_bytes([bytes[4], bytes[5]])),
+        wire_len: usize::from(u16::from_le_bytes([bytes[6], bytes[7]])),
+    };
+    if header.wire_len > BLOCK_SIZE || header.raw_len > BLOCK_SIZE {
+        return Err(FrameError::Damaged);
+    }
+
+    Ok(header)
+}
+
+/// Receive a block's payload into `buf` and check it.
+fn read_payload(buf: &mut [u8]) -> Result<(), FrameError> {
+    read_exact(buf)?;
+    let mut crc = [0; 4];
+    read_exact(&mut crc)?;
+    if crc32::checksum(buf) != u32::from_le_bytes(crc) {
+        return Err(FrameError::Damaged);
+    }
+
+    Ok(())
+}
+
+/// Unpack a checked payload into `dst`, which is exactly the block's size.
+fn unpack(header: &Header, payload: &[u8], dst: &mut [u8]) -> Result<(), &'static str> {
+    if header.flags & FLAG_LZ4 != 0 {
+        if lz4::decompress(payload, dst)? != dst.len() {
+            return Err("Short LZ4 block");
+        }
+    } else {
+        if payload.len() != dst.len() {
+            return Err("Short block");
+        }
+        dst.copy_from_slice(payload);
+    }
+
+    Ok(())
+}
+
+/// Receive `size` bytes to `load_addr` block by block.
+fn receive_blocks(load_addr: *mut u8, size: usize) -> Result<(), &'static str> {
+    let mut offset = 0;
+    let mut seq: u16 = 0;
+
+    while offset < size {
+        let header = match read_header() {
+            Ok(header) => header,
+            Err(FrameError::Idle) => return Err("Host went silent"),
+            Err(FrameError::Damaged) => {
+                drain();
+                reply(NAK, seq);
+                continue;
+            }
+        };
+
+        if header.seq == seq.wrapping_sub(1) && offset > 0 {
+            // Our `ACK` got lost; the block is already in place.
+            drain();
+            reply(ACK, header.seq);
+            continue;
+        }
+
+        let raw_len = BLOCK_SIZE.min(size - offset);
+        let unpacked = PAYLOAD.lock(|payload| {
+            let payload = &mut payload[..header.wire_len];
+            read_payload(payload).map_err(|_| ())?;
+            if header.seq != seq || header.raw_len != raw_len {
+                return Err(());
+            }
+
+            // Safety: the block lies within the image, which the host promised fits.
+            let dst = unsafe { core::slice::from_raw_parts_mut(load_addr.add(offset), raw_len) };
+            unpack(&header, payload, dst).map_err(|_| ())
+        });
+
+        match unpacked {
+            Ok(()) => {
+                reply(ACK, seq);
+                offset += raw_len;
+                seq = seq.wrapping_add(1);
+            }
+            Err(()) => {
+                drain();
+                reply(NAK, seq);
+            }
+        }
+    }
+
+    Ok(())
+}
+
+//--------------------------------------------------------------------------------------------------
+// Public Code
+//--------------------------------------------------------------------------------------------------
+
+/// Run a framed transfer to `load_addr`, after the host sent [`MAGIC`]. Return the image size.
+///
+/// The console is back at its original baud rate when this returns, also on failure.
+pub fn receive(load_addr: *mut u8) -> Result<usize, &'static str> {
+    let hello = read_hello()?;
+    let initial_baud = console().baud_rate();
+    let baud = if hello.baud != 0 && hello.baud <= console().max_baud_rate() {
+        hello.baud
+    } else {
+        initial_baud
+    };
+
+    write_bytes(b"OK");
+    write_bytes(&baud.to_le_bytes());
+    console().flush();
+    if baud != initial_baud {
+        console().set_baud_rate(baud)?;
+    }
+
+    let size = hello.size as usize;
+    let result = sync().and_then(|_| receive_blocks(load_addr, size));
+    let result = result.and_then(|_| {
+        // Safety: all of it was just written.
+        let image = unsafe { core::slice::from_raw_parts(load_addr, size) };
+        if crc32::checksum(image) == hello.crc {
+            write_bytes(b"DK");
+            Ok(size)
+        } else {
+            write_bytes(b"DE");
+            Err("Image checksum mismatch")
+        }
+    });
+
+    console().flush();
+    if baud != initial_baud {
+        console().set_baud_rate(initial_baud)?;
+    }
+
+    result
+}
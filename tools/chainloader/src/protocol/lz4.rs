@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: MIT OR Apache-2.0
+
+//! LZ4 block decompression.
+//!
+//! Decodes the raw LZ4 block format (no frame header), as produced for every transfer block by the
+//! host. The input comes off the wire, so every length and offset is checked before it is used.
+//!
+//! # Resources
+//!
+//! - <https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md>
+
+//--------------------------------------------------------------------------------------------------
+// Private Definitions
+//--------------------------------------------------------------------------------------------------
+
+const MIN_MATCH: usize = 4;
+
+const CORRUPT: &str = "Corrupt LZ4 block";
+
+//--------------------------------------------------------------------------------------------------
+// Private Code
+//--------------------------------------------------------------------------------------------------
+
+/// Read an extended length: bytes are added up until one is not 255.
+fn read_length(src: &[u8], pos: &mut usize) -> Result<usize, &'static str> {
+    let mut len = 0usize;
+    loop {
+        let byte = *src.get(*pos).ok_or(CORRUPT)?;
+        *pos += 1;
+        len = len.checked_add(usize::from(byte)).ok_or(CORRUPT)?;
+        if byte != 255 {
+            return Ok(len);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Public Code
+//--------------------------------------------------------------------------------------------------
+
+/// Decompress the block `src` into `dst` and return the number of bytes written.
+pub fn decompress(src: &[u8], dst: &mut [u8]) -> Result<usize, &'static str> {
+    let mut s: usize = 0;
+    let mut d: usize = 0;
+
+    loop {
+        let token = *src.get(s).ok_or(CORRUPT)?;
+        s += 1;
+
+        // Literals.
+        let mut literals = usize::from(token >> 4);
+        if literals == 15 {
+            literals += read_length(src, &mut s)?;
+        }
+        let src_end = s.checked_add(literals).ok_or(CORRUPT)?;
+        let dst_end = d.checked_add(literals).ok_or(CORRUPT)?;
+        if src_end > src.len() || dst_end > dst.len() {
+            return Err(CORRUPT);
+        }
+        dst[d..dst_end].copy_from_slice(&src[s..src_end]);
+        s = src_end;
+        d = dst_end;
+
+        // The last sequence has no match.
+        if s == src.len() {
+            return Ok(d);
+        }
+
+        // Match.
+        if s + 2 > src.len() {
+            return Err(CORRUPT);
+        }
+        let offset = usize::from(u16::from_le_bytes([src[s], src[s + 1]]));
+        s += 2;
+        if offset == 0 || offset > d {
+            return Err(CORRUPT);
+        }
+        let mut len = usize::from(token & 0xf);
+        if len == 15 {
+            len += read_length(src, &mut s)?;
+        }
+        len += MIN_MATCH;
+        if len > dst.len() - d {
+            return Err(CORRUPT);
+        }
+
+        // Byte by byte, the match may overlap what it produces.
+        for i in d..d + len {
+            dst[i] = dst[i - offset];
+        }
+        d += len;
+    }
+}
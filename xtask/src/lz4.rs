@@ -0,0 +1,83 @@
+//! LZ4 block compression for chainboot transfers.
+//!
+//! Produces the raw LZ4 block format (no frame header) that the chainloader decodes. A greedy
+//! single-probe matcher is enough here: the line is the bottleneck, not the compressor.
+
+const MIN_MATCH: usize = 4;
+/// The last five bytes are always literals.
+const LAST_LITERALS: usize = 5;
+/// A match may not start within the last twelve bytes.
+const MF_LIMIT: usize = 12;
+const MAX_OFFSET: usize = 65535;
+const HASH_LOG: u32 = 12;
+
+fn read_u32(data: &[u8], pos: usize) -> u32 {
+    u32::from_le_bytes(data[pos..pos + 4].try_into().unwrap())
+}
+
+fn hash(seq: u32) -> usize {
+    (seq.wrapping_mul(2654435761) >> (32 - HASH_LOG)) as usize
+}
+
+fn write_length(out: &mut Vec<u8>, mut len: usize) {
+    while len >= 255 {
+        out.push(255);
+        len -= 255;
+    }
+    out.push(len as u8);
+}
+
+fn write_sequence(out: &mut Vec<u8>, literals: &[u8], m: Option<(usize, usize)>) {
+    let lit_len = literals.len();
+    let match_code = m.map_or(0, |(_, len)| len - MIN_MATCH);
+    out.push(((lit_len.min(15) as u8) << 4) | match_code.min(15) as u8);
+    if lit_len >= 15 {
+        write_length(out, lit_len - 15);
+    }
+    out.extend_from_slice(literals);
+
+    if let Some((offset, _)) = m {
+        out.extend_from_slice(&(offset as u16).to_le_bytes());
+        if match_code >= 15 {
+            write_length(out, match_code - 15);
+        }
+    }
+}
+
+/// Compresses `src` into one LZ4 block.
+pub fn compress(src: &[u8]) -> Vec<u8> {
+    let mut out = Vec::with_capacity(src.len() / 2);
+    // Position + 1 of the last occurrence of each hashed 4-byte sequence.
+    let mut table = vec![0usize; 1 << HASH_LOG];
+    let mut anchor = 0;
+    let mut pos = 0;
+
+    if src.len() > MF_LIMIT {
+        let match_limit = src.len() - MF_LIMIT;
+        let end_limit = src.len() - LAST_LITERALS;
+        while pos < match_limit {
+            let seq = read_u32(src, pos);
+            let slot = &mut table[hash(seq)];
+            let candidate = *slot;
+            *slot = pos + 1;
+
+            if candidate != 0 {
+                let cand = candidate - 1;
+                if pos - cand <= MAX_OFFSET && read_u32(src, cand) == seq {
+                    let mut end = pos + MIN_MATCH;
+                    while end < end_limit && src[end] == src[end - pos + cand] {
+                        end += 1;
+                    }
+                    write_sequence(&mut out, &src[anchor..pos], Some((pos - cand, end - pos)));
+                    pos = end;
+                    anchor = pos;
+                    continue;
+                }
+            }
+            pos += 1;
+        }
+    }
+
+    write_sequence(&mut out, &src[anchor..], None);
+    out
+}
@@ -6,6 +6,7 @@ mod utils;
 use utils::{project_root, TaskResult};
 
 mod dwarf;
+mod lz4;
 mod plugins;
 
 #[macro_use]
@@ -42,6 +43,49 @@ pub struct BuildOptions {
     pub debug: bool,
 }
 
+#[derive(Debug, Clone, Parser)]
+pub struct BenchOptions {
+    #[command(flatten)]
+    pub build: BuildOptions,
+
+    /// Baseline file to compare against (default from [bench] in tinyconfig.toml)
+    #[arg(long)]
+    pub baseline: Option<std::path::PathBuf>,
+
+    /// Save the results as the new baseline instead of comparing
+    #[arg(long)]
+    pub save: bool,
+
+    /// Allowed regression in percent before failing
+    #[arg(long)]
+    pub threshold: Option<f64>,
+
+    /// Also run the benchmarks that overwrite part of the raw disk image
+    #[arg(long)]
+    pub raw_disk: bool,
+
+    /// Benchmarks to run (default: all)
+    pub filter: Vec<String>,
+}
+
+#[derive(Debug, Clone, Parser)]
+pub struct ChainbootOptions {
+    #[command(flatten)]
+    pub build: BuildOptions,
+
+    /// Serial device of the target (default from [chainboot] in tinyconfig.toml)
+    #[arg(long)]
+    pub serial: Option<String>,
+
+    /// Baud rate to ask the loader for during the transfer
+    #[arg(long)]
+    pub fast_baud: Option<u32>,
+
+    /// Send the blocks uncompressed
+    #[arg(long)]
+    pub no_compress: bool,
+}
+
 #[derive(Debug, Subcommand)]
 enum Commands {
     /// Build the project with specified configurations
@@ -53,8 +97,14 @@ enum Commands {
     /// Flash the built image to the target device
     Flash(BuildOptions),
 
+    /// Load the built image through the UART chainloader
+    Chainboot(ChainbootOptions),
+
     /// Build and run the project in QEMU
     Run(BuildOptions),
+
+    /// Run the kernel benchmarks in QEMU and compare them to a baseline
+    Bench(BenchOptions),
 }
 
 fn main() {
@@ -95,10 +145,18 @@ fn try_main() -> TaskResult<()> {
             let task = plugins::flash::FlashTask::new(options, &config)?;
             task.execute()?;
         }
+        Commands::Chainboot(options) => {
+            let task = plugins::chainboot::ChainbootTask::new(options, &config)?;
+            task.execute()?;
+        }
         Commands::Run(options) => {
             let task = plugins::run::RunTask::new(options, &config)?;
             task.execute()?;
         }
+        Commands::Bench(options) => {
+            let task = plugins::bench::BenchTask::new(options, &config)?;
+            task.execute()?;
+        }
     }
 
     Ok(())
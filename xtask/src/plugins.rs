@@ -1,5 +1,7 @@
 // Re-export plugin modules
+pub mod bench;
 pub mod build;
+pub mod chainboot;
 pub mod flash;
 pub mod tftp;
 pub mod run;
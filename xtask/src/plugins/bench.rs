@@ -0,0 +1,304 @@
+use crate::utils::{project_root, TaskError, TaskResult};
+use serde::{Deserialize, Serialize};
+use std::collections::BTreeMap;
+use std::fs;
+use std::io::{BufRead, BufReader, Write};
+use std::path::PathBuf;
+use std::process::{Child, Command, Stdio};
+use std::sync::mpsc;
+use std::time::{Duration, Instant};
+
+/// Printed by the kernel once the shell reads commands.
+const SHELL_READY: &str = "[tty] started";
+
+#[derive(Debug, Deserialize)]
+#[serde(default)]
+struct BenchConfig {
+    /// Baseline results, relative to the project root
+    baseline: String,
+    /// Allowed change against the baseline, in percent
+    threshold: f64,
+    /// Give up on a run after this many seconds
+    timeout: u64,
+}
+
+impl Default for BenchConfig {
+    fn default() -> Self {
+        BenchConfig {
+            baseline: "bench_baseline.jsonl".to_string(),
+            threshold: 10.0,
+            timeout: 600,
+        }
+    }
+}
+
+/// One result line printed by the kernel's `bench` command.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+struct BenchResult {
+    bench: String,
+    metric: String,
+    value: u64,
+    unit: String,
+    /// "lower" or "higher"
+    better: String,
+}
+
+impl BenchResult {
+    fn key(&self) -> (String, String) {
+        (self.bench.clone(), self.metric.clone())
+    }
+
+    /// Change against `base` in percent, positive when it got better.
+    fn improvement(&self, base: &BenchResult) -> f64 {
+        let change = (self.value as f64 - base.value as f64) / (base.value.max(1) as f64) * 100.0;
+        if self.better == "lower" {
+            -change
+        } else {
+            change
+        }
+    }
+}
+
+pub struct BenchTask {
+    run: super::run::RunTask,
+    bench_config: BenchConfig,
+    baseline: PathBuf,
+    save: bool,
+    raw_disk: bool,
+    filter: Vec<String>,
+}
+
+impl BenchTask {
+    pub fn new(options: crate::BenchOptions, config: &toml::Value) -> TaskResult<Self> {
+        let mut bench_config: BenchConfig = config
+            .get("bench")
+            .and_then(|v| v.clone().try_into().ok())
+            .unwrap_or_default();
+
+        if let Some(threshold) = options.threshold {
+            bench_config.threshold = threshold;
+        }
+        let baseline = options
+            .baseline
+            .unwrap_or_else(|| project_root().join(&bench_config.baseline));
+
+        // Nobody attaches a debugger to a benchmark run.
+        let mut build_options = options.build;
+        build_options.debug = false;
+        let run = super::run::RunTask::new(build_options, config)?;
+
+        Ok(BenchTask {
+            run,
+            bench_config,
+            baseline,
+            save: options.save,
+            raw_disk: options.raw_disk,
+            filter: options.filter,
+        })
+    }
+
+    pub fn execute(&self) -> TaskResult<()> {
+        info!("==> Building project before benchmarking:");
+        self.run.build_kernel()?;
+
+        info!("==> Running benchmarks in QEMU:");
+        let results = self.run_qemu()?;
+        info!("    {} results", results.len());
+
+        if self.save {
+            let mut content = String::new();
+            for result in &results {
+                content +=
+                    &serde_json::to_string(result).map_err(|e| TaskError::Other(e.to_string()))?;
+                content.push('\n');
+            }
+            fs::write(&self.baseline, content)?;
+            info!("==> Baseline saved to {}", self.baseline.display());
+            return Ok(());
+        }
+
+        if !self.baseline.exists() {
+            warn!(
+                "No baseline at {}, run with --save to create it",
+                self.baseline.display()
+            );
+            print_results(&results);
+            return Ok(());
+        }
+        let content = fs::read_to_string(&self.baseline)?;
+        let baseline: BTreeMap<_, _> = parse_results(&content)
+            .into_iter()
+            .map(|result| (result.key(), result))
+            .collect();
+
+        self.compare(&results, &baseline)
+    }
+
+    /// Boots the kernel, runs `bench` in its shell and collects the results.
+    fn run_qemu(&self) -> TaskResult<Vec<BenchResult>> {
+        let cmds = self.run.qemu_command()?;
+        let mut child = Command::new("bash")
+            .arg("-c")
+            .arg(&cmds)
+            .current_dir(project_root())
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .spawn()?;
+
+        // Read the console on its own thread, so a hung kernel times out.
+        let stdout = child.stdout.take().unwrap();
+        let (tx, rx) = mpsc::channel();
+        std::thread::spawn(move || {
+            for line in BufReader::new(stdout).lines() {
+                let Ok(line) = line else { break };
+                if tx.send(line).is_err() {
+                    break;
+                }
+            }
+        });
+
+        let result = self.drive_shell(&mut child, &rx);
+        // After `exit` the kernel powers off by itself; give it a moment to
+        // finish writing the disk.
+        let grace = Instant::now() + Duration::from_secs(10);
+        while result.is_ok() && Instant::now() < grace {
+            if child.try_wait()?.is_some() {
+                return result;
+            }
+            std::thread::sleep(Duration::from_millis(100));
+        }
+        let _ = child.kill();
+        let _ = child.wait();
+        result
+    }
+
+    fn drive_shell(
+        &self,
+        child: &mut Child,
+        console: &mpsc::Receiver<String>,
+    ) -> TaskResult<Vec<BenchResult>> {
+        let deadline = Instant::now() + Duration::from_secs(self.bench_config.timeout);
+        let mut stdin = child.stdin.take().unwrap();
+        let mut results = Vec::new();
+
+        loop {
+            let left = deadline.saturating_duration_since(Instant::now());
+            let line = match console.recv_timeout(left) {
+                Ok(line) => line,
+                Err(mpsc::RecvTimeoutError::Timeout) => {
+                    return Err(TaskError::ExecutionFailed(format!(
+                        "benchmarks did not finish in {}s",
+                        self.bench_config.timeout
+                    )));
+                }
+                Err(mpsc::RecvTimeoutError::Disconnected) => {
+                    return Err(TaskError::ExecutionFailed(
+                        "QEMU exited before the benchmarks finished".to_string(),
+                    ));
+                }
+            };
+            let line = line.trim();
+            debug!("    | {}", line);
+
+            if line.contains(SHELL_READY) {
+                let mut command = String::from("bench");
+                if self.raw_disk {
+                    command.push_str(" --raw-disk");
+                }
+                for name in &self.filter {
+                    command.push(' ');
+                    command.push_str(name);
+                }
+                info!("    Shell ready, running `{}`", command);
+                command.push('\r');
+                stdin.write_all(command.as_bytes())?;
+                stdin.flush()?;
+            } else if line.contains("{\"bench_done\"") {
+                stdin.write_all(b"exit\r")?;
+                stdin.flush()?;
+                return Ok(results);
+            } else if let Some(result) = parse_result(line) {
+                info!(
+                    "    {}/{}: {} {}",
+                    result.bench, result.metric, result.value, result.unit
+                );
+                results.push(result);
+            }
+        }
+    }
+
+    /// Prints the results next to the baseline and fails on regressions
+    /// beyond the threshold.
+    fn compare(
+        &self,
+        results: &[BenchResult],
+        baseline: &BTreeMap<(String, String), BenchResult>,
+    ) -> TaskResult<()> {
+        let threshold = self.bench_config.threshold;
+        info!(
+            "==> Comparing against {} (threshold {}%):",
+            self.baseline.display(),
+            threshold
+        );
+        println!(
+            "{:<28} {:>14} {:>14} {:>9}  {}",
+            "benchmark", "baseline", "current", "change", "unit"
+        );
+
+        let mut regressions = Vec::new();
+        for result in results {
+            let name = format!("{}/{}", result.bench, result.metric);
+            let Some(base) = baseline.get(&result.key()) else {
+                println!(
+                    "{:<28} {:>14} {:>14} {:>9}  {}",
+                    name, "-", result.value, "new", result.unit
+                );
+                continue;
+            };
+            let improvement = result.improvement(base);
+            let verdict = if improvement < -threshold {
+                regressions.push(name.clone());
+                "  REGRESSION"
+            } else {
+                ""
+            };
+            println!(
+                "{:<28} {:>14} {:>14} {:>+8.1}%  {}{}",
+                name, base.value, result.value, improvement, result.unit, verdict
+            );
+        }
+
+        if regressions.is_empty() {
+            info!("    No regressions");
+            Ok(())
+        } else {
+            Err(TaskError::ExecutionFailed(format!(
+                "{} benchmark(s) regressed: {}",
+                regressions.len(),
+                regressions.join(", ")
+            )))
+        }
+    }
+}
+
+/// Parses a console line, if it holds a benchmark result.
+fn parse_result(line: &str) -> Option<BenchResult> {
+    let start = line.find("{\"bench\"")?;
+    serde_json::from_str(&line[start..]).ok()
+}
+
+/// Parses JSON-lines results, skipping anything else.
+fn parse_results(content: &str) -> Vec<BenchResult> {
+    content.lines().filter_map(parse_result).collect()
+}
+
+fn print_results(results: &[BenchResult]) {
+    for result in results {
+        println!(
+            "{:<28} {:>14}  {}",
+            format!("{}/{}", result.bench, result.metric),
+            result.value,
+            result.unit
+        );
+    }
+}
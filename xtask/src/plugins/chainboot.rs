@@ -0,0 +1,385 @@
+use crate::lz4;
+use crate::utils::{TaskError, TaskResult};
+use serde::Deserialize;
+use std::collections::VecDeque;
+use std::fs::{self, File, OpenOptions};
+use std::io::{Read, Write};
+use std::sync::mpsc;
+use std::time::{Duration, Instant};
+
+/// Answers the loader's load request, instead of the plain protocol's size.
+const MAGIC: &[u8; 4] = b"RTCB";
+/// Uncompressed size of every block but the last; must match the loader.
+const BLOCK_SIZE: usize = 32 * 1024;
+
+const SYN: u8 = 0x16;
+const ACK: u8 = 0x06;
+const NAK: u8 = 0x15;
+const SOF: u8 = 0xa5;
+const FLAG_LZ4: u8 = 1 << 0;
+
+/// Sends of one block before giving up.
+const MAX_RETRIES: usize = 10;
+/// Longer than the loader waits on a stalled block, so it answers first.
+const REPLY_TIMEOUT: Duration = Duration::from_secs(1);
+
+#[derive(Debug, Deserialize)]
+#[serde(default)]
+struct ChainbootConfig {
+    /// Serial device the board's console is on
+    serial: String,
+    /// Baud rate the loader comes up with
+    baud: u32,
+    /// Baud rate to ask the loader for during the transfer
+    fast_baud: u32,
+    /// Compress the blocks with LZ4
+    compress: bool,
+}
+
+impl Default for ChainbootConfig {
+    fn default() -> Self {
+        ChainbootConfig {
+            serial: "/dev/ttyUSB0".to_string(),
+            baud: 921_600,
+            fast_baud: 3_000_000,
+            compress: true,
+        }
+    }
+}
+
+/// CRC-32 (IEEE 802.3), as checked by the loader.
+fn crc32(data: &[u8]) -> u32 {
+    let mut crc = !0u32;
+    for &byte in data {
+        crc ^= byte as u32;
+        for _ in 0..8 {
+            crc = if crc & 1 != 0 {
+                (crc >> 1) ^ 0xedb8_8320
+            } else {
+                crc >> 1
+            };
+        }
+    }
+    !crc
+}
+
+/// Encodes `image` as the blocks of a framed transfer.
+fn make_blocks(image: &[u8], compress: bool) -> Vec<Vec<u8>> {
+    image
+        .chunks(BLOCK_SIZE)
+        .enumerate()
+        .map(|(seq, raw)| {
+            let packed = compress.then(|| lz4::compress(raw));
+            let (flags, payload) = match &packed {
+                Some(packed) if packed.len() < raw.len() => (FLAG_LZ4, packed.as_slice()),
+                _ => (0, raw),
+            };
+
+            let mut block = vec![SOF];
+            block.extend_from_slice(&(seq as u16).to_le_bytes());
+            block.push(flags);
+            block.extend_from_slice(&(raw.len() as u16).to_le_bytes());
+            block.extend_from_slice(&(payload.len() as u16).to_le_bytes());
+            let header_crc = crc32(&block);
+            block.extend_from_slice(&header_crc.to_le_bytes());
+            block.extend_from_slice(payload);
+            block.extend_from_slice(&crc32(payload).to_le_bytes());
+            block
+        })
+        .collect()
+}
+
+/// Configures the serial line for raw 8N1 at `baud`.
+fn set_baud(serial: &str, baud: u32) -> TaskResult<()> {
+    duct::cmd!(
+        "stty",
+        "-F",
+        serial,
+        baud.to_string(),
+        "raw",
+        "-echo",
+        "cs8",
+        "-cstopb",
+        "-parenb",
+        "-ixon",
+        "-ixoff",
+        "-crtscts",
+        "clocal"
+    )
+    .run()?;
+    Ok(())
+}
+
+/// The serial line, read on its own thread so reads can time out.
+struct Serial {
+    port: File,
+    rx: mpsc::Receiver<Vec<u8>>,
+    pending: VecDeque<u8>,
+}
+
+impl Serial {
+    fn open(path: &str) -> TaskResult<Self> {
+        let port = OpenOptions::new().read(true).write(true).open(path)?;
+        let mut reader = port.try_clone()?;
+        let (tx, rx) = mpsc::channel();
+        std::thread::spawn(move || {
+            let mut buf = [0u8; 4096];
+            while let Ok(n) = reader.read(&mut buf) {
+                if n == 0 || tx.send(buf[..n].to_vec()).is_err() {
+                    break;
+                }
+            }
+        });
+
+        Ok(Serial {
+            port,
+            rx,
+            pending: VecDeque::new(),
+        })
+    }
+
+    fn write(&mut self, data: &[u8]) -> TaskResult<()> {
+        self.port.write_all(data)?;
+        self.port.flush()?;
+        Ok(())
+    }
+
+    fn read_byte(&mut self, timeout: Duration) -> TaskResult<Option<u8>> {
+        if let Some(byte) = self.pending.pop_front() {
+            return Ok(Some(byte));
+        }
+        match self.rx.recv_timeout(timeout) {
+            Ok(chunk) => {
+                self.pending.extend(chunk);
+                Ok(self.pending.pop_front())
+            }
+            Err(mpsc::RecvTimeoutError::Timeout) => Ok(None),
+            Err(mpsc::RecvTimeoutError::Disconnected) => {
+                Err(TaskError::ExecutionFailed("serial line closed".to_string()))
+            }
+        }
+    }
+
+    /// Reads exactly `N` bytes, each within `timeout`.
+    fn read_array<const N: usize>(&mut self, timeout: Duration) -> TaskResult<Option<[u8; N]>> {
+        let mut bytes = [0u8; N];
+        for byte in &mut bytes {
+            match self.read_byte(timeout)? {
+                Some(b) => *byte = b,
+                None => return Ok(None),
+            }
+        }
+        Ok(Some(bytes))
+    }
+
+    /// Discards input until the line has been quiet for `quiet`.
+    fn drain(&mut self, quiet: Duration) -> TaskResult<()> {
+        self.pending.clear();
+        while self.read_byte(quiet)?.is_some() {
+            self.pending.clear();
+        }
+        Ok(())
+    }
+}
+
+pub struct ChainbootTask {
+    build: super::build::BuildTask,
+    chainboot_config: ChainbootConfig,
+}
+
+impl ChainbootTask {
+    pub fn new(options: crate::ChainbootOptions, config: &toml::Value) -> TaskResult<Self> {
+        let mut chainboot_config: ChainbootConfig = config
+            .get("chainboot")
+            .and_then(|v| v.clone().try_into().ok())
+            .unwrap_or_default();
+
+        if let Some(serial) = options.serial {
+            chainboot_config.serial = serial;
+        }
+        if let Some(fast_baud) = options.fast_baud {
+            chainboot_config.fast_baud = fast_baud;
+        }
+        if options.no_compress {
+            chainboot_config.compress = false;
+        }
+
+        let build = super::build::BuildTask::new(options.build, config)?;
+
+        Ok(ChainbootTask {
+            build,
+            chainboot_config,
+        })
+    }
+
+    pub fn execute(&self) -> TaskResult<()> {
+        self.build.execute()?;
+
+        info!("==> Chainbooting over UART:");
+        let bin_path = self.build.elf_name().with_extension("bin");
+        let image = fs::read(&bin_path)?;
+        let blocks = make_blocks(&image, self.chainboot_config.compress);
+        let wire: usize = blocks.iter().map(Vec::len).sum();
+        info!("    Kernel: {}", bin_path.display());
+        info!(
+            "    Size: {} KiB, {} KiB on the wire in {} blocks",
+            image.len() / 1024,
+            wire / 1024,
+            blocks.len()
+        );
+
+        let config = &self.chainboot_config;
+        info!("    Serial: {} at {} baud", config.serial, config.baud);
+        set_baud(&config.serial, config.baud)?;
+        let mut serial = Serial::open(&config.serial)?;
+
+        info!("    Please power the target now");
+        self.wait_for_request(&mut serial)?;
+
+        let start = Instant::now();
+        let baud = self.negotiate(&mut serial, &image)?;
+        let result = self.send_blocks(&mut serial, &blocks);
+        if baud != config.baud {
+            set_baud(&config.serial, config.baud)?;
+        }
+        result?;
+
+        let secs = start.elapsed().as_secs_f64();
+        info!(
+            "    Loaded {} KiB in {:.1}s at {} baud ({:.0} KiB/s)",
+            image.len() / 1024,
+            secs,
+            baud,
+            image.len() as f64 / 1024.0 / secs
+        );
+
+        self.terminal(&mut serial)
+    }
+
+    /// Echoes the loader's banner until it asks for the binary with three `0x03`.
+    fn wait_for_request(&self, serial: &mut Serial) -> TaskResult<()> {
+        let mut stdout = std::io::stdout();
+        let mut breaks = 0;
+        loop {
+            let Some(byte) = serial.read_byte(Duration::from_secs(3600))? else {
+                continue;
+            };
+            if byte == 3 {
+                breaks += 1;
+                if breaks == 3 {
+                    return Ok(());
+                }
+            } else {
+                breaks = 0;
+                stdout.write_all(&[byte])?;
+                stdout.flush()?;
+            }
+        }
+    }
+
+    /// Sends the hello and switches to the baud rate the loader agreed to.
+    fn negotiate(&self, serial: &mut Serial, image: &[u8]) -> TaskResult<u32> {
+        let config = &self.chainboot_config;
+        let mut hello = Vec::new();
+        hello.extend_from_slice(&config.fast_baud.to_le_bytes());
+        hello.extend_from_slice(&(image.len() as u32).to_le_bytes());
+        hello.extend_from_slice(&crc32(image).to_le_bytes());
+        let hello_crc = crc32(&hello);
+        hello.extend_from_slice(&hello_crc.to_le_bytes());
+
+        serial.write(MAGIC)?;
+        serial.write(&hello)?;
+
+        let reply = serial.read_array::<6>(Duration::from_secs(2))?;
+        let Some([b'O', b'K', baud @ ..]) = reply else {
+            return Err(TaskError::ExecutionFailed(
+                "loader does not speak the framed protocol".to_string(),
+            ));
+        };
+        let baud = u32::from_le_bytes(baud);
+        if baud != config.fast_baud {
+            warn!("    Loader refused {} baud", config.fast_baud);
+        }
+        if baud == config.baud {
+            return Ok(baud);
+        }
+
+        // Give the loader time to drain its FIFO and switch.
+        std::thread::sleep(Duration::from_millis(20));
+        set_baud(&config.serial, baud)?;
+        for _ in 0..30 {
+            serial.write(&[SYN])?;
+            if serial.read_byte(Duration::from_millis(100))? == Some(ACK) {
+                serial.drain(Duration::from_millis(50))?;
+                return Ok(baud);
+            }
+        }
+
+        Err(TaskError::ExecutionFailed(format!(
+            "no answer from the loader at {} baud",
+            baud
+        )))
+    }
+
+    fn send_blocks(&self, serial: &mut Serial, blocks: &[Vec<u8>]) -> TaskResult<()> {
+        let mut stdout = std::io::stdout();
+        for (seq, block) in blocks.iter().enumerate() {
+            let seq = seq as u16;
+            let mut tries = 0;
+            loop {
+                tries += 1;
+                if tries > MAX_RETRIES {
+                    return Err(TaskError::ExecutionFailed(format!(
+                        "block {} failed {} times",
+                        seq, MAX_RETRIES
+                    )));
+                }
+
+                serial.write(block)?;
+                match serial.read_array::<3>(REPLY_TIMEOUT)? {
+                    Some([ACK, lo, hi]) if u16::from_le_bytes([lo, hi]) == seq => break,
+                    Some([NAK, ..]) => warn!("    Block {} damaged, resending", seq),
+                    _ => {
+                        warn!("    Block {} not acknowledged, resending", seq);
+                        serial.drain(Duration::from_millis(50))?;
+                    }
+                }
+            }
+            print!("\r    Sent {}/{} blocks", seq as usize + 1, blocks.len());
+            stdout.flush()?;
+        }
+        println!();
+
+        match serial.read_array::<2>(Duration::from_secs(5))? {
+            Some([b'D', b'K']) => Ok(()),
+            Some([b'D', b'E']) => Err(TaskError::ExecutionFailed(
+                "image checksum mismatch on the target".to_string(),
+            )),
+            _ => Err(TaskError::ExecutionFailed(
+                "no completion from the loader".to_string(),
+            )),
+        }
+    }
+
+    /// Stays connected as a console: target output to stdout, stdin lines to the target.
+    fn terminal(&self, serial: &mut Serial) -> TaskResult<()> {
+        info!("==> Console (Ctrl-C to quit):");
+        let mut input = serial.port.try_clone()?;
+        std::thread::spawn(move || {
+            for line in std::io::stdin().lines() {
+                let Ok(line) = line else { break };
+                if input.write_all(line.as_bytes()).is_err() || input.write_all(b"\r").is_err() {
+                    break;
+                }
+            }
+        });
+
+        let mut stdout = std::io::stdout();
+        loop {
+            if let Some(byte) = serial.read_byte(Duration::from_secs(3600))? {
+                stdout.write_all(&[byte])?;
+                stdout.flush()?;
+            }
+        }
+    }
+}
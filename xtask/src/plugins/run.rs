@@ -44,6 +44,20 @@ impl RunTask {
 
         info!("==> Starting QEMU:");
 
+        let cmds = self.qemu_command()?;
+        duct::cmd!("bash", "-c", cmds).run()?;
+
+        Ok(())
+    }
+
+    /// Builds the kernel without starting QEMU.
+    pub fn build_kernel(&self) -> TaskResult<()> {
+        self.build.execute()
+    }
+
+    /// Returns the QEMU command line for the built kernel, to be run from
+    /// the project root.
+    pub fn qemu_command(&self) -> TaskResult<String> {
         // Get the binary file path
         let bin_path = self.build.elf_name().with_extension("bin");
         info!("    Kernel: {}", bin_path.display());
@@ -117,8 +131,6 @@ impl RunTask {
         let cmds = String::from("qemu-system-aarch64 ") + &args.join(" ");
         info!("    QEMU Command: {}", cmds);
 
-        duct::cmd!("bash", "-c", cmds).run()?;
-
-        Ok(())
+        Ok(cmds)
     }
 }